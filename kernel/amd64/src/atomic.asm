@@ -24,3 +24,19 @@ hal_atomic_dec:
 	jnz hal_atomic_dec
 	mov EAX, ECX
 	ret
+
+global hal_atomic_or ;uint64_t hal_atomic_or(hal_atomic_t *atom, uint32_t bits);
+hal_atomic_or:
+	mov EAX, [RDI]
+	mov ECX, EAX
+	or ECX, ESI ;Set the given bits instead of counting
+	lock cmpxchg [RDI], ECX
+	jnz hal_atomic_or
+	mov EAX, ECX
+	ret
+
+global hal_atomic_swap ;uint64_t hal_atomic_swap(hal_atomic_t *atom, uint32_t val);
+hal_atomic_swap:
+	mov EAX, ESI
+	xchg [RDI], EAX ;Implicitly locked
+	ret
@@ -0,0 +1,264 @@
+//clock.c
+//Timekeeping on AMD64
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "hal_clock.h"
+#include "hal_cpu.h"
+#include "lapic.h"
+#include "amd64.h"
+
+#include <stdbool.h>
+
+//PIT input frequency, for calibrating other timers against
+#define CLOCK_PIT_HZ 1193182
+
+//Interval over which we calibrate, in nanoseconds
+#define CLOCK_CAL_NS 10000000
+
+//Local APIC timer divide configuration - divide by 16
+#define CLOCK_LAPIC_DIV 0x3
+
+//MSR holding the deadline in TSC-deadline mode
+#define CLOCK_MSR_TSC_DEADLINE 0x6E0
+
+//MSR whose value RDTSCP returns alongside the TSC - we put the CPU index there
+#define CLOCK_MSR_TSC_AUX 0xC0000103
+
+//GPS epoch (1980-01-06) in seconds since the Unix epoch
+#define CLOCK_GPS_UNIX 315964800ll
+
+//Local APIC timer ticks and TSC cycles counted over the calibration interval.
+//Every core's timer runs from the same clocks, so these are measured only once.
+//We assume the TSC is invariant and synchronized between cores, as it is on anything recent.
+static uint64_t clock_lapic_cal;
+static uint64_t clock_tsc_cal;
+
+//TSC value at calibration, taken as time zero
+static uint64_t clock_tsc_base;
+
+//Whether the Local APIC timer supports TSC-deadline mode
+static bool clock_tsc_deadline;
+
+//Whether the CPU has RDTSCP, so user code can tell which CPU it's on
+static bool clock_rdtscp;
+
+static void clock_wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile ("wrmsr" : : "c"(msr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
+}
+
+//Measures the Local APIC timer and TSC against the PIT.
+static void clock_calibrate(void)
+{
+	uint32_t eax = 1, ebx, ecx = 0, edx;
+	asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+	clock_tsc_deadline = (ecx & (1u << 24)) != 0;
+	
+	eax = 0x80000000;
+	asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+	if(eax >= 0x80000001)
+	{
+		eax = 0x80000001;
+		asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+		clock_rdtscp = (edx & (1u << 27)) != 0;
+	}
+	
+	//Use PIT channel 2, which can be gated and polled through port 0x61 without any interrupts.
+	uint8_t port61 = inb(0x61);
+	outb(0x61, (port61 & ~0x02) | 0x01); //Speaker off, gate on
+	
+	uint16_t pitcount = CLOCK_PIT_HZ / (1000000000 / CLOCK_CAL_NS);
+	outb(0x43, 0xB0); //Channel 2, low/high byte, mode 0 (interrupt on terminal count)
+	outb(0x42, pitcount & 0xFF);
+	outb(0x42, pitcount >> 8);
+	
+	//Count down the Local APIC timer until the PIT output goes high.
+	//Mask the timer while we do, so it doesn't interrupt when it runs out.
+	uint32_t lvt = lapic_read(LAPIC_REG_LVT_TIMER);
+	lapic_write(LAPIC_REG_LVT_TIMER, (LAPIC_VEC_TIMER) | (1u << 16));
+	lapic_write(LAPIC_REG_TIMER_INIT, 0xFFFFFFFFu);
+	uint64_t tsc_start = hal_clock_cycles();
+	while(!(inb(0x61) & 0x20))
+	{
+		asm volatile ("pause");
+	}
+	uint32_t remain = lapic_read(LAPIC_REG_TIMER_CUR);
+	uint64_t tsc_end = hal_clock_cycles();
+	lapic_write(LAPIC_REG_TIMER_INIT, 0);
+	lapic_write(LAPIC_REG_LVT_TIMER, lvt);
+	
+	outb(0x61, port61);
+	
+	clock_lapic_cal = 0xFFFFFFFFu - remain;
+	if(clock_lapic_cal == 0)
+		clock_lapic_cal = 1;
+	
+	clock_tsc_cal = tsc_end - tsc_start;
+	if(clock_tsc_cal == 0)
+		clock_tsc_cal = 1;
+	
+	clock_tsc_base = tsc_start;
+}
+
+//Converts a count of calibrated ticks into nanoseconds, or back, without overflowing.
+static uint64_t clock_scale(uint64_t val, uint64_t mul, uint64_t div)
+{
+	return ((val / div) * mul) + (((val % div) * mul) / div);
+}
+
+//Called by each CPU during init, one at a time, to set up its Local APIC timer.
+void clock_initcpu(void)
+{
+	lapic_write(LAPIC_REG_TIMER_DIV, CLOCK_LAPIC_DIV);
+	
+	if(clock_lapic_cal == 0)
+		clock_calibrate();
+	
+	//Let user code find out what CPU it's on when it reads the TSC
+	if(clock_rdtscp)
+		clock_wrmsr(CLOCK_MSR_TSC_AUX, hal_cpu_num());
+	
+	//Interrupt on our timer vector, unmasked, once per arming - either by deadline or by countdown
+	if(clock_tsc_deadline)
+		lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_VEC_TIMER | (2u << 17));
+	else
+		lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_VEC_TIMER);
+}
+
+uint64_t hal_clock_cycles(void)
+{
+	uint32_t lo, hi;
+	asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+uint64_t hal_clock_ns(void)
+{
+	return clock_scale(hal_clock_cycles() - clock_tsc_base, CLOCK_CAL_NS, clock_tsc_cal);
+}
+
+uint64_t hal_clock_cycles_ns(uint64_t cycles)
+{
+	return clock_scale(cycles, CLOCK_CAL_NS, clock_tsc_cal);
+}
+
+bool hal_clock_user(hal_clock_user_t *out)
+{
+	//TSC is readable from user code, as we don't set CR4.TSD
+	out->base = clock_tsc_base;
+	out->mul = CLOCK_CAL_NS;
+	out->div = clock_tsc_cal;
+	out->cpunum = clock_rdtscp;
+	return true;
+}
+
+//Reads a register of the CMOS real-time clock
+static uint8_t clock_cmos(uint8_t reg)
+{
+	outb(0x70, reg);
+	return inb(0x71);
+}
+
+//Reads the time fields of the CMOS real-time clock, once no update is in progress
+static void clock_cmos_fields(uint8_t *fields)
+{
+	while(clock_cmos(0x0A) & 0x80)
+	{
+		asm volatile ("pause");
+	}
+	
+	static const uint8_t regs[6] = { 0x00, 0x02, 0x04, 0x07, 0x08, 0x09 }; //Second, minute, hour, day, month, year
+	for(int ff = 0; ff < 6; ff++)
+	{
+		fields[ff] = clock_cmos(regs[ff]);
+	}
+}
+
+int64_t hal_clock_rtc(void)
+{
+	//Read until we get the same thing twice, in case it ticked while we were reading
+	uint8_t fields[6];
+	uint8_t again[6];
+	clock_cmos_fields(again);
+	do
+	{
+		for(int ff = 0; ff < 6; ff++)
+		{
+			fields[ff] = again[ff];
+		}
+		clock_cmos_fields(again);
+	}
+	while(fields[0] != again[0] || fields[1] != again[1] || fields[2] != again[2] ||
+		fields[3] != again[3] || fields[4] != again[4] || fields[5] != again[5]);
+	
+	//Decode BCD and 12-hour time, if the clock uses them
+	uint8_t statb = clock_cmos(0x0B);
+	bool pm = (fields[2] & 0x80) != 0;
+	fields[2] &= 0x7F;
+	if(!(statb & 0x04))
+	{
+		for(int ff = 0; ff < 6; ff++)
+		{
+			fields[ff] = ((fields[ff] >> 4) * 10) + (fields[ff] & 0xF);
+		}
+	}
+	if(!(statb & 0x02))
+	{
+		fields[2] %= 12;
+		if(pm)
+			fields[2] += 12;
+	}
+	
+	int64_t sec = fields[0];
+	int64_t min = fields[1];
+	int64_t hour = fields[2];
+	int64_t day = fields[3];
+	int64_t mon = fields[4];
+	int64_t year = 2000 + fields[5]; //Assume we're in the 21st century
+	if(sec > 59 || min > 59 || hour > 23 || day < 1 || day > 31 || mon < 1 || mon > 12)
+		return -1; //No clock, or nonsense in it
+	
+	//Count days since the Unix epoch, with years starting in March so the leap day comes last
+	if(mon <= 2)
+		year--;
+	
+	int64_t era = year / 400;
+	int64_t yoe = year - (era * 400);
+	int64_t doy = ((153 * (mon + ((mon > 2) ? -3 : 9))) + 2) / 5 + day - 1;
+	int64_t doe = (yoe * 365) + (yoe / 4) - (yoe / 100) + doy;
+	int64_t days = (era * 146097) + doe - 719468;
+	
+	//The clock keeps UTC, we assume
+	int64_t unix_sec = (days * 86400) + (hour * 3600) + (min * 60) + sec;
+	return (unix_sec - CLOCK_GPS_UNIX) * 1000000ll;
+}
+
+void hal_clock_alarm(uint64_t ns)
+{
+	if(clock_tsc_deadline)
+	{
+		//Writing zero disarms the timer, so make sure a real deadline is never zero
+		uint64_t tsc = 0;
+		if(ns != 0)
+			tsc = clock_tsc_base + clock_scale(ns, clock_tsc_cal, CLOCK_CAL_NS) + 1;
+		
+		clock_wrmsr(CLOCK_MSR_TSC_DEADLINE, tsc);
+		return;
+	}
+	
+	if(ns == 0)
+	{
+		lapic_write(LAPIC_REG_TIMER_INIT, 0);
+		return;
+	}
+	
+	uint64_t now = hal_clock_ns();
+	uint64_t ticks = 1;
+	if(ns > now)
+		ticks = clock_scale(ns - now, clock_lapic_cal, CLOCK_CAL_NS) + 1;
+	
+	if(ticks > 0xFFFFFFFFu)
+		ticks = 0xFFFFFFFFu; //Interrupts early, and the kernel re-arms for the remainder
+	
+	lapic_write(LAPIC_REG_TIMER_INIT, ticks);
+}
@@ -0,0 +1,168 @@
+;copy.asm
+;Copying memory on AMD64
+;Bryan E. Topp <betopp@betopp.com> 2021
+section .text
+bits 64
+
+;Copies use string instructions. With Enhanced REP MOVSB/STOSB (ERMS), the CPU handles any size and alignment best bytewise.
+;Without it, we move quadwords and finish with bytes.
+;Copies that may fault on user memory each have an entry in copy_fixups, giving the range of instructions that might fault.
+;If one does and the fault can't be resolved, kentry_kfault resumes at the fixup, which returns -EFAULT.
+;These are leaf functions that push nothing, so the fixup can just return.
+
+;Negative error number returned from fixups
+%define COPY_EFAULT -14
+
+;Copies RCX bytes from [RSI] to [RDI] with the best string instructions. Clobbers RCX, RDX, RSI, RDI.
+%macro COPY_MOVS 0
+	cld
+	cmp byte [copy_erms], 0
+	jne %%bytes
+		mov RDX, RCX
+		shr RCX, 3
+		rep movsq
+		mov RCX, RDX
+		and RCX, 7
+	%%bytes:
+	rep movsb
+%endmacro
+
+;Fills RCX bytes at [RDI] with AL, with the best string instructions. Clobbers RCX, RDX, RDI, and upper RAX.
+%macro COPY_STOS 0
+	cld
+	cmp byte [copy_erms], 0
+	jne %%bytes
+		movzx EAX, AL
+		mov RDX, 0x0101010101010101
+		imul RAX, RDX
+		mov RDX, RCX
+		shr RCX, 3
+		rep stosq
+		mov RCX, RDX
+		and RCX, 7
+	%%bytes:
+	rep stosb
+%endmacro
+
+align 16
+global copy_initcpu ;void copy_initcpu(void);
+copy_initcpu:
+	push RBX
+	
+	;Check CPUID leaf 7 for ERMS
+	xor EAX, EAX
+	cpuid
+	cmp EAX, 7
+	jb .done
+	
+	mov EAX, 7
+	xor ECX, ECX
+	cpuid
+	bt EBX, 9
+	jnc .done
+	mov byte [copy_erms], 1
+	
+	.done:
+	pop RBX
+	ret
+
+align 16
+global hal_memcpy ;void *hal_memcpy(void *dst, const void *src, size_t len);
+hal_memcpy:
+	mov RAX, RDI
+	mov RCX, RDX
+	COPY_MOVS
+	ret
+
+align 16
+global hal_memset ;void *hal_memset(void *dst, int val, size_t len);
+hal_memset:
+	mov R8, RDI
+	mov EAX, ESI
+	mov RCX, RDX
+	COPY_STOS
+	mov RAX, R8
+	ret
+
+align 16
+global hal_copy ;int hal_copy(void *dst, const void *src, size_t len);
+hal_copy:
+	mov RCX, RDX
+	.start:
+	COPY_MOVS
+	.end:
+	xor EAX, EAX
+	ret
+	.fault:
+	mov RAX, COPY_EFAULT
+	ret
+
+align 16
+global hal_copy_zero ;int hal_copy_zero(void *dst, size_t len);
+hal_copy_zero:
+	mov RCX, RSI
+	xor EAX, EAX
+	.start:
+	COPY_STOS
+	.end:
+	xor EAX, EAX
+	ret
+	.fault:
+	mov RAX, COPY_EFAULT
+	ret
+
+align 16
+global hal_copy_str ;ssize_t hal_copy_str(char *dst, const char *src, size_t max);
+hal_copy_str:
+	;Strings copied this way are short names and arguments - just go bytewise
+	xor EAX, EAX
+	.start:
+	.loop:
+	cmp RAX, RDX
+	jae .done
+	mov CL, [RSI+RAX]
+	mov [RDI+RAX], CL
+	test CL, CL
+	jz .done
+	inc RAX
+	jmp .loop
+	.end:
+	.done:
+	ret
+	.fault:
+	mov RAX, COPY_EFAULT
+	ret
+
+align 16
+global hal_copy_fixup ;uintptr_t hal_copy_fixup(uintptr_t pc);
+hal_copy_fixup:
+	mov RSI, copy_fixups
+	.loop:
+	mov RAX, [RSI+16]
+	test RAX, RAX
+	jz .done ;End of table - not found, return 0
+	cmp RDI, [RSI]
+	jb .next
+	cmp RDI, [RSI+8]
+	jae .next
+	ret ;Found - return the fixup
+	.next:
+	add RSI, 24
+	jmp .loop
+	.done:
+	ret
+
+section .rodata
+
+;Fixup table - start of instructions that may fault, end of them, and where to resume
+align 8
+copy_fixups:
+	dq hal_copy.start,      hal_copy.end,      hal_copy.fault
+	dq hal_copy_zero.start, hal_copy_zero.end, hal_copy_zero.fault
+	dq hal_copy_str.start,  hal_copy_str.end,  hal_copy_str.fault
+	dq 0, 0, 0
+
+section .bss
+
+;Whether the CPU has Enhanced REP MOVSB/STOSB
+copy_erms: resb 1
@@ -415,6 +415,11 @@ cpuinit_all:
 	mov RAX, CR4
 	or RAX, (1<<16) ;set FSGSBASE bit
 	mov CR4, RAX
+	
+	;Make the kernel respect read-only pages, so it faults when writing to shared frames in userspace
+	mov RAX, CR0
+	or RAX, (1<<16) ;set WP bit
+	mov CR0, RAX
 
 	;Find a core number for ourselves.
 	mov RAX, 0 ;ID to try taking, if it's the next-ID
@@ -520,6 +525,32 @@ cpuinit_all:
 	mov RSP, RAX
 	add RSP, 4096
 	
+	;Software-enable our Local APIC so we actually receive interprocessor interrupts.
+	;Spurious interrupts are delivered on vector 253, which ignores them.
+	mov RCX, [cpuinit_lapicaddr]
+	mov EAX, 0x1FD ;APIC Software Enable (bit 8), spurious vector 0xFD
+	mov [RCX + 0xF0], EAX
+	
+	;Note our Local APIC ID, so other cores can send us interrupts
+	extern lapic_initcpu
+	call lapic_initcpu
+	
+	;Check whether we can idle with MONITOR/MWAIT
+	extern intr_initcpu
+	call intr_initcpu
+	
+	;Turn on FPU/SSE/AVX for user code
+	extern fpu_initcpu
+	call fpu_initcpu
+	
+	;Pick how to copy memory
+	extern copy_initcpu
+	call copy_initcpu
+	
+	;Set up our Local APIC timer, calibrating it if we're the first core
+	extern clock_initcpu
+	call clock_initcpu
+	
 	;Now we're done with shared init resources - allow other cores to go
 	inc qword [cpuinit_coresdone]
 	
@@ -573,6 +604,26 @@ cpuinit_gettss:
 	mov RAX, [cpuinit_tssptrs + (8 * RAX)]
 	ret
 
+;Returns the index of the calling CPU, based on its task register.
+align 16
+global hal_cpu_num ;int hal_cpu_num(void);
+hal_cpu_num:
+	mov RAX, 0
+	str AX ;Find our current task-state selector
+	cmp AX, 0 ;Bootstrap core before init hasn't loaded one - call it CPU 0
+	je .done
+	sub AX, (cpuinit_gdt.ktss_array - cpuinit_gdt) ;Make relative to the first task-state selector
+	shr AX, 4 ;16 bytes per descriptor
+	.done:
+	ret
+
+;Returns the number of CPUs that have finished init.
+align 16
+global hal_cpu_count ;int hal_cpu_count(void);
+hal_cpu_count:
+	mov RAX, [cpuinit_coresdone]
+	ret
+
 ;Called to exit the kernel initially to a nearly-undefined user state	
 align 16
 global hal_exit_fresh ;void hal_exit_fresh(uintptr_t u_pc, void *k_sp);
@@ -607,14 +658,42 @@ hal_exit_fresh:
 	o64 a64 sysret ;Drop to usermode
 	
 align 16
-global hal_intr_wake ;void hal_intr_wake(void);
-hal_intr_wake:
-	;Send a broadcast IPI on our "wakeup" interrupt vector (255)
-	mov RCX, [cpuinit_lapicaddr]
-	mov EAX, 0xC45FF ;Fixed interrupt, positive edge-trigger, to all-except-self, vector 0xFF
-	mov [RCX + 0x300], EAX
-	ret
+global hal_exit_thread ;void hal_exit_thread(uintptr_t u_pc, uintptr_t u_sp, uintptr_t u_tls, uintptr_t u_arg, void *k_sp);
+hal_exit_thread:
 
+	;Save k_sp parameter as RSP0 entry in task-state segment
+	call cpuinit_gettss
+	mov [RAX + 0x4], R8
+	
+	;Set up for dropping to usermode with a sysret
+	mov R9, RSI ;Will be RSP - user stack
+	mov R10, RDX ;Will be GS-base - user thread pointer
+	mov R11, RDI
+	mov RDI, RCX ;First parameter
+	mov RCX, R11 ;Will be RIP - user entry point
+	mov R11, 0x202 ;Will be RFLAGS - initialize to just interrupts (and always-1 flag) enabled
+	
+	;Zero all other registers
+	mov RAX, 0
+	mov RDX, RAX
+	mov RBX, RAX
+	mov RBP, RAX
+	mov RSI, RAX
+	mov R8,  RAX
+	mov R12, RAX
+	mov R13, RAX
+	mov R14, RAX
+	mov R15, RAX
+	
+	;Drop to user-mode
+	cli ;Disable interrupts so we don't get caught with wrong GS-base
+	swapgs ;Preserve kernel GS-base
+	wrgsbase R10 ;Set user GS-base
+	mov RSP, R9 ;Switch to user stack
+	mov R9, RAX
+	mov R10, RAX
+	o64 a64 sysret ;Drop to usermode
+	
 ;Entry point for system calls
 bits 64
 align 16
@@ -906,6 +985,9 @@ cpuinit_isr_bad:
 ;Common handling for exceptions
 cpuinit_exception:
 
+	;Exceptions in kernel-mode are handled separately - the kernel may be able to fix them up and continue.
+	test qword [RSP + (8*3)], 3 ;Check privilege level of CS that the CPU pushed
+	jz cpuinit_kexception
 	
 	;CPU should have already switched us to the kernel stack, as we store it in the TSS when dropping to user-mode.
 	;Interrupts will already be disabled.
@@ -947,6 +1029,24 @@ cpuinit_exception:
 
 	;Alright, exit buffer is built on the stack.
 	
+	;Timer interrupts come through here too, but they're not exceptions - just a chance to preempt the thread.
+	cmp qword [RSP+(8*20)], 0xFC
+	jne .exception
+		mov RDI, RSP ;Location of exit-buffer
+		extern kentry_timer ;void kentry_timer(hal_exit_t *eptr)
+		call kentry_timer
+		jmp .spin
+	.exception:
+	
+	;Device-not-available just means a thread is using the FPU for the first time since switching to it.
+	cmp qword [RSP+(8*20)], 7
+	jne .signal
+		mov RDI, RSP ;Location of exit-buffer
+		extern kentry_fpu ;void kentry_fpu(hal_exit_t *eptr)
+		call kentry_fpu
+		jmp .spin
+	.signal:
+	
 	;Figure out what signal number to tell the kernel.
 	mov RDI, [RSP+(8*20)] ;Get vector number that we pushed before jumping to cpuinit_exception
 	extern excsig
@@ -964,6 +1064,49 @@ cpuinit_exception:
 	hlt
 	jmp .spin
 
+;Handling for exceptions taken in kernel-mode
+cpuinit_kexception:
+	
+	;We're already on the kernel stack with the kernel GS-base, and interrupts are disabled.
+	;The stack contains already: Vector number, error-code, RIP, CS, RFLAGS, RSP, SS
+	;Save all registers that the kernel might use but won't save when making function calls.
+	push RAX
+	push RDI
+	push RSI
+	push RDX
+	push RCX
+	push R8
+	push R9
+	push R10
+	push R11
+	
+	;Figure out what signal number to tell the kernel.
+	mov RDI, [RSP+(8*9)] ;Get vector number that we pushed before jumping to cpuinit_exception
+	call excsig
+	
+	;Let the kernel try to resolve the fault. It won't return if it can't.
+	mov RDI, RAX ;Return value from excsig
+	mov RSI, [RSP+(8*11)] ;RIP that CPU pushed
+	mov RDX, CR2 ;Fault address from CPU
+	extern kentry_kfault ;uint64_t kentry_kfault(int signum, uint64_t pc_addr, uint64_t ref_addr)
+	call kentry_kfault
+	
+	;Resolved - retry the faulting instruction, or continue at a fixup for it.
+	mov [RSP+(8*11)], RAX
+	pop R11
+	pop R10
+	pop R9
+	pop R8
+	pop RCX
+	pop RDX
+	pop RSI
+	pop RDI
+	pop RAX
+	
+	add RSP, 16 ;Pop vector number and error-code
+	
+	iretq
+
 
 ;Interrupt service routines for legacy interrupts
 cpuinit_isr_irq0:
@@ -1090,6 +1233,96 @@ bits 64
 align 16
 cpuinit_isr_woke:
 	;Do nothing - we've been brought out of a halt, and that's all we care about.
+	;Acknowledge the interrupt though, or the Local APIC won't deliver any more.
+	push RAX
+	mov RAX, [cpuinit_lapicaddr]
+	mov dword [RAX + 0xB0], 0 ;EOI register
+	pop RAX
+	iretq
+	
+;Interrupt service routine for TLB shootdown interrupts
+bits 64
+align 16
+cpuinit_isr_flush:
+	push RAX
+	
+	;Flush all non-global TLB entries by reloading the page directory base register
+	mov RAX, CR3
+	mov CR3, RAX
+	
+	;Let the core waiting on the shootdown know that we're done
+	extern pt_flush_acks
+	lock inc qword [pt_flush_acks]
+	
+	mov RAX, [cpuinit_lapicaddr]
+	mov dword [RAX + 0xB0], 0 ;EOI register
+	pop RAX
+	iretq
+	
+;Interrupt service routine for the Local APIC timer, which runs kernel timers and ends time-slices
+bits 64
+align 16
+cpuinit_isr_timer:
+	;Acknowledge the interrupt right away, as we might not come back this way
+	push RAX
+	mov RAX, [cpuinit_lapicaddr]
+	mov dword [RAX + 0xB0], 0 ;EOI register
+	pop RAX
+	
+	;From usermode, handle it like an exception, so the kernel can preempt the thread
+	test qword [RSP + 8], 3 ;Check privilege level of CS that the CPU pushed
+	jz .kernel
+		push qword 0 ;phony error-code
+		push qword 0xFC ;vector
+		jmp cpuinit_exception
+	.kernel:
+	
+	;The kernel isn't preemptible - just run timers and return, like an IRQ.
+	push qword 0xFC ;vector, as an IRQ would have
+	
+	;Save all registers that the kernel might use but won't save when making function calls.
+	push RAX
+	push RDI
+	push RSI
+	push RDX
+	push RCX
+	push R8
+	push R9
+	push R10
+	push R11
+	
+	rdgsbase RAX
+	push RAX
+	
+	;Clear the GS-base as interrupts don't execute "on a thread"
+	mov RAX, 0
+	wrgsbase RAX
+	
+	extern kentry_ktimer ;void kentry_ktimer(void)
+	call kentry_ktimer
+	
+	pop RAX
+	wrgsbase RAX
+	
+	pop R11
+	pop R10
+	pop R9
+	pop R8
+	pop RCX
+	pop RDX
+	pop RSI
+	pop RDI
+	pop RAX
+	
+	add RSP, 8 ;Pop vector number
+	
+	iretq
+	
+;Interrupt service routine for spurious interrupts from the Local APIC
+bits 64
+align 16
+cpuinit_isr_spurious:
+	;Spurious interrupts must not be acknowledged
 	iretq
 	
 section .data
@@ -1240,7 +1473,16 @@ cpuinit_isrptrs:
 	dq cpuinit_isr_irq15 ;47
 	
 	;Other vectors unused
-	times 207 dq cpuinit_isr_bad ;48-254
+	times 204 dq cpuinit_isr_bad ;48-251
+	
+	;Vector 252 is the Local APIC timer
+	dq cpuinit_isr_timer ;252
+	
+	;Vector 253 is spurious interrupts from Local APIC
+	dq cpuinit_isr_spurious ;253
+	
+	;Vector 254 is TLB shootdown
+	dq cpuinit_isr_flush ;254
 	
 	;Vector 255 is wakeup
 	dq cpuinit_isr_woke ;255
@@ -1293,6 +1535,7 @@ cpuinit_idt:
 	
 ;Address where we mapped the Local APIC
 align 8
+global cpuinit_lapicaddr
 cpuinit_lapicaddr:
 	resb 8
 
@@ -1303,6 +1546,7 @@ cpuinit_nextid:
 
 ;Number of CPUs that have completed startup successfully
 align 8
+global cpuinit_coresdone
 cpuinit_coresdone:
 	resb 8
 
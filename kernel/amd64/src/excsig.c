@@ -30,7 +30,7 @@ int excsig(int exception)
 		case 16: return SIGFPE; // #x87 floating-point exception
 		case 17: return 0; // #AC - alignment check
 		case 18: return 0; // #MC - machine check
-		case 19: return 0; // #XF - SIMD floating-point exception
+		case 19: return SIGFPE; // #XF - SIMD floating-point exception
 		case 28: return 0; // #HV - hypervisor injection
 		case 29: return 0; // #VC - VMM communication exception
 		case 30: return 0; // #SX - security exception
@@ -0,0 +1,161 @@
+;fpu.asm
+;Floating-point and vector state on AMD64
+;Bryan E. Topp <betopp@betopp.com> 2021
+section .text
+bits 64
+
+;User code gets x87, SSE, and AVX where the CPU has it. The kernel is built without any of them.
+;Saving is done with XSAVEOPT, which skips components that haven't changed since they were loaded, if available.
+;Trapping uses CR0.TS - with it set, the first FPU instruction causes #NM (vector 7).
+
+align 16
+global fpu_initcpu ;void fpu_initcpu(void);
+fpu_initcpu:
+	push RBX
+	
+	;Let user code use SSE, with its exceptions reported as #XM rather than as x87 errors
+	mov RAX, CR4
+	or RAX, (1<<9) | (1<<10) ;set OSFXSR and OSXMMEXCPT bits
+	mov CR4, RAX
+	
+	;No x87 emulation, and have WAIT/FWAIT respect TS too.
+	;Start with TS set, so the first use of the FPU traps.
+	mov RAX, CR0
+	and RAX, ~(1<<2) ;clear EM bit
+	or RAX, (1<<1) | (1<<3) ;set MP and TS bits
+	mov CR0, RAX
+	
+	;Check CPUID for XSAVE support - without it we use FXSAVE and just get x87/SSE
+	mov EAX, 1
+	cpuid
+	bt ECX, 26
+	jnc .fxsave
+	
+	;Enable XSAVE and XSETBV
+	mov RAX, CR4
+	or RAX, (1<<18) ;set OSXSAVE bit
+	mov CR4, RAX
+	
+	;Turn on x87 and SSE state, and AVX if the CPU has it and XSAVE can hold it
+	mov R8D, 3
+	bt ECX, 28
+	jnc .noavx
+		or R8D, 4
+	.noavx:
+	mov EAX, 0xD
+	xor ECX, ECX
+	cpuid
+	and R8D, EAX
+	mov EAX, R8D
+	xor EDX, EDX
+	xor ECX, ECX
+	xsetbv
+	
+	;With XCR0 set, CPUID reports the buffer size needed for what we turned on
+	mov EAX, 0xD
+	xor ECX, ECX
+	cpuid
+	mov [fpu_bytes], RBX
+	
+	;Check whether XSAVEOPT is supported
+	mov EAX, 0xD
+	mov ECX, 1
+	cpuid
+	and EAX, 1
+	mov [fpu_xsaveopt], AL
+	mov byte [fpu_xsave], 1
+	
+	pop RBX
+	ret
+	
+	.fxsave:
+	mov qword [fpu_bytes], 512
+	mov byte [fpu_xsave], 0
+	mov byte [fpu_xsaveopt], 0
+	
+	pop RBX
+	ret
+
+align 16
+global hal_fpu_size ;size_t hal_fpu_size(void);
+hal_fpu_size:
+	mov RAX, [fpu_bytes]
+	ret
+
+align 16
+global hal_fpu_reset ;void hal_fpu_reset(void *buf);
+hal_fpu_reset:
+	;Zero the buffer. That marks every XSAVE component as being in its initial state, too.
+	mov RDX, RDI
+	mov RCX, [fpu_bytes]
+	xor EAX, EAX
+	rep stosb
+	
+	;x87 and SSE control words get loaded regardless, so fill those in with all exceptions masked
+	mov word [RDX + 0], 0x37F ;FCW
+	mov dword [RDX + 24], 0x1F80 ;MXCSR
+	ret
+
+align 16
+global hal_fpu_save ;void hal_fpu_save(void *buf);
+hal_fpu_save:
+	cmp byte [fpu_xsave], 0
+	je .fxsave
+	
+	;Save all enabled components
+	mov EAX, 0xFFFFFFFF
+	mov EDX, 0xFFFFFFFF
+	cmp byte [fpu_xsaveopt], 0
+	je .xsave
+		xsaveopt64 [RDI]
+		ret
+	.xsave:
+		xsave64 [RDI]
+		ret
+	.fxsave:
+		fxsave64 [RDI]
+		ret
+
+align 16
+global hal_fpu_load ;void hal_fpu_load(const void *buf);
+hal_fpu_load:
+	cmp byte [fpu_xsave], 0
+	je .fxrstor
+	
+	mov EAX, 0xFFFFFFFF
+	mov EDX, 0xFFFFFFFF
+	xrstor64 [RDI]
+	ret
+	
+	.fxrstor:
+	fxrstor64 [RDI]
+	ret
+
+align 16
+global hal_fpu_trap ;void hal_fpu_trap(bool trap);
+hal_fpu_trap:
+	cmp DIL, 0
+	je .clear
+	
+	;Writing CR0 is slow - don't bother if TS is already set
+	mov RAX, CR0
+	bt RAX, 3
+	jc .done
+	or RAX, (1<<3)
+	mov CR0, RAX
+	.done:
+	ret
+	
+	.clear:
+	clts
+	ret
+
+section .bss
+
+;Size of buffer used to save FPU state
+alignb 8
+fpu_bytes: resq 1
+
+;Whether the CPU supports XSAVE and XSAVEOPT
+fpu_xsave: resb 1
+fpu_xsaveopt: resb 1
@@ -5,28 +5,141 @@
 #include "pmem.h"
 #include "hal_frame.h"
 #include "hal_spl.h"
+#include <stdbool.h>
 #include <stdint.h>
 #include <sys/types.h>
 
-//Free-list of frames
+//Free-list of frames.
+//Each free frame holds the next frame in the list, followed by the previous one, so runs can be taken out of the middle.
 static hal_frame_id_t frame_head;
 
 //Number of free frames
 static size_t frame_count;
 
+//Free-list of huge frames - aligned runs of small frames, kept together while we can
+static hal_frame_id_t frame_huge_head;
+
+//Number of free huge frames
+static size_t frame_huge_count;
+
+//Number of small frames in a huge frame
+#define FRAME_HUGE_SMALL 512
+
+//Number of huge-frame-sized regions of physical memory we track, for putting huge frames back together.
+//Small frames above this (64GBytes) are never reassembled.
+#define FRAME_REGION_MAX 32768
+
+//Number of small frames from each region that are on the free-list
+static uint16_t frame_region_free[FRAME_REGION_MAX];
+
+//Number of regions with all of their small frames on the free-list
+static size_t frame_region_full;
+
 //Spinlock protecting frame allocator
 static hal_spl_t frame_spl;
 
+//Counts a small frame going onto or coming off the free-list, in its region. Frame allocator should be locked.
+static void frame_region_count(hal_frame_id_t frame, int delta)
+{
+	size_t region = frame / (4096 * FRAME_HUGE_SMALL);
+	if(region >= FRAME_REGION_MAX)
+		return;
+	
+	if(frame_region_free[region] == FRAME_HUGE_SMALL)
+		frame_region_full--;
+	
+	frame_region_free[region] += delta;
+	
+	if(frame_region_free[region] == FRAME_HUGE_SMALL)
+		frame_region_full++;
+}
+
+//Puts a small frame on the head of the free-list. Frame allocator should be locked.
+static void frame_push(hal_frame_id_t frame)
+{
+	pmem_write(frame, frame_head);
+	pmem_write(frame + 8, 0);
+	if(frame_head != 0)
+		pmem_write(frame_head + 8, frame);
+	
+	frame_head = frame;
+	frame_count++;
+	frame_region_count(frame, 1);
+}
+
+//Takes the given small frame out of the free-list, wherever it is. Frame allocator should be locked.
+static void frame_unlink(hal_frame_id_t frame)
+{
+	hal_frame_id_t next = pmem_read(frame);
+	hal_frame_id_t prev = pmem_read(frame + 8);
+	
+	if(prev != 0)
+		pmem_write(prev, next);
+	else
+		frame_head = next;
+	
+	if(next != 0)
+		pmem_write(next + 8, prev);
+	
+	frame_count--;
+	frame_region_count(frame, -1);
+}
+
+//Puts a region, whose small frames are all free, back together as a huge frame. Frame allocator should be locked.
+//Returns whether one was found.
+static bool frame_reassemble(void)
+{
+	if(frame_region_full == 0)
+		return false;
+	
+	for(size_t rr = 0; rr < FRAME_REGION_MAX; rr++)
+	{
+		if(frame_region_free[rr] != FRAME_HUGE_SMALL)
+			continue;
+		
+		hal_frame_id_t huge = rr * 4096 * FRAME_HUGE_SMALL;
+		for(hal_frame_id_t ff = huge; ff < huge + (4096 * FRAME_HUGE_SMALL); ff += 4096)
+		{
+			frame_unlink(ff);
+		}
+		
+		pmem_write(huge, frame_huge_head);
+		frame_huge_head = huge;
+		frame_huge_count++;
+		return true;
+	}
+	
+	return false;
+}
+
 size_t hal_frame_size(void)
 {
-	//Always small-pages
+	//Small pages by default
 	return 4096;
 }
 
+size_t hal_frame_huge_size(void)
+{
+	return 4096 * FRAME_HUGE_SMALL;
+}
+
 hal_frame_id_t hal_frame_alloc(void)
 {
 	hal_spl_lock(&frame_spl);
 	
+	//If we're out of small frames, break up a huge frame into small frames.
+	if(frame_head == 0 && frame_huge_head != 0)
+	{
+		hal_frame_id_t huge = frame_huge_head;
+		frame_huge_head = pmem_read(huge);
+		frame_huge_count--;
+		
+		for(hal_frame_id_t ff = huge; ff < huge + (4096 * FRAME_HUGE_SMALL); ff += 4096)
+		{
+			frame_push(ff);
+		}
+	}
+	
 	//Check if there's any frames free to allocate
 	if(frame_head == 0)
 	{
@@ -37,9 +150,7 @@ hal_frame_id_t hal_frame_alloc(void)
 	//Return the frame that was previously on the head of the free-list.
 	//Advance the head to the next entry in the list.
 	hal_frame_id_t retval = frame_head;
-	frame_head = pmem_read(frame_head);
-	
-	frame_count--;
+	frame_unlink(retval);
 	hal_spl_unlock(&frame_spl);
 	
 	pmem_clrframe(retval); //Zero everything before allowing it to be used. Paranoid? Maybe.
@@ -50,11 +161,9 @@ void hal_frame_free(hal_frame_id_t frame)
 {
 	hal_spl_lock(&frame_spl);
 	
-	//Write the old head of the free-list into the frame we're freeing.
 	//The frame we're freeing becomes the head of the list.
-	pmem_write(frame, frame_head);
-	frame_head = frame;
-	frame_count++;
+	//If that completes an aligned run, it's put back together when someone wants a huge frame.
+	frame_push(frame);
 	
 	hal_spl_unlock(&frame_spl);
 }
@@ -62,7 +171,51 @@ void hal_frame_free(hal_frame_id_t frame)
 size_t hal_frame_count(void)
 {
 	hal_spl_lock(&frame_spl);
-	size_t val = frame_count;
+	size_t val = frame_count + (frame_huge_count * FRAME_HUGE_SMALL);
+	hal_spl_unlock(&frame_spl);
+	return val;
+}
+
+hal_frame_id_t hal_frame_alloc_huge(void)
+{
+	hal_spl_lock(&frame_spl);
+	
+	//If we're out of huge frames, see if any were broken up and have since been freed again.
+	if(frame_huge_head == 0 && !frame_reassemble())
+	{
+		hal_spl_unlock(&frame_spl);
+		return 0;
+	}
+	
+	hal_frame_id_t retval = frame_huge_head;
+	frame_huge_head = pmem_read(frame_huge_head);
+	
+	frame_huge_count--;
+	hal_spl_unlock(&frame_spl);
+	
+	for(hal_frame_id_t ff = retval; ff < retval + (4096 * FRAME_HUGE_SMALL); ff += 4096)
+	{
+		pmem_clrframe(ff);
+	}
+	
+	return retval;
+}
+
+void hal_frame_free_huge(hal_frame_id_t frame)
+{
+	hal_spl_lock(&frame_spl);
+	
+	pmem_write(frame, frame_huge_head);
+	frame_huge_head = frame;
+	frame_huge_count++;
+	
+	hal_spl_unlock(&frame_spl);
+}
+
+size_t hal_frame_huge_count(void)
+{
+	hal_spl_lock(&frame_spl);
+	size_t val = frame_huge_count;
 	hal_spl_unlock(&frame_spl);
 	return val;
 }
@@ -131,10 +284,21 @@ void frame_free_multiboot()
 			//Round the end down to a page boundary
 			range_end &= 0xFFFFFFFFFFFFF000;
 			
-			//Free all pages within the range
-			for(uintptr_t pp = range_start; pp < range_end; pp += 4096)
+			//Free all pages within the range.
+			//Keep aligned runs together as huge frames where they fit.
+			uintptr_t pp = range_start;
+			while(pp < range_end)
 			{
-				hal_frame_free(pp);
+				if( (pp % (4096 * FRAME_HUGE_SMALL) == 0) && (range_end - pp >= 4096 * FRAME_HUGE_SMALL) )
+				{
+					hal_frame_free_huge(pp);
+					pp += 4096 * FRAME_HUGE_SMALL;
+				}
+				else
+				{
+					hal_frame_free(pp);
+					pp += 4096;
+				}
 			}
 		}
 		
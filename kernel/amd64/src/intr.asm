@@ -22,6 +22,19 @@ hal_intr_ei:
 		sti
 		ret
 
+align 16
+global intr_initcpu ;void intr_initcpu(void);
+intr_initcpu:
+	;Check CPUID for MONITOR/MWAIT support
+	push RBX
+	mov EAX, 1
+	cpuid
+	pop RBX
+	shr ECX, 3
+	and ECX, 1
+	mov [intr_mwait], CL
+	ret
+
 align 16
 global hal_intr_halt ;void hal_intr_halt(void);
 hal_intr_halt:
@@ -30,3 +43,40 @@ hal_intr_halt:
 	sti
 	hlt
 	ret
+
+align 16
+global hal_intr_canwatch ;bool hal_intr_canwatch(void);
+hal_intr_canwatch:
+	movzx EAX, byte [intr_mwait]
+	ret
+
+align 16
+global hal_intr_watch ;void hal_intr_watch(const volatile uint32_t *word, uint32_t val);
+hal_intr_watch:
+	cmp byte [intr_mwait], 0
+	je hal_intr_halt
+	
+	;Arm the monitor on the word's cache line, then check that the word hasn't already changed.
+	;A store after arming the monitor will make the MWAIT return immediately, so nothing gets missed in between.
+	mov RAX, RDI
+	xor ECX, ECX
+	xor EDX, EDX
+	monitor
+	cmp [RDI], ESI
+	jne .changed
+	
+	;Like sti/hlt, the sti takes effect after the MWAIT begins, so an interrupt pending now will end the wait.
+	xor EAX, EAX ;Hint - C1 only
+	xor ECX, ECX ;No extensions
+	sti
+	mwait
+	ret
+	
+	.changed:
+	sti
+	ret
+
+section .bss
+
+;Whether the CPU supports MONITOR/MWAIT
+intr_mwait: resb 1
@@ -0,0 +1,67 @@
+//lapic.c
+//Local APIC access on AMD64
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "lapic.h"
+#include "hal_cpu.h"
+#include "hal_intr.h"
+
+//Defined in cpuinit.asm
+extern volatile uint8_t *cpuinit_lapicaddr;
+extern volatile uint64_t cpuinit_coresdone;
+
+//Local APIC ID of each CPU, by index
+static uint8_t lapic_id_array[HAL_CPU_MAX];
+
+uint32_t lapic_read(uint32_t reg)
+{
+	return *(volatile uint32_t*)(cpuinit_lapicaddr + reg);
+}
+
+void lapic_write(uint32_t reg, uint32_t val)
+{
+	*(volatile uint32_t*)(cpuinit_lapicaddr + reg) = val;
+}
+
+void lapic_initcpu(void)
+{
+	lapic_id_array[hal_cpu_num()] = lapic_read(LAPIC_REG_ID) >> 24;
+}
+
+void lapic_ipi_others(uint8_t vector)
+{
+	//Wait for any previous IPI to be sent
+	while(lapic_read(LAPIC_REG_ICRLO) & (1u << 12))
+	{
+		asm volatile ("pause");
+	}
+	
+	//Fixed interrupt, positive edge-trigger, to all-except-self
+	lapic_write(LAPIC_REG_ICRLO, 0xC4000u | vector);
+}
+
+void lapic_ipi_cpu(int cpu, uint8_t vector)
+{
+	//Sending takes two register writes - don't let an interrupt handler send its own in between
+	bool old_ei = hal_intr_ei(false);
+	while(lapic_read(LAPIC_REG_ICRLO) & (1u << 12))
+	{
+		asm volatile ("pause");
+	}
+	
+	//Fixed interrupt, positive edge-trigger, physical destination
+	lapic_write(LAPIC_REG_ICRHI, (uint32_t)lapic_id_array[cpu] << 24);
+	lapic_write(LAPIC_REG_ICRLO, 0x4000u | vector);
+	hal_intr_ei(old_ei);
+}
+
+void hal_intr_wake(int cpu)
+{
+	lapic_ipi_cpu(cpu, LAPIC_VEC_WAKE);
+}
+
+int lapic_count(void)
+{
+	//Each CPU enables its Local APIC before it finishes init
+	return cpuinit_coresdone;
+}
@@ -0,0 +1,44 @@
+//lapic.h
+//Local APIC access on AMD64
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef LAPIC_H
+#define LAPIC_H
+
+#include <stdint.h>
+
+//Register offsets in the Local APIC
+#define LAPIC_REG_ID 0x020
+#define LAPIC_REG_EOI 0x0B0
+#define LAPIC_REG_SVR 0x0F0
+#define LAPIC_REG_ICRLO 0x300
+#define LAPIC_REG_ICRHI 0x310
+#define LAPIC_REG_LVT_TIMER 0x320
+#define LAPIC_REG_TIMER_INIT 0x380
+#define LAPIC_REG_TIMER_CUR 0x390
+#define LAPIC_REG_TIMER_DIV 0x3E0
+
+//Interrupt vectors used for Local APIC interrupts
+#define LAPIC_VEC_TIMER 0xFC
+#define LAPIC_VEC_SPURIOUS 0xFD
+#define LAPIC_VEC_FLUSH 0xFE
+#define LAPIC_VEC_WAKE 0xFF
+
+//Reads a register of the Local APIC of the current CPU.
+uint32_t lapic_read(uint32_t reg);
+
+//Writes a register of the Local APIC of the current CPU.
+void lapic_write(uint32_t reg, uint32_t val);
+
+//Notes the Local APIC ID of the calling CPU, during init.
+void lapic_initcpu(void);
+
+//Sends a fixed interprocessor interrupt to all CPUs except the current one.
+void lapic_ipi_others(uint8_t vector);
+
+//Sends a fixed interprocessor interrupt to the given CPU, by index.
+void lapic_ipi_cpu(int cpu, uint8_t vector);
+
+//Returns the number of CPUs that have their Local APIC enabled and can take interprocessor interrupts.
+int lapic_count(void);
+
+#endif //LAPIC_H
@@ -134,6 +134,50 @@ hal_frame_copy:
 	
 	ret	
 
+global hal_frame_read ;void hal_frame_read(hal_frame_id_t src, void *dst);
+hal_frame_read:
+	push RSI
+	push RDI
+	mov RDI, pmem_spl
+	call hal_spl_lock
+	pop RDI
+	pop RSI
+	
+	mov R11, RSI
+	call pmem_map
+	
+	mov RDI, R11
+	mov RSI, pmem_window
+	mov RCX, 4096 / 8
+	rep movsq
+	
+	mov RDI, pmem_spl
+	call hal_spl_unlock
+	
+	ret
+	
+global hal_frame_write ;void hal_frame_write(hal_frame_id_t dst, const void *src);
+hal_frame_write:
+	push RSI
+	push RDI
+	mov RDI, pmem_spl
+	call hal_spl_lock
+	pop RDI
+	pop RSI
+	
+	mov R11, RSI
+	call pmem_map
+	
+	mov RDI, pmem_window
+	mov RSI, R11
+	mov RCX, 4096 / 8
+	rep movsq
+	
+	mov RDI, pmem_spl
+	call hal_spl_unlock
+	
+	ret
+
 
 section .bss
 alignb 4096
@@ -5,7 +5,9 @@
 #include "hal_kspc.h"
 #include "hal_uspc.h"
 #include "hal_spl.h"
+#include "hal_intr.h"
 #include "pmem.h"
+#include "lapic.h"
 #include <stdint.h>
 
 //Defined in cpuinit.asm
@@ -18,9 +20,24 @@ extern uint8_t _KSPACE_BASE[];
 //Spinlock protecting kernel-space
 static hal_spl_t kspace_spl;
 
+//Number of CPUs that have flushed their TLB in response to the current shootdown - incremented in cpuinit.asm
+volatile uint64_t pt_flush_acks;
+
+//Spinlock making sure only one TLB shootdown happens at a time
+static hal_spl_t pt_flush_spl;
+
 //Address mask to turn a pagetable entry into a frame address
 #define ADDRMASK 0x0FFFFFFFFFFFF000
 
+//Address mask to turn a page directory entry for a huge page into a frame address
+#define HUGEMASK 0x0FFFFFFFFFE00000
+
+//Page directory entry flag indicating a huge page, rather than a reference to a page table
+#define PDE_PS 0x80
+
+//Size of huge pages mapped by a page directory entry
+#define HUGESIZE (4096ul * 512)
+
 //Invalidates the TLB entry for the given page address
 static inline void invlpg(uint64_t addr)
 {
@@ -42,6 +59,7 @@ static inline uint64_t getcr3(void)
 }
 
 //Sets a mapping in a page table, allocating frames as needed.
+//The given flags apply to the final mapping. Intermediate tables are always made writable.
 int pt_set(uint64_t pml4, uint64_t addr, uint64_t frame, uint64_t flags)
 {
 	uint64_t pml4_idx = (addr >> 39) % 512;
@@ -58,7 +76,7 @@ int pt_set(uint64_t pml4, uint64_t addr, uint64_t frame, uint64_t flags)
 		
 		pmem_clrframe(pml4_entry);
 		
-		pml4_entry |= flags;
+		pml4_entry |= flags | 2;
 		pmem_write(pml4 + (8 * pml4_idx), pml4_entry);
 	}
 	
@@ -77,13 +95,19 @@ int pt_set(uint64_t pml4, uint64_t addr, uint64_t frame, uint64_t flags)
 		
 		pmem_clrframe(pdpt_entry);
 		
-		pdpt_entry |= flags;
+		pdpt_entry |= flags | 2;
 		pmem_write(pdpt + (8 * pdpt_idx), pdpt_entry);
 	}
 	
 	uint64_t pd = pdpt_entry & ADDRMASK;
 	uint64_t pd_idx = (addr >> 21) % 512;
 	uint64_t pd_entry = pmem_read(pd + (8 * pd_idx));
+	if(pd_entry & PDE_PS)
+	{
+		//Part of a huge page - need to split it up before changing single pages.
+		return -1;
+	}
+	
 	if(!(pd_entry & 1))
 	{
 		if(frame == 0)
@@ -96,7 +120,7 @@ int pt_set(uint64_t pml4, uint64_t addr, uint64_t frame, uint64_t flags)
 		
 		pmem_clrframe(pd_entry);
 		
-		pd_entry |= flags;
+		pd_entry |= flags | 2;
 		pmem_write(pd + (8 * pd_idx), pd_entry);
 	}
 	
@@ -131,6 +155,12 @@ hal_frame_id_t pt_get(uint64_t pml4, uint64_t addr)
 	if(!(pd_entry & 1))
 		return 0;
 	
+	if(pd_entry & PDE_PS)
+	{
+		//Huge page - return the small frame within it
+		return (pd_entry & HUGEMASK) + (addr & (HUGESIZE - 1) & ADDRMASK);
+	}
+	
 	uint64_t pt = pd_entry & ADDRMASK;
 	uint64_t pt_idx = (addr >> 12) % 512;
 	uint64_t pt_entry = pmem_read(pt + (8 * pt_idx));
@@ -141,6 +171,114 @@ hal_frame_id_t pt_get(uint64_t pml4, uint64_t addr)
 }
 
 
+//Finds the page directory entry covering the given address, if the paging structures above it exist.
+//Returns its physical address, or 0 if there's no page directory there.
+static uint64_t pt_pde(uint64_t pml4, uint64_t addr)
+{
+	uint64_t pml4_idx = (addr >> 39) % 512;
+	uint64_t pml4_entry = pmem_read(pml4 + (8 * pml4_idx));
+	if(!(pml4_entry & 1))
+		return 0;
+	
+	uint64_t pdpt = pml4_entry & ADDRMASK;
+	uint64_t pdpt_idx = (addr >> 30) % 512;
+	uint64_t pdpt_entry = pmem_read(pdpt + (8 * pdpt_idx));
+	if(!(pdpt_entry & 1))
+		return 0;
+	
+	uint64_t pd = pdpt_entry & ADDRMASK;
+	uint64_t pd_idx = (addr >> 21) % 512;
+	return pd + (8 * pd_idx);
+}
+
+//Finds the page table entry covering the given address, if there's a page table there.
+//Returns its physical address, or 0 if there's no page table there (or it's part of a huge page).
+static uint64_t pt_pte(uint64_t pml4, uint64_t addr)
+{
+	uint64_t pde = pt_pde(pml4, addr);
+	if(pde == 0)
+		return 0;
+	
+	uint64_t pd_entry = pmem_read(pde);
+	if(!(pd_entry & 1) || (pd_entry & PDE_PS))
+		return 0;
+	
+	uint64_t pt = pd_entry & ADDRMASK;
+	uint64_t pt_idx = (addr >> 12) % 512;
+	return pt + (8 * pt_idx);
+}
+
+//Sets a huge page mapping in a page table, allocating frames as needed.
+//Any page table previously referenced in its place is returned in *table_out, for the caller to free - it should be empty.
+int pt_set_huge(uint64_t pml4, uint64_t addr, uint64_t frame, uint64_t flags, uint64_t *table_out)
+{
+	*table_out = 0;
+	
+	//Make sure there's a page directory to hold the mapping, by way of mapping a small page.
+	//Then we replace whatever the PD referenced.
+	uint64_t pde = pt_pde(pml4, addr);
+	if(pde == 0)
+	{
+		if(frame == 0)
+			return 0; //Already not mapped
+		
+		if(pt_set(pml4, addr, frame, flags) != 0)
+			return -1;
+		
+		pt_set(pml4, addr, 0, 0);
+		pde = pt_pde(pml4, addr);
+	}
+	
+	uint64_t pd_entry = pmem_read(pde);
+	if(frame == 0)
+		pmem_write(pde, 0);
+	else
+		pmem_write(pde, frame | flags | PDE_PS);
+	
+	if( (pd_entry & 1) && !(pd_entry & PDE_PS) )
+	{
+		//Replaced a page table. Its entries may still be in the TLB, so flush everything here.
+		//Other CPUs may have it cached too, so it's up to the caller when to free it.
+		*table_out = pd_entry & ADDRMASK;
+		setcr3(getcr3());
+	}
+	else
+	{
+		invlpg(addr);
+	}
+	
+	return 0;
+}
+
+//Breaks up a huge page mapping into a page table of small pages referencing the same frames.
+int pt_split(uint64_t pml4, uint64_t addr)
+{
+	uint64_t pde = pt_pde(pml4, addr);
+	if(pde == 0)
+		return 0; //Not mapped at all
+	
+	uint64_t pd_entry = pmem_read(pde);
+	if(!(pd_entry & PDE_PS))
+		return 0; //Not a huge page
+	
+	uint64_t pt = hal_frame_alloc();
+	if(pt == 0)
+		return -1; //No room for paging structures
+	
+	uint64_t base = pd_entry & HUGEMASK;
+	uint64_t flags = pd_entry & 7;
+	for(uint64_t pp = 0; pp < 512; pp++)
+	{
+		pmem_write(pt + (8 * pp), (base + (4096 * pp)) | flags);
+	}
+	
+	pmem_write(pde, pt | flags | 2);
+	
+	//Flush all the small pages that might be cached in the TLB.
+	setcr3(getcr3());
+	return 0;
+}
+
 void hal_kspc_bound(uintptr_t *start_out, uintptr_t *end_out)
 {
 	//Dynamically allocate in the virtual region below the kernel as-linked.
@@ -213,6 +351,9 @@ void hal_uspc_delete(hal_uspc_id_t id)
 				if(!(pd_entry & 1))
 					continue; //No PT referenced here
 				
+				if(pd_entry & PDE_PS)
+					continue; //Huge page rather than a PT - should have been freed already
+				
 				uint64_t pt = pd_entry & ADDRMASK;
 				
 				//All actual data frames should have been freed already - the PT should be empty.
@@ -232,9 +373,9 @@ void hal_uspc_delete(hal_uspc_id_t id)
 	return;
 }
 
-int hal_uspc_set(hal_uspc_id_t id, uintptr_t vaddr, hal_frame_id_t frame)
+int hal_uspc_set(hal_uspc_id_t id, uintptr_t vaddr, hal_frame_id_t frame, bool writable)
 {
-	return pt_set(id, vaddr, frame, 7);
+	return pt_set(id, vaddr, frame, writable ? 7 : 5);
 }
 
 hal_frame_id_t hal_uspc_get(hal_uspc_id_t id, uintptr_t vaddr)
@@ -242,6 +383,133 @@ hal_frame_id_t hal_uspc_get(hal_uspc_id_t id, uintptr_t vaddr)
 	return pt_get(id, vaddr);
 }
 
+int hal_uspc_set_huge(hal_uspc_id_t id, uintptr_t vaddr, hal_frame_id_t frame, bool writable, hal_frame_id_t *table_out)
+{
+	return pt_set_huge(id, vaddr, frame, writable ? 7 : 5, table_out);
+}
+
+bool hal_uspc_is_huge(hal_uspc_id_t id, uintptr_t vaddr)
+{
+	uint64_t pde = pt_pde(id, vaddr);
+	if(pde == 0)
+		return false;
+	
+	uint64_t pd_entry = pmem_read(pde);
+	return (pd_entry & 1) && (pd_entry & PDE_PS);
+}
+
+int hal_uspc_split(hal_uspc_id_t id, uintptr_t vaddr)
+{
+	return pt_split(id, vaddr);
+}
+
+int hal_uspc_setswap(hal_uspc_id_t id, uintptr_t vaddr, uint64_t token)
+{
+	uint64_t pte = pt_pte(id, vaddr);
+	if(pte == 0)
+		return -1;
+	
+	//Keep the present bit clear, and store the token above it
+	pmem_write(pte, token << 1);
+	invlpg(vaddr);
+	return 0;
+}
+
+uint64_t hal_uspc_getswap(hal_uspc_id_t id, uintptr_t vaddr)
+{
+	uint64_t pte = pt_pte(id, vaddr);
+	if(pte == 0)
+		return 0;
+	
+	uint64_t pt_entry = pmem_read(pte);
+	if(pt_entry & 1)
+		return 0;
+	
+	return pt_entry >> 1;
+}
+
+bool hal_uspc_accessed(hal_uspc_id_t id, uintptr_t vaddr, bool clear)
+{
+	uint64_t pte = pt_pte(id, vaddr);
+	if(pte == 0)
+		return false;
+	
+	uint64_t pt_entry = pmem_read(pte);
+	if(!(pt_entry & 1))
+		return false;
+	
+	if(!(pt_entry & 0x20))
+		return false;
+	
+	if(clear)
+	{
+		pmem_write(pte, pt_entry & ~0x20ul);
+		invlpg(vaddr);
+	}
+	
+	return true;
+}
+
+bool hal_uspc_dirty(hal_uspc_id_t id, uintptr_t vaddr, bool clear)
+{
+	uint64_t pte = pt_pte(id, vaddr);
+	if(pte == 0)
+		return false;
+	
+	uint64_t pt_entry = pmem_read(pte);
+	if(!(pt_entry & 1))
+		return false;
+	
+	if(!(pt_entry & 0x40))
+		return false;
+	
+	if(clear)
+	{
+		pmem_write(pte, pt_entry & ~0x40ul);
+		invlpg(vaddr);
+	}
+	
+	return true;
+}
+
+bool hal_uspc_writable(hal_uspc_id_t id, uintptr_t vaddr)
+{
+	uint64_t pte = pt_pte(id, vaddr);
+	if(pte == 0)
+		return false;
+	
+	uint64_t pt_entry = pmem_read(pte);
+	return (pt_entry & 1) && (pt_entry & 2);
+}
+
+void hal_uspc_flush(void)
+{
+	//Keep taking interrupts while we wait, in case another CPU is trying to shoot us down at the same time.
+	bool intr_prev = hal_intr_ei(true);
+	while(!hal_spl_try(&pt_flush_spl))
+	{
+		asm volatile ("pause");
+	}
+	
+	//Interrupt all the other CPUs and wait for them all to reload their pagetables
+	uint64_t others = lapic_count() - 1;
+	pt_flush_acks = 0;
+	if(others > 0)
+	{
+		lapic_ipi_others(LAPIC_VEC_FLUSH);
+		while(pt_flush_acks < others)
+		{
+			asm volatile ("pause");
+		}
+	}
+	
+	hal_spl_unlock(&pt_flush_spl);
+	
+	//Flush our own TLB as well
+	setcr3(getcr3());
+	hal_intr_ei(intr_prev);
+}
+
 void hal_uspc_activate(hal_uspc_id_t id)
 {
 	if(id == HAL_USPC_ID_INVALID)
@@ -258,5 +526,10 @@ hal_uspc_id_t hal_uspc_current(void)
 void hal_uspc_bound(uintptr_t *start_out, uintptr_t *end_out)
 {
 	*start_out = hal_frame_size(); //+1 page is first usable
-	*end_out = 0x800000000000ul; //bottom 47-bit space usable as AMD64 canonical addresses
+	*end_out = hal_uspc_vdata(); //bottom 47-bit space usable as AMD64 canonical addresses, less kernel data at the top
+}
+
+uintptr_t hal_uspc_vdata(void)
+{
+	return 0x800000000000ul - (HAL_USPC_VDATA_PAGES * hal_frame_size());
 }
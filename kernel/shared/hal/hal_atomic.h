@@ -13,4 +13,10 @@ uint64_t hal_atomic_inc(hal_atomic_t *atom);
 //Decrements a counter and returns the new value
 uint64_t hal_atomic_dec(hal_atomic_t *atom);
 
+//Sets the given bits in a word and returns the new value
+uint64_t hal_atomic_or(hal_atomic_t *atom, uint32_t bits);
+
+//Replaces a word with the given value and returns the old value
+uint64_t hal_atomic_swap(hal_atomic_t *atom, uint32_t val);
+
 #endif //HAL_ATOMIC_H
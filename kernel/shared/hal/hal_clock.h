@@ -0,0 +1,42 @@
+//hal_clock.h
+//HAL interface - timekeeping
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef HAL_CLOCK_H
+#define HAL_CLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//How user code can keep time by itself, by reading the cycle counter without entering the kernel.
+//Nanoseconds of monotonic time are ((cycles - base) * mul / div), computed without overflowing.
+typedef struct hal_clock_user_s
+{
+	uint64_t base;
+	uint64_t mul;
+	uint64_t div;
+	bool cpunum; //Whether user code can also read the index of the CPU it's on, along with the cycle count
+} hal_clock_user_t;
+
+//Returns a free-running cycle count on the current CPU, for measuring short intervals.
+uint64_t hal_clock_cycles(void);
+
+//Returns the monotonic time since boot, in nanoseconds. Consistent across all CPUs.
+uint64_t hal_clock_ns(void);
+
+//Converts a difference between two values of hal_clock_cycles into nanoseconds.
+uint64_t hal_clock_cycles_ns(uint64_t cycles);
+
+//Fills in how user code can compute the monotonic time itself.
+//Returns false if user code can't read the cycle counter.
+bool hal_clock_user(hal_clock_user_t *out);
+
+//Reads the battery-backed real-time clock.
+//Returns microseconds since the GPS epoch, or a negative number if there's no clock to read.
+int64_t hal_clock_rtc(void);
+
+//Arms the calling CPU's timer to interrupt once, at the given monotonic time in nanoseconds.
+//Times already passed interrupt as soon as possible. Passing 0 disarms the timer.
+//The interrupt calls kentry_timer or kentry_ktimer, depending on whether it came from user or kernel code.
+void hal_clock_alarm(uint64_t ns);
+
+#endif //HAL_CLOCK_H
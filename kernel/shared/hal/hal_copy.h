@@ -0,0 +1,37 @@
+//hal_copy.h
+//HAL interface - copying memory
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef HAL_COPY_H
+#define HAL_COPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+//Plain copies back the kernel's memcpy and memset, using the fastest instructions the CPU has for them.
+//Copies that may touch user memory are done separately, so they can be abandoned if the memory isn't there.
+//If one faults on a user address that can't be paged in, kentry_kfault resumes it at a fixup, and it returns -EFAULT.
+
+//Copies memory. Neither buffer may fault. Returns dst.
+void *hal_memcpy(void *dst, const void *src, size_t len);
+
+//Fills memory with a byte. The buffer may not fault. Returns dst.
+void *hal_memset(void *dst, int val, size_t len);
+
+//Copies memory where either buffer may be in userspace.
+//Returns 0 on success or -EFAULT if user memory couldn't be accessed. Some of the data may have been copied.
+int hal_copy(void *dst, const void *src, size_t len);
+
+//Zeroes memory that may be in userspace.
+//Returns 0 on success or -EFAULT if user memory couldn't be accessed.
+int hal_copy_zero(void *dst, size_t len);
+
+//Copies a NUL-terminated string where either buffer may be in userspace, including the NUL, stopping after max bytes.
+//Returns the length of the string, max if no NUL was found, or -EFAULT if user memory couldn't be accessed.
+ssize_t hal_copy_str(char *dst, const char *src, size_t max);
+
+//Returns where to resume after a fault at the given instruction address, in one of the copies that may fault.
+//Returns 0 if the instruction isn't part of one.
+uintptr_t hal_copy_fixup(uintptr_t pc);
+
+#endif //HAL_COPY_H
@@ -0,0 +1,17 @@
+//hal_cpu.h
+//HAL interface - processor identification
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef HAL_CPU_H
+#define HAL_CPU_H
+
+//Maximum number of CPUs the HAL will bring up
+#define HAL_CPU_MAX 256
+
+//Returns the index of the calling CPU, counting from 0 in the order CPUs were brought up.
+//Returns 0 on the bootstrap CPU before it has finished initialization.
+int hal_cpu_num(void);
+
+//Returns the number of CPUs that have finished initialization.
+int hal_cpu_count(void);
+
+#endif //HAL_CPU_H
@@ -21,6 +21,10 @@ typedef struct hal_exit_s
 //Initially exits the kernel to a specified user entry point, to be re-entered at the given stack pointer.
 void hal_exit_fresh(uintptr_t u_pc, void *k_sp);
 
+//Initially exits the kernel to a new user thread, at the given entry point, stack pointer, and thread pointer.
+//The argument is passed as the first function parameter. The thread re-enters the kernel at the given stack pointer.
+void hal_exit_thread(uintptr_t u_pc, uintptr_t u_sp, uintptr_t u_tls, uintptr_t u_arg, void *k_sp);
+
 //Exits the kernel to userland using the given existing enter/exit buffer, to be re-entered at the given stack pointer.
 void hal_exit_resume(hal_exit_t *e, void *k_sp);
 
@@ -0,0 +1,32 @@
+//hal_fpu.h
+//HAL interface - floating-point and vector state
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef HAL_FPU_H
+#define HAL_FPU_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+//User code may use the floating-point and vector registers. The kernel itself never touches them.
+//Their state is large, so it's only saved and restored for threads that actually use it.
+//While trapping is on, user code's first use of the registers calls kentry_fpu, which loads the right state.
+
+//Alignment required of buffers holding FPU state
+#define HAL_FPU_ALIGN 64
+
+//Returns the size of a buffer holding FPU state, in bytes.
+size_t hal_fpu_size(void);
+
+//Fills a buffer with the initial FPU state, as a new program should see it.
+void hal_fpu_reset(void *buf);
+
+//Saves the calling CPU's FPU state in the given buffer. Trapping must be off.
+void hal_fpu_save(void *buf);
+
+//Loads the calling CPU's FPU state from the given buffer. Trapping must be off.
+void hal_fpu_load(const void *buf);
+
+//Sets whether user code using the FPU on the calling CPU traps into kentry_fpu.
+void hal_fpu_trap(bool trap);
+
+#endif //HAL_FPU_H
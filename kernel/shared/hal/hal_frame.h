@@ -26,4 +26,24 @@ size_t hal_frame_count(void);
 //Copies a physical frame of memory
 void hal_frame_copy(hal_frame_id_t dst, hal_frame_id_t src);
 
+//Copies the contents of a physical frame into a frame-sized kernel buffer.
+void hal_frame_read(hal_frame_id_t src, void *dst);
+
+//Copies a frame-sized kernel buffer into a physical frame.
+void hal_frame_write(hal_frame_id_t dst, const void *src);
+
+//Returns the size of huge frames - aligned, contiguous runs of frames that can be mapped as one page.
+size_t hal_frame_huge_size(void);
+
+//Allocates a huge frame, zeroed. Returns HAL_FRAME_ID_INVALID if none are available.
+//The small frames within a huge frame may later be freed individually with hal_frame_free.
+//Huge frames broken up for small allocations are put back together once all their small frames are free again.
+hal_frame_id_t hal_frame_alloc_huge(void);
+
+//Frees a whole huge frame back to the frame allocator.
+void hal_frame_free_huge(hal_frame_id_t paddr);
+
+//Returns how many huge frames are currently available.
+size_t hal_frame_huge_count(void);
+
 #endif //HAL_FRAME_H
@@ -5,6 +5,7 @@
 #define HAL_INTR_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 //Enables or disables interrupt handling. Returns whether interrupts were previously enabled.
 bool hal_intr_ei(bool enable);
@@ -12,8 +13,16 @@ bool hal_intr_ei(bool enable);
 //Enables interrupts and halts, atomically.
 void hal_intr_halt(void);
 
-//Wakes up any cores that are halted using an interprocessor interrupt.
-void hal_intr_wake(void);
+//Returns whether the CPU can wait on a word of memory with hal_intr_watch, rather than only halting.
+bool hal_intr_canwatch(void);
+
+//Enables interrupts and waits, atomically, until an interrupt arrives or the given word no longer holds the given value.
+//Any store to the word (or near it) may end the wait early, so callers should check again whatever they were waiting for.
+//If the CPU can't watch memory, this halts like hal_intr_halt, and only an interrupt ends the wait.
+void hal_intr_watch(const volatile uint32_t *word, uint32_t val);
+
+//Wakes up the given CPU, if it's halted, using an interprocessor interrupt.
+void hal_intr_wake(int cpu);
 
 //The only external interrupt system supported is MSI.
 //The HAL reports a range of possible interrupt numbers to the kernel.
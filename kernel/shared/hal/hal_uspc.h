@@ -5,6 +5,7 @@
 #define HAL_USPC_H
 
 #include "hal_frame.h"
+#include <stdbool.h>
 
 //Type identifying a userspace.
 typedef uintptr_t hal_uspc_id_t;
@@ -18,13 +19,54 @@ void hal_uspc_delete(hal_uspc_id_t id);
 
 //Sets the mapping of a page in the given userspace.
 //Pass frame 0 to unmap the page.
+//If writable is false, the page is mapped read-only, and writes to it will fault - even from the kernel.
 //May fail if there's not enough frames left for paging structures.
 //Returns 0 on success or -1 on failure.
-int hal_uspc_set(hal_uspc_id_t id, uintptr_t vaddr, hal_frame_id_t frame);
+int hal_uspc_set(hal_uspc_id_t id, uintptr_t vaddr, hal_frame_id_t frame, bool writable);
 
 //Returns the mapping of a page in the given userspace, or 0 if not mapped.
+//If the page is part of a huge page, returns the small frame within it.
 hal_frame_id_t hal_uspc_get(hal_uspc_id_t id, uintptr_t vaddr);
 
+//Sets the mapping of a huge page in the given userspace.
+//The address and frame must be aligned to the huge page size, and any small pages in the range must be unmapped already.
+//Pass frame 0 to unmap the huge page.
+//If a page table was replaced, it's not freed - other CPUs might still have it cached. It's stored in *table_out for the caller
+//to free once they've flushed, or 0 is stored if there wasn't one. Only the calling CPU's cached mappings are flushed.
+//Returns 0 on success or -1 on failure.
+int hal_uspc_set_huge(hal_uspc_id_t id, uintptr_t vaddr, hal_frame_id_t frame, bool writable, hal_frame_id_t *table_out);
+
+//Returns whether the given address is mapped as part of a huge page.
+bool hal_uspc_is_huge(hal_uspc_id_t id, uintptr_t vaddr);
+
+//Breaks up the huge page containing the given address, if any, into small pages referencing the same frames.
+//Returns 0 on success or -1 if there weren't enough frames left for paging structures.
+int hal_uspc_split(hal_uspc_id_t id, uintptr_t vaddr);
+
+//Stores a token in place of a page mapping, leaving the page not present.
+//The page must already have a page table (i.e. it's been mapped before) and not be part of a huge page.
+//Tokens must fit in 63 bits.
+//Returns 0 on success or -1 on failure.
+int hal_uspc_setswap(hal_uspc_id_t id, uintptr_t vaddr, uint64_t token);
+
+//Returns the token stored for a page that isn't present, or 0 if there's none.
+uint64_t hal_uspc_getswap(hal_uspc_id_t id, uintptr_t vaddr);
+
+//Returns whether a small page has been accessed since its accessed-flag was last cleared.
+//If clear is true, clears the accessed-flag again.
+bool hal_uspc_accessed(hal_uspc_id_t id, uintptr_t vaddr, bool clear);
+
+//Returns whether a small page has been written since its dirty-flag was last cleared.
+//If clear is true, clears the dirty-flag again.
+bool hal_uspc_dirty(hal_uspc_id_t id, uintptr_t vaddr, bool clear);
+
+//Returns whether a small page is mapped writable.
+bool hal_uspc_writable(hal_uspc_id_t id, uintptr_t vaddr);
+
+//Flushes any cached mappings from all userspaces, on all CPUs.
+//Must be called without any spinlocks held, as it waits on other CPUs.
+void hal_uspc_flush(void);
+
 //Activates the given userspace.
 //If ID is HAL_USPC_ID_INVALID, switches back to kernel-space only.
 void hal_uspc_activate(hal_uspc_id_t id);
@@ -35,4 +77,9 @@ hal_uspc_id_t hal_uspc_current(void);
 //Returns the bounds of addresses usable for user-spaces.
 void hal_uspc_bound(uintptr_t *start_out, uintptr_t *end_out);
 
+//Returns the address of pages reserved just past the end of the usable bounds, in every userspace.
+//The kernel maps data there that user code may read but not write. There are HAL_USPC_VDATA_PAGES of them.
+#define HAL_USPC_VDATA_PAGES 2
+uintptr_t hal_uspc_vdata(void);
+
 #endif //HAL_USPC_H
@@ -4,6 +4,7 @@
 
 #include "argenv.h"
 #include "kassert.h"
+#include "copy.h"
 #include "libcstubs.h"
 #include "kspace.h"
 
@@ -11,26 +12,43 @@
 
 int argenv_load(mem_space_t *mem, char * const * argv, char * const * envp)
 {	
-	//Todo - this needs to read from userspace safely (ugh).
-	
 	//Track how much size is needed.
 	//We need to store all the NUL-terminated string literals.
 	//Count the number of string literals and their total size.
+	//The arrays and strings are in userspace, so everything comes through copyin - they might be bad or change under us.
 	size_t nargv = 0;
 	size_t nenvp = 0;
 	size_t nstrings = 0;
 	size_t nultermsize = 0;
-	for(int ii = 0; argv[ii] != NULL; ii++)
-	{
-		nargv++;
-		nstrings++;
-		nultermsize += strlen(argv[ii]) + 1;
-	}
-	for(int ii = 0; envp[ii] != NULL; ii++)
+	for(int ll = 0; ll < 2; ll++)
 	{
-		nenvp++;
-		nstrings++;
-		nultermsize += strlen(envp[ii]) + 1;
+		char * const * uarray = (ll == 0) ? argv : envp;
+		for(size_t ii = 0; ; ii++)
+		{
+			const char *ustr = NULL;
+			int ptr_err = copyin(&ustr, &(uarray[ii]), sizeof(ustr));
+			if(ptr_err < 0)
+				return ptr_err;
+			
+			if(ustr == NULL)
+				break;
+			
+			ssize_t len = copyinstrlen(ustr, ARGENV_MAX);
+			if(len == -ENAMETOOLONG)
+				return -E2BIG;
+			if(len < 0)
+				return len;
+			
+			if(ll == 0)
+				nargv++;
+			else
+				nenvp++;
+			
+			nstrings++;
+			nultermsize += len + 1;
+			if(nultermsize > ARGENV_MAX || nstrings > ARGENV_MAX / sizeof(char*))
+				return -E2BIG;
+		}
 	}
 	
 	//We need to store a pointer to each one, in an array of arg and env pointers.
@@ -43,7 +61,7 @@ int argenv_load(mem_space_t *mem, char * const * argv, char * const * envp)
 	space_needed = ((space_needed + pagesize - 1) / pagesize) * pagesize;
 	
 	//Sanity-check
-	if(space_needed > 65536)
+	if(space_needed > ARGENV_MAX)
 		return -E2BIG;
 	
 	//Build the buffer into kernel-space
@@ -61,8 +79,6 @@ int argenv_load(mem_space_t *mem, char * const * argv, char * const * envp)
 	//NULL
 	//String data
 	
-	//What a fucking mess - can we move this disgusting garbage to userspace?
-	//Even after I come back and audit this I don't think I can make this safe.
 	char *kbuf_next = kbuf;
 	uintptr_t base = pagesize; //Where we'll map this in userspace (page +1)
 	
@@ -79,32 +95,31 @@ int argenv_load(mem_space_t *mem, char * const * argv, char * const * envp)
 	*argv_ptr_ptr = (char**)(base + (2 * sizeof(char**)));
 	*envp_ptr_ptr = (char**)(base + (2 * sizeof(char**)) + ((nargv + 1) * sizeof(char*)));
 	
-	for(size_t aa = 0; aa < nargv; aa++)
-	{
-		argv_array_ptr[aa] = (char*)(base + (string_data - kbuf));
-		
-		size_t copylen = strlen(argv[aa]);
-		
-		KASSERT(copylen + (kbuf_next - kbuf) < space_needed);
-		memcpy(string_data, argv[aa], copylen);
-		
-		string_data += copylen + 1;
-	}
-	
-	for(size_t aa = 0; aa < nenvp; aa++)
+	//Copy the strings in for real, now that we know where they go.
+	//If userspace changed them since we measured, they might not fit - fail rather than overrun.
+	for(size_t aa = 0; aa < nargv + nenvp; aa++)
 	{
-		envp_array_ptr[aa] = (char*)(base + (string_data - kbuf));
+		char * const * uptr = (aa < nargv) ? &(argv[aa]) : &(envp[aa - nargv]);
+		char **kptr = (aa < nargv) ? &(argv_array_ptr[aa]) : &(envp_array_ptr[aa - nargv]);
+		*kptr = (char*)(base + (string_data - kbuf));
 		
-		size_t copylen = strlen(envp[aa]);
+		const char *ustr = NULL;
+		ssize_t copylen = copyin(&ustr, uptr, sizeof(ustr));
+		if(copylen >= 0)
+			copylen = copyinstr(string_data, ustr, (kbuf + space_needed) - string_data);
 		
-		KASSERT(copylen + (kbuf_next - kbuf) < space_needed);
-		memcpy(string_data, envp[aa], copylen);
+		if(copylen < 0)
+		{
+			kspace_free(kbuf, space_needed);
+			return (copylen == -ENAMETOOLONG) ? -E2BIG : copylen;
+		}
 		
 		string_data += copylen + 1;
 	}
 	
 	//Make space to store this in the new userspace.
-	int map_err = mem_space_add(mem, base, space_needed, MEM_PROT_R);
+	//Needs real frames immediately, as we fill them while the space isn't yet in use.
+	int map_err = mem_space_add(mem, base, space_needed, MEM_PROT_R, MEM_ADD_EAGER);
 	if(map_err < 0)
 	{
 		//Failed to make space in the userspace for argv/envp data
@@ -6,6 +6,9 @@
 
 #include "mem.h"
 
+//Most space that argv/envp data can take up in a new process
+#define ARGENV_MAX 65536
+
 //Packs the data from the argv/envp parameters into the given memory space.
 int argenv_load(mem_space_t *mem, char * const * argv, char * const * envp);
 
@@ -3,12 +3,14 @@
 //Bryan E. Topp <betopp@betopp.com> 2021
 
 #include "con.h"
+#include "copy.h"
 #include "kspace.h"
 #include "kassert.h"
 #include "libcstubs.h"
 #include "process.h"
 #include "notify.h"
 
+#include "hal_copy.h"
 #include "hal_intr.h"
 
 #include <errno.h>
@@ -261,11 +263,25 @@ ssize_t con_write(int minor, const void *buf, size_t len)
 	//Remove old cursor indicator
 	con_ega[ (con_curs_row*80) + con_curs_col ] = con_curs_buf;
 	
-	//Write all bytes
+	//Write all bytes, bringing them in from the caller a chunk at a time
 	const uint8_t *bufbytes = (const uint8_t*)buf;
-	for(size_t ll = 0; ll < len; ll++)
+	size_t written = 0;
+	while(written < len)
 	{
-		con_outp(bufbytes[ll]);
+		uint8_t chunk[64];
+		size_t chunklen = len - written;
+		if(chunklen > sizeof(chunk))
+			chunklen = sizeof(chunk);
+		
+		if(hal_copy(chunk, bufbytes + written, chunklen) < 0)
+			break;
+		
+		for(size_t ll = 0; ll < chunklen; ll++)
+		{
+			con_outp(chunk[ll]);
+		}
+		
+		written += chunklen;
 	}
 	
 	//Where the cursor ends up, draw cursor indicator
@@ -273,10 +289,13 @@ ssize_t con_write(int minor, const void *buf, size_t len)
 	con_ega[ (con_curs_row*80) + con_curs_col ] &= 0xFF;
 	con_ega[ (con_curs_row*80) + con_curs_col ] |= 0xA000;
 	
-	return len;
+	if(written == 0 && len > 0)
+		return -EFAULT;
+	
+	return written;
 }
 
-ssize_t con_read(int minor, void *buf, size_t len)
+ssize_t con_read(int minor, void *buf, size_t len, uint64_t deadline)
 {
 	if(minor != 1)
 		return -ENXIO;
@@ -299,11 +318,14 @@ ssize_t con_read(int minor, void *buf, size_t len)
 		//Release the lock and sleep. Anyone who adds to the buffer after this will notify us.
 		//If we're notified any time since the last notify_wait, notify_wait will return.
 		hal_spl_unlock(&con_kbd_lock);
-		int wait_err = notify_wait();
+		int wait_err = notify_timedwait(deadline);
 		hal_spl_lock(&con_kbd_lock);
 		
 		notify_remove(&con_kbd_notify, &n);
 		
+		if(wait_err == -ETIMEDOUT)
+			wait_err = -EAGAIN; //Timed out waiting for input, like a nonblocking read would
+		
 		if(wait_err < 0)
 		{
 			//Probably got interrupted while waiting
@@ -313,14 +335,17 @@ ssize_t con_read(int minor, void *buf, size_t len)
 		}
 	}
 		
-	//Copy bytes out of input buffer
+	//Copy bytes out of input buffer.
+	//Take them aside first, so we don't touch the caller's buffer with interrupts off.
+	char chunk[64];
+	if(len > sizeof(chunk))
+		len = sizeof(chunk);
+	
 	size_t nread = 0;
-	char *buf_bytes = (char*)buf;
 	while( (nread < len) && (con_kbd_buf_count > 0) )
 	{
-		*buf_bytes = con_kbd_buf_array[0];
+		chunk[nread] = con_kbd_buf_array[0];
 		nread++;
-		buf_bytes++;
 		
 		for(size_t ii = 0; ii < (con_kbd_buf_count - 1); ii++)
 		{
@@ -332,6 +357,10 @@ ssize_t con_read(int minor, void *buf, size_t len)
 	//Done
 	hal_spl_unlock(&con_kbd_lock);
 	hal_intr_ei(old_ei);
+	
+	if(hal_copy(buf, chunk, nread) < 0)
+		return -EFAULT;
+	
 	return nread;
 }
 
@@ -344,7 +373,7 @@ int con_ioctl(int minor, uint64_t request, void *ptr, size_t len)
 		return 1;
 	
 	if(request == PX_FD_IOCTL_TTYNAME)
-		return process_strncpy_touser(ptr, "/dev/con", len);
+		return copyoutstr(ptr, "/dev/con", len);
 	
 	(void)ptr;
 	(void)len;
@@ -19,7 +19,8 @@ void con_panic(const char *str);
 ssize_t con_write(int minor, const void *buf, size_t len);
 
 //Reads from the console.
-ssize_t con_read(int minor, void *buf, size_t len);
+//If no input is available, waits for some, giving up with -EAGAIN at the given monotonic time if it's nonzero.
+ssize_t con_read(int minor, void *buf, size_t len, uint64_t deadline);
 
 //Controls console operation.
 int con_ioctl(int minor, uint64_t request, void *ptr, size_t len);
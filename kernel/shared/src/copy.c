@@ -0,0 +1,123 @@
+//copy.c
+//Copying to and from userspace
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "copy.h"
+#include "libcstubs.h"
+
+#include "hal_copy.h"
+#include "hal_uspc.h"
+
+#include <errno.h>
+
+int copy_check(const void *uptr, size_t len)
+{
+	uintptr_t uspc_start = 0;
+	uintptr_t uspc_end = 0;
+	hal_uspc_bound(&uspc_start, &uspc_end);
+	
+	//Careful to not overflow when the length is huge
+	uintptr_t addr = (uintptr_t)uptr;
+	if(addr < uspc_start || addr > uspc_end)
+		return -EFAULT;
+	
+	if(len > uspc_end - addr)
+		return -EFAULT;
+	
+	return 0;
+}
+
+int copyin(void *kdst, const void *usrc, size_t len)
+{
+	int check_err = copy_check(usrc, len);
+	if(check_err < 0)
+		return check_err;
+	
+	return hal_copy(kdst, usrc, len);
+}
+
+int copyout(void *udst, const void *ksrc, size_t len)
+{
+	int check_err = copy_check(udst, len);
+	if(check_err < 0)
+		return check_err;
+	
+	return hal_copy(udst, ksrc, len);
+}
+
+ssize_t copyinstr(char *kdst, const char *usrc, size_t size)
+{
+	if(size <= 0)
+		return -ENAMETOOLONG;
+	
+	//Don't read past the end of userspace, looking for the end of the string
+	uintptr_t uspc_start = 0;
+	uintptr_t uspc_end = 0;
+	hal_uspc_bound(&uspc_start, &uspc_end);
+	
+	uintptr_t addr = (uintptr_t)usrc;
+	if(addr < uspc_start || addr >= uspc_end)
+		return -EFAULT;
+	
+	size_t max = size;
+	if(max > uspc_end - addr)
+		max = uspc_end - addr;
+	
+	ssize_t len = hal_copy_str(kdst, usrc, max);
+	if(len < 0)
+		return len;
+	
+	if((size_t)len >= max)
+	{
+		//No NUL found - either the string is too long, or it runs off the end of userspace
+		kdst[size - 1] = '\0';
+		return (max < size) ? -EFAULT : -ENAMETOOLONG;
+	}
+	
+	return len;
+}
+
+ssize_t copyinstrlen(const char *usrc, size_t max)
+{
+	//Bring the string through a little buffer until we find its end
+	char chunk[64];
+	size_t len = 0;
+	while(1)
+	{
+		ssize_t part = copyinstr(chunk, usrc + len, sizeof(chunk));
+		if(part >= 0)
+		{
+			len += part;
+			break;
+		}
+		
+		if(part != -ENAMETOOLONG)
+			return part;
+		
+		//Whole chunk was non-NUL
+		len += sizeof(chunk) - 1;
+		if(len > max)
+			return -ENAMETOOLONG;
+	}
+	
+	if(len > max)
+		return -ENAMETOOLONG;
+	
+	return len;
+}
+
+int copyoutstr(char *udst, const char *ksrc, size_t size)
+{
+	if(size <= 0)
+		return 0;
+	
+	size_t len = strlen(ksrc);
+	if(len > size - 1)
+		len = size - 1;
+	
+	int copy_err = copyout(udst, ksrc, len);
+	if(copy_err < 0)
+		return copy_err;
+	
+	return copyout(udst + len, "", 1);
+}
@@ -0,0 +1,40 @@
+//copy.h
+//Copying to and from userspace
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef COPY_H
+#define COPY_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+//System calls never dereference user pointers directly. They copy parameters in and results out with these.
+//Buffers are checked to lie within userspace, and if the memory isn't mapped, the copy fails rather than the kernel.
+//Deeper layers that move bulk data to or from a caller's buffer, like file reads and writes, use hal_copy directly,
+//once the system call has checked the buffer with copy_check.
+
+//Checks that the given buffer lies entirely within userspace.
+//Returns 0 if so or -EFAULT if not.
+int copy_check(const void *uptr, size_t len);
+
+//Copies from userspace into the kernel.
+//Returns 0 on success or -EFAULT.
+int copyin(void *kdst, const void *usrc, size_t len);
+
+//Copies from the kernel out to userspace.
+//Returns 0 on success or -EFAULT.
+int copyout(void *udst, const void *ksrc, size_t len);
+
+//Copies a NUL-terminated string from userspace into a kernel buffer of the given size.
+//Returns the length of the string, -ENAMETOOLONG if it doesn't fit with its NUL, or -EFAULT.
+ssize_t copyinstr(char *kdst, const char *usrc, size_t size);
+
+//Measures a NUL-terminated string in userspace, without copying it anywhere.
+//Returns the length of the string, -ENAMETOOLONG if it's longer than max, or -EFAULT.
+ssize_t copyinstrlen(const char *usrc, size_t max);
+
+//Copies a NUL-terminated string from the kernel out to a user buffer of the given size, truncating it if needed.
+//The result is always NUL-terminated if the buffer isn't empty.
+//Returns 0 on success or -EFAULT.
+int copyoutstr(char *udst, const char *ksrc, size_t size);
+
+#endif //COPY_H
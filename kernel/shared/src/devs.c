@@ -4,11 +4,12 @@
 
 #include "devs.h"
 
-ssize_t dev_null_read(int minor, void *buf, size_t size)
+ssize_t dev_null_read(int minor, void *buf, size_t size, uint64_t deadline)
 {
 	(void)minor;
 	(void)buf;
 	(void)size;
+	(void)deadline;
 	return 0;
 }
 
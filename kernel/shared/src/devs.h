@@ -5,9 +5,10 @@
 #define DEVS_H
 
 #include <sys/types.h>
+#include <stdint.h>
 
 //Implementation of /dev/null
-ssize_t dev_null_read(int minor, void *buf, size_t size);
+ssize_t dev_null_read(int minor, void *buf, size_t size, uint64_t deadline);
 ssize_t dev_null_write(int minor, const void *buf, size_t size);
 
 
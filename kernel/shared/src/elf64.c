@@ -264,11 +264,30 @@ int elf64_load(id_t fdid, mem_space_t *mem, uintptr_t *entry_out)
 		if(phdr->p_flags & PF_X)
 			prot |= MEM_PROT_X;
 		
-		int map_result = mem_space_add(mem, phdr->p_vaddr, phdr->p_memsz, prot);
-		if(map_result < 0)
+		//Pages loaded from the file need frames now. We read into them with this space active, but it isn't our process's space yet,
+		//so kentry_kfault won't resolve faults on it. Any zero-filled tail past that can share the zero-frame until written.
+		size_t loaded_size = phdr->p_filesz;
+		if(loaded_size % pagesize != 0)
+			loaded_size += pagesize - (loaded_size % pagesize);
+		
+		if(loaded_size > 0)
 		{
-			retval = map_result;
-			goto cleanup;
+			int map_result = mem_space_add(mem, phdr->p_vaddr, loaded_size, prot, MEM_ADD_EAGER);
+			if(map_result < 0)
+			{
+				retval = map_result;
+				goto cleanup;
+			}
+		}
+		
+		if(loaded_size < phdr->p_memsz)
+		{
+			int map_result = mem_space_add(mem, phdr->p_vaddr + loaded_size, phdr->p_memsz - loaded_size, prot, 0);
+			if(map_result < 0)
+			{
+				retval = map_result;
+				goto cleanup;
+			}
 		}
 	}
 	
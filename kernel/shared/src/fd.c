@@ -3,12 +3,16 @@
 //Bryan E. Topp <betopp@betopp.com> 2021
 
 #include "fd.h"
+#include "copy.h"
 #include "kspace.h"
 #include "kassert.h"
+#include "idtab.h"
 #include "ramfs.h"
 #include "devs.h"
 #include "con.h"
 #include "pipe.h"
+#include "timer.h"
+#include "libcstubs.h"
 
 #include <sys/types.h>
 #include <errno.h>
@@ -16,13 +20,12 @@
 #include <sys/stat.h>
 
 //File descriptor table
-static fd_t *fd_array;
-static int fd_count;
+static idtab_t fd_tab;
 
 //Functions supported by device drivers
 typedef struct fd_devfuncs_s
 {
-	ssize_t (*read) (int minor, void *buf, size_t len);
+	ssize_t (*read) (int minor, void *buf, size_t len, uint64_t deadline);
 	ssize_t (*write)(int minor, const void *buf, size_t len);
 	int     (*ioctl)(int minor, uint64_t request, void *ptr, size_t len);
 } fd_devfuncs_t;
@@ -44,40 +47,23 @@ static const fd_devfuncs_t fd_devfuncs[DEV_MAX] =
 
 void fd_init(void)
 {
-	int fds = 4096; //Todo - configurable
-	fd_array = kspace_alloc(sizeof(fd_t) * fds, alignof(fd_t));
-	KASSERT(fd_array != NULL);
-	fd_count = fds;
+	idtab_init(&fd_tab, sizeof(fd_t), FD_MAX);
 }
 
 fd_t *fd_new(void)
 {
-	for(int ff = 0; ff < fd_count; ff++)
-	{
-		fd_t *fptr = &(fd_array[ff]);
-		if(hal_spl_try(&(fptr->spl)))
-		{
-			if(fptr->state == FD_STATE_NONE)
-			{
-				//Found a spot for the file descriptor.
-				//Give it an ID that indicates the position in the table (modulo the size of the table).
-				//Advance through IDs as we reuse table entries.
-				if(fptr->id == 0)
-					fptr->id = ff;
-				
-				fptr->id += fd_count;
-				
-				KASSERT( (fptr->id % fd_count) == ff );
-				
-				fptr->state = FD_STATE_READY;
-				return fptr; //Still locked
-			}
-			hal_spl_unlock(&(fptr->spl));
-		}
-	}
-	
-	//No room
-	return NULL;
+	//Take a spot for the file descriptor. Its ID indicates the position in the table.
+	id_t id = 0;
+	fd_t *fptr = idtab_alloc(&fd_tab, &id);
+	if(fptr == NULL)
+		return NULL; //No room
+	
+	//Whatever freed it might not have unlocked it yet
+	hal_spl_lock(&(fptr->spl));
+	KASSERT(fptr->state == FD_STATE_NONE);
+	fptr->id = id;
+	fptr->state = FD_STATE_READY;
+	return fptr; //Still locked
 }
 
 void fd_unlock(fd_t *fd)
@@ -106,6 +92,8 @@ void fd_unlock(fd_t *fd)
 		fd->off = 0;
 		fd->spec = 0;
 		fd->access = 0;
+		fd->rdtimeo = 0;
+		idtab_free(&fd_tab, fd->id);
 	}
 	
 	hal_spl_unlock(&(fd->spl));
@@ -118,10 +106,12 @@ fd_t *fd_getlocked(id_t id)
 		return NULL;
 	}
 	
-	fd_t *fdptr = &(fd_array[id % fd_count]);
-	hal_spl_lock(&(fdptr->spl));
+	fd_t *fdptr = idtab_get(&fd_tab, id);
+	if(fdptr == NULL)
+		return NULL;
 	
-	if(fdptr->id != id)
+	hal_spl_lock(&(fdptr->spl));
+	if(fdptr->id != id || fdptr->state == FD_STATE_NONE)
 	{
 		//Empty/reused array entry
 		hal_spl_unlock(&(fdptr->spl));
@@ -232,6 +222,11 @@ ssize_t fd_read(id_t id, void *buf, size_t len)
 	if(fptr == NULL)
 		return -EBADF;
 	
+	//Work out when to give up, for reads that block
+	uint64_t deadline = 0;
+	if(fptr->rdtimeo > 0)
+		deadline = timer_now() + fptr->rdtimeo;
+	
 	if(S_ISCHR(fptr->mode))
 	{
 		int major = (fptr->spec >> 16) & 0xFFFF;
@@ -244,7 +239,7 @@ ssize_t fd_read(id_t id, void *buf, size_t len)
 		if(fd_devfuncs[major].read == NULL)
 			return -ENOTTY;
 		
-		return (*fd_devfuncs[major].read)(minor, buf, len);
+		return (*fd_devfuncs[major].read)(minor, buf, len, deadline);
 	}
 	
 	if(S_ISFIFO(fptr->mode))
@@ -252,7 +247,7 @@ ssize_t fd_read(id_t id, void *buf, size_t len)
 		int64_t pipe = fptr->spec;
 		fd_unlock(fptr);
 		
-		return pipe_read(pipe, buf, len);
+		return pipe_read(pipe, buf, len, deadline);
 	}
 	
 	ssize_t retval = ramfs_read(fptr, buf, len);
@@ -354,10 +349,32 @@ int fd_unlink(id_t dirfd, const char *name, id_t reffd, int rmdir)
 
 int fd_ioctl(id_t id, uint64_t request, void *ptr, size_t len)
 {
+	//Read timeouts apply to any kind of file. Get the value before locking, in case we fault on it.
+	int64_t rdtimeo = 0;
+	if(request == PX_FD_IOCTL_RDTIMEO)
+	{
+		if(len != sizeof(rdtimeo))
+			return -EINVAL;
+		
+		int copy_err = copyin(&rdtimeo, ptr, sizeof(rdtimeo));
+		if(copy_err < 0)
+			return copy_err;
+		
+		if(rdtimeo < 0)
+			return -EINVAL;
+	}
+	
 	fd_t *fptr = fd_getlocked(id);
 	if(fptr == NULL)
 		return -EBADF;
 	
+	if(request == PX_FD_IOCTL_RDTIMEO)
+	{
+		fptr->rdtimeo = rdtimeo;
+		fd_unlock(fptr);
+		return 0;
+	}
+	
 	if(S_ISCHR(fptr->mode))
 	{
 		int major = (fptr->spec >> 16) & 0xFFFF;
@@ -9,6 +9,11 @@
 
 #include "px.h"
 
+//Most file descriptors that can be open at once, across all processes
+#ifndef FD_MAX
+#define FD_MAX 262144
+#endif
+
 //State of file descriptor
 typedef enum fd_state_e
 {
@@ -48,6 +53,9 @@ typedef struct fd_s
 	//Access flags enabled on the file descriptor
 	int access;
 	
+	//How long reads can block before giving up, in nanoseconds, or 0 to wait forever
+	int64_t rdtimeo;
+	
 	//Threads to wake up when the file descriptor becomes ready
 	id_t *waketid_array;
 	int waketid_count;
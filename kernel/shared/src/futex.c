@@ -0,0 +1,172 @@
+//futex.c
+//Waiting on words of user memory
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "futex.h"
+#include "copy.h"
+#include "kassert.h"
+#include "notify.h"
+#include "process.h"
+#include "thread.h"
+#include "timer.h"
+
+#include "hal_spl.h"
+#include "hal_uspc.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+//One thread waiting on a word. Lives on the waiting thread's stack.
+typedef struct futex_waiter_s
+{
+	//Process and address of the word waited on
+	pid_t pid;
+	uintptr_t addr;
+	
+	//Thread waiting
+	id_t tid;
+	
+	//Set when a waker removes this waiter from its bucket
+	bool woken;
+	
+	//Link in bucket
+	struct futex_waiter_s *next;
+	
+} futex_waiter_t;
+
+//Bucket of waiters whose addresses hash to the same place
+typedef struct futex_bucket_s
+{
+	//Spinlock protecting the bucket
+	hal_spl_t spl;
+	
+	//Threads waiting, oldest first
+	futex_waiter_t *waiters;
+	
+} futex_bucket_t;
+static futex_bucket_t futex_bucket_array[FUTEX_BUCKETS];
+
+//Returns the bucket holding waiters on the given word
+static futex_bucket_t *futex_bucket(pid_t pid, uintptr_t addr)
+{
+	uint64_t hash = ((addr / sizeof(uint64_t)) + (uint64_t)pid) * 0x9E3779B97F4A7C15ull;
+	return &(futex_bucket_array[(hash >> 32) % FUTEX_BUCKETS]);
+}
+
+//Checks that the given address is a word we can wait on, and returns the calling process's ID.
+//Returns the process ID or a negative error number.
+static pid_t futex_pid(uintptr_t addr)
+{
+	if(addr % sizeof(uint64_t) != 0)
+		return -EINVAL;
+	
+	uintptr_t uspc_start = 0;
+	uintptr_t uspc_end = 0;
+	hal_uspc_bound(&uspc_start, &uspc_end);
+	if(addr < uspc_start || addr > uspc_end - sizeof(uint64_t))
+		return -EFAULT;
+	
+	process_t *pptr = process_lockcur();
+	pid_t pid = pptr->id;
+	process_unlock(pptr);
+	return pid;
+}
+
+int futex_wait(uintptr_t addr, uint64_t expected, int64_t timeout)
+{
+	pid_t pid = futex_pid(addr);
+	if(pid < 0)
+		return pid;
+	
+	thread_t *tptr = thread_lockcur();
+	futex_waiter_t waiter = { .pid = pid, .addr = addr, .tid = tptr->id };
+	thread_unlock(tptr);
+	
+	uint64_t deadline = 0;
+	if(timeout >= 0)
+		deadline = timer_now() + timeout;
+	
+	//Get in line at the end of the bucket
+	futex_bucket_t *bptr = futex_bucket(pid, addr);
+	hal_spl_lock(&(bptr->spl));
+	futex_waiter_t **ww = &(bptr->waiters);
+	while(*ww != NULL)
+		ww = &((*ww)->next);
+	
+	*ww = &waiter;
+	hal_spl_unlock(&(bptr->spl));
+	
+	//Only check the word once we're in line, so a wake after the check can't be missed.
+	//Don't hold the bucket lock while reading it, as we might fault.
+	int result = 0;
+	uint64_t current = 0;
+	result = copyin(&current, (const void*)addr, sizeof(current));
+	if(result == 0 && current != expected)
+		result = -EAGAIN;
+	
+	while(result == 0)
+	{
+		hal_spl_lock(&(bptr->spl));
+		bool woken = waiter.woken;
+		hal_spl_unlock(&(bptr->spl));
+		
+		if(woken)
+			break;
+		
+		//Notifications from anything else just make us check again
+		result = notify_timedwait(deadline);
+	}
+	
+	//Get out of line, if nobody took us out already.
+	//If we were woken in the meantime, report that instead - the waker counted us.
+	hal_spl_lock(&(bptr->spl));
+	if(waiter.woken)
+	{
+		result = 0;
+	}
+	else
+	{
+		ww = &(bptr->waiters);
+		while(*ww != &waiter)
+		{
+			KASSERT(*ww != NULL);
+			ww = &((*ww)->next);
+		}
+		*ww = waiter.next;
+	}
+	hal_spl_unlock(&(bptr->spl));
+	
+	return result;
+}
+
+int futex_wake(uintptr_t addr, int count)
+{
+	pid_t pid = futex_pid(addr);
+	if(pid < 0)
+		return pid;
+	
+	futex_bucket_t *bptr = futex_bucket(pid, addr);
+	hal_spl_lock(&(bptr->spl));
+	
+	int woken = 0;
+	futex_waiter_t **ww = &(bptr->waiters);
+	while(*ww != NULL && woken < count)
+	{
+		futex_waiter_t *wptr = *ww;
+		if(wptr->pid != pid || wptr->addr != addr)
+		{
+			ww = &(wptr->next);
+			continue;
+		}
+		
+		//Take the waiter out of line. It can't return until we unlock the bucket, so it's safe to use until then.
+		*ww = wptr->next;
+		wptr->woken = true;
+		notify_thread(wptr->tid);
+		woken++;
+	}
+	
+	hal_spl_unlock(&(bptr->spl));
+	return woken;
+}
@@ -0,0 +1,27 @@
+//futex.h
+//Waiting on words of user memory
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include <stdint.h>
+
+//Userspace builds its locks on atomic operations on words of its own memory.
+//When it needs to block, it asks the kernel to wait until the word is woken, keyed by its address.
+//Waiters are hashed by address onto a fixed set of buckets, each with its own lock and list.
+
+//Number of buckets waiting threads are hashed onto
+#ifndef FUTEX_BUCKETS
+	#define FUTEX_BUCKETS 64
+#endif
+
+//Waits until the given word in the calling process is woken, if it still holds the expected value.
+//Gives up after the given time in nanoseconds, unless it's negative.
+//Returns 0 if woken or a negative error number - -EAGAIN if the word didn't hold the expected value.
+int futex_wait(uintptr_t addr, uint64_t expected, int64_t timeout);
+
+//Wakes up to the given number of threads waiting on the given word in the calling process.
+//Returns the number of threads woken or a negative error number.
+int futex_wake(uintptr_t addr, int count);
+
+#endif //FUTEX_H
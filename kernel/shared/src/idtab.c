@@ -0,0 +1,160 @@
+//idtab.c
+//Growable tables of objects looked up by ID
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "idtab.h"
+#include "kspace.h"
+#include "kassert.h"
+
+#include <stdint.h>
+
+//Chunk of slots in a table
+typedef struct idtab_chunk_s
+{
+	//Next free slot after each one in the chunk, while it's on the free list
+	int next[IDTAB_CHUNK];
+	
+	//ID last handed out for each slot in the chunk
+	id_t ids[IDTAB_CHUNK];
+	
+	//Entries themselves
+	uint8_t entries[] __attribute__((aligned(IDTAB_ALIGN)));
+	
+} idtab_chunk_t;
+
+//Returns the number of bytes allocated for each chunk of the given table
+static size_t idtab_chunk_size(const idtab_t *tab)
+{
+	return sizeof(idtab_chunk_t) + (tab->size * IDTAB_CHUNK);
+}
+
+//Returns the chunk holding the given slot, or NULL if it's not allocated yet
+static idtab_chunk_t *idtab_chunk(idtab_t *tab, int slot)
+{
+	if(slot < 0 || slot >= tab->max)
+		return NULL;
+	
+	return *(idtab_chunk_t * volatile *)&(tab->chunks[slot / IDTAB_CHUNK]);
+}
+
+//Adds a chunk of slots to the table, when there are no free slots left, and makes them the free list.
+//The table should be locked. Returns 0 on success or -1 if the table can't grow.
+static int idtab_grow(idtab_t *tab)
+{
+	KASSERT(tab->free_head < 0 && tab->free_tail < 0);
+	if(tab->count >= tab->max)
+		return -1;
+	
+	//kspace memory comes zeroed
+	idtab_chunk_t *cptr = kspace_alloc(idtab_chunk_size(tab), IDTAB_ALIGN);
+	if(cptr == NULL)
+		return -1;
+	
+	int first = tab->count;
+	for(int ss = 0; ss < IDTAB_CHUNK; ss++)
+	{
+		cptr->next[ss] = -1;
+		
+		//Slot 0 is never used
+		if(first + ss == 0)
+			continue;
+		
+		if(tab->free_tail < 0)
+			tab->free_head = first + ss;
+		else
+			cptr->next[tab->free_tail - first] = first + ss;
+		
+		tab->free_tail = first + ss;
+	}
+	
+	//Publish the chunk before the count, so anyone who sees the new count can find it
+	*(idtab_chunk_t * volatile *)&(tab->chunks[first / IDTAB_CHUNK]) = cptr;
+	*(volatile int*)&(tab->count) = first + IDTAB_CHUNK;
+	return 0;
+}
+
+void idtab_init(idtab_t *tab, size_t size, int max)
+{
+	KASSERT(max > 0 && (max % IDTAB_CHUNK) == 0);
+	
+	tab->size = (size + IDTAB_ALIGN - 1) & ~(size_t)(IDTAB_ALIGN - 1);
+	tab->max = max;
+	tab->chunks = kspace_alloc(sizeof(tab->chunks[0]) * (max / IDTAB_CHUNK), alignof(tab->chunks[0]));
+	KASSERT(tab->chunks != NULL);
+	tab->count = 0;
+	tab->free_head = -1;
+	tab->free_tail = -1;
+}
+
+void *idtab_alloc(idtab_t *tab, id_t *id_out)
+{
+	hal_spl_lock(&(tab->spl));
+	if(tab->free_head < 0 && idtab_grow(tab) < 0)
+	{
+		//No free slots, and no room to grow
+		hal_spl_unlock(&(tab->spl));
+		return NULL;
+	}
+	
+	int slot = tab->free_head;
+	idtab_chunk_t *cptr = tab->chunks[slot / IDTAB_CHUNK];
+	tab->free_head = cptr->next[slot % IDTAB_CHUNK];
+	if(tab->free_head < 0)
+		tab->free_tail = -1;
+	
+	cptr->next[slot % IDTAB_CHUNK] = -1;
+	
+	//Advance the slot's ID, wrapping around before it goes negative
+	id_t id = cptr->ids[slot % IDTAB_CHUNK];
+	if(id == 0 || id > INT32_MAX - tab->max)
+		id = slot;
+	else
+		id += tab->max;
+	
+	cptr->ids[slot % IDTAB_CHUNK] = id;
+	hal_spl_unlock(&(tab->spl));
+	
+	*id_out = id;
+	return cptr->entries + (tab->size * (slot % IDTAB_CHUNK));
+}
+
+void idtab_free(idtab_t *tab, id_t id)
+{
+	int slot = id % tab->max;
+	idtab_chunk_t *cptr = idtab_chunk(tab, slot);
+	KASSERT(cptr != NULL);
+	KASSERT(cptr->ids[slot % IDTAB_CHUNK] == id);
+	
+	//Goes at the end of the free list, so it's reused as late as possible
+	hal_spl_lock(&(tab->spl));
+	KASSERT(cptr->next[slot % IDTAB_CHUNK] == -1);
+	if(tab->free_tail < 0)
+		tab->free_head = slot;
+	else
+		tab->chunks[tab->free_tail / IDTAB_CHUNK]->next[tab->free_tail % IDTAB_CHUNK] = slot;
+	
+	tab->free_tail = slot;
+	hal_spl_unlock(&(tab->spl));
+}
+
+void *idtab_get(idtab_t *tab, id_t id)
+{
+	if(id <= 0)
+		return NULL;
+	
+	return idtab_slot(tab, id % tab->max);
+}
+
+void *idtab_slot(idtab_t *tab, int slot)
+{
+	idtab_chunk_t *cptr = idtab_chunk(tab, slot);
+	if(cptr == NULL || slot == 0)
+		return NULL;
+	
+	return cptr->entries + (tab->size * (slot % IDTAB_CHUNK));
+}
+
+int idtab_count(idtab_t *tab)
+{
+	return *(volatile int*)&(tab->count);
+}
@@ -0,0 +1,70 @@
+//idtab.h
+//Growable tables of objects looked up by ID
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef IDTAB_H
+#define IDTAB_H
+
+#include "hal_spl.h"
+
+#include <sys/types.h>
+#include <stddef.h>
+
+//Threads, processes, file descriptors, and pipes live in tables, and are referred to by ID.
+//Each ID maps to one slot in its table - the ID modulo the most slots the table can have.
+//Tables grow a chunk of slots at a time, as needed, and never shrink. Entries never move, so pointers to them stay valid.
+//Free slots are reused oldest-first, and a slot's ID advances each time it's reused, so IDs don't come back quickly.
+//Slot 0 is never used, so ID 0 is never handed out.
+
+//Number of slots added each time a table grows
+#ifndef IDTAB_CHUNK
+#define IDTAB_CHUNK 64
+#endif
+
+//Entries are padded and aligned to this, so neighbouring entries don't share cache lines
+#define IDTAB_ALIGN 64
+
+//Table of objects
+typedef struct idtab_s
+{
+	//Spinlock protecting the free list and the growth of the table
+	hal_spl_t spl;
+	
+	//Size of each entry, padded, and the most slots the table can have
+	size_t size;
+	int max;
+	
+	//Chunks of slots allocated so far, and how many slots they hold.
+	//Only ever added to - these are read without the lock.
+	struct idtab_chunk_s **chunks;
+	int count;
+	
+	//Free slots, in the order they were freed, or -1 if there are none
+	int free_head;
+	int free_tail;
+	
+} idtab_t;
+
+//Sets up a table of entries of the given size, able to grow to the given number of slots.
+void idtab_init(idtab_t *tab, size_t size, int max);
+
+//Takes a free slot from the table, growing it if needed, and stores the slot's new ID.
+//The entry is zeroed when the table first grows to include it, and left as it was freed after that.
+//Returns the entry, not locked, or NULL if the table is full.
+void *idtab_alloc(idtab_t *tab, id_t *id_out);
+
+//Puts the slot holding the given ID back on the free list.
+//The caller should have already marked the entry free, so anyone finding it by an old ID ignores it.
+void idtab_free(idtab_t *tab, id_t id);
+
+//Returns the entry in the slot for the given ID, or NULL if there can't be one.
+//The entry may be free or hold a different ID - the caller should lock it and check.
+void *idtab_get(idtab_t *tab, id_t id);
+
+//Returns the entry in the given slot, or NULL if the table hasn't grown that far.
+//Used to look at every entry, for slots from 0 up to idtab_count.
+void *idtab_slot(idtab_t *tab, int slot);
+
+//Returns the number of slots the table has grown to so far.
+int idtab_count(idtab_t *tab);
+
+#endif //IDTAB_H
@@ -4,16 +4,27 @@
 
 #include "con.h"
 #include "fd.h"
+#include "pipe.h"
 #include "thread.h"
 #include "process.h"
+#include "mem.h"
+#include "reclaim.h"
+#include "merge.h"
+#include "teardown.h"
+#include "timer.h"
+#include "vdata.h"
 #include "kassert.h"
 #include "syscalls.h"
 #include "libcstubs.h"
 
+#include "hal_atomic.h"
+#include "hal_copy.h"
 #include "hal_exit.h"
+#include "hal_ktls.h"
 
 #include "px.h"
 #include <errno.h>
+#include <signal.h>
 
 //Called on bootstrap core before releasing other cores.
 //Should return when single-threaded initialization is finished.
@@ -21,9 +32,14 @@ void kentry_boot(void)
 {
 	//Init kernel and make initial process/thread
 	con_init();
+	mem_init();
+	vdata_init();
 	fd_init();
+	pipe_init();
 	thread_init();
 	process_init();
+	reclaim_init();
+	merge_init();
 	
 	//Return to start scheduling threads
 }
@@ -31,21 +47,46 @@ void kentry_boot(void)
 //Called on all cores after kentry_boot. Should never return.
 void kentry_sched(void)
 {
+	teardown_initcpu();
+	vdata_initcpu();
 	thread_sched(); //Should not return.
 	KASSERT(0);
 }
 
-//Called when user code makes a system-call.
-//Should not return. Instead, call hal_exit_resume with the given exit-buffer.
-void kentry_syscall(uint64_t call, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, uint64_t p5, hal_exit_t *eptr)
+//Returns to user code with the given exit-buffer, after a system-call or preemption.
+//Kills the thread instead if its process is exiting, or enters a signal handler if a signal is pending.
+static void kentry_resume(hal_exit_t *eptr)
 {
-	//Perform the system-call as requested and store return-value in the kernel-exit context.
-	eptr->vals[HAL_EXIT_IDX_RV] = syscalls_switch(call, p1, p2, p3, p4, p5);
+	//Anything that could stop us going straight back - preemption, signals, being killed, memory to release - flags it on the thread first.
+	//Usually nothing has, and we can return without locking anything.
+	thread_t *tptr = hal_ktls_get();
+	if(*(volatile hal_atomic_t*)&(tptr->work) == 0)
+	{
+		thread_usage_exit();
+		hal_exit_resume(eptr, tptr->stack_top);
+		KASSERT(0);
+	}
+	
+	//Take the flags, then check everything properly.
+	//Anything flagged after this is either caught by the checks below, or still flagged next time.
+	uint32_t work = hal_atomic_swap(&(tptr->work), 0);
+	tptr = NULL;
+	
+	//Release anything that a fault in the kernel replaced, now that we can wait on other CPUs to flush it
+	if(work & THREAD_WORK_MEM)
+		mem_space_sync(process_curmem());
+	
+	//Let other threads have a turn, if we've used up our time-slice
+	thread_preempt();
+	
+	//Before returning, check that the calling process should keep executing.
+	//If the process is supposed to be exiting, or the thread was killed, kill the thread instead of returning to userland.
+	tptr = thread_lockcur();
+	bool killed = tptr->killed;
+	thread_unlock(tptr);
 	
-	//On return from system-call, check that the calling process should keep executing.
-	//If the process is supposed to be exiting, kill the thread instead of returning to userland.
 	process_t *pptr = process_lockcur();
-	if(pptr->state != PROCESS_STATE_ALIVE)
+	if(pptr->state != PROCESS_STATE_ALIVE || killed)
 	{
 		process_unlock(pptr);
 		process_leave();
@@ -64,7 +105,7 @@ void kentry_syscall(uint64_t call, uint64_t p1, uint64_t p2, uint64_t p3, uint64
 	//See if the thread has a pending signal.
 	//If so, return to the signal handler instead.
 	//Restore any temporarily-saved signal mask, regardless.
-	thread_t *tptr = thread_lockcur();
+	tptr = thread_lockcur();
 	
 	//Get the location of the kernel-stack pointer for the thread, for re-entering the kernel after we leave.
 	void *sp = tptr->stack_top;
@@ -85,9 +126,10 @@ void kentry_syscall(uint64_t call, uint64_t p1, uint64_t p2, uint64_t p3, uint64
 		//The signal is no longer pending
 		tptr->sigpend &= ~sigcaught_mask;
 		
-		//Save our exit context to the thread, so it can retrieve it later
+		//Save our exit context to the thread, so it can retrieve it later, and the FPU state to go with it
 		KASSERT(eptr->vals[0] <= sizeof(tptr->sigexit.vals));
 		memcpy(tptr->sigexit.vals, eptr->vals, eptr->vals[0]);
+		thread_fpu_sigsave();
 		
 		//Save signal information for the thread to get
 		tptr->siginfo.signum = sigcaught_num;
@@ -102,21 +144,56 @@ void kentry_syscall(uint64_t call, uint64_t p1, uint64_t p2, uint64_t p3, uint64
 	thread_unlock(tptr);
 	tptr = NULL;
 	
-	//Return from the system call with the given return value
+	//Return to user code, with the return value of any system call
+	thread_usage_exit();
 	hal_exit_resume(eptr, sp);
 	KASSERT(0);
 }
 
+//Called when user code makes a system-call.
+//Should not return. Instead, call hal_exit_resume with the given exit-buffer.
+void kentry_syscall(uint64_t call, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, uint64_t p5, hal_exit_t *eptr)
+{
+	//Time up to now was spent in user code
+	thread_usage_enter();
+	
+	//Perform the system-call as requested and store return-value in the kernel-exit context.
+	eptr->vals[HAL_EXIT_IDX_RV] = syscalls_switch(call, p1, p2, p3, p4, p5);
+	kentry_resume(eptr);
+	KASSERT(0);
+}
+
+//Called when user code is interrupted by the timer.
+//Should not return. Instead, call hal_exit_resume with the given exit-buffer.
+void kentry_timer(hal_exit_t *eptr)
+{
+	thread_usage_enter();
+	
+	//Run any timers that are due, then come back the same way as a system-call.
+	//That way a thread stuck in a loop is still preempted, still gets its signals, and still dies when its process exits.
+	timer_fire();
+	kentry_resume(eptr);
+	KASSERT(0);
+}
+
+//Called when kernel code is interrupted by the timer.
+//The kernel isn't preemptible, so this just runs any timers that are due.
+void kentry_ktimer(void)
+{
+	timer_fire();
+}
+
 //Called when an exception is caught by hardware.
 //The state of the CPU should be preserved already, and continue if this returns.
 void kentry_exception(int signum, uint64_t pc_addr, uint64_t ref_addr, hal_exit_t *eptr)
 {
 	//Check if this exception was in user-space or kernel-space.
-	//For now we don't handle exceptions in the kernel.
-	//Todo - we'll need to handle exceptions in the kernel for safely copying to/from userspace in a timely way.
+	//Exceptions in the kernel should come in through kentry_kfault instead.
+	//User code can also run into the kernel's data pages past the end of its space.
 	uintptr_t uspc_start = 0;
 	uintptr_t uspc_end = 0;
 	hal_uspc_bound(&uspc_start, &uspc_end);
+	uspc_end = hal_uspc_vdata() + (HAL_USPC_VDATA_PAGES * hal_frame_size());
 	if(pc_addr < uspc_start || pc_addr >= uspc_end)
 	{
 		static const char *exc = "exception caught in kernel space";
@@ -126,6 +203,27 @@ void kentry_exception(int signum, uint64_t pc_addr, uint64_t ref_addr, hal_exit_
 	}
 	
 	//Exception came from user-space.
+	thread_usage_enter();
+	
+	//It may just be the first write to memory that isn't private yet - see if we can resolve it and continue.
+	if(signum == SIGSEGV)
+	{
+		int fault_err = mem_space_fault(process_curmem(), ref_addr);
+		if(fault_err == 0)
+		{
+			//Frames the fault replaced might still be cached by other threads' CPUs
+			mem_space_sync(process_curmem());
+			
+			thread_t *tptr = thread_lockcur();
+			void *sp = tptr->stack_top;
+			thread_unlock(tptr);
+			
+			thread_usage_exit();
+			hal_exit_resume(eptr, sp);
+			KASSERT(0);
+		}
+	}
+	
 	//We'll allow user-space to handle it like a signal being raised.
 	
 	//Figure out where the signal handler entry is
@@ -158,6 +256,7 @@ void kentry_exception(int signum, uint64_t pc_addr, uint64_t ref_addr, hal_exit_
 	//Save the exit context for when the user code wants to return to the interrupted context
 	KASSERT(eptr->vals[0] < sizeof(tptr->sigexit.vals));
 	memcpy(tptr->sigexit.vals, eptr->vals, eptr->vals[0]);
+	thread_fpu_sigsave();
 	
 	//Save signal information for the signal handler to retrieve
 	tptr->siginfo.signum = signum;
@@ -176,10 +275,70 @@ void kentry_exception(int signum, uint64_t pc_addr, uint64_t ref_addr, hal_exit_
 	thread_unlock(tptr);
 	tptr = NULL;
 	
+	thread_usage_exit();
 	hal_exit_resume(eptr, sp);
 	KASSERT(0);
 }
 
+//Called when user code uses the FPU for the first time since switching to its thread.
+//Should not return. Instead, call hal_exit_resume with the given exit-buffer.
+void kentry_fpu(hal_exit_t *eptr)
+{
+	thread_usage_enter();
+	
+	//Load the thread's FPU state and retry the instruction.
+	//If there's no room to keep its state, it can't use the FPU - treat it like a floating-point exception.
+	int claim_err = thread_fpu_claim();
+	if(claim_err < 0)
+	{
+		kentry_exception(SIGFPE, eptr->vals[HAL_EXIT_IDX_PC], 0, eptr);
+		KASSERT(0);
+	}
+	
+	thread_t *tptr = thread_lockcur();
+	void *sp = tptr->stack_top;
+	thread_unlock(tptr);
+	
+	thread_usage_exit();
+	hal_exit_resume(eptr, sp);
+	KASSERT(0);
+}
+
+//Called when an exception is caught by hardware while running kernel code.
+//Returns if the fault was resolved, with the address where execution should continue.
+uint64_t kentry_kfault(int signum, uint64_t pc_addr, uint64_t ref_addr)
+{
+	uintptr_t uspc_start = 0;
+	uintptr_t uspc_end = 0;
+	hal_uspc_bound(&uspc_start, &uspc_end);
+	if(signum == SIGSEGV && ref_addr >= uspc_start && ref_addr < uspc_end)
+	{
+		//The kernel faults when writing to userspace memory that isn't private yet.
+		//We can resolve that if it's the current process's memory that's active.
+		//The copy might be made under any lock, including ones that other threads hold while waiting on our process.
+		//So don't lock the process or thread - the memory space has its own lock for resolving faults.
+		mem_space_t *mptr = process_curmem();
+		if(mptr != NULL && mptr->uspc == hal_uspc_current() && mem_space_fault(mptr, ref_addr) == 0)
+		{
+			//We might hold locks, so release what the fault replaced on the way back to userspace
+			if(mptr->stale_count > 0)
+				thread_work(hal_ktls_get(), THREAD_WORK_MEM);
+			
+			return pc_addr;
+		}
+		
+		//Copies to and from userspace give up with an error, if the memory isn't really there
+		uintptr_t fixup = hal_copy_fixup(pc_addr);
+		if(fixup != 0)
+			return fixup;
+	}
+	
+	static const char *exc = "exception caught in kernel space";
+	con_panic(exc);
+	hal_panic(exc);
+	while(1) { }
+}
+
 //Called in interrupt context when a key is pressed or released on the keyboard.
 void kentry_isr_kbd(hal_kbd_scancode_t scancode, bool state)
 {
@@ -5,6 +5,8 @@
 #include "libcstubs.h"
 #include "kspace.h"
 
+#include "hal_copy.h"
+
 int memcmp(const void *s1, const void *s2, size_t n)
 {
 	const unsigned char *b1 = (const unsigned char *)s1;
@@ -21,23 +23,12 @@ int memcmp(const void *s1, const void *s2, size_t n)
 
 void *memset(void *s, int c, size_t n)
 {
-	unsigned char *b = (unsigned char*)s;
-	for(size_t bb = 0; bb < n; bb++)
-	{
-		b[bb] = (unsigned char)c;
-	}
-	return s;
+	return hal_memset(s, c, n);
 }
 
 void *memcpy(void *dest, const void *src, size_t n)
 {
-	unsigned char *destc = (unsigned char*)dest;
-	const unsigned char *srcc = (const unsigned char*)src;
-	for(size_t bb = 0; bb < n; bb++)
-	{
-		destc[bb] = srcc[bb];
-	}
-	return dest;
+	return hal_memcpy(dest, src, n);
 }
 
 size_t strlen(const char *s)
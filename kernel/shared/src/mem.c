@@ -5,12 +5,466 @@
 #include "mem.h"
 #include "kassert.h"
 #include "kspace.h"
+#include "zpage.h"
+#include "merge.h"
+#include "reclaim.h"
+#include "zygote.h"
+#include "vdata.h"
 
 #include "hal_frame.h"
+#include "hal_clock.h"
+#include "hal_spl.h"
 
 #include <errno.h>
 #include <stddef.h>
 
+//Pages that aren't present can have a token left in their place, saying where their contents went.
+//Pages in the middle of being evicted keep their frame as the token - frames are page-aligned, so the low bit is clear.
+//Pages in the compressed store have their handle as the token, shifted up, with the low bit set.
+#define MEM_TOKEN_ZPAGE 1
+
+//Number of pages examined in each scan for cold pages
+#define MEM_EVICT_SCAN 1024
+
+//Number of pages examined in each scan for pages to merge
+#define MEM_MERGE_SCAN 1024
+
+//Things held in a memory space until other CPUs flush them, kept with their kind in the low bits - frames are page-aligned.
+#define MEM_STALE_FRAME 0 //Frame that was mapped, released like any other - or a frame left in place of a page being evicted
+#define MEM_STALE_HUGE 1 //Huge frame
+#define MEM_STALE_TABLE 2 //Pagetable replaced by a huge page
+#define MEM_STALE_KIND 3
+
+//Number of things held in each chunk of the list, so a chunk fills one page
+#define MEM_STALE_CHUNK 510
+
+//Chunk of the list of things unmapped from a memory space, that other CPUs might still reach through cached mappings.
+typedef struct mem_stale_s
+{
+	struct mem_stale_s *next;
+	int count;
+	uint64_t entry[MEM_STALE_CHUNK];
+} mem_stale_t;
+
+//Frame of zeroes, shared read-only by all anonymous memory that hasn't been written yet.
+static hal_frame_id_t mem_zero_frame;
+
+//Statistics about memory usage, across all memory spaces
+static hal_spl_t mem_stat_spl;
+static uint64_t mem_stat_huge_mapped; //Huge pages currently mapped
+static uint64_t mem_stat_huge_fallback; //Times that small pages were used because no huge frame was available
+
+//Numbers of flushes of all CPUs started and finished, with mem_flush
+static hal_spl_t mem_flush_spl;
+static uint64_t mem_flush_started;
+static uint64_t mem_flush_done;
+
+void mem_init(void)
+{
+	//Frames come from the allocator already zeroed
+	mem_zero_frame = hal_frame_alloc();
+	KASSERT(mem_zero_frame != HAL_FRAME_ID_INVALID);
+}
+
+//Releases a frame that was mapped in a memory space, unless it's shared.
+static void mem_frame_release(hal_frame_id_t frame)
+{
+	if(frame == mem_zero_frame)
+		return;
+	
+	if(merge_release(frame))
+		return;
+	
+	hal_frame_free(frame);
+}
+
+//Adjusts statistics kept on huge pages
+static void mem_stat_huge(int64_t mapped, int64_t fallback)
+{
+	hal_spl_lock(&mem_stat_spl);
+	mem_stat_huge_mapped += mapped;
+	mem_stat_huge_fallback += fallback;
+	hal_spl_unlock(&mem_stat_spl);
+}
+
+//Releases something that was held until other CPUs flushed it.
+static void mem_stale_release(uint64_t entry)
+{
+	hal_frame_id_t frame = entry & ~(uint64_t)MEM_STALE_KIND;
+	switch(entry & MEM_STALE_KIND)
+	{
+		case MEM_STALE_HUGE:
+			hal_frame_free_huge(frame);
+			break;
+		case MEM_STALE_TABLE:
+			hal_frame_free(frame);
+			break;
+		default:
+			mem_frame_release(frame);
+			break;
+	}
+}
+
+//Releases everything held in a memory space, which should be locked.
+//Frees the chunks of the list as well, unless one is kept for next time.
+static void mem_stale_release_all(mem_space_t *mptr, bool keep)
+{
+	mem_stale_t *sptr = mptr->stale;
+	mptr->stale = NULL;
+	while(sptr != NULL)
+	{
+		mem_stale_t *next = sptr->next;
+		for(int ee = 0; ee < sptr->count; ee++)
+		{
+			mem_stale_release(sptr->entry[ee]);
+		}
+		
+		sptr->count = 0;
+		if(keep && mptr->stale == NULL)
+		{
+			sptr->next = NULL;
+			mptr->stale = sptr;
+		}
+		else
+		{
+			kspace_free(sptr, sizeof(mem_stale_t));
+		}
+		
+		sptr = next;
+	}
+	
+	mptr->stale_count = 0;
+}
+
+//Makes sure a memory space, which should be locked, has room to hold the given number of things until other CPUs flush.
+//Returns 0 on success or -ENOMEM.
+static int mem_stale_room(mem_space_t *mptr, int needed)
+{
+	int room = 0;
+	for(const mem_stale_t *sptr = mptr->stale; sptr != NULL; sptr = sptr->next)
+	{
+		room += MEM_STALE_CHUNK - sptr->count;
+	}
+	
+	while(room < needed)
+	{
+		mem_stale_t *sptr = kspace_alloc(sizeof(mem_stale_t), alignof(mem_stale_t));
+		if(sptr == NULL)
+			return -ENOMEM;
+		
+		sptr->count = 0;
+		sptr->next = mptr->stale;
+		mptr->stale = sptr;
+		room += MEM_STALE_CHUNK;
+	}
+	
+	return 0;
+}
+
+//Holds something unmapped from a memory space, which should be locked, until every CPU has flushed.
+//Room must have been made with mem_stale_room.
+static void mem_stale_add(mem_space_t *mptr, uint64_t entry)
+{
+	mem_stale_t *sptr = mptr->stale;
+	while(sptr != NULL && sptr->count >= MEM_STALE_CHUNK)
+	{
+		sptr = sptr->next;
+	}
+	
+	KASSERT(sptr != NULL);
+	sptr->entry[sptr->count] = entry;
+	sptr->count++;
+	mptr->stale_count++;
+	
+	//Any flush that starts after this point covers the mapping we just removed.
+	//The lock orders our pagetable change before the flush reads the count.
+	hal_spl_lock(&mem_flush_spl);
+	mptr->stale_gen = mem_flush_started + 1;
+	hal_spl_unlock(&mem_flush_spl);
+}
+
+//Releases what's held in a memory space, which should be locked, if every CPU has flushed since it was unmapped.
+static void mem_stale_reap(mem_space_t *mptr)
+{
+	if(mptr->stale_count == 0)
+		return;
+	
+	hal_spl_lock(&mem_flush_spl);
+	bool flushed = (mem_flush_done >= mptr->stale_gen);
+	hal_spl_unlock(&mem_flush_spl);
+	
+	if(flushed)
+		mem_stale_release_all(mptr, true);
+}
+
+//Releases a frame or pagetable just unmapped from a memory space, which should be locked.
+//If other CPUs might still have it cached, it's held until they flush instead - there must be room for it.
+static void mem_drop(mem_space_t *mptr, uint64_t entry)
+{
+	if(entry == mem_zero_frame)
+		return;
+	
+	if(mptr->threaded)
+		mem_stale_add(mptr, entry);
+	else
+		mem_stale_release(entry);
+}
+
+//Locks a memory space, releasing whatever it held that's since been flushed.
+static void mem_lock(mem_space_t *mptr)
+{
+	hal_spl_lock(&(mptr->spl));
+	mem_stale_reap(mptr);
+}
+
+void mem_flush(void)
+{
+	hal_spl_lock(&mem_flush_spl);
+	mem_flush_started++;
+	uint64_t gen = mem_flush_started;
+	hal_spl_unlock(&mem_flush_spl);
+	
+	hal_uspc_flush();
+	
+	//Flushes may finish out of order - a later one still covers everything an earlier one did
+	hal_spl_lock(&mem_flush_spl);
+	if(mem_flush_done < gen)
+		mem_flush_done = gen;
+	hal_spl_unlock(&mem_flush_spl);
+}
+
+void mem_space_sync(mem_space_t *mptr)
+{
+	//Peek without the lock - at worst we flush for nothing, or leave it for next time
+	if(mptr == NULL || mptr->stale_count == 0)
+		return;
+	
+	mem_flush();
+	
+	mem_lock(mptr);
+	hal_spl_unlock(&(mptr->spl));
+}
+
+void mem_space_threaded(mem_space_t *mptr)
+{
+	mem_lock(mptr);
+	mptr->threaded = true;
+	hal_spl_unlock(&(mptr->spl));
+}
+
+//Returns how many things mem_unmap would hold for the given range, until other CPUs flush.
+static int mem_unmap_count(mem_space_t *mptr, uintptr_t start, uintptr_t end)
+{
+	if(!mptr->threaded)
+		return 0;
+	
+	size_t pagesize = hal_frame_size();
+	size_t hugesize = hal_frame_huge_size();
+	
+	int count = 0;
+	uintptr_t aa = start;
+	while(aa < end)
+	{
+		if(hal_uspc_is_huge(mptr->uspc, aa))
+		{
+			count++;
+			aa += hugesize;
+			continue;
+		}
+		
+		hal_frame_id_t frame = hal_uspc_get(mptr->uspc, aa);
+		if(frame != HAL_FRAME_ID_INVALID && frame != mem_zero_frame)
+			count++;
+		else if(frame == HAL_FRAME_ID_INVALID && hal_uspc_getswap(mptr->uspc, aa) != 0)
+			count++;
+		
+		aa += pagesize;
+	}
+	
+	return count;
+}
+
+//Unmaps the given range of a memory space and releases the frames that were mapped there.
+//If other CPUs might be using the space, the frames are held until they flush - there must be room for them.
+//Huge pages in the range must lie entirely within it.
+static void mem_unmap(mem_space_t *mptr, uintptr_t start, uintptr_t end)
+{
+	size_t pagesize = hal_frame_size();
+	size_t hugesize = hal_frame_huge_size();
+	
+	uintptr_t aa = start;
+	while(aa < end)
+	{
+		if(hal_uspc_is_huge(mptr->uspc, aa))
+		{
+			KASSERT(aa % hugesize == 0);
+			KASSERT(aa + hugesize <= end);
+			hal_frame_id_t huge = hal_uspc_get(mptr->uspc, aa);
+			hal_frame_id_t table = HAL_FRAME_ID_INVALID;
+			hal_uspc_set_huge(mptr->uspc, aa, HAL_FRAME_ID_INVALID, false, &table);
+			KASSERT(table == HAL_FRAME_ID_INVALID); //Was a huge page, not a pagetable
+			mem_drop(mptr, huge | MEM_STALE_HUGE);
+			mem_stat_huge(-1, 0);
+			aa += hugesize;
+			continue;
+		}
+		
+		hal_frame_id_t oldframe = hal_uspc_get(mptr->uspc, aa);
+		if(oldframe != HAL_FRAME_ID_INVALID)
+		{
+			hal_uspc_set(mptr->uspc, aa, HAL_FRAME_ID_INVALID, false);
+			//Todo - don't free the frame if it came from a file
+			mem_drop(mptr, oldframe);
+		}
+		else
+		{
+			uint64_t token = hal_uspc_getswap(mptr->uspc, aa);
+			if(token != 0)
+			{
+				hal_uspc_set(mptr->uspc, aa, HAL_FRAME_ID_INVALID, false);
+				
+				//A frame in the middle of being evicted might still be cached, but the compressed store isn't mapped anywhere
+				if(token & MEM_TOKEN_ZPAGE)
+					zpage_free(token >> 1);
+				else
+					mem_drop(mptr, token);
+			}
+		}
+		
+		aa += pagesize;
+	}
+}
+
+//Breaks up a huge page containing the given address, if it extends outside the given range.
+static int mem_split_edge(mem_space_t *mptr, uintptr_t start, uintptr_t end, uintptr_t addr)
+{
+	if(!hal_uspc_is_huge(mptr->uspc, addr))
+		return 0;
+	
+	size_t hugesize = hal_frame_huge_size();
+	uintptr_t block = addr - (addr % hugesize);
+	if(block >= start && block + hugesize <= end)
+		return 0;
+	
+	if(hal_uspc_split(mptr->uspc, addr) < 0)
+		return -ENOMEM;
+	
+	mem_stat_huge(-1, 0);
+	return 0;
+}
+
+//Backs the huge page at the given address with a single huge frame, replacing any small pages there.
+//If src is given, the contents of the same range in that memory space are copied.
+static int mem_huge_map(mem_space_t *mptr, uintptr_t addr, mem_space_t *src)
+{
+	size_t pagesize = hal_frame_size();
+	size_t hugesize = hal_frame_huge_size();
+	KASSERT(addr % hugesize == 0);
+	
+	//Need room to hold the small pages and their pagetable, if other CPUs might have them cached
+	if(mptr->threaded && mem_stale_room(mptr, mem_unmap_count(mptr, addr, addr + hugesize) + 1) < 0)
+		return -ENOMEM;
+	
+	hal_frame_id_t huge = hal_frame_alloc_huge();
+	if(huge == HAL_FRAME_ID_INVALID)
+	{
+		//Fragmented or out of memory - caller will fall back to small pages.
+		mem_stat_huge(0, 1);
+		return -ENOMEM;
+	}
+	
+	if(src != NULL)
+	{
+		for(size_t pp = 0; pp < hugesize; pp += pagesize)
+		{
+			hal_frame_id_t srcframe = hal_uspc_get(src->uspc, addr + pp);
+			KASSERT(srcframe != HAL_FRAME_ID_INVALID);
+			if(srcframe != mem_zero_frame)
+				hal_frame_copy(huge + pp, srcframe);
+		}
+	}
+	
+	mem_unmap(mptr, addr, addr + hugesize);
+	hal_frame_id_t table = HAL_FRAME_ID_INVALID;
+	int set_err = hal_uspc_set_huge(mptr->uspc, addr, huge, true, &table);
+	if(set_err < 0)
+	{
+		hal_frame_free_huge(huge);
+		return -ENOMEM;
+	}
+	
+	if(table != HAL_FRAME_ID_INVALID)
+		mem_drop(mptr, table | MEM_STALE_TABLE);
+	
+	mem_stat_huge(1, 0);
+	return 0;
+}
+
+//Returns whether every page in the huge page at the given address still shares the zero-frame.
+static bool mem_huge_untouched(mem_space_t *mptr, uintptr_t addr)
+{
+	size_t pagesize = hal_frame_size();
+	size_t hugesize = hal_frame_huge_size();
+	for(size_t pp = 0; pp < hugesize; pp += pagesize)
+	{
+		if(hal_uspc_get(mptr->uspc, addr + pp) != mem_zero_frame)
+			return false;
+	}
+	
+	return true;
+}
+
+//Gives the page at the given address a private, writable frame, containing a copy of the given frame.
+//If other CPUs might be using the space, there must be room to hold the old frame until they flush.
+static int mem_page_private(mem_space_t *mptr, uintptr_t addr, hal_frame_id_t src)
+{
+	hal_frame_id_t frame = hal_frame_alloc();
+	if(frame == HAL_FRAME_ID_INVALID)
+		return -ENOMEM;
+	
+	//New frames come zeroed, so no need to copy the zero-frame.
+	if(src != mem_zero_frame)
+		hal_frame_copy(frame, src);
+	
+	hal_frame_id_t oldframe = hal_uspc_get(mptr->uspc, addr);
+	int set_err = hal_uspc_set(mptr->uspc, addr, frame, true);
+	if(set_err < 0)
+	{
+		hal_frame_free(frame);
+		return -ENOMEM;
+	}
+	
+	if(oldframe != HAL_FRAME_ID_INVALID)
+		mem_drop(mptr, oldframe);
+	
+	return 0;
+}
+
+//Brings back a page that was evicted, given the token left in its place.
+static int mem_page_swapin(mem_space_t *mptr, uintptr_t addr, uint64_t token)
+{
+	if(!(token & MEM_TOKEN_ZPAGE))
+	{
+		//Eviction didn't finish yet, and the frame is untouched. Just map it again.
+		int set_err = hal_uspc_set(mptr->uspc, addr, token, true);
+		KASSERT(set_err == 0); //Pagetables already exist, as they hold the token
+		return 0;
+	}
+	
+	uint64_t start = hal_clock_cycles();
+	
+	hal_frame_id_t frame = hal_frame_alloc();
+	if(frame == HAL_FRAME_ID_INVALID)
+		return -ENOMEM;
+	
+	zpage_get_frame(token >> 1, frame, false);
+	int set_err = hal_uspc_set(mptr->uspc, addr, frame, true);
+	KASSERT(set_err == 0);
+	
+	zpage_fault_count(hal_clock_cycles() - start);
+	return 0;
+}
+
 mem_space_t *mem_space_new(void)
 {
 	mem_space_t *retval = kspace_alloc(sizeof(mem_space_t), alignof(mem_space_t));
@@ -24,12 +478,21 @@ mem_space_t *mem_space_new(void)
 		return NULL;
 	}
 	
+	if(vdata_map(retval) < 0)
+	{
+		hal_uspc_delete(retval->uspc);
+		kspace_free(retval, sizeof(mem_space_t));
+		return NULL;
+	}
+	
 	return retval;
 }
 
-mem_space_t *mem_space_fork(mem_space_t *old)
+//Makes a copy of a memory space, which should be locked.
+static mem_space_t *mem_fork(mem_space_t *old)
 {
 	const size_t pagesize = hal_frame_size();
+	const size_t hugesize = hal_frame_huge_size();
 	
 	mem_space_t *forked = mem_space_new();
 	if(forked == NULL)
@@ -42,32 +505,101 @@ mem_space_t *mem_space_fork(mem_space_t *old)
 			continue;
 		
 		//Todo - distinguish shared memory?
-		int add_err = mem_space_add(forked, oldseg->start, oldseg->end - oldseg->start, oldseg->prot);
+		//Map the new segment to the zero-frame initially, then copy any pages that aren't still zero.
+		int add_err = mem_space_add(forked, oldseg->start, oldseg->end - oldseg->start, oldseg->prot, 0);
 		if(add_err < 0)
 		{
 			mem_space_delete(forked);
 			return NULL;
 		}
 		
-		for(uintptr_t aa = oldseg->start; aa < oldseg->end; aa += pagesize)
+		uintptr_t aa = oldseg->start;
+		while(aa < oldseg->end)
 		{
+			//Keep huge pages huge in the copy, if we can.
+			if(hal_uspc_is_huge(old->uspc, aa))
+			{
+				KASSERT(aa % hugesize == 0);
+				KASSERT(aa + hugesize <= oldseg->end);
+				if(mem_huge_map(forked, aa, old) == 0)
+				{
+					aa += hugesize;
+					continue;
+				}
+			}
+			
 			hal_frame_id_t frame_old = hal_uspc_get(old->uspc, aa);
-			hal_frame_id_t frame_new = hal_uspc_get(forked->uspc, aa);
-			KASSERT(frame_old != HAL_FRAME_ID_INVALID);
+			if(frame_old == HAL_FRAME_ID_INVALID)
+			{
+				//Page was evicted from the old space.
+				//Give the new space its own copy, leaving the old one where it is.
+				uint64_t token = hal_uspc_getswap(old->uspc, aa);
+				KASSERT(token != 0);
+				if(token & MEM_TOKEN_ZPAGE)
+				{
+					hal_frame_id_t frame_new = hal_frame_alloc();
+					if(frame_new == HAL_FRAME_ID_INVALID || hal_uspc_set(forked->uspc, aa, frame_new, true) < 0)
+					{
+						if(frame_new != HAL_FRAME_ID_INVALID)
+							hal_frame_free(frame_new);
+						
+						mem_space_delete(forked);
+						return NULL;
+					}
+					
+					zpage_get_frame(token >> 1, frame_new, true);
+					aa += pagesize;
+					continue;
+				}
+				
+				frame_old = token;
+			}
+			
 			KASSERT(frame_old % pagesize == 0);
-			KASSERT(frame_new != HAL_FRAME_ID_INVALID);
-			KASSERT(frame_new % pagesize == 0);
-			hal_frame_copy(frame_new, frame_old);
+			if(merge_shared(frame_old))
+			{
+				//Merged frames stay shared, read-only, in the copy
+				if(hal_uspc_set(forked->uspc, aa, frame_old, false) < 0)
+				{
+					mem_space_delete(forked);
+					return NULL;
+				}
+				
+				merge_ref(frame_old);
+			}
+			else if(frame_old != mem_zero_frame)
+			{
+				int copy_err = mem_page_private(forked, aa, frame_old);
+				if(copy_err < 0)
+				{
+					mem_space_delete(forked);
+					return NULL;
+				}
+			}
+			
+			aa += pagesize;
 		}
 	}
 	
 	return forked;
 }
 
+mem_space_t *mem_space_fork(mem_space_t *old)
+{
+	mem_lock(old);
+	mem_space_t *forked = mem_fork(old);
+	hal_spl_unlock(&(old->spl));
+	return forked;
+}
+
 void mem_space_delete(mem_space_t *mptr)
 {
 	size_t pagesize = hal_frame_size();
 	
+	//Nothing can be using the space anymore, so nothing needs holding until other CPUs flush
+	mptr->threaded = false;
+	mem_stale_release_all(mptr, false);
+	
 	for(int mm = 0; mm < MEM_SEG_MAX; mm++)
 	{
 		if(mptr->seg_array[mm].end > 0)
@@ -76,33 +608,108 @@ void mem_space_delete(mem_space_t *mptr)
 			uintptr_t end = mptr->seg_array[mm].end;
 			KASSERT(start % pagesize == 0);
 			KASSERT(end % pagesize == 0);
-			for(uintptr_t aa = start; aa < end; aa += pagesize)
-			{
-				//Todo - check that these frames are private before freeing them
-				hal_frame_id_t oldframe = hal_uspc_get(mptr->uspc, aa);
-				KASSERT(oldframe != HAL_FRAME_ID_INVALID);
-				hal_uspc_set(mptr->uspc, aa, HAL_FRAME_ID_INVALID);
-				hal_frame_free(oldframe);
-			}
+			mem_unmap(mptr, start, end);
 		}
 		
 		mptr->seg_array[mm].start = 0;
 		mptr->seg_array[mm].end = 0;
 	}
 	
+	vdata_unmap(mptr);
 	hal_uspc_delete(mptr->uspc);
 	kspace_free(mptr, sizeof(mem_space_t));
 }
 
-int mem_space_add(mem_space_t *mptr, uintptr_t addr, size_t size, int prot)
+size_t mem_space_share(mem_space_t *mptr)
+{
+	size_t pagesize = hal_frame_size();
+	size_t hugesize = hal_frame_huge_size();
+	size_t unshared = 0;
+	mem_lock(mptr);
+	
+	//Pages are made read-only without flushing other CPUs, so nothing else can be using the space
+	KASSERT(!mptr->threaded);
+	for(int mm = 0; mm < MEM_SEG_MAX; mm++)
+	{
+		const mem_seg_t *seg = &(mptr->seg_array[mm]);
+		uintptr_t aa = seg->start;
+		while(aa < seg->end)
+		{
+			//Huge pages are copied whole by mem_space_fork
+			if(hal_uspc_is_huge(mptr->uspc, aa))
+			{
+				aa = aa - (aa % hugesize) + hugesize;
+				unshared += hugesize / pagesize;
+				continue;
+			}
+			
+			hal_frame_id_t frame = hal_uspc_get(mptr->uspc, aa);
+			if(frame == HAL_FRAME_ID_INVALID || frame == mem_zero_frame || merge_shared(frame))
+			{
+				aa += pagesize;
+				continue;
+			}
+			
+			hal_frame_id_t merged = merge_frame(frame);
+			if(merged == HAL_FRAME_ID_INVALID)
+			{
+				unshared++;
+				aa += pagesize;
+				continue;
+			}
+			
+			//Use an identical frame if one was already merged, or share our own
+			int set_err = hal_uspc_set(mptr->uspc, aa, merged, false);
+			KASSERT(set_err == 0);
+			if(merged != frame)
+				hal_frame_free(frame);
+			
+			aa += pagesize;
+		}
+	}
+	
+	hal_spl_unlock(&(mptr->spl));
+	return unshared;
+}
+
+//Finishes deleting a memory space in the background
+static void mem_space_retire_finish(teardown_job_t *job)
+{
+	mem_space_t *mptr = (mem_space_t*)((uint8_t*)job - offsetof(mem_space_t, teardown));
+	mem_space_delete(mptr);
+}
+
+void mem_space_retire(mem_space_t *mptr)
+{
+	//Count what's mapped, to know how much memory is tied up until the worker gets to it
+	size_t pagesize = hal_frame_size();
+	size_t pages = 0;
+	for(int mm = 0; mm < MEM_SEG_MAX; mm++)
+	{
+		pages += (mptr->seg_array[mm].end - mptr->seg_array[mm].start) / pagesize;
+	}
+	
+	teardown_defer(&(mptr->teardown), &mem_space_retire_finish, pages);
+}
+
+//Adds an anonymous segment to a memory space, which should be locked.
+static int mem_add(mem_space_t *mptr, uintptr_t addr, size_t size, int prot, int flags)
 {
 	//Address and length must be page-aligned
 	size_t pagesize = hal_frame_size();
+	size_t hugesize = hal_frame_huge_size();
 	if( (addr % pagesize) != 0 )
 		return -EINVAL;
 	if( (size % pagesize) != 0 )
 		return -EINVAL;
 	
+	//Must lie within userspace - particularly, mustn't cover the kernel's data past the end of it
+	uintptr_t uspc_start = 0;
+	uintptr_t uspc_end = 0;
+	hal_uspc_bound(&uspc_start, &uspc_end);
+	if(addr < uspc_start || addr > uspc_end || size > uspc_end - addr)
+		return -EINVAL;
+	
 	//Make sure there's room. If the last array entry is used, there's no room.
 	if(mptr->seg_array[MEM_SEG_MAX - 1].end > 0)
 		return -ENOMEM;
@@ -136,17 +743,44 @@ int mem_space_add(mem_space_t *mptr, uintptr_t addr, size_t size, int prot)
 	KASSERT(insertidx < MEM_SEG_MAX);
 	
 	//Try to allocate and map frames to back the region.
-	for(uintptr_t aa = addr; aa < end; aa += pagesize)
+	//If the caller wants huge pages, use them wherever an aligned huge page fits, falling back to small pages.
+	//Unless the caller needs private frames immediately, just map the zero-frame read-only.
+	//Writable pages then get their own frame when they're first written.
+	//If other threads use the space, they might cache what we map - keep room to hold it all, in case we unwind.
+	int held = 0;
+	uintptr_t aa = addr;
+	while(aa < end)
 	{
-		hal_frame_id_t frame = hal_frame_alloc();
+		if( (flags & MEM_ADD_HUGE) && (aa % hugesize == 0) && (end - aa >= hugesize) )
+		{
+			if( (!mptr->threaded || mem_stale_room(mptr, held + 2) == 0) && mem_huge_map(mptr, aa, NULL) == 0)
+			{
+				held++;
+				aa += hugesize;
+				continue;
+			}
+		}
+		
+		hal_frame_id_t frame = mem_zero_frame;
+		if(flags & MEM_ADD_EAGER)
+		{
+			frame = HAL_FRAME_ID_INVALID;
+			if(!mptr->threaded || mem_stale_room(mptr, held + 1) == 0)
+				frame = hal_frame_alloc();
+		}
+		
 		if(frame != HAL_FRAME_ID_INVALID)
 		{
 			KASSERT( (aa % pagesize) == 0 );
 			KASSERT( (frame % pagesize) == 0 );
-			int ins_err = hal_uspc_set(mptr->uspc, aa, frame); //Todo - set protection
+			int ins_err = hal_uspc_set(mptr->uspc, aa, frame, frame != mem_zero_frame); //Todo - set protection
 			if(ins_err == 0)
 			{
 				//Success, keep adding frames
+				if(frame != mem_zero_frame)
+					held++;
+				
+				aa += pagesize;
 				continue;
 			}
 		}
@@ -156,19 +790,12 @@ int mem_space_add(mem_space_t *mptr, uintptr_t addr, size_t size, int prot)
 		//If we had allocated a frame but couldn't map it, free it.
 		if(frame != HAL_FRAME_ID_INVALID)
 		{
-			hal_frame_free(frame);
+			mem_frame_release(frame);
 			frame = HAL_FRAME_ID_INVALID;
 		}
 		
 		//Unwind any that we did actually map.
-		while(aa > addr)
-		{
-			aa -= pagesize;
-			hal_frame_id_t oldframe = hal_uspc_get(mptr->uspc, aa);
-			KASSERT(oldframe != HAL_FRAME_ID_INVALID);
-			hal_uspc_set(mptr->uspc, aa, HAL_FRAME_ID_INVALID);
-			hal_frame_free(oldframe);
-		}
+		mem_unmap(mptr, addr, aa);
 		
 		//Return that we ran out of memory (note - at this point, we didn't add a mem_seg_t yet.)
 		return -ENOMEM;
@@ -228,12 +855,34 @@ int mem_space_add(mem_space_t *mptr, uintptr_t addr, size_t size, int prot)
 	return insertidx;
 }
 
-int mem_space_clear(mem_space_t *mptr, uintptr_t addr, size_t size)
+int mem_space_add(mem_space_t *mptr, uintptr_t addr, size_t size, int prot, int flags)
+{
+	mem_lock(mptr);
+	int retval = mem_add(mptr, addr, size, prot, flags);
+	hal_spl_unlock(&(mptr->spl));
+	return retval;
+}
+
+//Removes a range from a memory space, which should be locked.
+static int mem_clear(mem_space_t *mptr, uintptr_t addr, size_t size)
 {
 	size_t pagesize = hal_frame_size();
 	if( (addr % pagesize) || (size % pagesize) )
 		return -EINVAL; //Non page aligned
 	
+	if(size == 0)
+		return 0;
+	
+	//Break up any huge pages that are only partly removed, before changing anything else.
+	if(mem_split_edge(mptr, addr, addr + size, addr) < 0)
+		return -ENOMEM;
+	if(mem_split_edge(mptr, addr, addr + size, addr + size - pagesize) < 0)
+		return -ENOMEM;
+	
+	//Make sure we can hold whatever's unmapped, if other CPUs might have it cached
+	if(mem_stale_room(mptr, mem_unmap_count(mptr, addr, addr + size)) < 0)
+		return -ENOMEM;
+	
 	//Update bookkeeping for removing this range - change all affected segments
 	uintptr_t remove_start = addr;
 	uintptr_t remove_end = addr + size;
@@ -323,21 +972,303 @@ int mem_space_clear(mem_space_t *mptr, uintptr_t addr, size_t size)
 	}
 
 	//Unmap the pages
-	for(uintptr_t aa = addr; aa < addr + size; aa += pagesize)
+	mem_unmap(mptr, addr, addr + size);
+	return 0;
+}
+
+int mem_space_clear(mem_space_t *mptr, uintptr_t addr, size_t size)
+{
+	mem_lock(mptr);
+	int retval = mem_clear(mptr, addr, size);
+	hal_spl_unlock(&(mptr->spl));
+	return retval;
+}
+
+//Resolves a fault in a memory space, which should be locked.
+static int mem_fault(mem_space_t *mptr, uintptr_t addr)
+{
+	size_t pagesize = hal_frame_size();
+	uintptr_t page = addr - (addr % pagesize);
+	
+	//Find the segment containing the address
+	const mem_seg_t *seg = NULL;
+	for(int ss = 0; ss < MEM_SEG_MAX; ss++)
 	{
-		hal_frame_id_t fr = hal_uspc_get(mptr->uspc, aa);
-		if(fr != HAL_FRAME_ID_INVALID)
+		if(mptr->seg_array[ss].end <= 0)
+			break; //No further segments
+		
+		if(page >= mptr->seg_array[ss].start && page < mptr->seg_array[ss].end)
 		{
-			hal_uspc_set(mptr->uspc, aa, HAL_FRAME_ID_INVALID);
-			//Todo - don't free the frame if it came from a file
-			hal_frame_free(fr);
+			seg = &(mptr->seg_array[ss]);
+			break;
 		}
-	}	
+	}
 	
-	return 0;
+	if(seg == NULL)
+		return -EFAULT; //Not mapped at all
+	
+	//Replacing a frame needs room to hold the old one, if other CPUs might have it cached
+	if(mptr->threaded && mem_stale_room(mptr, 1) < 0)
+		return -ENOMEM;
+	
+	//If the page was evicted, bring it back.
+	uint64_t token = hal_uspc_getswap(mptr->uspc, page);
+	if(token != 0)
+		return mem_page_swapin(mptr, page, token);
+	
+	if(!(seg->prot & MEM_PROT_W))
+		return -EFAULT; //Not supposed to be writable
+	
+	hal_frame_id_t frame = hal_uspc_get(mptr->uspc, page);
+	if(frame == HAL_FRAME_ID_INVALID)
+		return -EFAULT; //Not present, and not evicted either
+	
+	if(frame != mem_zero_frame)
+	{
+		//Private pages are write-protected while being considered for merging.
+		//Merged pages are read-only, and writing them needs a private copy - unless nobody else uses them anymore.
+		if(hal_uspc_writable(mptr->uspc, page))
+			return 0; //Already resolved, maybe by another CPU
+		
+		if(merge_shared(frame) && !merge_take(frame))
+			return mem_page_private(mptr, page, frame);
+		
+		int set_err = hal_uspc_set(mptr->uspc, page, frame, true);
+		KASSERT(set_err == 0);
+		return 0;
+	}
+	
+	//If this is the first write to a whole aligned huge page within the segment, back it with a huge frame.
+	size_t hugesize = hal_frame_huge_size();
+	uintptr_t block = page - (page % hugesize);
+	if(block >= seg->start && block + hugesize <= seg->end && mem_huge_untouched(mptr, block))
+	{
+		if(mem_huge_map(mptr, block, NULL) == 0)
+			return 0;
+	}
+	
+	return mem_page_private(mptr, page, frame);
 }
 
-intptr_t mem_space_avail(mem_space_t *mptr, uintptr_t around, size_t size)
+int mem_space_fault(mem_space_t *mptr, uintptr_t addr)
+{
+	//We're about to need memory, most likely. Ask for it before locking - this wakes the reclaim thread.
+	reclaim_check();
+	
+	mem_lock(mptr);
+	int retval = mem_fault(mptr, addr);
+	hal_spl_unlock(&(mptr->spl));
+	return retval;
+}
+
+//Moves a scanning hand to the next small page within a segment, at or after its current position.
+//Wraps around to the beginning of the space, once. Returns false if there's nothing left to scan.
+static bool mem_hand_seek(mem_space_t *mptr, uintptr_t *hand, bool *wrapped)
+{
+	size_t hugesize = hal_frame_huge_size();
+	while(1)
+	{
+		//Find the segment containing the hand, or the next one after it
+		const mem_seg_t *seg = NULL;
+		for(int ss = 0; ss < MEM_SEG_MAX; ss++)
+		{
+			if(mptr->seg_array[ss].end <= 0)
+				break; //No further segments
+			
+			if(*hand < mptr->seg_array[ss].end)
+			{
+				seg = &(mptr->seg_array[ss]);
+				break;
+			}
+		}
+		
+		if(seg == NULL)
+		{
+			//Past the last segment. Start again from the beginning, unless we already did.
+			if(*wrapped)
+				return false;
+			
+			*wrapped = true;
+			*hand = 0;
+			continue;
+		}
+		
+		if(*hand < seg->start)
+			*hand = seg->start;
+		
+		if(hal_uspc_is_huge(mptr->uspc, *hand))
+		{
+			*hand = *hand - (*hand % hugesize) + hugesize;
+			continue;
+		}
+		
+		return true;
+	}
+}
+
+int mem_space_evict_pick(mem_space_t *mptr, mem_pick_t *ev)
+{
+	size_t pagesize = hal_frame_size();
+	ev->count = 0;
+	
+	//Sweep through the space like a clock-hand, picking up where we left off last time.
+	//Pages accessed since the last sweep get a second chance - we just clear their accessed-flag.
+	mem_lock(mptr);
+	bool wrapped = false;
+	uintptr_t aa = mptr->evict_hand;
+	for(int scanned = 0; scanned < MEM_EVICT_SCAN && ev->count < MEM_PICK_MAX; scanned++)
+	{
+		if(!mem_hand_seek(mptr, &aa, &wrapped))
+			break;
+		
+		//Frames merged with identical pages stay put, but ones that nobody else has merged with yet can go.
+		hal_frame_id_t frame = hal_uspc_get(mptr->uspc, aa);
+		if(frame != HAL_FRAME_ID_INVALID && frame != mem_zero_frame && !hal_uspc_accessed(mptr->uspc, aa, true)
+			&& (!merge_shared(frame) || merge_take(frame)))
+		{
+			//Leave the frame in place of the mapping, so it can be mapped again if needed before it's compressed.
+			int swap_err = hal_uspc_setswap(mptr->uspc, aa, frame);
+			KASSERT(swap_err == 0);
+			ev->addr[ev->count] = aa;
+			ev->frame[ev->count] = frame;
+			ev->count++;
+		}
+		
+		aa += pagesize;
+	}
+	
+	mptr->evict_hand = aa;
+	hal_spl_unlock(&(mptr->spl));
+	return ev->count;
+}
+
+int mem_space_evict_finish(mem_space_t *mptr, const mem_pick_t *ev)
+{
+	int freed = 0;
+	mem_lock(mptr);
+	for(int ee = 0; ee < ev->count; ee++)
+	{
+		//If the page was faulted back in or unmapped meanwhile, leave it alone
+		if(hal_uspc_getswap(mptr->uspc, ev->addr[ee]) != ev->frame[ee])
+			continue;
+		
+		uint64_t handle = zpage_put_frame(ev->frame[ee]);
+		if(handle == 0)
+		{
+			//Didn't compress well - put it back
+			int set_err = hal_uspc_set(mptr->uspc, ev->addr[ee], ev->frame[ee], true);
+			KASSERT(set_err == 0);
+			continue;
+		}
+		
+		int swap_err = hal_uspc_setswap(mptr->uspc, ev->addr[ee], (handle << 1) | MEM_TOKEN_ZPAGE);
+		KASSERT(swap_err == 0);
+		hal_frame_free(ev->frame[ee]);
+		freed++;
+	}
+	
+	hal_spl_unlock(&(mptr->spl));
+	return freed;
+}
+
+int mem_space_merge_pick(mem_space_t *mptr, mem_pick_t *pick)
+{
+	size_t pagesize = hal_frame_size();
+	pick->count = 0;
+	
+	//Sweep through the space like when evicting, but looking for private pages that haven't been written lately.
+	//Pages written since the last sweep are likely to change again, so just clear their dirty-flag.
+	mem_lock(mptr);
+	bool wrapped = false;
+	uintptr_t aa = mptr->merge_hand;
+	for(int scanned = 0; scanned < MEM_MERGE_SCAN && pick->count < MEM_PICK_MAX; scanned++)
+	{
+		if(!mem_hand_seek(mptr, &aa, &wrapped))
+			break;
+		
+		hal_frame_id_t frame = hal_uspc_get(mptr->uspc, aa);
+		if(frame != HAL_FRAME_ID_INVALID && frame != mem_zero_frame && hal_uspc_writable(mptr->uspc, aa) && !hal_uspc_dirty(mptr->uspc, aa, true))
+		{
+			//Write-protect it, so we can compare its contents without them changing
+			int set_err = hal_uspc_set(mptr->uspc, aa, frame, false);
+			KASSERT(set_err == 0);
+			pick->addr[pick->count] = aa;
+			pick->frame[pick->count] = frame;
+			pick->count++;
+		}
+		
+		aa += pagesize;
+	}
+	
+	mptr->merge_hand = aa;
+	hal_spl_unlock(&(mptr->spl));
+	return pick->count;
+}
+
+int mem_space_merge_finish(mem_space_t *mptr, const mem_pick_t *pick)
+{
+	int freed = 0;
+	mem_lock(mptr);
+	for(int pp = 0; pp < pick->count; pp++)
+	{
+		//If the page was written, evicted, or unmapped meanwhile, leave it alone
+		uintptr_t aa = pick->addr[pp];
+		hal_frame_id_t frame = pick->frame[pp];
+		if(hal_uspc_get(mptr->uspc, aa) != frame || hal_uspc_writable(mptr->uspc, aa))
+			continue;
+		
+		//Other CPUs might still read the frame through cached mappings - we only know they can't write it.
+		//So hold it until they flush again, even if the space isn't threaded, as we're not on its CPU.
+		if(mem_stale_room(mptr, 1) < 0)
+		{
+			int set_err = hal_uspc_set(mptr->uspc, aa, frame, true);
+			KASSERT(set_err == 0);
+			continue;
+		}
+		
+		hal_frame_id_t merged = merge_frame(frame);
+		if(merged == HAL_FRAME_ID_INVALID)
+		{
+			//No room to track it - just let it be written again
+			int set_err = hal_uspc_set(mptr->uspc, aa, frame, true);
+			KASSERT(set_err == 0);
+			continue;
+		}
+		
+		if(merged == frame)
+			continue; //Nothing to merge with, but the page is now available for others to merge with
+		
+		//Found an identical frame - use it instead
+		int set_err = hal_uspc_set(mptr->uspc, aa, merged, false);
+		KASSERT(set_err == 0);
+		mem_stale_add(mptr, frame);
+		freed++;
+	}
+	
+	hal_spl_unlock(&(mptr->spl));
+	return freed;
+}
+
+void mem_getstat(px_mem_stat_t *out)
+{
+	out->frame_size = hal_frame_size();
+	out->frames_free = hal_frame_count();
+	out->huge_size = hal_frame_huge_size();
+	out->huge_free = hal_frame_huge_count();
+	
+	hal_spl_lock(&mem_stat_spl);
+	out->huge_mapped = mem_stat_huge_mapped;
+	out->huge_fallback = mem_stat_huge_fallback;
+	hal_spl_unlock(&mem_stat_spl);
+	
+	zpage_getstat(out);
+	merge_getstat(out);
+	teardown_getstat(out);
+	zygote_getstat(out);
+}
+
+//Finds a free region in a memory space, which should be locked.
+static intptr_t mem_avail(mem_space_t *mptr, uintptr_t around, size_t size)
 {
 	if(size <= 0)
 		return EINVAL;
@@ -417,3 +1348,11 @@ intptr_t mem_space_avail(mem_space_t *mptr, uintptr_t around, size_t size)
 }
 
 
+
+intptr_t mem_space_avail(mem_space_t *mptr, uintptr_t around, size_t size)
+{
+	mem_lock(mptr);
+	intptr_t retval = mem_avail(mptr, around, size);
+	hal_spl_unlock(&(mptr->spl));
+	return retval;
+}
@@ -5,6 +5,9 @@
 #define MEM_H
 
 #include "hal_uspc.h"
+#include "hal_spl.h"
+#include "px.h"
+#include "teardown.h"
 #include <sys/types.h>
 
 //Eh just make the info fit in one page
@@ -14,6 +17,15 @@
 #define MEM_PROT_W 0x2
 #define MEM_PROT_X 0x1
 
+//Flags for adding segments
+#define MEM_ADD_EAGER 0x1 //Allocate private frames immediately, rather than sharing the zero-frame until written
+#define MEM_ADD_HUGE  0x2 //Back with huge frames immediately, wherever an aligned huge page fits
+
+
+//Maximum number of pages picked out of a memory space at once, for eviction or merging
+#define MEM_PICK_MAX 64
+
+
 //Information about a region of memory mapped in a memory space.
 typedef struct mem_seg_s
 {
@@ -29,10 +41,18 @@ typedef struct mem_seg_s
 	
 } mem_seg_t;
 
+//Frames and pagetables unmapped from a memory space, that other CPUs might still reach through cached mappings.
+struct mem_stale_s;
+
 //Information about a memory space overall.
-//Note - not locked! Should belong to a structure with locking.
+//Locked by the mem_space_* functions themselves, after the lock of any process using it.
+//They take no other locks while holding it, besides the frame allocators and page stores.
+//That way, faults can be resolved while copying to and from userspace under any other lock.
 typedef struct mem_space_s
 {
+	//Spinlock protecting the space
+	hal_spl_t spl;
+	
 	//Kernel-side tracking of segments in the space.
 	//Sorted by address. Non-overlapping.
 	mem_seg_t seg_array[MEM_SEG_MAX];
@@ -40,8 +60,38 @@ typedef struct mem_space_s
 	//HAL paging structures for the CPU
 	hal_uspc_id_t uspc;
 	
+	//Addresses where the next scans for cold pages and for pages to merge should start
+	uintptr_t evict_hand;
+	uintptr_t merge_hand;
+	
+	//Queue entry for deleting the space in the background
+	teardown_job_t teardown;
+	
+	//Page of information about the process, mapped read-only past the end of the usable space (see vdata.h)
+	px_vproc_t *vproc;
+	
+	//Set once more than one thread uses the space, so it may be active on several CPUs at once.
+	//From then on, frames and pagetables unmapped from it are held until every CPU has flushed (see mem_space_sync).
+	bool threaded;
+	
+	//What's held until the next flush, how many things, and the number of the first flush that frees them
+	struct mem_stale_s *stale;
+	int stale_count;
+	uint64_t stale_gen;
+	
 } mem_space_t;
 
+//Pages picked out of a memory space for eviction or merging, while TLBs are flushed.
+typedef struct mem_pick_s
+{
+	int count;
+	uintptr_t addr[MEM_PICK_MAX];
+	hal_frame_id_t frame[MEM_PICK_MAX];
+} mem_pick_t;
+
+
+//Sets up shared resources for memory spaces
+void mem_init(void);
 
 //Makes a new empty memory space
 mem_space_t *mem_space_new(void);
@@ -52,9 +102,32 @@ mem_space_t *mem_space_fork(mem_space_t *old);
 //Deletes the given memory space
 void mem_space_delete(mem_space_t *mptr);
 
+//Makes the private pages of a memory space into merged frames, so copies made by mem_space_fork share them.
+//The pages become read-only in the space, and in any copies, until written.
+//Returns the number of pages left private, because there was no room to track them.
+//The space must not be active on any CPU.
+size_t mem_space_share(mem_space_t *mptr);
+
+//Notes that more than one thread uses the given memory space, so it may be active on several CPUs at once.
+void mem_space_threaded(mem_space_t *mptr);
+
+//Releases frames and pagetables unmapped from the memory space while other CPUs might have had them cached.
+//Flushes all CPUs first, if there's anything to release. Must be called without any spinlocks held.
+void mem_space_sync(mem_space_t *mptr);
+
+//Flushes cached mappings on all CPUs, like hal_uspc_flush, and notes that it happened.
+//Anything unmapped from a memory space before the flush is released the next time the space is used.
+//Must be called without any spinlocks held.
+void mem_flush(void);
+
+//Deletes the given memory space in the background, for when nobody needs to wait on the memory coming back.
+//The space must not be active on any CPU.
+void mem_space_retire(mem_space_t *mptr);
+
 //Adds an anonymous segment to the given memory space.
+//The segment is zero-filled. Unless MEM_ADD_EAGER is given, frames are only allocated as pages are written.
 //Returns its index on success or a negative error number.
-int mem_space_add(mem_space_t *mptr, uintptr_t addr, size_t size, int prot);
+int mem_space_add(mem_space_t *mptr, uintptr_t addr, size_t size, int prot, int flags);
 
 //Finds a free region in the memory space for the given size around the given address.
 //Returns the address found or a negative error number on failure.
@@ -63,5 +136,34 @@ intptr_t mem_space_avail(mem_space_t *mptr, uintptr_t around, size_t size);
 //Chops or removes any memory segments overlapping the given range.
 int mem_space_clear(mem_space_t *mptr, uintptr_t addr, size_t size);
 
+//Attempts to resolve a fault at the given address, as when first writing to a page that shares the zero-frame.
+//An untouched, aligned huge page within a writable segment is backed by a huge frame when first written.
+//Pages that were evicted are brought back from the compressed store.
+//Pages that were merged with identical pages get a private copy when written.
+//Returns 0 if the access can be retried, or a negative error number if the fault was legitimate.
+int mem_space_fault(mem_space_t *mptr, uintptr_t addr);
+
+//Picks pages in the memory space that haven't been accessed recently, for eviction to the compressed store.
+//The pages are unmapped, but their frames are left in place until mem_space_evict_finish.
+//Between the two calls, the caller should flush cached mappings with mem_flush.
+//Returns the number of pages picked, which are stored in *ev.
+int mem_space_evict_pick(mem_space_t *mptr, mem_pick_t *ev);
+
+//Compresses pages picked by mem_space_evict_pick, unless they've been faulted back in since.
+//Returns the number of frames freed.
+int mem_space_evict_finish(mem_space_t *mptr, const mem_pick_t *ev);
+
+//Picks pages in the memory space that haven't been written recently, as candidates for merging with identical pages.
+//The pages are made read-only, and between this and mem_space_merge_finish, the caller should flush with mem_flush.
+//Returns the number of pages picked, which are stored in *pick.
+int mem_space_merge_pick(mem_space_t *mptr, mem_pick_t *pick);
+
+//Merges pages picked by mem_space_merge_pick with identical pages elsewhere, unless they've been written since.
+//Returns the number of frames freed.
+int mem_space_merge_finish(mem_space_t *mptr, const mem_pick_t *pick);
+
+//Returns statistics about memory usage across all memory spaces.
+void mem_getstat(px_mem_stat_t *out);
+
 
 #endif //MEM_H
@@ -0,0 +1,325 @@
+//merge.c
+//Merging of identical pages
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "merge.h"
+#include "kassert.h"
+#include "kspace.h"
+#include "libcstubs.h"
+#include "notify.h"
+#include "process.h"
+#include "ramfs.h"
+#include "thread.h"
+
+#include "hal_spl.h"
+
+//Maximum number of merged frames tracked
+#define MERGE_MAX 8192
+
+//Number of hash buckets for finding merged frames by contents and by frame
+#define MERGE_BUCKETS 4096
+
+//Number of RAMfs pages to look at in each pass
+#define MERGE_RAMFS_SCAN 1024
+
+//Number of passes to make each time the scanner is woken
+#define MERGE_PASSES 8
+
+//Merged frame
+typedef struct merge_ent_s
+{
+	hal_frame_id_t frame; //Frame holding the contents, or HAL_FRAME_ID_INVALID if unused
+	uint64_t hash; //Hash of the contents
+	uint64_t refs; //Number of mappings and files referencing the frame
+	int next_hash; //Next entry in the same bucket by contents, plus one
+	int next_frame; //Next entry in the same bucket by frame, plus one
+} merge_ent_t;
+
+//Spinlock protecting the table of merged frames and the buffers used to compare them
+static hal_spl_t merge_spl;
+
+//Table of merged frames.
+//Chains are stored as index plus one, so zero means the end.
+static merge_ent_t *merge_ent_array;
+static int *merge_bucket_hash;
+static int *merge_bucket_frame;
+static int merge_free;
+
+//Buffers for comparing page contents
+static uint64_t merge_buf[4096 / sizeof(uint64_t)];
+static uint64_t merge_cmpbuf[4096 / sizeof(uint64_t)];
+
+//Statistics
+static uint64_t merge_stat_frames;
+static uint64_t merge_stat_refs;
+
+//Notification for waking the scanner thread, and spinlock protecting it
+static hal_spl_t merge_notify_spl;
+static notify_src_t merge_notify;
+
+//Returns a hash of page contents
+static uint64_t merge_hashof(const uint64_t *words)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for(size_t ww = 0; ww < sizeof(merge_buf) / sizeof(merge_buf[0]); ww++)
+	{
+		hash ^= words[ww];
+		hash *= 1099511628211ull;
+		hash ^= hash >> 29;
+	}
+	return hash;
+}
+
+//Returns the bucket for the given frame
+static int merge_bucketof(hal_frame_id_t frame)
+{
+	return (frame / hal_frame_size()) % MERGE_BUCKETS;
+}
+
+//Finds the entry for the given frame. Returns its index, or -1 if it's not merged.
+static int merge_lookup(hal_frame_id_t frame)
+{
+	if(merge_stat_frames == 0)
+		return -1;
+
+	for(int ee = merge_bucket_frame[merge_bucketof(frame)]; ee != 0; ee = merge_ent_array[ee - 1].next_frame)
+	{
+		if(merge_ent_array[ee - 1].frame == frame)
+			return ee - 1;
+	}
+
+	return -1;
+}
+
+//Looks for a merged frame with the same contents as merge_buf. Adds a reference to it if found.
+static hal_frame_id_t merge_search(uint64_t hash)
+{
+	for(int ee = merge_bucket_hash[hash % MERGE_BUCKETS]; ee != 0; ee = merge_ent_array[ee - 1].next_hash)
+	{
+		merge_ent_t *eptr = &(merge_ent_array[ee - 1]);
+		if(eptr->hash != hash)
+			continue;
+
+		//Same hash - make sure it's really the same contents
+		hal_frame_read(eptr->frame, merge_cmpbuf);
+		if(memcmp(merge_buf, merge_cmpbuf, sizeof(merge_buf)) != 0)
+			continue;
+
+		eptr->refs++;
+		merge_stat_refs++;
+		return eptr->frame;
+	}
+
+	return HAL_FRAME_ID_INVALID;
+}
+
+//Starts tracking a frame as merged, with one reference. Returns false if there's no room.
+static bool merge_insert(hal_frame_id_t frame, uint64_t hash)
+{
+	if(merge_free == 0)
+		return false;
+
+	int idx = merge_free - 1;
+	merge_ent_t *eptr = &(merge_ent_array[idx]);
+	merge_free = eptr->next_hash;
+
+	eptr->frame = frame;
+	eptr->hash = hash;
+	eptr->refs = 1;
+	eptr->next_hash = merge_bucket_hash[hash % MERGE_BUCKETS];
+	merge_bucket_hash[hash % MERGE_BUCKETS] = idx + 1;
+	eptr->next_frame = merge_bucket_frame[merge_bucketof(frame)];
+	merge_bucket_frame[merge_bucketof(frame)] = idx + 1;
+
+	merge_stat_frames++;
+	merge_stat_refs++;
+	return true;
+}
+
+//Stops tracking the merged frame with the given entry index.
+static void merge_remove(int idx)
+{
+	merge_ent_t *eptr = &(merge_ent_array[idx]);
+
+	int *link = &(merge_bucket_hash[eptr->hash % MERGE_BUCKETS]);
+	while(*link != idx + 1)
+	{
+		KASSERT(*link != 0);
+		link = &(merge_ent_array[*link - 1].next_hash);
+	}
+	*link = eptr->next_hash;
+
+	link = &(merge_bucket_frame[merge_bucketof(eptr->frame)]);
+	while(*link != idx + 1)
+	{
+		KASSERT(*link != 0);
+		link = &(merge_ent_array[*link - 1].next_frame);
+	}
+	*link = eptr->next_frame;
+
+	merge_stat_frames--;
+	merge_stat_refs -= eptr->refs;
+
+	eptr->frame = HAL_FRAME_ID_INVALID;
+	eptr->refs = 0;
+	eptr->next_frame = 0;
+	eptr->next_hash = merge_free;
+	merge_free = idx + 1;
+}
+
+//Entry point of scanner thread
+static void merge_main(void *data)
+{
+	(void)data;
+
+	static notify_dst_t dst;
+	hal_spl_lock(&merge_notify_spl);
+	notify_add(&merge_notify, &dst);
+	hal_spl_unlock(&merge_notify_spl);
+
+	//Only this thread scans, so it can keep its list of pages aside from its small stack
+	static mem_pick_t pick;
+
+	while(1)
+	{
+		notify_wait();
+
+		//Scan some pages, stopping early if nothing's getting merged.
+		//RAMfs goes first, so copies of files loaded into user memory can merge with them.
+		for(int pp = 0; pp < MERGE_PASSES; pp++)
+		{
+			size_t merged = 0;
+			merged += ramfs_merge(MERGE_RAMFS_SCAN);
+			merged += process_memscan(&mem_space_merge_pick, &mem_space_merge_finish, &pick);
+			if(merged == 0)
+				break;
+		}
+	}
+}
+
+void merge_init(void)
+{
+	merge_ent_array = kspace_alloc(sizeof(merge_ent_t) * MERGE_MAX, alignof(merge_ent_t));
+	merge_bucket_hash = kspace_alloc(sizeof(int) * MERGE_BUCKETS, alignof(int));
+	merge_bucket_frame = kspace_alloc(sizeof(int) * MERGE_BUCKETS, alignof(int));
+	KASSERT(merge_ent_array != NULL && merge_bucket_hash != NULL && merge_bucket_frame != NULL);
+	KASSERT(sizeof(merge_buf) == hal_frame_size());
+
+	//Kernel-space allocations come zeroed, which means empty buckets. Build the free list.
+	for(int ee = 0; ee < MERGE_MAX; ee++)
+	{
+		merge_ent_array[ee].next_hash = merge_free;
+		merge_free = ee + 1;
+	}
+
+	thread_t *tptr = thread_new(&merge_main, NULL);
+	KASSERT(tptr != NULL);
+	thread_unlock(tptr);
+}
+
+void merge_kick(void)
+{
+	hal_spl_lock(&merge_notify_spl);
+	notify_send(&merge_notify);
+	hal_spl_unlock(&merge_notify_spl);
+}
+
+hal_frame_id_t merge_frame(hal_frame_id_t frame)
+{
+	hal_spl_lock(&merge_spl);
+	KASSERT(merge_lookup(frame) < 0);
+	hal_frame_read(frame, merge_buf);
+	uint64_t hash = merge_hashof(merge_buf);
+	hal_frame_id_t retval = merge_search(hash);
+	if(retval == HAL_FRAME_ID_INVALID && merge_insert(frame, hash))
+		retval = frame;
+
+	hal_spl_unlock(&merge_spl);
+	return retval;
+}
+
+hal_frame_id_t merge_page(const void *page)
+{
+	hal_spl_lock(&merge_spl);
+	memcpy(merge_buf, page, sizeof(merge_buf));
+	uint64_t hash = merge_hashof(merge_buf);
+	hal_frame_id_t retval = merge_search(hash);
+	if(retval == HAL_FRAME_ID_INVALID)
+	{
+		//Nothing to merge with yet - make a frame for others to merge with later
+		retval = hal_frame_alloc();
+		if(retval != HAL_FRAME_ID_INVALID)
+		{
+			hal_frame_write(retval, merge_buf);
+			if(!merge_insert(retval, hash))
+			{
+				hal_frame_free(retval);
+				retval = HAL_FRAME_ID_INVALID;
+			}
+		}
+	}
+
+	hal_spl_unlock(&merge_spl);
+	return retval;
+}
+
+bool merge_shared(hal_frame_id_t frame)
+{
+	hal_spl_lock(&merge_spl);
+	bool retval = merge_lookup(frame) >= 0;
+	hal_spl_unlock(&merge_spl);
+	return retval;
+}
+
+void merge_ref(hal_frame_id_t frame)
+{
+	hal_spl_lock(&merge_spl);
+	int idx = merge_lookup(frame);
+	KASSERT(idx >= 0);
+	merge_ent_array[idx].refs++;
+	merge_stat_refs++;
+	hal_spl_unlock(&merge_spl);
+}
+
+bool merge_release(hal_frame_id_t frame)
+{
+	hal_spl_lock(&merge_spl);
+	int idx = merge_lookup(frame);
+	if(idx < 0)
+	{
+		hal_spl_unlock(&merge_spl);
+		return false;
+	}
+
+	KASSERT(merge_ent_array[idx].refs > 0);
+	merge_ent_array[idx].refs--;
+	merge_stat_refs--;
+	if(merge_ent_array[idx].refs == 0)
+	{
+		merge_remove(idx);
+		hal_frame_free(frame);
+	}
+
+	hal_spl_unlock(&merge_spl);
+	return true;
+}
+
+bool merge_take(hal_frame_id_t frame)
+{
+	hal_spl_lock(&merge_spl);
+	int idx = merge_lookup(frame);
+	bool retval = (idx >= 0) && (merge_ent_array[idx].refs == 1);
+	if(retval)
+		merge_remove(idx);
+
+	hal_spl_unlock(&merge_spl);
+	return retval;
+}
+
+void merge_getstat(px_mem_stat_t *out)
+{
+	hal_spl_lock(&merge_spl);
+	out->merge_frames = merge_stat_frames;
+	out->merge_saved = merge_stat_refs - merge_stat_frames;
+	hal_spl_unlock(&merge_spl);
+}
@@ -0,0 +1,48 @@
+//merge.h
+//Merging of identical pages
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef MERGE_H
+#define MERGE_H
+
+#include "hal_frame.h"
+#include "px.h"
+#include <stdbool.h>
+
+//Identical pages in user memory and RAMfs are merged into a single read-only frame.
+//Merged frames are reference-counted, and users make a private copy before writing.
+
+//Starts the thread that scans for pages to merge.
+void merge_init(void);
+
+//Wakes the scanning thread, as when new pages are likely to duplicate existing ones.
+void merge_kick(void);
+
+//Looks for a merged frame with the same contents as the given frame.
+//If there's none, the frame itself becomes a merged frame, so later pages can merge with it.
+//Returns the merged frame to use in its place, with a reference for the caller.
+//Returns HAL_FRAME_ID_INVALID if there's no room to track another merged frame.
+hal_frame_id_t merge_frame(hal_frame_id_t frame);
+
+//Looks for a merged frame with the same contents as the given page of kernel memory.
+//If there's none, a new frame is made with the contents, so later pages can merge with it.
+//Returns the merged frame with a reference for the caller, or HAL_FRAME_ID_INVALID on failure.
+hal_frame_id_t merge_page(const void *page);
+
+//Returns whether the given frame is a merged frame.
+bool merge_shared(hal_frame_id_t frame);
+
+//Adds a reference to a merged frame.
+void merge_ref(hal_frame_id_t frame);
+
+//Drops a reference to a frame, freeing it if it was the last one.
+//Returns false, without doing anything, if the frame isn't a merged frame.
+bool merge_release(hal_frame_id_t frame);
+
+//If the caller holds the only reference to a merged frame, stops tracking it, so the caller owns it privately.
+//Returns whether that happened.
+bool merge_take(hal_frame_id_t frame);
+
+//Fills in statistics about merged pages.
+void merge_getstat(px_mem_stat_t *out);
+
+#endif //MERGE_H
@@ -5,10 +5,11 @@
 #include "notify.h"
 #include "kassert.h"
 #include "thread.h"
+#include "timer.h"
 #include "errno.h"
-#include "hal_intr.h"
 
 #include <stddef.h>
+#include <stdbool.h>
 
 void notify_add(notify_src_t *src, notify_dst_t *dst)
 {
@@ -31,22 +32,64 @@ void notify_remove(notify_src_t *src, notify_dst_t *dst)
 
 int notify_wait(void)
 {
+	return notify_timedwait(0);
+}
+
+//Called by a timer when a thread's wait has timed out
+static void notify_timeout(void *arg)
+{
+	thread_t *tptr = thread_getlocked((id_t)(intptr_t)arg);
+	if(tptr == NULL)
+		return;
+	
+	if(tptr->state == THREAD_STATE_NOTIFY)
+		thread_ready(tptr);
+	
+	thread_unlock(tptr);
+}
+
+int notify_timedwait(uint64_t deadline)
+{
+	//Set up a timer to wake us, if we have a deadline.
+	//If we can't get one, fail rather than risk waiting forever.
+	timer_event_t ev = { .func = &notify_timeout };
+	if(deadline != 0)
+	{
+		thread_t *tptr = thread_lockcur();
+		ev.arg = (void*)(intptr_t)(tptr->id);
+		thread_unlock(tptr);
+		
+		int arm_err = timer_arm(&ev, deadline);
+		if(arm_err < 0)
+			return arm_err;
+	}
+	
+	int retval = 0;
 	while(1)
 	{
 		//Inspect the current thread's control block, to see if we want to return yet.
 		thread_t *tptr = thread_lockcur();
-		if(tptr->sigpend & ~tptr->sigmask_cur)
+		if((tptr->sigpend & ~tptr->sigmask_cur) || tptr->killed)
 		{
-			//We caught a signal. Ignore whether we got notified or not - caller should bail for signal handling.
+			//We caught a signal, or are being killed. Ignore whether we got notified or not - caller should bail.
 			thread_unlock(tptr);
-			return -EINTR;
+			retval = -EINTR;
+			break;
 		}
 		else if(tptr->notify_count > tptr->notify_last)
 		{
 			//Got a notify since the last time. We're done waiting. Caller should check their conditions again.
 			tptr->notify_last = tptr->notify_count;
 			thread_unlock(tptr);
-			return 0;
+			retval = 0;
+			break;
+		}
+		else if(deadline != 0 && timer_now() >= deadline)
+		{
+			//Ran out of time.
+			thread_unlock(tptr);
+			retval = -ETIMEDOUT;
+			break;
 		}
 		else
 		{
@@ -57,22 +100,50 @@ int notify_wait(void)
 			continue;
 		}
 	}
+	
+	timer_disarm(&ev);
+	return retval;
+}
+
+//Notifies a single thread by ID, possibly having it take over the calling CPU.
+//Returns whether it was blocked waiting.
+static bool notify_one(id_t tid, bool handoff)
+{
+	thread_t *tptr = thread_getlocked(tid);
+	if(tptr == NULL)
+		return false;
+	
+	tptr->notify_count++;
+	bool blocked = (tptr->state == THREAD_STATE_NOTIFY);
+	if(blocked && handoff)
+		thread_ready_handoff(tptr);
+	else if(blocked)
+		thread_ready(tptr);
+	
+	thread_unlock(tptr);
+	return blocked;
 }
 
 void notify_send(notify_src_t *src)
 {
 	for(notify_dst_t *dd = src->dsts; dd != NULL; dd = dd->next)
 	{		
-		thread_t *tptr = thread_getlocked(dd->tid);
-		if(tptr == NULL)
-			continue;
-		
-		tptr->notify_count++;
-		if(tptr->state == THREAD_STATE_NOTIFY)
-			tptr->state = THREAD_STATE_READY;
-		
-		hal_intr_wake();
-		
-		thread_unlock(tptr);
+		notify_one(dd->tid, false);
 	}
 }
+
+void notify_send_handoff(notify_src_t *src)
+{
+	//Hand off to the first thread we find blocked
+	bool handoff = true;
+	for(notify_dst_t *dd = src->dsts; dd != NULL; dd = dd->next)
+	{
+		if(notify_one(dd->tid, handoff))
+			handoff = false;
+	}
+}
+
+void notify_thread(id_t tid)
+{
+	notify_one(tid, false);
+}
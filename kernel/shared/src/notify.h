@@ -5,6 +5,7 @@
 #define NOTIFY_H
 
 #include <sys/types.h>
+#include <stdint.h>
 
 //Data about one thread waiting for one notification.
 typedef struct notify_dst_s
@@ -30,7 +31,18 @@ void notify_remove(notify_src_t *src, notify_dst_t *dst);
 //Returns 0 on success or a negative error number (primarily, -EINTR if a signal was caught).
 int notify_wait(void);
 
+//Waits like notify_wait, but gives up at the given monotonic time in nanoseconds, if that's nonzero.
+//Returns 0 on notify, -EINTR on signal, or -ETIMEDOUT if the time passed first.
+int notify_timedwait(uint64_t deadline);
+
 //Notifies all threads waiting on the given notify source.
 void notify_send(notify_src_t *src);
 
+//Notifies all threads waiting on the given notify source, like notify_send.
+//The first one that was blocked takes over the calling CPU when the caller next yields (see thread_handoff).
+void notify_send_handoff(notify_src_t *src);
+
+//Notifies a single thread by ID, as if it were waiting on a source that was sent.
+void notify_thread(id_t tid);
+
 #endif //NOTIFY_H
@@ -3,10 +3,13 @@
 //Bryan E. Topp <betopp@betopp.com> 2021
 
 #include "pipe.h"
+#include "hal_copy.h"
 #include "hal_spl.h"
 #include "kassert.h"
 #include "kspace.h"
+#include "idtab.h"
 #include "notify.h"
+#include "thread.h"
 #include "libcstubs.h"
 
 #include <stddef.h>
@@ -57,9 +60,8 @@ typedef struct pipe_s
 	
 } pipe_t;
 
-//All pipes, who cares
-#define PIPE_MAX 4096
-static pipe_t pipe_array[PIPE_MAX];
+//Pipe table
+static idtab_t pipe_tab;
 
 //Returns how many more bytes can be read from the given pipe's buffer before it is empty.
 static size_t pipe_canread(const pipe_t *p)
@@ -105,27 +107,17 @@ static size_t pipe_canwrite_single(const pipe_t *p)
 
 static pipe_t *pipe_locknew(void)
 {
-	for(int pp = 0; pp < PIPE_MAX; pp++)
-	{
-		pipe_t *pptr = &(pipe_array[pp]);
-		if(hal_spl_try(&(pptr->spl)))
-		{
-			if(pptr->state == PIPE_STATE_NONE)
-			{
-				//Found a free spot. Give it a new ID that maps to this location in the array.
-				if(pptr->id == 0)
-					pptr->id = pp;
-				
-				pptr->id += PIPE_MAX;
-				
-				return pptr;
-			}
-			hal_spl_unlock(&(pptr->spl)); //Keep looking
-		}
-	}
+	//Take a free spot. Its ID maps to this location in the table.
+	id_t id = 0;
+	pipe_t *pptr = idtab_alloc(&pipe_tab, &id);
+	if(pptr == NULL)
+		return NULL;
 	
-	//No free spots
-	return NULL;
+	//Whatever freed it might not have unlocked it yet
+	hal_spl_lock(&(pptr->spl));
+	KASSERT(pptr->state == PIPE_STATE_NONE);
+	pptr->id = id;
+	return pptr;
 }
 
 static pipe_t *pipe_getlocked(id_t id)
@@ -134,8 +126,11 @@ static pipe_t *pipe_getlocked(id_t id)
 	if(id < 0)
 		return NULL;
 	
-	//Lock the array entry corresponding to this ID
-	pipe_t *pptr = &(pipe_array[id % PIPE_MAX]);
+	//Lock the table entry corresponding to this ID
+	pipe_t *pptr = idtab_get(&pipe_tab, id);
+	if(pptr == NULL)
+		return NULL;
+	
 	hal_spl_lock(&(pptr->spl));
 	
 	if(pptr->id != id || pptr->state == PIPE_STATE_NONE)
@@ -164,11 +159,17 @@ static void pipe_unlock(pipe_t *pptr)
 		pptr->buf_len = 0;
 		
 		pptr->state = PIPE_STATE_NONE;
+		idtab_free(&pipe_tab, pptr->id);
 	}
 	
 	hal_spl_unlock(&(pptr->spl));
 }
 
+void pipe_init(void)
+{
+	idtab_init(&pipe_tab, sizeof(pipe_t), PIPE_MAX);
+}
+
 id_t pipe_new(void)
 {
 	pipe_t *pptr = pipe_locknew();
@@ -302,7 +303,15 @@ ssize_t pipe_write(int64_t id, const void *buf, size_t nbytes)
 		if(copylen == 0)
 			break;
 		
-		memcpy(pptr->buf_ptr + pptr->next_w, buf_bytes, copylen);
+		//The caller's buffer may be in userspace
+		if(hal_copy(pptr->buf_ptr + pptr->next_w, buf_bytes, copylen) < 0)
+		{
+			if(written == 0)
+				written = -EFAULT;
+			
+			break;
+		}
+		
 		pptr->next_w = (pptr->next_w + copylen) % (pptr->buf_len);
 		
 		buf_bytes += copylen;
@@ -310,12 +319,27 @@ ssize_t pipe_write(int64_t id, const void *buf, size_t nbytes)
 		nbytes -= copylen;
 	}
 	
+	if(written < 0)
+	{
+		pipe_unlock(pptr);
+		return written;
+	}
+	
+	//Let a reader that was waiting for this data run right away, in our place
+	if(PIPE_HANDOFF && written > 0)
+	{
+		notify_send_handoff(&(pptr->notify));
+		pipe_unlock(pptr);
+		thread_handoff();
+		return written;
+	}
+	
 	notify_send(&(pptr->notify));
 	pipe_unlock(pptr);
 	return written;
 }
 
-ssize_t pipe_read(int64_t id, void *buf, size_t nbytes)
+ssize_t pipe_read(int64_t id, void *buf, size_t nbytes, uint64_t deadline)
 {
 	pipe_t *pptr = pipe_getlocked(id);
 	if(pptr == NULL)
@@ -336,13 +360,16 @@ ssize_t pipe_read(int64_t id, void *buf, size_t nbytes)
 		notify_add(&(pptr->notify), &n);
 		
 		pipe_unlock(pptr);
-		int wait_err = notify_wait();
+		int wait_err = notify_timedwait(deadline);
 		pptr = pipe_getlocked(id);
 		if(pptr == NULL)
 			return -EBADF; //Pipe disappeared while we were waiting...? (Is this a valid case?)
 		
 		notify_remove(&(pptr->notify), &n);
 		
+		if(wait_err == -ETIMEDOUT)
+			wait_err = -EAGAIN; //Timed out waiting for data, like a nonblocking read would
+		
 		if(wait_err < 0)
 		{
 			pipe_unlock(pptr);
@@ -362,7 +389,18 @@ ssize_t pipe_read(int64_t id, void *buf, size_t nbytes)
 		if(copylen == 0)
 			break;
 		
-		memcpy(buf_bytes, pptr->buf_ptr + pptr->next_r, copylen);
+		//The caller's buffer may be in userspace. If it's bad, leave the data for someone else.
+		if(hal_copy(buf_bytes, pptr->buf_ptr + pptr->next_r, copylen) < 0)
+		{
+			if(nread == 0)
+			{
+				pipe_unlock(pptr);
+				return -EFAULT;
+			}
+			
+			break;
+		}
+		
 		pptr->next_r = (pptr->next_r + copylen) % (pptr->buf_len);
 		
 		buf_bytes += copylen;
@@ -5,11 +5,26 @@
 #define PIPE_H
 
 #include <sys/types.h>
+#include <stdint.h>
+
+//Most pipes that can exist at once
+#ifndef PIPE_MAX
+#define PIPE_MAX 65536
+#endif
+
+//Whether a writer that wakes a blocked reader gives it the rest of its time-slice right away.
+//Keeps both ends of a pipeline on one CPU, passing the data while it's still in cache.
+#ifndef PIPE_HANDOFF
+#define PIPE_HANDOFF 1
+#endif
 
 //Note - pipe reference counts are complex because we need to know if there are readers/writers when writing/reading.
 //The pipes store a "refs" count that just counts how many inodes refer to that pipe as a named pipe.
 //They also store "refs_r" and "refs_w" counts of how many open file descriptors can read or write the pipe.
 
+//Sets up the pipe table
+void pipe_init(void);
+
 //Makes a new pipe. Returns its ID. The pipe starts with one reference.
 id_t pipe_new(void);
 
@@ -29,6 +44,7 @@ int pipe_decr(id_t id, int access);
 ssize_t pipe_write(id_t id, const void *buf, size_t nbytes);
 
 //Reads from the given pipe.
-ssize_t pipe_read(id_t id, void *buf, size_t nbytes);
+//If no data is available, waits for some, giving up with -EAGAIN at the given monotonic time if it's nonzero.
+ssize_t pipe_read(id_t id, void *buf, size_t nbytes, uint64_t deadline);
 
 #endif //PIPE_H
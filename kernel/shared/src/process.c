@@ -5,68 +5,136 @@
 #include "process.h"
 #include "kspace.h"
 #include "kassert.h"
+#include "idtab.h"
 #include "systar.h"
+#include "vdata.h"
 #include "libcstubs.h"
 #include "thread.h"
 
 #include "px.h"
 #include "hal_uspc.h"
+#include "hal_ktls.h"
 #include <errno.h>
 
 //Process table
-static process_t *process_array;
-static size_t process_count;
+static idtab_t process_tab;
+
+//Index of processes by process group, so groups can be signalled without scanning the table.
+//Its lock is taken before any process lock. Changing a process's group, or its leaving the index, takes both.
+static hal_spl_t process_pgrp_spl;
+static process_t *process_pgrp_array[PROCESS_PGRP_BUCKETS];
+
+//Returns the head of the list of processes whose group ID hashes like the given one
+static process_t **process_pgrp_bucket(pid_t pgid)
+{
+	return &(process_pgrp_array[(unsigned)pgid % PROCESS_PGRP_BUCKETS]);
+}
+
+//Adds a process to the index of process groups. Both should be locked.
+static void process_pgrp_link(process_t *pptr)
+{
+	KASSERT(!pptr->pgrp_linked);
+	process_t **head = process_pgrp_bucket(pptr->pgid);
+	pptr->pgrp_next = *head;
+	*head = pptr;
+	pptr->pgrp_linked = true;
+}
+
+//Removes a process from the index of process groups. Both should be locked.
+static void process_pgrp_unlink(process_t *pptr)
+{
+	KASSERT(pptr->pgrp_linked);
+	process_t **pp = process_pgrp_bucket(pptr->pgid);
+	while(*pp != pptr)
+	{
+		KASSERT(*pp != NULL);
+		pp = &((*pp)->pgrp_next);
+	}
+	*pp = pptr->pgrp_next;
+	pptr->pgrp_next = NULL;
+	pptr->pgrp_linked = false;
+}
 
 //Entry for initial process
 void process_init_entry(void *data)
 {
-	(void)data;
-	
 	//Activate the initial process userspace (should be empty)
-	KASSERT(process_array[1].mem != NULL);
-	KASSERT(process_array[1].mem->uspc != HAL_USPC_ID_INVALID);
-	hal_uspc_activate(process_array[1].mem->uspc);
+	process_t *pptr = (process_t*)data;
+	KASSERT(pptr->id == 1);
+	KASSERT(pptr->mem != NULL);
+	KASSERT(pptr->mem->uspc != HAL_USPC_ID_INVALID);
+	hal_uspc_activate(pptr->mem->uspc);
 	
 	//Unpack initial TAR file into RAMfs
 	systar_unpack();
 	
 	//Simulate system calls to exec our init process using the normal codepaths.
+	//System calls only take pointers to userspace, so stage their parameters in a page there first.
+	struct
+	{
+		char names[3][8];
+		char *argv[2];
+		char *envp[5];
+		char strings[512];
+	} *stage = (void*)(uintptr_t)hal_frame_size();
+	KASSERT(sizeof(*stage) <= hal_frame_size());
+	
+	hal_spl_lock(&(pptr->spl));
+	int stage_err = mem_space_add(pptr->mem, (uintptr_t)stage, hal_frame_size(), MEM_PROT_R | MEM_PROT_W, MEM_ADD_EAGER);
+	hal_spl_unlock(&(pptr->spl));
+	KASSERT(stage_err >= 0);
+	
+	memcpy(stage->names[0], "/", sizeof("/"));
+	memcpy(stage->names[1], "bin", sizeof("bin"));
+	memcpy(stage->names[2], "pxinit", sizeof("pxinit"));
+	
+	const char *strings[] = { "pxinit", "PX=1", "PX_BUILDVERSION="BUILDVERSION, "PX_BUILDDATE="BUILDDATE, "PX_BUILDUSER="BUILDUSER };
+	char *strings_next = stage->strings;
+	for(size_t ss = 0; ss < sizeof(strings) / sizeof(strings[0]); ss++)
+	{
+		KASSERT(strings_next + strlen(strings[ss]) < stage->strings + sizeof(stage->strings));
+		memcpy(strings_next, strings[ss], strlen(strings[ss]) + 1);
+		if(ss == 0)
+			stage->argv[ss] = strings_next;
+		else
+			stage->envp[ss - 1] = strings_next;
+		
+		strings_next += strlen(strings[ss]) + 1;
+	}
+	stage->argv[1] = NULL;
+	stage->envp[4] = NULL;
+	
 	extern int k_px_fd_find();
-	int root_fd = k_px_fd_find(-1, "/");
+	int root_fd = k_px_fd_find(-1, stage->names[0]);
 	KASSERT(root_fd >= 0);
 	
-	int bin_fd = k_px_fd_find(root_fd, "bin");
+	int bin_fd = k_px_fd_find(root_fd, stage->names[1]);
 	KASSERT(bin_fd >= 0);
 	
-	int fd = k_px_fd_find(bin_fd, "pxinit");
+	int fd = k_px_fd_find(bin_fd, stage->names[2]);
 	KASSERT(fd >= 0);
 	
+	//Exec replaces the memory space, staging page and all, once it's copied what it needs.
 	extern int k_px_fd_exec();
-	k_px_fd_exec(fd, 
-		(char*[]){"pxinit", 0}, 
-		(char*[]){"PX=1", "PX_BUILDVERSION="BUILDVERSION, "PX_BUILDDATE="BUILDDATE, "PX_BUILDUSER="BUILDUSER, 0}
-	);
+	k_px_fd_exec(fd, stage->argv, stage->envp);
 		
 	KASSERT(0);
 }
 
 void process_init(void)
 {
-	//Allocate process table
-	size_t procs = 64; //Todo - support configuring this with a command-line or something.
-	process_array = kspace_alloc(procs * sizeof(process_t), alignof(process_t));
-	KASSERT(process_array != NULL);
-	process_count = procs;
+	//Set up process table
+	idtab_init(&process_tab, sizeof(process_t), PROCESS_MAX);
 	
-	//Make the initial process
-	process_t *pptr = &(process_array[1]);
-	hal_spl_lock(&(pptr->spl));
+	//Make the initial process - the first one made gets ID 1
+	process_t *pptr = process_locknew();
+	KASSERT(pptr != NULL && pptr->id == 1);
 	
 	pptr->state = PROCESS_STATE_ALIVE;
-	pptr->id = 1;
 	
 	pptr->mem = mem_space_new();
 	KASSERT(pptr->mem != NULL);
+	vdata_setpid(pptr->mem, pptr->id);
 	
 	int nfds = 64; //Todo - configurable
 	pptr->fd_array = kspace_alloc(nfds * sizeof(pptr->fd_array[0]), alignof(pptr->fd_array[0]));
@@ -74,10 +142,13 @@ void process_init(void)
 	pptr->fd_count = nfds;
 	
 	thread_t *tptr = thread_new(&process_init_entry, pptr);
-	tptr->process = pptr;
-	pptr->nthreads = 1;
+	process_addthread(pptr, tptr);
 	thread_unlock(tptr);
 	
+	hal_spl_lock(&process_pgrp_spl);
+	process_pgrp_link(pptr);
+	hal_spl_unlock(&process_pgrp_spl);
+	
 	fd_t *rootpwd = fd_new();
 	rootpwd->ino = 0;
 	pptr->fd_pwd = rootpwd->id;
@@ -89,40 +160,46 @@ void process_init(void)
 
 process_t *process_lockcur(void)
 {
+	//Only the calling thread changes which process it's in, so we needn't keep it locked while locking the process.
+	//Processes are locked before their threads, elsewhere.
 	thread_t *tptr = thread_lockcur();
 	process_t *pptr = tptr->process;
+	thread_unlock(tptr);
+	
 	KASSERT(pptr != NULL);
 	hal_spl_lock(&(pptr->spl));
-	thread_unlock(tptr);
 	return pptr;
 }
 
+mem_space_t *process_curmem(void)
+{
+	thread_t *tptr = hal_ktls_get();
+	if(tptr == NULL || tptr->process == NULL)
+		return NULL;
+	
+	return tptr->process->mem;
+}
+
 process_t *process_locknew(void)
 {
-	for(size_t pp = 0; pp < process_count; pp++)
-	{
-		//Check each entry in the process table in turn. If one is busy just skip it.
-		if(hal_spl_try(&(process_array[pp].spl)))
-		{
-			if(process_array[pp].state == PROCESS_STATE_NONE)
-			{
-				//Found a free entry. Give it a valid ID - that maps to the entry in the table.
-				if( (process_array[pp].id % process_count) != pp )
-					process_array[pp].id = pp;
-				
-				//Each time we use a table entry, advance its ID.
-				process_array[pp].id += process_count;
-				
-				return &(process_array[pp]); //Still locked
-			}
-			
-			//Wasn't free, keep looking
-			hal_spl_unlock(&(process_array[pp].spl));
-		}
-	}
+	//Take a free entry in the process table
+	id_t id = 0;
+	process_t *pptr = idtab_alloc(&process_tab, &id);
+	if(pptr == NULL)
+		return NULL;
 	
-	//No room in process table
-	return NULL;
+	//Whatever freed it might not have unlocked it yet
+	hal_spl_lock(&(pptr->spl));
+	KASSERT(pptr->state == PROCESS_STATE_NONE);
+	pptr->id = id;
+	return pptr; //Still locked
+}
+
+void process_free(process_t *pptr)
+{
+	pptr->state = PROCESS_STATE_NONE;
+	idtab_free(&process_tab, pptr->id);
+	hal_spl_unlock(&(pptr->spl));
 }
 
 process_t *process_getlocked(id_t id)
@@ -132,7 +209,10 @@ process_t *process_getlocked(id_t id)
 	
 	//The process ID implies where in the table the process could be found.
 	//Lock that table entry.
-	process_t *pptr = &(process_array[id % process_count]);
+	process_t *pptr = idtab_get(&process_tab, id);
+	if(pptr == NULL)
+		return NULL;
+	
 	hal_spl_lock(&(pptr->spl));
 	
 	//See if it's actually the ID we were looking for - or has been reused since, or not used.
@@ -153,26 +233,305 @@ void process_unlock(process_t *pptr)
 	hal_spl_unlock(&(pptr->spl));
 }
 
+int process_foreach(idtype_t idtype, id_t id, void (*func)(process_t *pptr, void *arg), void *arg)
+{
+	int count = 0;
+	if(idtype == P_PID)
+	{
+		process_t *pptr = process_getlocked(id);
+		if(pptr != NULL)
+		{
+			func(pptr, arg);
+			count++;
+			process_unlock(pptr);
+		}
+	}
+	else if(idtype == P_PGID)
+	{
+		hal_spl_lock(&process_pgrp_spl);
+		for(process_t *pptr = *process_pgrp_bucket(id); pptr != NULL; pptr = pptr->pgrp_next)
+		{
+			hal_spl_lock(&(pptr->spl));
+			if(pptr->pgid == id)
+			{
+				func(pptr, arg);
+				count++;
+			}
+			hal_spl_unlock(&(pptr->spl));
+		}
+		hal_spl_unlock(&process_pgrp_spl);
+	}
+	else if(idtype == P_ALL)
+	{
+		int slots = idtab_count(&process_tab);
+		for(int pp = 0; pp < slots; pp++)
+		{
+			process_t *pptr = idtab_slot(&process_tab, pp);
+			if(pptr == NULL)
+				continue;
+			
+			hal_spl_lock(&(pptr->spl));
+			if(pptr->state != PROCESS_STATE_NONE)
+			{
+				func(pptr, arg);
+				count++;
+			}
+			hal_spl_unlock(&(pptr->spl));
+		}
+	}
+	
+	return count;
+}
+
+void process_addthread(process_t *pptr, thread_t *tptr)
+{
+	KASSERT(tptr->process == NULL);
+	tptr->process = pptr;
+	tptr->process_next = pptr->threads;
+	pptr->threads = tptr;
+	pptr->nthreads++;
+}
+
+void process_addchild(process_t *pptr, process_t *child)
+{
+	KASSERT(child->parent == pptr->id);
+	child->child_next = pptr->children;
+	pptr->children = child;
+}
+
+//Adds a child to the end of its parent's queue of children with status. Both should be locked.
+static void process_zombie_push(process_t *pptr, process_t *child)
+{
+	KASSERT(!child->zombie_queued);
+	child->zombie_next = NULL;
+	if(pptr->zombie_tail == NULL)
+		pptr->zombie_head = child;
+	else
+		pptr->zombie_tail->zombie_next = child;
+	
+	pptr->zombie_tail = child;
+	child->zombie_queued = true;
+}
+
+//Removes a child from its parent's queue of children with status. Both should be locked.
+static void process_zombie_unlink(process_t *pptr, process_t *child)
+{
+	KASSERT(child->zombie_queued);
+	process_t *prev = NULL;
+	process_t **zz = &(pptr->zombie_head);
+	while(*zz != child)
+	{
+		KASSERT(*zz != NULL);
+		prev = *zz;
+		zz = &((*zz)->zombie_next);
+	}
+	*zz = child->zombie_next;
+	if(pptr->zombie_tail == child)
+		pptr->zombie_tail = prev;
+	
+	child->zombie_next = NULL;
+	child->zombie_queued = false;
+}
+
+//Removes a child from its parent's list of children. Both should be locked.
+static void process_child_unlink(process_t *pptr, process_t *child)
+{
+	process_t **cc = &(pptr->children);
+	while(*cc != child)
+	{
+		KASSERT(*cc != NULL);
+		cc = &((*cc)->child_next);
+	}
+	*cc = child->child_next;
+	child->child_next = NULL;
+}
+
+//Gives the children of a process that's finished to init, including any it didn't wait on.
+//The process should not be locked, and nothing else can make it children anymore.
+static void process_orphan(process_t *pptr)
+{
+	//Init gets locked before anything else
+	process_t *init_pptr = process_getlocked(1);
+	KASSERT(init_pptr != NULL);
+	hal_spl_lock(&(pptr->spl));
+	
+	bool zombies = false;
+	while(pptr->children != NULL)
+	{
+		process_t *child = pptr->children;
+		hal_spl_lock(&(child->spl));
+		
+		bool queued = child->zombie_queued;
+		if(queued)
+			process_zombie_unlink(pptr, child);
+		
+		process_child_unlink(pptr, child);
+		
+		child->parent = init_pptr->id;
+		process_addchild(init_pptr, child);
+		if(queued)
+		{
+			process_zombie_push(init_pptr, child);
+			zombies = true;
+		}
+		
+		hal_spl_unlock(&(child->spl));
+	}
+	
+	KASSERT(pptr->zombie_head == NULL);
+	hal_spl_unlock(&(pptr->spl));
+	
+	//If we handed over any children that already finished, init needs to know about them
+	if(zombies)
+		notify_send(&(init_pptr->child_notify));
+	
+	process_unlock(init_pptr);
+	
+	if(zombies)
+		thread_sendsig(P_PID, 1, SIGCHLD);
+}
+
+//Puts a process that has status to report in its parent's queue.
+//The process should not be locked. Returns the ID of the parent.
+static pid_t process_report(process_t *pptr)
+{
+	while(1)
+	{
+		//Parents are locked before their children, so lock the parent we think we have, then check it's still ours.
+		hal_spl_lock(&(pptr->spl));
+		pid_t parent_pid = pptr->parent;
+		hal_spl_unlock(&(pptr->spl));
+		
+		//Parents hand off their children before they can be waited on themselves, so our parent is still there.
+		process_t *parent_pptr = process_getlocked(parent_pid);
+		KASSERT(parent_pptr != NULL);
+		
+		hal_spl_lock(&(pptr->spl));
+		if(pptr->parent != parent_pid)
+		{
+			//Got handed to init in the meantime
+			hal_spl_unlock(&(pptr->spl));
+			process_unlock(parent_pptr);
+			continue;
+		}
+		
+		if(!pptr->zombie_queued)
+			process_zombie_push(parent_pptr, pptr);
+		
+		hal_spl_unlock(&(pptr->spl));
+		
+		//Fire a notify to threads waiting on child status in that parent
+		notify_send(&(parent_pptr->child_notify));
+		process_unlock(parent_pptr);
+		return parent_pid;
+	}
+}
+
+int process_setpgid(pid_t pid, pid_t pgrp)
+{
+	hal_spl_lock(&process_pgrp_spl);
+	
+	//If pgrp is 0, this is interpreted to mean "the group of the calling process".
+	if(pgrp == 0)
+	{
+		process_t *pptr_cur = process_lockcur();
+		pgrp = pptr_cur->pgid;
+		process_unlock(pptr_cur);
+	}
+	
+	process_t *pptr = NULL;
+	if(pid == 0)
+		pptr = process_lockcur();
+	else
+		pptr = process_getlocked(pid);
+	
+	if(pptr == NULL)
+	{
+		hal_spl_unlock(&process_pgrp_spl);
+		return -ESRCH;
+	}
+	
+	//Move the process to the list for its new group, if it's in the index at all
+	bool linked = pptr->pgrp_linked;
+	if(linked)
+		process_pgrp_unlink(pptr);
+	
+	pptr->pgid = pgrp;
+	
+	if(linked)
+		process_pgrp_link(pptr);
+	
+	process_unlock(pptr);
+	hal_spl_unlock(&process_pgrp_spl);
+	return 0;
+}
+
+void process_pgrp_join(pid_t pid)
+{
+	hal_spl_lock(&process_pgrp_spl);
+	
+	//The process might have already moved itself to another group, or even finished, by the time we get here.
+	process_t *pptr = process_getlocked(pid);
+	if(pptr != NULL)
+	{
+		if(!pptr->pgrp_linked && pptr->nthreads > 0)
+			process_pgrp_link(pptr);
+		
+		process_unlock(pptr);
+	}
+	
+	hal_spl_unlock(&process_pgrp_spl);
+}
+
 void process_leave(void)
 {
 	//Switch back to no-userland pagetables
 	hal_uspc_activate(HAL_USPC_ID_INVALID);
 	
-	//Remove the reference from the thread control block
+	//Lock the process, and the process group index in case we're the last thread out
+	hal_spl_lock(&process_pgrp_spl);
+	process_t *pptr = process_lockcur();
+	
+	//Remove the thread from the process
 	thread_t *tptr = thread_lockcur();
-	process_t *pptr = tptr->process;
+	thread_t **tt = &(pptr->threads);
+	while(*tt != tptr)
+	{
+		KASSERT(*tt != NULL);
+		tt = &((*tt)->process_next);
+	}
+	*tt = tptr->process_next;
+	tptr->process_next = NULL;
 	tptr->process = NULL;
+	
+	//Keep what the thread used, for the process totals
+	thread_usage_exit();
+	thread_usage_add(&(pptr->usage_left), &(tptr->usage));
 	thread_unlock(tptr);
 	
-	//Remove the reference from the process control block
-	hal_spl_lock(&(pptr->spl));
 	pptr->nthreads--;
 	KASSERT(pptr->nthreads >= 0);
 	
+	//A process with no threads can't be signalled, so it needn't be found by group
+	if(pptr->nthreads == 0 && pptr->pgrp_linked)
+		process_pgrp_unlink(pptr);
+	
+	hal_spl_unlock(&process_pgrp_spl);
+	
+	//Let anyone joining us know we're gone
+	notify_send(&(pptr->thread_notify));
+	
 	//If there's more threads in the process, that's all. Otherwise, we need to clean it up.
 	if(pptr->nthreads > 0)
 	{
+		//If the process is exiting, make sure the rest notice, even if they're waiting on something.
+		bool exiting = (pptr->state == PROCESS_STATE_EXITING);
+		pid_t pid = pptr->id;
 		process_unlock(pptr);
+		
+		if(exiting)
+			thread_kill(pid, -1);
+		
 		return;
 	}
 	
@@ -184,8 +543,17 @@ void process_leave(void)
 	//Init process death is fatal to the kernel too
 	KASSERT(pptr->id != 1);
 	
-	//Free all the memory of the process
-	mem_space_delete(pptr->mem);
+	//Stop all timers
+	for(int tt = 0; tt < PX_TIMER_MAX; tt++)
+	{
+		timer_disarm(&(pptr->timers[tt].event));
+		pptr->timers[tt].deadline = 0;
+		pptr->timers[tt].interval = 0;
+	}
+	
+	//Free all the memory of the process.
+	//That can take a while for a big process, so don't hold up the parent waiting on it.
+	mem_space_retire(pptr->mem);
 	pptr->mem = NULL;
 	
 	//Free all file descriptors
@@ -212,21 +580,297 @@ void process_leave(void)
 	//Indicate that the process is done and just needs to be waited upon.
 	pptr->state = PROCESS_STATE_DONE;
 	pptr->waitstatus = WEXITED;
-	int notify_pid = pptr->parent;
 	process_unlock(pptr);
 	
-	//Fire a notify to threads waiting on child status in that parent
-	process_t *parent_pptr = process_getlocked(notify_pid);
-	if(parent_pptr != NULL)
-	{
-		notify_send(&(parent_pptr->child_notify));
-		process_unlock(parent_pptr);
-	}
+	//Our own children go to init, before our parent can wait on us and free us
+	process_orphan(pptr);
+	
+	//Queue ourselves for our parent to wait on
+	pid_t notify_pid = process_report(pptr);
 	
 	//Signal the parent that a child has exited (might go to any arbitrary thread)
 	thread_sendsig(P_PID, notify_pid, SIGCHLD);
 }
 
+//Entry point in the kernel for new user threads
+static void process_thread_entry(void *data)
+{
+	(void)data;
+	
+	//Activate the userspace of the process that made us
+	process_t *pptr = process_lockcur();
+	hal_uspc_activate(pptr->mem->uspc);
+	process_unlock(pptr);
+	
+	thread_t *tptr = thread_lockcur();
+	uintptr_t pc = tptr->ustart_pc;
+	uintptr_t usp = tptr->ustart_sp;
+	uintptr_t tls = tptr->ustart_tls;
+	uintptr_t arg = tptr->ustart_arg;
+	void *ksp = tptr->stack_top;
+	thread_unlock(tptr);
+	
+	//Drop to the requested userspace address
+	thread_usage_exit();
+	hal_exit_thread(pc, usp, tls, arg, ksp);
+}
+
+int process_thread_new(uintptr_t pc, uintptr_t sp, uintptr_t tls, uintptr_t arg)
+{
+	//The new thread starts with the same signal mask as the calling one
+	thread_t *cur_tptr = thread_lockcur();
+	int64_t sigmask = cur_tptr->sigmask_cur;
+	thread_unlock(cur_tptr);
+	
+	process_t *pptr = process_lockcur();
+	if(pptr->state != PROCESS_STATE_ALIVE)
+	{
+		process_unlock(pptr);
+		return -EAGAIN;
+	}
+	
+	thread_t *tptr = thread_new(&process_thread_entry, NULL);
+	if(tptr == NULL)
+	{
+		process_unlock(pptr);
+		return -EAGAIN;
+	}
+	
+	process_addthread(pptr, tptr);
+	
+	//Once there's another thread, the memory space may be active on several CPUs at once
+	mem_space_threaded(pptr->mem);
+	
+	tptr->sigmask_cur = sigmask;
+	tptr->sigmask_ret = sigmask;
+	
+	tptr->ustart_pc = pc;
+	tptr->ustart_sp = sp;
+	tptr->ustart_tls = tls;
+	tptr->ustart_arg = arg;
+	
+	int tid = tptr->id;
+	thread_unlock(tptr);
+	process_unlock(pptr);
+	return tid;
+}
+
+int process_thread_join(id_t tid)
+{
+	thread_t *cur_tptr = thread_lockcur();
+	id_t cur_tid = cur_tptr->id;
+	thread_unlock(cur_tptr);
+	
+	if(tid == cur_tid)
+		return -EDEADLK;
+	
+	//Subscribe to the notify that gets fired when threads leave our process
+	process_t *pptr = process_lockcur();
+	notify_dst_t n = {0};
+	notify_add(&(pptr->thread_notify), &n);
+	process_unlock(pptr);
+	
+	int result = -ESRCH;
+	while(1)
+	{
+		//See if the thread is still in our process
+		thread_t *tptr = thread_getlocked(tid);
+		bool present = (tptr != NULL) && (tptr->process == pptr);
+		if(tptr != NULL)
+			thread_unlock(tptr);
+		
+		if(!present)
+			break; //Gone - or never there, if this is our first look
+		
+		result = notify_wait();
+		if(result < 0)
+			break; //Probably got interrupted
+	}
+	
+	pptr = process_lockcur();
+	notify_remove(&(pptr->thread_notify), &n);
+	process_unlock(pptr);
+	
+	return result;
+}
+
+int process_thread_solo(void)
+{
+	thread_t *cur_tptr = thread_lockcur();
+	id_t cur_tid = cur_tptr->id;
+	thread_unlock(cur_tptr);
+	
+	process_t *pptr = process_lockcur();
+	notify_dst_t n = {0};
+	notify_add(&(pptr->thread_notify), &n);
+	pid_t pid = pptr->id;
+	process_unlock(pptr);
+	
+	int result = 0;
+	while(1)
+	{
+		pptr = process_lockcur();
+		int nthreads = pptr->nthreads;
+		process_unlock(pptr);
+		
+		if(nthreads <= 1)
+			break;
+		
+		//Kill the others each time around, in case any made new threads before they noticed
+		thread_kill(pid, cur_tid);
+		
+		result = notify_wait();
+		if(result < 0)
+			break; //Interrupted, or killed ourselves
+	}
+	
+	pptr = process_lockcur();
+	notify_remove(&(pptr->thread_notify), &n);
+	process_unlock(pptr);
+	
+	return result;
+}
+
+//Called when one of a process's timers is due
+static void process_timer_expired(void *arg)
+{
+	id_t pid = (id_t)(intptr_t)arg;
+	process_t *pptr = process_getlocked(pid);
+	if(pptr == NULL)
+		return;
+	
+	//Check all the timers, in case this is a stale event and the timer's been changed since
+	int nsig = 0;
+	uint64_t now = timer_now();
+	for(int tt = 0; tt < PX_TIMER_MAX; tt++)
+	{
+		process_timer_t *tptr = &(pptr->timers[tt]);
+		if(tptr->deadline == 0 || tptr->deadline > now)
+			continue;
+		
+		nsig++;
+		if(tptr->interval == 0)
+		{
+			tptr->deadline = 0;
+			continue;
+		}
+		
+		//Reload the timer. If we've fallen more than an interval behind, skip the expiries we missed.
+		tptr->deadline += tptr->interval;
+		if(tptr->deadline <= now)
+			tptr->deadline = now + tptr->interval;
+		
+		if(timer_arm(&(tptr->event), tptr->deadline) < 0)
+			tptr->deadline = 0; //Can't keep it running
+	}
+	
+	process_unlock(pptr);
+	
+	//Raise the signal without the process locked, as signalling looks up and locks the process itself
+	if(nsig > 0)
+		thread_sendsig(P_PID, pid, SIGALRM);
+}
+
+int64_t process_timer_set(int id, int64_t value, int64_t interval)
+{
+	if(id < 0 || id >= PX_TIMER_MAX || value < 0 || interval < 0)
+		return -EINVAL;
+	
+	process_t *pptr = process_lockcur();
+	process_timer_t *tptr = &(pptr->timers[id]);
+	uint64_t now = timer_now();
+	
+	int64_t oldval = 0;
+	if(tptr->deadline > now)
+		oldval = tptr->deadline - now;
+	else if(tptr->deadline != 0)
+		oldval = 1; //Due but not signalled yet
+	
+	timer_disarm(&(tptr->event));
+	tptr->deadline = 0;
+	tptr->interval = 0;
+	
+	if(value > 0)
+	{
+		tptr->event.func = &process_timer_expired;
+		tptr->event.arg = (void*)(intptr_t)(pptr->id);
+		int arm_err = timer_arm(&(tptr->event), now + value);
+		if(arm_err < 0)
+		{
+			process_unlock(pptr);
+			return arm_err;
+		}
+		
+		tptr->deadline = now + value;
+		tptr->interval = interval;
+	}
+	
+	process_unlock(pptr);
+	return oldval;
+}
+
+int64_t process_timer_get(int id)
+{
+	if(id < 0 || id >= PX_TIMER_MAX)
+		return -EINVAL;
+	
+	process_t *pptr = process_lockcur();
+	uint64_t deadline = pptr->timers[id].deadline;
+	process_unlock(pptr);
+	
+	uint64_t now = timer_now();
+	if(deadline == 0)
+		return 0;
+	else if(deadline > now)
+		return deadline - now;
+	else
+		return 1; //Due but not signalled yet
+}
+
+int process_memscan(int (*pick)(mem_space_t *mptr, mem_pick_t *pick), int (*finish)(mem_space_t *mptr, const mem_pick_t *pick), mem_pick_t *buf)
+{
+	int freed = 0;
+	int slots = idtab_count(&process_tab);
+	for(int pp = 0; pp < slots; pp++)
+	{
+		//Pick out pages in the process, changing their mappings
+		process_t *pptr = idtab_slot(&process_tab, pp);
+		if(pptr == NULL)
+			continue;
+		
+		hal_spl_lock(&(pptr->spl));
+		if(pptr->state != PROCESS_STATE_ALIVE || pptr->mem == NULL)
+		{
+			hal_spl_unlock(&(pptr->spl));
+			continue;
+		}
+		
+		id_t pid = pptr->id;
+		mem_space_t *mptr = pptr->mem;
+		int picked = (*pick)(mptr, buf);
+		hal_spl_unlock(&(pptr->spl));
+		
+		if(picked == 0)
+			continue;
+		
+		//Make sure no CPU can still write to them through a cached mapping
+		mem_flush();
+		
+		//Finish with whatever pages weren't faulted on meanwhile.
+		//If the process went away or exec'd in the meantime, the frames were freed with its old memory space.
+		pptr = process_getlocked(pid);
+		if(pptr == NULL)
+			continue;
+		
+		if(pptr->mem == mptr)
+			freed += (*finish)(mptr, buf);
+		
+		process_unlock(pptr);
+	}
+	
+	return freed;
+}
+
 int process_addfd(id_t id, int min, bool overwrite, id_t *old_id)
 {
 	process_t *pptr = process_lockcur();
@@ -340,35 +984,43 @@ id_t process_getfdpwd(void)
 	return retval;
 }
 
-int process_strncpy_touser(void *dst_u, const void *src_k, size_t buflen)
-{
-	//Todo - safety...
-	strncpy(dst_u, src_k, buflen);
-	return 0;
-}
-
 //Makes a single attempt to wait for a child process to change status, returning if there's none available.
-static int process_wait_attempt(id_t caller_pid, idtype_t id_type, int64_t id, int options, px_wait_t *out)
+static int process_wait_attempt(idtype_t id_type, int64_t id, int options, px_wait_t *out)
 {
-	//See if any processes match the requested ID and have status available.
+	process_t *pptr = process_lockcur();
+	if(pptr->children == NULL)
+	{
+		//No children at all
+		process_unlock(pptr);
+		return -ECHILD;
+	}
+	
+	if(id_type == P_PID)
+	{
+		//Waiting for a particular process - it needs to be one of ours
+		process_t *child = pptr->children;
+		while(child != NULL && child->id != id)
+			child = child->child_next;
+		
+		if(child == NULL)
+		{
+			process_unlock(pptr);
+			return -ECHILD;
+		}
+	}
+	
+	//See if any children with status available match the requested ID, oldest first.
 	process_t *found_pptr = NULL;
-	int children = 0;
-	for(size_t pp = 0; pp < process_count; pp++)
+	for(process_t *check_pptr = pptr->zombie_head; check_pptr != NULL; check_pptr = check_pptr->zombie_next)
 	{
-		process_t *check_pptr = &(process_array[pp]);
 		hal_spl_lock(&(check_pptr->spl));
-		
-		if(check_pptr->state != PROCESS_STATE_NONE && check_pptr->parent == caller_pid)
+		if((id_type == P_ALL) || (id_type == P_PID && check_pptr->id == id) || (id_type == P_PGID && check_pptr->pgid == id))
 		{
-			children++;	
-			if((id_type == P_ALL) || (id_type == P_PID && check_pptr->id == id) || (id_type == P_PGID && check_pptr->pgid == id))
+			if(check_pptr->waitstatus & options)
 			{
-				if(check_pptr->waitstatus & options)
-				{
-					//Got a match. Keep the lock held and continue with it.
-					found_pptr = check_pptr;
-					break;
-				}
+				//Got a match. Keep the lock held and continue with it.
+				found_pptr = check_pptr;
+				break;
 			}
 		}
 		
@@ -377,16 +1029,9 @@ static int process_wait_attempt(id_t caller_pid, idtype_t id_type, int64_t id, i
 	
 	if(found_pptr == NULL)
 	{
-		if(children == 0)
-		{
-			//No children at all
-			return -ECHILD;
-		}
-		else
-		{
-			//No children with status
-			return -EAGAIN;
-		}
+		//No children with status
+		process_unlock(pptr);
+		return -EAGAIN;
 	}
 	
 	//Success
@@ -394,17 +1039,65 @@ static int process_wait_attempt(id_t caller_pid, idtype_t id_type, int64_t id, i
 	out->waitst = found_pptr->waitstatus;
 	out->exitst = found_pptr->exitstatus;
 	found_pptr->waitstatus = 0;
+	process_zombie_unlink(pptr, found_pptr);
 	
 	//If we just waited on an otherwise-dead child, it's now fully dead.
+	//What it used goes into our totals for children.
 	if(found_pptr->state == PROCESS_STATE_DONE)
 	{
 		//Should have already been mostly cleaned up by this point
 		KASSERT(found_pptr->mem == NULL);
 		KASSERT(found_pptr->fd_array == NULL);
-		found_pptr->state = PROCESS_STATE_NONE;
+		KASSERT(found_pptr->children == NULL);
+		
+		process_child_unlink(pptr, found_pptr);
+		
+		thread_usage_add(&(pptr->usage_children), &(found_pptr->usage_left));
+		thread_usage_add(&(pptr->usage_children), &(found_pptr->usage_children));
+		memset(&(found_pptr->usage_left), 0, sizeof(found_pptr->usage_left));
+		memset(&(found_pptr->usage_children), 0, sizeof(found_pptr->usage_children));
+		
+		process_free(found_pptr);
+	}
+	else
+	{
+		process_unlock(found_pptr);
+	}
+	
+	process_unlock(pptr);
+	return 0;
+}
+
+int process_usage(int who, thread_usage_t *out)
+{
+	memset(out, 0, sizeof(*out));
+	
+	//Make sure our own time is current
+	thread_usage_exit();
+	
+	process_t *pptr = process_lockcur();
+	if(who == PX_RUSAGE_CHILDREN)
+	{
+		thread_usage_add(out, &(pptr->usage_children));
+	}
+	else if(who == PX_RUSAGE_PROCESS)
+	{
+		thread_usage_add(out, &(pptr->usage_left));
+		for(thread_t *tptr = pptr->threads; tptr != NULL; tptr = tptr->process_next)
+		{
+			//Threads running elsewhere haven't been charged for what they're doing right now - close enough
+			hal_spl_lock(&(tptr->spl));
+			thread_usage_add(out, &(tptr->usage));
+			hal_spl_unlock(&(tptr->spl));
+		}
+	}
+	else
+	{
+		process_unlock(pptr);
+		return -EINVAL;
 	}
 	
-	process_unlock(found_pptr);
+	process_unlock(pptr);
 	return 0;
 }
 
@@ -417,8 +1110,7 @@ int process_wait(idtype_t id_type, int64_t id, int options, px_wait_t *out)
 	notify_dst_t n = {0};
 	notify_add(&(caller_pptr->child_notify), &n);
 
-	//Get ID of caller for checking parentage / group IDs
-	pid_t caller_pid = caller_pptr->id;
+	//Get group ID of caller, for waiting on our own group
 	pid_t caller_pgid = caller_pptr->pgid;
 	if( (id == 0) && ((id_type == P_PID) || (id_type == P_PGID)) )
 	{
@@ -434,7 +1126,7 @@ int process_wait(idtype_t id_type, int64_t id, int options, px_wait_t *out)
 	while(1)
 	{
 		//Check for any matching children with status changes
-		result = process_wait_attempt(caller_pid, id_type, id, options, out);
+		result = process_wait_attempt(id_type, id, options, out);
 		if(result != -EAGAIN)
 			break; //Success or total failure - something besides "wait on it"
 		
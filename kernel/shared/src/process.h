@@ -9,9 +9,22 @@
 #include "fd.h"
 #include "mem.h"
 #include "notify.h"
+#include "timer.h"
+#include "thread.h"
+#include "px.h"
 
 #include <sys/resource.h>
 
+//Most processes that can exist at once
+#ifndef PROCESS_MAX
+	#define PROCESS_MAX 32768
+#endif
+
+//Number of lists that processes are hashed onto by process group ID
+#ifndef PROCESS_PGRP_BUCKETS
+	#define PROCESS_PGRP_BUCKETS 16
+#endif
+
 //State of a process
 typedef enum process_state_e
 {
@@ -44,6 +57,20 @@ typedef struct process_fdnum_s
 	
 } process_fdnum_t;
 
+//Interval timer of a process
+typedef struct process_timer_s
+{
+	//Monotonic time of the next expiry in nanoseconds, or 0 if stopped
+	uint64_t deadline;
+	
+	//Time added to the deadline on each expiry, or 0 to stop after the first
+	uint64_t interval;
+	
+	//Kernel timer that wakes us up to raise the signal
+	timer_event_t event;
+	
+} process_timer_t;
+
 //Process control block
 typedef struct process_s
 {
@@ -59,6 +86,18 @@ typedef struct process_s
 	//ID of parent of this process
 	int parent;
 	
+	//Children of this process, linked through their child_next.
+	//Protected by the parent's lock. A parent is locked before its children, and init before any other process.
+	struct process_s *children;
+	struct process_s *child_next;
+	
+	//Children that have status for this process to wait on, oldest first, linked through their zombie_next.
+	//Protected by the parent's lock, like the list of children. Also whether this process is in its parent's queue.
+	struct process_s *zombie_head;
+	struct process_s *zombie_tail;
+	struct process_s *zombie_next;
+	bool zombie_queued;
+	
 	//ID of the process group containing this process (one process group at a time may write to the console)
 	int pgid;
 	
@@ -68,6 +107,14 @@ typedef struct process_s
 	//Number of threads executing in the process
 	int nthreads;
 	
+	//Threads executing in the process, linked through their process_next
+	struct thread_s *threads;
+	
+	//Link in the index of processes by group, and whether the process is in it.
+	//Protected by the lock on the index, rather than the process. Processes leave the index once their last thread leaves.
+	struct process_s *pgrp_next;
+	bool pgrp_linked;
+	
 	//Array of IDs of file descriptors present in the process
 	process_fdnum_t *fd_array;
 	int fd_count;
@@ -90,6 +137,24 @@ typedef struct process_s
 	//Notification fired when a child changes status
 	notify_src_t child_notify;
 	
+	//Notification fired when a thread leaves the process
+	notify_src_t thread_notify;
+	
+	//Interval timers
+	process_timer_t timers[PX_TIMER_MAX];
+	
+	//Resources used by threads that have left the process
+	thread_usage_t usage_left;
+	
+	//Resources used by children that have been waited on, including their own waited-on children
+	thread_usage_t usage_children;
+	
+	//Ring of submissions being polled by a kernel thread in the process, that thread, and how long it waits before sleeping.
+	//Cleared by the polling thread when it leaves, or by whatever stops the polling.
+	uintptr_t ring_addr;
+	id_t ring_tid;
+	int64_t ring_idle;
+	
 } process_t;
 
 //Makes process table and sets up first process.
@@ -98,18 +163,61 @@ void process_init(void);
 //Locks and returns the calling process's process control block.
 process_t *process_lockcur(void);
 
+//Returns the memory space of the calling thread's process, without locking anything, or NULL if it has none.
+//Only the calling thread replaces it - when it execs, once it's alone - so it stays valid while the thread uses it.
+mem_space_t *process_curmem(void);
+
 //Looks up and locks the process with the given ID. Returns a pointer to it.
 process_t *process_getlocked(id_t id);
 
 //Looks up and locks a process entry that is unused. Returns a pointer to it.
 process_t *process_locknew(void);
 
+//Marks a locked process entry unused, once everything in it has been cleaned up, and unlocks it.
+void process_free(process_t *pptr);
+
 //Unlocks the given process
 void process_unlock(process_t *pptr);
 
+//Calls the given function on each process identified by the given ID (P_PID or P_PGID), or on every process (P_ALL), with the process locked.
+//Returns the number of processes found.
+int process_foreach(idtype_t idtype, id_t id, void (*func)(process_t *pptr, void *arg), void *arg);
+
+//Adds a new thread to a process. Both should be locked by the caller.
+void process_addthread(process_t *pptr, struct thread_s *tptr);
+
+//Adds a newly-forked process to the children of its parent. Both should be locked by the caller.
+void process_addchild(process_t *pptr, process_t *child);
+
+//Sets the process group of the given process (or the calling process, if 0) to the given group (or the caller's, if 0).
+//Returns 0 on success or a negative error number.
+int process_setpgid(pid_t pid, pid_t pgrp);
+
+//Puts a newly-forked process in the index of its process group. Call once it's unlocked.
+void process_pgrp_join(pid_t pid);
+
 //Removes the calling thread from its process and sets the process to dead if none remain.
 void process_leave(void);
 
+//Starts a new user thread in the calling process, at the given entry point, stack, and thread pointer.
+//Returns the thread ID or a negative error number.
+int process_thread_new(uintptr_t pc, uintptr_t sp, uintptr_t tls, uintptr_t arg);
+
+//Waits for the given thread in the calling process to leave it.
+//Returns 0 on success or a negative error number.
+int process_thread_join(id_t tid);
+
+//Kills all threads in the calling process besides the calling one, and waits for them to leave.
+//Returns 0 on success or a negative error number.
+int process_thread_solo(void);
+
+//Sets one of the calling process's timers to expire after the given number of nanoseconds, then every interval.
+//Returns the time that was left on the timer, or a negative error number.
+int64_t process_timer_set(int id, int64_t value, int64_t interval);
+
+//Returns the time left on one of the calling process's timers, or a negative error number.
+int64_t process_timer_get(int id);
+
 //Adds the given file descriptor to the process, with a number at least "min".
 //Overwrites an existing descriptor at "min" if overwrite is specified.
 //If an ID was overwritten, it is returned in *old_id.
@@ -131,12 +239,17 @@ int process_flagfdnum(int num, int set, int clr);
 //Returns the ID of the file descriptor for the working directory of the calling process.
 id_t process_getfdpwd(void);
 
-//Copies a string to the calling process's memory.
+//Totals the resources used by the calling process (PX_RUSAGE_PROCESS) or its waited-on children (PX_RUSAGE_CHILDREN).
 //Returns 0 on success or a negative error number.
-int process_strncpy_touser(void *dst_u, const void *src_k, size_t buflen);
+int process_usage(int who, thread_usage_t *out);
 
 //Waits for children of the calling process to have available status.
 //Returns 0 on success or a negative error number. Places result in *out.
 int process_wait(idtype_t id_type, int64_t id, int options, px_wait_t *out);
 
+//Scans the memory of all processes in two phases, as when evicting or merging pages.
+//Pages are picked with the first function, then TLBs are flushed, then the second function finishes with them.
+//The pick buffer is used to hold pages between the two. Returns the total number of frames freed.
+int process_memscan(int (*pick)(mem_space_t *mptr, mem_pick_t *pick), int (*finish)(mem_space_t *mptr, const mem_pick_t *pick), mem_pick_t *buf);
+
 #endif //PROCESS_H
@@ -7,6 +7,14 @@
 #include "kspace.h"
 #include "libcstubs.h"
 #include "pipe.h"
+#include "zpage.h"
+#include "reclaim.h"
+#include "merge.h"
+#include "teardown.h"
+#include "zygote.h"
+
+#include "hal_clock.h"
+#include "hal_copy.h"
 
 #include <stdbool.h>
 #include <errno.h>
@@ -16,6 +24,18 @@
 //Number of page-length allocations referred to in each level of RAMfs table
 #define RAMFS_PAGENUM 500
 
+//Data page pointers with the low bit set are actually handles for pages evicted to the compressed store.
+#define RAMFS_PAGE_ZPAGE 1
+
+//Data page pointers with the next bit set are actually frames, shared with identical pages elsewhere.
+#define RAMFS_PAGE_MERGED 2
+
+//All bits that mark a data page pointer as something other than a plain pointer
+#define RAMFS_PAGE_TAGS (RAMFS_PAGE_ZPAGE | RAMFS_PAGE_MERGED)
+
+//Number of free frames below which RAMfs refuses to grow files, leaving the rest for the kernel itself
+#define RAMFS_RESERVE_FRAMES 256
+
 //Indirect table of pointers
 //Todo - can probably write this to be automatically recursive
 //(like, always assume the last entry is to the root of one more indirection)
@@ -51,11 +71,33 @@ typedef struct ramfs_inode_s
 	//Indirect table (following RAMFS_PAGENUM * RAMFS_PAGENUM pages)
 	ramfs_indir_t *indir;
 	
+	//Links in the list of all inodes, scanned when reclaiming memory
+	struct ramfs_inode_s *list_next;
+	struct ramfs_inode_s *list_prev;
+	
+	//Whether the file has been read or written since it was last scanned for eviction
+	bool used;
+	
+	//Whether the file has been written since it was last scanned for merging
+	bool written;
+	
+	//Queue entry for freeing the data of a deleted file in the background
+	teardown_job_t teardown;
+	
 } ramfs_inode_t;
 
 //Root directory inode - one "filesystem" reference to keep it around always. One "file descriptor" ref for init's PWD on startup.
 static ramfs_inode_t ramfs_root = { .refs_fs = 1, .refs_fd = 1, .mode = S_IFDIR | 0777 };
 
+//List of all inodes other than root, and spinlock protecting it.
+//Taken after any inode lock, or only tried while holding the list lock.
+static ramfs_inode_t *ramfs_list;
+static hal_spl_t ramfs_list_spl;
+
+//Buffer for reading merged pages, which aren't mapped in kernel space, and spinlock protecting it
+static uint8_t ramfs_bounce[4096];
+static hal_spl_t ramfs_bounce_spl;
+
 //Interprets an inode number as an inode pointer.
 //Inode numbers are just pointers shifted down, to make them positive, under the assumption that they're 2-byte-aligned
 static ramfs_inode_t *ramfs_inode_ptr(ino_t ino)
@@ -98,11 +140,75 @@ static ino_t ramfs_inode_ino(ramfs_inode_t *ptr)
 	return (ino_t)ptr_int;
 }
 
+//Makes sure the data page in the given slot is in memory, bringing it back from the compressed store if needed.
+//Merged pages are left in place for reading, but copied to a private page for writing.
+//Returns 0 on success or a negative error number.
+static int ramfs_page_resident(void **slot, bool write)
+{
+	uintptr_t entry = (uintptr_t)(*slot);
+	if(!(entry & RAMFS_PAGE_TAGS))
+		return 0;
+	
+	if((entry & RAMFS_PAGE_MERGED) && !write)
+		return 0;
+	
+	uint64_t start = hal_clock_cycles();
+	
+	void *page = kspace_alloc(hal_frame_size(), hal_frame_size());
+	if(page == NULL)
+		return -ENOSPC;
+	
+	if(entry & RAMFS_PAGE_ZPAGE)
+	{
+		zpage_get(entry >> 1, page, false);
+		zpage_fault_count(hal_clock_cycles() - start);
+	}
+	else
+	{
+		hal_frame_read(entry & ~(uintptr_t)RAMFS_PAGE_TAGS, page);
+		merge_release(entry & ~(uintptr_t)RAMFS_PAGE_TAGS);
+	}
+	
+	*slot = page;
+	reclaim_check();
+	return 0;
+}
+
+//Frees a data page, whether it's in memory, in the compressed store, or merged.
+static void ramfs_page_free(void *page)
+{
+	uintptr_t entry = (uintptr_t)page;
+	if(entry & RAMFS_PAGE_ZPAGE)
+		zpage_free(entry >> 1);
+	else if(entry & RAMFS_PAGE_MERGED)
+		merge_release(entry & ~(uintptr_t)RAMFS_PAGE_TAGS);
+	else
+		kspace_free(page, hal_frame_size());
+}
+
+//Returns the slot referencing the given data page of an inode, or NULL if no table covers it.
+static void **ramfs_slot(ramfs_inode_t *iptr, size_t pp)
+{
+	if(pp < RAMFS_PAGENUM)
+		return &(iptr->pages[pp]);
+	
+	pp -= RAMFS_PAGENUM;
+	if(pp >= RAMFS_PAGENUM * RAMFS_PAGENUM || iptr->indir == NULL)
+		return NULL;
+	
+	ramfs_indir_t *indir2 = iptr->indir->pages[pp / RAMFS_PAGENUM];
+	if(indir2 == NULL)
+		return NULL;
+	
+	return &(indir2->pages[pp % RAMFS_PAGENUM]);
+}
+
 //Finds the page containing data for the given offset in the given inode.
 //Optionally allocates that page if it does not exist.
+//If it's going to be written, makes sure it's a private page in memory - otherwise, it may be a merged frame.
 //Outputs the page address in *ptr_out, or outputs NULL if it doesn't exist and won't be created.
 //Returns 0 on success or a negative error number.
-static int ramfs_getpage(ramfs_inode_t *iptr, off_t off, bool alloc, void **ptr_out)
+static int ramfs_getpage(ramfs_inode_t *iptr, off_t off, bool alloc, bool write, void **ptr_out)
 {
 	//Zero this initially, for error returns
 	*ptr_out = NULL;
@@ -126,10 +232,16 @@ static int ramfs_getpage(ramfs_inode_t *iptr, off_t off, bool alloc, void **ptr_
 			iptr->pages[off] = kspace_alloc(pagesize, pagesize);
 			if(iptr->pages[off] == NULL)
 				return -ENOSPC; //Tried and failed to allocate data page
+			
+			reclaim_check();
 		}
 		
-		//Found it
+		//Found it - make sure it's not compressed, or shared if we're going to write it
 		KASSERT(iptr->pages[off] != NULL);
+		int resident_err = ramfs_page_resident(&(iptr->pages[off]), write);
+		if(resident_err < 0)
+			return resident_err;
+		
 		*ptr_out = iptr->pages[off];
 		return 0;
 	}
@@ -175,10 +287,16 @@ static int ramfs_getpage(ramfs_inode_t *iptr, off_t off, bool alloc, void **ptr_
 			indir2->pages[off % RAMFS_PAGENUM] = kspace_alloc(pagesize, pagesize);
 			if(indir2->pages[off % RAMFS_PAGENUM] == NULL)
 				return -ENOSPC; //No room for data page		
+			
+			reclaim_check();
 		}
 		
-		//Found it
+		//Found it - make sure it's not compressed, or shared if we're going to write it
 		KASSERT(indir2->pages[off % RAMFS_PAGENUM] != NULL);
+		int resident_err = ramfs_page_resident(&(indir2->pages[off % RAMFS_PAGENUM]), write);
+		if(resident_err < 0)
+			return resident_err;
+		
 		*ptr_out = indir2->pages[off % RAMFS_PAGENUM];
 		return 0;
 	}
@@ -192,6 +310,7 @@ static ssize_t ramfs_readat(ramfs_inode_t *iptr, off_t off, void *buf, ssize_t l
 {	
 	//Have to read in chunks of at most one memory page
 	size_t pagesize = hal_frame_size();
+	iptr->used = true;
 	
 	//Read from each data page
 	uint8_t *buf_remain = buf;
@@ -221,21 +340,34 @@ static ssize_t ramfs_readat(ramfs_inode_t *iptr, off_t off, void *buf, ssize_t l
 		
 		//Find the page of data
 		uint8_t *datapage_ptr = NULL;
-		int datapage_err = ramfs_getpage(iptr, off, false, (void**)(&datapage_ptr));
+		int datapage_err = ramfs_getpage(iptr, off, false, false, (void**)(&datapage_ptr));
 		if(datapage_err < 0)
 			return datapage_err;
 		
-		if(datapage_ptr != NULL)
+		int copy_err = 0;
+		if(datapage_ptr != NULL && ((uintptr_t)datapage_ptr & RAMFS_PAGE_MERGED))
+		{
+			//If the page of data is merged, it's only a physical frame - read it through a buffer
+			hal_spl_lock(&ramfs_bounce_spl);
+			hal_frame_read((uintptr_t)datapage_ptr & ~(uintptr_t)RAMFS_PAGE_TAGS, ramfs_bounce);
+			copy_err = hal_copy(buf_remain, ramfs_bounce + (off % pagesize), chunksize);
+			hal_spl_unlock(&ramfs_bounce_spl);
+		}
+		else if(datapage_ptr != NULL)
 		{
 			//If the page of data exists, copy from the page, with appropriate offset		
-			memcpy(buf_remain, datapage_ptr + (off % pagesize), chunksize);
+			copy_err = hal_copy(buf_remain, datapage_ptr + (off % pagesize), chunksize);
 		}
 		else
 		{
 			//If there's no data page, then this is a hole in the file - read as zeroes.
-			memset(buf_remain, 0, chunksize);
+			copy_err = hal_copy_zero(buf_remain, chunksize);
 		}
 		
+		//The buffer may be in userspace. Stop if it's bad, returning what we got.
+		if(copy_err < 0)
+			return (total_out > 0) ? total_out : copy_err;
+		
 		//Advance
 		buf_remain += chunksize;
 		total_out += chunksize;
@@ -249,6 +381,8 @@ static ssize_t ramfs_writeat(ramfs_inode_t *iptr, off_t off, const void *buf, ss
 {
 	//Similar to read. Go page-by-page and copy data into the file.
 	size_t pagesize = hal_frame_size();
+	iptr->used = true;
+	iptr->written = true;
 	const uint8_t *buf_remain = buf;
 	ssize_t total_out = 0;
 	while(1)
@@ -269,20 +403,29 @@ static ssize_t ramfs_writeat(ramfs_inode_t *iptr, off_t off, const void *buf, ss
 		//Find the page of data, and try to allocate if it doesn't exist.
 		uint8_t *datapage_ptr = NULL;
 		
-		//Super temp - don't allow consuming all the machine's memory with RAMfs.
-		//Needs to be configurable somehow...
-		bool alloc = (hal_frame_count() * hal_frame_size()) > (32*1024*1024);
-		int datapage_err = ramfs_getpage(iptr, off, alloc, (void**)(&datapage_ptr));
+		//Cold pages get compressed as memory runs low, so files can use nearly all of it.
+		//Leave a little for the kernel itself though.
+		//If deleted files are still being freed in the background, finish that first.
+		bool alloc = hal_frame_count() > RAMFS_RESERVE_FRAMES;
+		if(!alloc && teardown_help() > 0)
+			alloc = hal_frame_count() > RAMFS_RESERVE_FRAMES;
+		
+		//Pages that exist are always made private for writing, even when we wouldn't allocate new ones.
+		//If a merged page can't be copied, that fails with -ENOSPC.
+		int datapage_err = ramfs_getpage(iptr, off, alloc, true, (void**)(&datapage_ptr));
 		if(datapage_err < 0)
 			return datapage_err;
 		
 		if(datapage_ptr == NULL && !alloc)
 			return -ENOSPC;
 		
-		//Page must exist if we're writing into it. The above code should fail if allocation fails.
+		//Page must exist if we're writing into it, and be an ordinary page in memory.
 		//Copy into the page, with appropriate offset
 		KASSERT(datapage_ptr != NULL);
-		memcpy(datapage_ptr + (off % pagesize), buf_remain, chunksize);
+		KASSERT(!((uintptr_t)datapage_ptr & RAMFS_PAGE_TAGS));
+		int copy_err = hal_copy(datapage_ptr + (off % pagesize), buf_remain, chunksize);
+		if(copy_err < 0)
+			return (total_out > 0) ? total_out : copy_err;
 		
 		//Advance
 		buf_remain += chunksize;
@@ -313,7 +456,7 @@ static void ramfs_trunc_inode(ramfs_inode_t *iptr, off_t size)
 	{
 		if(iptr->pages[pp] != NULL)
 		{
-			kspace_free(iptr->pages[pp], pagesize);
+			ramfs_page_free(iptr->pages[pp]);
 			iptr->pages[pp] = NULL;
 		}
 	}
@@ -339,7 +482,7 @@ static void ramfs_trunc_inode(ramfs_inode_t *iptr, off_t size)
 			
 			if(indir2->pages[pp % RAMFS_PAGENUM] != NULL)
 			{
-				kspace_free(indir2->pages[pp % RAMFS_PAGENUM], pagesize);
+				ramfs_page_free(indir2->pages[pp % RAMFS_PAGENUM]);
 				indir2->pages[pp % RAMFS_PAGENUM] = NULL;
 			}
 		}
@@ -370,13 +513,10 @@ static void ramfs_trunc_inode(ramfs_inode_t *iptr, off_t size)
 	}	
 }
 
-//Deletes the given inode, assuming it has no references.
-static void ramfs_delete(ramfs_inode_t *iptr)
+//Frees the data and the inode of a deleted file, after it's been made unreachable.
+static void ramfs_delete_finish(teardown_job_t *job)
 {
-	//Should be locked with no references at time of deletion
-	KASSERT(iptr->spl > 0);
-	KASSERT(iptr->refs_fd == 0);
-	KASSERT(iptr->refs_fs == 0);
+	ramfs_inode_t *iptr = (ramfs_inode_t*)((uint8_t*)job - offsetof(ramfs_inode_t, teardown));
 	
 	//Truncate to nothing to free all data pages
 	ramfs_trunc_inode(iptr, 0);
@@ -399,14 +539,132 @@ static void ramfs_delete(ramfs_inode_t *iptr)
 		KASSERT(iptr->pages[ii] == NULL);
 	}
 	
+	//Free the inode itself
+	kspace_free(iptr, sizeof(*iptr));
+}
+
+//Deletes the given inode, assuming it has no references. Unlocks it.
+//Big files take a while to free, so the data is freed in the background.
+static void ramfs_delete(ramfs_inode_t *iptr)
+{
+	//Should be locked with no references at time of deletion
+	KASSERT(iptr->spl > 0);
+	KASSERT(iptr->refs_fd == 0);
+	KASSERT(iptr->refs_fs == 0);
+	
+	//The inode number can be reused by a new file, which mustn't be mistaken for this one
+	zygote_forget(ramfs_inode_ino(iptr));
+	
 	//Remove reference to pipe if any
 	if(S_ISFIFO(iptr->mode))
 	{
 		pipe_decr(iptr->spec, 0);
 	}
 	
-	//Free the inode itself
-	kspace_free(iptr, sizeof(*iptr));
+	//Remove from the list of all inodes
+	hal_spl_lock(&ramfs_list_spl);
+	if(iptr->list_next != NULL)
+		iptr->list_next->list_prev = iptr->list_prev;
+	if(iptr->list_prev != NULL)
+		iptr->list_prev->list_next = iptr->list_next;
+	else
+		ramfs_list = iptr->list_next;
+	hal_spl_unlock(&ramfs_list_spl);
+	
+	//Nothing can find the inode anymore, so nobody else will be waiting on its lock
+	size_t pages = (iptr->size + hal_frame_size() - 1) / hal_frame_size();
+	hal_spl_unlock(&(iptr->spl));
+	teardown_defer(&(iptr->teardown), &ramfs_delete_finish, pages);
+}
+
+//Compresses the in-memory data pages of an inode, stopping after the given number of pages.
+//Returns the number of pages evicted.
+static size_t ramfs_evict_inode(ramfs_inode_t *iptr, size_t max)
+{
+	size_t evicted = 0;
+	size_t pagesize = hal_frame_size();
+	size_t npages = (iptr->size + pagesize - 1) / pagesize;
+	for(size_t pp = 0; pp < npages && evicted < max; pp++)
+	{
+		void **slot = ramfs_slot(iptr, pp);
+		if(slot == NULL || *slot == NULL || ((uintptr_t)(*slot) & RAMFS_PAGE_TAGS))
+			continue; //Hole in the file, or already compressed or merged
+		
+		uint64_t handle = zpage_put(*slot);
+		if(handle == 0)
+			continue; //Didn't compress well
+		
+		kspace_free(*slot, pagesize);
+		*slot = (void*)((handle << 1) | RAMFS_PAGE_ZPAGE);
+		evicted++;
+	}
+	
+	return evicted;
+}
+
+size_t ramfs_evict(size_t max)
+{
+	//Work through all files, skipping any that are busy.
+	//Files that were used since the last scan get a second chance.
+	size_t evicted = 0;
+	hal_spl_lock(&ramfs_list_spl);
+	for(ramfs_inode_t *iptr = ramfs_list; iptr != NULL && evicted < max; iptr = iptr->list_next)
+	{
+		if(!hal_spl_try(&(iptr->spl)))
+			continue;
+		
+		if(iptr->used)
+			iptr->used = false;
+		else
+			evicted += ramfs_evict_inode(iptr, max - evicted);
+		
+		hal_spl_unlock(&(iptr->spl));
+	}
+	hal_spl_unlock(&ramfs_list_spl);
+	return evicted;
+}
+
+size_t ramfs_merge(size_t max)
+{
+	//Work through all files, skipping any that are busy.
+	//Files written since the last scan are likely to be written again, so leave them until next time.
+	size_t pagesize = hal_frame_size();
+	size_t scanned = 0;
+	size_t merged = 0;
+	hal_spl_lock(&ramfs_list_spl);
+	for(ramfs_inode_t *iptr = ramfs_list; iptr != NULL && scanned < max; iptr = iptr->list_next)
+	{
+		if(!hal_spl_try(&(iptr->spl)))
+			continue;
+		
+		if(iptr->written)
+		{
+			iptr->written = false;
+			hal_spl_unlock(&(iptr->spl));
+			continue;
+		}
+		
+		size_t npages = (iptr->size + pagesize - 1) / pagesize;
+		for(size_t pp = 0; pp < npages && scanned < max; pp++)
+		{
+			void **slot = ramfs_slot(iptr, pp);
+			if(slot == NULL || *slot == NULL || ((uintptr_t)(*slot) & RAMFS_PAGE_TAGS))
+				continue; //Hole in the file, or already compressed or merged
+			
+			scanned++;
+			hal_frame_id_t frame = merge_page(*slot);
+			if(frame == HAL_FRAME_ID_INVALID)
+				continue;
+			
+			kspace_free(*slot, pagesize);
+			*slot = (void*)(frame | RAMFS_PAGE_MERGED);
+			merged++;
+		}
+		
+		hal_spl_unlock(&(iptr->spl));
+	}
+	hal_spl_unlock(&ramfs_list_spl);
+	return merged;
 }
 
 
@@ -521,6 +779,14 @@ id_t ramfs_create(fd_t *fd, const char *name, mode_t mode, uint64_t spec)
 	newinode->mode = mode;
 	newinode->spec = spec;
 	
+	//Add to the list of all inodes
+	hal_spl_lock(&ramfs_list_spl);
+	newinode->list_next = ramfs_list;
+	if(ramfs_list != NULL)
+		ramfs_list->list_prev = newinode;
+	ramfs_list = newinode;
+	hal_spl_unlock(&ramfs_list_spl);
+	
 	//If we're making a directory, make sure it starts with "." and ".." entries.
 	if(S_ISDIR(mode))
 	{
@@ -692,10 +958,12 @@ ssize_t ramfs_write(fd_t *fd, const void *buf, size_t len)
 	if(len >= SSIZE_MAX)
 		len = SSIZE_MAX;
 	
+	//Programs loaded from the file are out of date once it's written
+	zygote_forget(fd->ino);
+	
 	ramfs_inode_t *iptr = ramfs_inode_ptr(fd->ino);
 	hal_spl_lock(&(iptr->spl));
 	
-	
 	ssize_t retval = ramfs_writeat(iptr, fd->off, buf, (ssize_t)len);
 	
 	hal_spl_unlock(&(iptr->spl));
@@ -732,6 +1000,8 @@ int ramfs_trunc(fd_t *fd, off_t size)
 	if(size >= RAMFS_PAGENUM * RAMFS_PAGENUM * (off_t)hal_frame_size())
 		return -EFBIG;
 	
+	zygote_forget(fd->ino);
+	
 	ramfs_inode_t *iptr = ramfs_inode_ptr(fd->ino);
 	hal_spl_lock(&(iptr->spl));
 	
@@ -17,4 +17,12 @@ int     ramfs_unlink(fd_t *fd, const char *name, ino_t only_ino, int rmdir);
 void    ramfs_close (fd_t *fd);
 int     ramfs_access(fd_t *fd, int set, int clr);
 
+//Compresses data pages of files that haven't been used recently, up to the given number of pages.
+//Returns the number of pages evicted.
+size_t ramfs_evict(size_t max);
+
+//Merges data pages of files that haven't been written lately with identical pages elsewhere.
+//Looks at up to the given number of pages. Returns the number of pages merged.
+size_t ramfs_merge(size_t max);
+
 #endif //RAMFS_H
@@ -0,0 +1,103 @@
+//reclaim.c
+//Background reclaim of memory under pressure
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "reclaim.h"
+#include "kassert.h"
+#include "notify.h"
+#include "process.h"
+#include "ramfs.h"
+#include "thread.h"
+#include "merge.h"
+#include "teardown.h"
+
+#include "hal_frame.h"
+#include "hal_spl.h"
+
+#include <stdbool.h>
+
+//Number of free frames below which we start evicting cold pages to the compressed store
+#define RECLAIM_LOW_FRAMES 4096
+
+//Number of free frames we try to get back up to, once we start
+#define RECLAIM_HIGH_FRAMES 6144
+
+//Maximum number of RAMfs pages to evict in one pass
+#define RECLAIM_RAMFS_MAX 256
+
+//Number of passes without freeing anything, before we give up for now.
+//Pages get a second chance if they were used, so one pass might just clear their accessed-flags.
+#define RECLAIM_IDLE_PASSES 3
+
+//Notification for waking the reclaim thread, and spinlock protecting it
+static hal_spl_t reclaim_spl;
+static notify_src_t reclaim_notify;
+
+//Whether the reclaim thread has been woken and has yet to finish.
+//Starts set, as the thread makes a pass when it starts, before it can receive notifications.
+static bool reclaim_running = true;
+
+//Entry point of reclaim thread
+static void reclaim_main(void *data)
+{
+	(void)data;
+	
+	static notify_dst_t dst;
+	hal_spl_lock(&reclaim_spl);
+	notify_add(&reclaim_notify, &dst);
+	hal_spl_unlock(&reclaim_spl);
+	
+	//Only this thread evicts, so it can keep its list of pages aside from its small stack
+	static mem_pick_t pick;
+	
+	while(1)
+	{
+		//Merging identical pages is cheaper than compressing them, so get that going too
+		if(hal_frame_count() < RECLAIM_HIGH_FRAMES)
+			merge_kick();
+		
+		//Evict cold pages until there's comfortably enough memory free, or we stop making progress.
+		int idle = 0;
+		while(hal_frame_count() < RECLAIM_HIGH_FRAMES && idle < RECLAIM_IDLE_PASSES)
+		{
+			//Memory still waiting to be freed from exited processes and deleted files comes back cheapest
+			size_t freed = teardown_help();
+			if(hal_frame_count() >= RECLAIM_HIGH_FRAMES)
+				break;
+			
+			freed += process_memscan(&mem_space_evict_pick, &mem_space_evict_finish, &pick);
+			freed += ramfs_evict(RECLAIM_RAMFS_MAX);
+			if(freed > 0)
+				idle = 0;
+			else
+				idle++;
+		}
+		
+		hal_spl_lock(&reclaim_spl);
+		reclaim_running = false;
+		hal_spl_unlock(&reclaim_spl);
+		
+		notify_wait();
+	}
+}
+
+void reclaim_init(void)
+{
+	thread_t *tptr = thread_new(&reclaim_main, NULL);
+	KASSERT(tptr != NULL);
+	thread_unlock(tptr);
+}
+
+void reclaim_check(void)
+{
+	if(hal_frame_count() >= RECLAIM_LOW_FRAMES)
+		return;
+	
+	hal_spl_lock(&reclaim_spl);
+	if(!reclaim_running)
+	{
+		reclaim_running = true;
+		notify_send(&reclaim_notify);
+	}
+	hal_spl_unlock(&reclaim_spl);
+}
@@ -0,0 +1,14 @@
+//reclaim.h
+//Background reclaim of memory under pressure
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef RECLAIM_H
+#define RECLAIM_H
+
+//Starts the reclaim thread.
+void reclaim_init(void);
+
+//Wakes the reclaim thread if free memory is running low.
+//Cheap enough to call whenever memory is allocated.
+void reclaim_check(void);
+
+#endif //RECLAIM_H
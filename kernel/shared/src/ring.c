@@ -0,0 +1,332 @@
+//ring.c
+//Batches of system calls submitted through shared memory
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "ring.h"
+#include "copy.h"
+#include "futex.h"
+#include "kassert.h"
+#include "notify.h"
+#include "process.h"
+#include "syscalls.h"
+#include "thread.h"
+#include "timer.h"
+
+#include "hal_uspc.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+//Performs one submission, returning what the corresponding system call would.
+static int64_t ring_op(const px_ring_sqe_t *sqe)
+{
+	switch(sqe->op)
+	{
+		case PX_RING_OP_NOP:
+			return 0;
+		case PX_RING_OP_FD_FIND:
+			return k_px_fd_find(sqe->fd, (const char*)(sqe->ptr));
+		case PX_RING_OP_FD_READ:
+			return k_px_fd_read(sqe->fd, (void*)(sqe->ptr), sqe->len);
+		case PX_RING_OP_FD_WRITE:
+			return k_px_fd_write(sqe->fd, (const void*)(sqe->ptr), sqe->len);
+		case PX_RING_OP_FD_SEEK:
+			return k_px_fd_seek(sqe->fd, sqe->arg, (int)(sqe->len));
+		case PX_RING_OP_FD_STAT:
+			return k_px_fd_stat(sqe->fd, (px_fd_stat_t*)(sqe->ptr), sqe->len);
+		case PX_RING_OP_FD_CLOSE:
+			return k_px_fd_close(sqe->fd);
+		case PX_RING_OP_FD_CREATE:
+			return k_px_fd_create(sqe->fd, (const char*)(sqe->ptr), (mode_t)(sqe->len), sqe->arg);
+		case PX_RING_OP_FD_TRUNC:
+			return k_px_fd_trunc(sqe->fd, sqe->arg);
+		case PX_RING_OP_FD_UNLINK:
+			return k_px_fd_unlink(sqe->fd, (const char*)(sqe->ptr), (int)(sqe->arg), (int)(sqe->len));
+		default:
+			return -ENOSYS;
+	}
+}
+
+//Reads the header of a ring from userspace and checks that it makes sense.
+//Returns 0 on success or a negative error number.
+static int ring_header(px_ring_t *uring, px_ring_t *out)
+{
+	//Counters are waited on as futexes, so need to be aligned like them
+	if((uintptr_t)uring % sizeof(uint64_t) != 0)
+		return -EINVAL;
+	
+	int copy_err = copyin(out, uring, sizeof(*out));
+	if(copy_err < 0)
+		return copy_err;
+	
+	if(out->size == 0 || out->size > RING_SIZE_MAX || (out->size & (out->size - 1)) != 0)
+		return -EINVAL;
+	
+	return 0;
+}
+
+//Performs submissions posted to the ring at the given user address, until there are none or the completion queue is full.
+//Returns the number performed or a negative error number.
+static int ring_run(px_ring_t *uring)
+{
+	px_ring_t ring;
+	int header_err = ring_header(uring, &ring);
+	if(header_err < 0)
+		return header_err;
+	
+	const uint64_t mask = ring.size - 1;
+	int done = 0;
+	int64_t prev = 0;
+	bool linked = false;
+	while(ring.sq_head != ring.sq_tail)
+	{
+		//Make sure there's room for the completion, looking again at what userspace has consumed if not
+		if(ring.cq_tail - ring.cq_head >= ring.size)
+		{
+			int head_err = copyin(&(ring.cq_head), &(uring->cq_head), sizeof(ring.cq_head));
+			if(head_err < 0)
+				return done ? done : head_err;
+			
+			if(ring.cq_tail - ring.cq_head >= ring.size)
+				break;
+		}
+		
+		px_ring_sqe_t sqe;
+		int sqe_err = copyin(&sqe, &(ring.sq[ring.sq_head & mask]), sizeof(sqe));
+		if(sqe_err < 0)
+			return done ? done : sqe_err;
+		
+		//Skip the operation if it's linked to one that failed.
+		//Otherwise, perform it, maybe on the file descriptor that the one before it returned.
+		int64_t result = 0;
+		if(linked && prev < 0)
+		{
+			result = -ECANCELED;
+		}
+		else if(sqe.flags & PX_RING_SQE_FDPREV)
+		{
+			if(linked && prev <= INT_MAX)
+			{
+				sqe.fd = prev;
+				result = ring_op(&sqe);
+			}
+			else
+			{
+				result = -EINVAL;
+			}
+		}
+		else
+		{
+			result = ring_op(&sqe);
+		}
+		
+		//A canceled operation passes its failure down the rest of the chain
+		linked = (sqe.flags & PX_RING_SQE_LINK) != 0;
+		prev = result;
+		
+		//Post the completion, then advance the counters so userspace sees it
+		px_ring_cqe_t cqe = { .user = sqe.user, .result = result };
+		int cqe_err = copyout(&(ring.cq[ring.cq_tail & mask]), &cqe, sizeof(cqe));
+		if(cqe_err < 0)
+			return done ? done : cqe_err;
+		
+		ring.sq_head++;
+		ring.cq_tail++;
+		done++;
+		
+		int ctr_err = copyout(&(uring->sq_head), &(ring.sq_head), sizeof(ring.sq_head));
+		if(ctr_err == 0)
+			ctr_err = copyout(&(uring->cq_tail), &(ring.cq_tail), sizeof(ring.cq_tail));
+		if(ctr_err < 0)
+			return done ? done : ctr_err; //Operations already performed still count
+		
+		//Pick up anything posted in the meantime
+		if(ring.sq_head == ring.sq_tail)
+		{
+			int tail_err = copyin(&(ring.sq_tail), &(uring->sq_tail), sizeof(ring.sq_tail));
+			if(tail_err < 0)
+				return done ? done : tail_err;
+		}
+	}
+	
+	return done;
+}
+
+//Sets or clears the sleep flag on a ring.
+static int ring_sleepflag(px_ring_t *uring, bool sleeping)
+{
+	uint64_t flags = sleeping ? PX_RING_F_SLEEP : 0;
+	return copyout(&(uring->flags), &flags, sizeof(flags));
+}
+
+//Entry point for the kernel thread polling a ring
+static void ring_poll_entry(void *data)
+{
+	(void)data;
+	
+	thread_t *tptr = thread_lockcur();
+	id_t tid = tptr->id;
+	thread_unlock(tptr);
+	
+	//Work in the userspace of the process that made us.
+	//Hear about threads leaving, so we notice if we're the last one.
+	process_t *pptr = process_lockcur();
+	hal_uspc_activate(pptr->mem->uspc);
+	notify_dst_t n = {0};
+	notify_add(&(pptr->thread_notify), &n);
+	process_unlock(pptr);
+	
+	uint64_t idle_since = timer_now();
+	while(1)
+	{
+		//Keep going as long as the process lives, still wants us polling, and has someone else to post work
+		tptr = thread_lockcur();
+		bool killed = tptr->killed;
+		thread_unlock(tptr);
+		
+		pptr = process_lockcur();
+		bool keep = !killed && pptr->state == PROCESS_STATE_ALIVE && pptr->ring_tid == tid && pptr->nthreads > 1;
+		px_ring_t *uring = (px_ring_t*)(pptr->ring_addr);
+		int64_t idle = pptr->ring_idle;
+		process_unlock(pptr);
+		
+		if(!keep)
+			break;
+		
+		int done = ring_run(uring);
+		
+		//Release anything that faults while copying replaced, now that we don't hold locks
+		mem_space_sync(process_curmem());
+		
+		if(done < 0)
+			break; //Ring isn't usable anymore
+		
+		if(done > 0)
+		{
+			futex_wake((uintptr_t)&(uring->cq_tail), INT_MAX);
+			idle_since = timer_now();
+		}
+		else if(timer_now() - idle_since >= (uint64_t)idle)
+		{
+			//Nothing posted for a while - sleep until px_ring_enter wakes us.
+			//Look once more after setting the flag, in case something was posted before userspace could see it.
+			if(ring_sleepflag(uring, true) < 0)
+				break;
+			
+			__sync_synchronize();
+			
+			px_ring_t ring;
+			if(ring_header(uring, &ring) < 0)
+				break;
+			
+			if(ring.sq_head == ring.sq_tail)
+				notify_wait();
+			
+			if(ring_sleepflag(uring, false) < 0)
+				break;
+			
+			idle_since = timer_now();
+		}
+		
+		//Only hold the CPU while nothing else wants it
+		thread_preempt();
+	}
+	
+	//Stop polling, if nobody else has already
+	pptr = process_lockcur();
+	notify_remove(&(pptr->thread_notify), &n);
+	if(pptr->ring_tid == tid)
+	{
+		pptr->ring_tid = 0;
+		pptr->ring_addr = 0;
+	}
+	process_unlock(pptr);
+	
+	process_leave();
+	thread_die();
+	KASSERT(0);
+}
+
+int ring_enter(px_ring_t *ring)
+{
+	//If a thread is polling this ring, it does the work - just make sure it's awake
+	process_t *pptr = process_lockcur();
+	id_t poller = (pptr->ring_addr == (uintptr_t)ring) ? pptr->ring_tid : 0;
+	process_unlock(pptr);
+	
+	if(poller != 0)
+	{
+		notify_thread(poller);
+		return 0;
+	}
+	
+	return ring_run(ring);
+}
+
+int ring_poll(px_ring_t *ring, int64_t idle)
+{
+	if(idle < 0)
+		return -EINVAL;
+	
+	process_t *pptr = process_lockcur();
+	if(ring == NULL)
+	{
+		//Stop any polling - the thread notices its ID is gone and leaves
+		id_t poller = pptr->ring_tid;
+		pptr->ring_tid = 0;
+		pptr->ring_addr = 0;
+		process_unlock(pptr);
+		
+		if(poller != 0)
+			notify_thread(poller);
+		
+		return 0;
+	}
+	process_unlock(pptr);
+	
+	//Make sure the ring is sensible before starting on it
+	px_ring_t header;
+	int header_err = ring_header(ring, &header);
+	if(header_err < 0)
+		return header_err;
+	
+	pptr = process_lockcur();
+	if(pptr->ring_tid != 0)
+	{
+		process_unlock(pptr);
+		return -EBUSY;
+	}
+	
+	if(pptr->state != PROCESS_STATE_ALIVE)
+	{
+		process_unlock(pptr);
+		return -EAGAIN;
+	}
+	
+	thread_t *tptr = thread_new(&ring_poll_entry, NULL);
+	if(tptr == NULL)
+	{
+		process_unlock(pptr);
+		return -EAGAIN;
+	}
+	
+	process_addthread(pptr, tptr);
+	
+	//The poller works on the process's memory, maybe on another CPU than its other threads
+	mem_space_threaded(pptr->mem);
+	
+	//The poller never handles signals, and only runs when the CPU would otherwise be idle
+	tptr->sigmask_cur = ~0l;
+	tptr->sigmask_ret = ~0l;
+	tptr->priority = PX_PRIO_BATCH;
+	
+	pptr->ring_addr = (uintptr_t)ring;
+	pptr->ring_tid = tptr->id;
+	pptr->ring_idle = idle;
+	
+	thread_unlock(tptr);
+	process_unlock(pptr);
+	return 0;
+}
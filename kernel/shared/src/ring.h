@@ -0,0 +1,26 @@
+//ring.h
+//Batches of system calls submitted through shared memory
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef RING_H
+#define RING_H
+
+#include "px.h"
+
+//Userspace posts file operations into a ring in its own memory, and has them all performed with one system call.
+//The ring is only ever accessed with copyin/copyout, so userspace can change it under us without harm.
+//Optionally a kernel thread in the process polls the ring, so no system calls are needed at all while it's busy.
+
+//Most entries allowed in each queue of a ring
+#ifndef RING_SIZE_MAX
+	#define RING_SIZE_MAX 65536
+#endif
+
+//Performs submissions posted to the given ring, or wakes the thread polling it.
+//Returns the number performed or a negative error number.
+int ring_enter(px_ring_t *ring);
+
+//Starts a kernel thread polling the given ring, or stops polling if ring is NULL.
+//Returns 0 on success or a negative error number.
+int ring_poll(px_ring_t *ring, int64_t idle);
+
+#endif //RING_H
@@ -9,6 +9,7 @@
 #include "px.h"
 
 #include "hal_exit.h"
+#include "hal_clock.h"
 
 #include "fd.h"
 #include "libcstubs.h"
@@ -19,18 +20,26 @@
 #include "elf64.h"
 #include "argenv.h"
 #include "notify.h"
+#include "merge.h"
+#include "timer.h"
+#include "futex.h"
+#include "zygote.h"
+#include "copy.h"
+#include "ring.h"
+#include "vdata.h"
+#include "syscalls.h"
 
 
-//Big todo - these need some kind of safety so they can be aborted when accessing userspace.
-//We need to ensure that a bad userspace address doesn't cause an unhandled exception in the kernel.
-//In the simplest case we could just have a copy_to_userspace function and do them all in kernel-mode.
+//Pointers passed in by userspace are never used directly - parameters are copied in, and results copied out.
+//Bulk data for reads and writes goes straight to or from the user buffer, once it's checked to lie in userspace.
 
 
 int k_px_fd_find(int at, const char *name)
 {
-	//Todo - validate memory and copy name to kernelspace safely
 	char kname[256] = {0};
-	strncpy(kname, name, 255);
+	ssize_t name_len = copyinstr(kname, name, sizeof(kname));
+	if(name_len < 0)
+		return name_len;
 	
 	//Make the new file descriptor and start it with one reference
 	id_t newid = 0;
@@ -98,6 +107,10 @@ int k_px_fd_flag(int fd, int set, int clr)
 
 ssize_t k_px_fd_read(int fd, void *buf, size_t len)
 {
+	int check_err = copy_check(buf, len);
+	if(check_err < 0)
+		return check_err;
+	
 	id_t id = process_getfdnum(fd);
 	if(id == 0)
 		return -EBADF;
@@ -107,6 +120,10 @@ ssize_t k_px_fd_read(int fd, void *buf, size_t len)
 
 ssize_t k_px_fd_write(int fd, const void *buf, size_t len)
 {
+	int check_err = copy_check(buf, len);
+	if(check_err < 0)
+		return check_err;
+	
 	id_t id = process_getfdnum(fd);
 	if(id == 0)
 		return -EBADF;
@@ -134,9 +151,10 @@ int k_px_fd_create(int at, const char *name, mode_t mode, uint64_t spec)
 	if(!any_type)
 		return -EINVAL;
 	
-	//Todo - validate memory and copy name to kernelspace safely
 	char kname[256] = {0};
-	strncpy(kname, name, 255);
+	ssize_t name_len = copyinstr(kname, name, sizeof(kname));
+	if(name_len < 0)
+		return name_len;
 	
 	id_t newid = fd_create(id, kname, mode, spec);
 	if(newid < 0)
@@ -164,7 +182,19 @@ ssize_t k_px_fd_stat(int fd, px_fd_stat_t *buf, size_t len)
 	if(id == 0)
 		return -EBADF;
 	
-	return fd_stat(id, buf, len);
+	px_fd_stat_t st = {0};
+	ssize_t result = fd_stat(id, &st, sizeof(st));
+	if(result < 0)
+		return result;
+	
+	if(len > (size_t)result)
+		len = result;
+	
+	int copy_err = copyout(buf, &st, len);
+	if(copy_err < 0)
+		return copy_err;
+	
+	return len;
 }
 
 int k_px_fd_trunc(int fd, off_t size)
@@ -190,7 +220,12 @@ int k_px_fd_unlink(int at, const char *name, int onlyfd, int rmdir)
 			return -EBADF;
 	}
 	
-	return fd_unlink(at_id, name, only_id, rmdir);
+	char kname[256] = {0};
+	ssize_t name_len = copyinstr(kname, name, sizeof(kname));
+	if(name_len < 0)
+		return name_len;
+	
+	return fd_unlink(at_id, kname, only_id, rmdir);
 }
 
 int k_px_fd_close(int fd)
@@ -203,6 +238,25 @@ int k_px_fd_close(int fd)
 	return 0;
 }
 
+int k_px_fd_zygote(int fd, int keep)
+{
+	//Templates take memory that isn't charged to anyone, so only init gets to decide what's kept
+	process_t *pptr = process_lockcur();
+	bool init = (pptr->id == 1);
+	process_unlock(pptr);
+	if(!init)
+		return -EPERM;
+	
+	id_t id = process_getfdnum(fd);
+	if(id == 0)
+		return -EBADF;
+	
+	if(keep)
+		return zygote_make(id);
+	else
+		return zygote_drop(id);
+}
+
 int k_px_fd_exec(int fd, char * const *argv, char * const *envp)
 {	
 	//Error code returned on failure (success never returns)
@@ -219,21 +273,26 @@ int k_px_fd_exec(int fd, char * const *argv, char * const *envp)
 		goto failure;
 	}
 	
-	//Make new userspace and memory-map info
-	new_mem = mem_space_new();
-	if(new_mem == NULL)
-	{
-		err_ret = -ENOMEM; //No memory for memory space info
-		goto failure;
-	}
-	
-	//Try to load the given file
+	//Start from a template of the program, if one was kept
 	uintptr_t entry = 0;
-	int elf_err = elf64_load(id, new_mem, &entry);
-	if(elf_err < 0)
+	new_mem = zygote_spawn(id, &entry);
+	if(new_mem == NULL)
 	{
-		err_ret = elf_err; //Failed to load ELF file
-		goto failure;
+		//Make new userspace and memory-map info
+		new_mem = mem_space_new();
+		if(new_mem == NULL)
+		{
+			err_ret = -ENOMEM; //No memory for memory space info
+			goto failure;
+		}
+		
+		//Try to load the given file
+		int elf_err = elf64_load(id, new_mem, &entry);
+		if(elf_err < 0)
+		{
+			err_ret = elf_err; //Failed to load ELF file
+			goto failure;
+		}
 	}
 	
 	//Try to place the argv/envp in the new memory image for the crt0 to find.
@@ -244,25 +303,35 @@ int k_px_fd_exec(int fd, char * const *argv, char * const *envp)
 		goto failure;
 	}
 	
+	//Only the calling thread survives into the new image - get rid of any others.
+	//Do this last, once the new image is ready, so a failed exec leaves the process as it was.
+	//We can still be interrupted while waiting for them, though.
+	int solo_err = process_thread_solo();
+	if(solo_err < 0)
+	{
+		err_ret = solo_err;
+		goto failure;
+	}
+	
 	//Alright, we're about to start destroying the old process image.
 	//Any possible failures after this point would be very bad and wreck the process if they occur.
 	process_t *pptr = process_lockcur();
 	KASSERT(pptr != NULL);
 	
-	//Todo - make sure all other threads in this process are dead
-		
+	//Other threads were killed off before we started
 	KASSERT(pptr->nthreads == 1); //Should only be this thread at the moment.
 	
 	//Switch over to the new memory space before deleting the old one
 	hal_uspc_activate(new_mem->uspc);
 	
-	//Get rid of old memory space of the process, including private frames
+	//Get rid of old memory space of the process, including private frames, once we're on our way
 	KASSERT(pptr->mem != NULL);
-	mem_space_delete(pptr->mem);
+	mem_space_retire(pptr->mem);
 	pptr->mem = NULL;
 	
 	//Put the new image in its place....
 	pptr->mem = new_mem;
+	vdata_setpid(pptr->mem, pptr->id);
 	pptr->entry = entry;
 	
 	//This thread drops to userspace to be the initial thread in the new program.
@@ -273,6 +342,14 @@ int k_px_fd_exec(int fd, char * const *argv, char * const *envp)
 	
 	//Drop to execute the new user-mode code.
 	process_unlock(pptr);
+	
+	//The new image probably duplicates pages already in memory - have the scanner look
+	merge_kick();
+	
+	//New program starts with clean floating-point state
+	thread_fpu_reset();
+	
+	thread_usage_exit();
 	hal_exit_fresh(entry, sp);
 	
 	//Should never get here
@@ -379,6 +456,10 @@ int k_px_exit(int status, int signal)
 
 int k_px_fd_ioctl(int fd, uint64_t request, void *ptr, size_t len)
 {
+	int check_err = copy_check(ptr, len);
+	if(check_err < 0)
+		return check_err;
+	
 	id_t id = process_getfdnum(fd);
 	if(id == 0)
 		return -EBADF;
@@ -394,6 +475,14 @@ pid_t k_px_getpid(void)
 	return id;
 }
 
+int k_px_gettid(void)
+{
+	thread_t *tptr = thread_lockcur();
+	int id = tptr->id;
+	thread_unlock(tptr);
+	return id;
+}
+
 pid_t k_px_getppid(void)
 {
 	process_t *pptr = process_lockcur();
@@ -420,26 +509,7 @@ pid_t k_px_getpgid(pid_t pid)
 
 int k_px_setpgid(pid_t pid, pid_t pgrp)
 {	
-	//If pgrp is 0, this is interpreted to mean "the group of the calling process".
-	if(pgrp == 0)
-	{
-		process_t *pptr_cur = process_lockcur();
-		pgrp = pptr_cur->pgid;
-		process_unlock(pptr_cur);
-	}
-	
-	process_t *pptr = NULL;
-	if(pid == 0)
-		pptr = process_lockcur();
-	else
-		pptr = process_getlocked(pid);
-	
-	if(pptr == NULL)
-		return -ESRCH;	
-	
-	pptr->pgid = pgrp;
-	process_unlock(pptr);
-	return 0;
+	return process_setpgid(pid, pgrp);
 }
 
 int k_px_setrlimit(int resource, const px_rlimit_t *ptr, size_t len)
@@ -452,7 +522,9 @@ int k_px_setrlimit(int resource, const px_rlimit_t *ptr, size_t len)
 	if(len > sizeof(px_rlimit_t))
 		len = sizeof(px_rlimit_t);
 	
-	memcpy(&lim, ptr, len);
+	int copy_err = copyin(&lim, ptr, len);
+	if(copy_err < 0)
+		return copy_err;
 	
 	//Current limit can never exceed max limit
 	if( (lim.cur > lim.max) || (lim.cur == RLIM_INFINITY && lim.max != RLIM_INFINITY) )
@@ -493,22 +565,46 @@ int k_px_getrlimit(int resource, px_rlimit_t *ptr, size_t len)
 	if(len > sizeof(px_rlimit_t))
 		len = sizeof(px_rlimit_t);
 	
-	memcpy(ptr, &lim, len);
+	int copy_err = copyout(ptr, &lim, len);
+	if(copy_err < 0)
+		return copy_err;
 	
 	return len;
 }
 
 int k_px_rusage(int who, px_rusage_t *ptr, size_t len)
 {
-	//Stub
-	(void)who;
-	px_rusage_t r = {0};
+	thread_usage_t u = {0};
+	if(who == PX_RUSAGE_THREAD)
+	{
+		thread_usage_exit();
+		thread_t *tptr = thread_lockcur();
+		u = tptr->usage;
+		thread_unlock(tptr);
+	}
+	else
+	{
+		int err = process_usage(who, &u);
+		if(err < 0)
+			return err;
+	}
+	
+	uint64_t uns = hal_clock_cycles_ns(u.ucycles);
+	uint64_t sns = hal_clock_cycles_ns(u.scycles);
+	px_rusage_t r = 
+	{
+		.utime_sec = uns / 1000000000ull,
+		.utime_usec = (uns % 1000000000ull) / 1000,
+		.stime_sec = sns / 1000000000ull,
+		.stime_usec = (sns % 1000000000ull) / 1000,
+		.nvcsw = u.nvcsw,
+		.nivcsw = u.nivcsw,
+	};
 	
 	if(len > sizeof(px_rusage_t))
 		len = sizeof(px_rusage_t);
 	
-	memcpy(ptr, &r, len);
-	return 0;
+	return copyout(ptr, &r, len);
 }
 
 int64_t k_px_sigmask(int how, int64_t val)
@@ -534,6 +630,9 @@ int64_t k_px_sigmask(int how, int64_t val)
 	
 	tptr->sigmask_cur &= ~((1l << 63) | (1l << SIGKILL) | (1l << SIGSTOP));
 	tptr->sigmask_ret = tptr->sigmask_cur; //Persists across return from syscall
+	if(tptr->sigpend & ~(tptr->sigmask_cur))
+		thread_work(tptr, THREAD_WORK_SIGNAL);
+	
 	thread_unlock(tptr);
 	
 	KASSERT(oldval >= 0);
@@ -546,6 +645,7 @@ int k_px_sigsuspend(int64_t tempmask)
 	//Change sigmask_cur but not sigmask_ret - so the mask gets restored after this call.
 	thread_t *tptr = thread_lockcur();
 	tptr->sigmask_cur = tempmask;
+	thread_work(tptr, THREAD_WORK_SIGNAL);
 	thread_unlock(tptr);
 	
 	//We didn't set ourselves up to be notified of anything.
@@ -560,18 +660,25 @@ int k_px_sigsuspend(int64_t tempmask)
 
 int k_px_sigsend(idtype_t to_type, int64_t to_id, int sig)
 {
-	thread_sendsig(to_type, to_id, sig);
-	return 0;
+	return thread_sendsig(to_type, to_id, sig);
 }
 
 ssize_t k_px_siginfo(px_siginfo_t *out_ptr, size_t out_len)
 {
-	thread_t *tptr = thread_lockcur();
 	if(out_len > sizeof(px_siginfo_t))
 		out_len = sizeof(px_siginfo_t);
 	
-	memcpy(out_ptr, &(tptr->siginfo), out_len);
+	//Copy out of the thread while locked, then to userspace after unlocking.
+	//Writing to userspace may fault, which needs to lock the thread again.
+	px_siginfo_t info;
+	thread_t *tptr = thread_lockcur();
+	memcpy(&info, &(tptr->siginfo), sizeof(info));
 	thread_unlock(tptr);
+	
+	int copy_err = copyout(out_ptr, &info, out_len);
+	if(copy_err < 0)
+		return copy_err;
+	
 	return out_len;
 }
 
@@ -590,6 +697,8 @@ int k_px_sigexit(void)
 	//Restore the signal mask at the time of the signal
 	tptr->sigmask_cur = tptr->siginfo.sigmask;
 	tptr->sigmask_ret = tptr->siginfo.sigmask;
+	if(tptr->sigpend & ~(tptr->sigmask_cur))
+		thread_work(tptr, THREAD_WORK_SIGNAL);
 	
 	//Clear old signal info
 	memset(&(tptr->siginfo), 0, sizeof(tptr->siginfo));
@@ -605,6 +714,8 @@ int k_px_sigexit(void)
 	//With the exit-buffer on the stack, unlock the thread's control block and return to the point it was signalled.
 	void *sp = tptr->stack_top;
 	thread_unlock(tptr);
+	thread_fpu_sigrestore();
+	thread_usage_exit();
 	hal_exit_resume(&buf, sp);
 	
 	//hal_exit_resume shouldn't return
@@ -615,13 +726,21 @@ int k_px_sigexit(void)
 
 int64_t k_px_getrtc(void)
 {
-	return -ENOSYS;
+	return vdata_getrtc();
 }
 
 int k_px_setrtc(int64_t val)
 {
-	(void)val;
-	return -ENOSYS;
+	if(val < 0)
+		return -EINVAL;
+	
+	vdata_setrtc(val);
+	return 0;
+}
+
+intptr_t k_px_vdata(int page)
+{
+	return vdata_addr(page);
 }
 
 void postfork(void *data)
@@ -637,6 +756,7 @@ void postfork(void *data)
 	thread_unlock(tptr);
 	
 	//Drop to the requested userspace address
+	thread_usage_exit();
 	hal_exit_fresh((uintptr_t)data, sp);
 }
 
@@ -645,10 +765,19 @@ pid_t k_px_fork(uintptr_t child_entry_pc)
 	//Error returned on failure
 	pid_t err_ret = 0;
 	
+	//The new thread starts with a copy of our FPU state, if we've been using it
+	void *fpu_buf = NULL;
+	int fpu_err = thread_fpu_dup(&fpu_buf);
+	if(fpu_err < 0)
+		return fpu_err;
+	
 	//Find room for a new process
 	process_t *new_pptr = process_locknew();
 	if(new_pptr == NULL)
+	{
+		thread_fpu_free(fpu_buf);
 		return -EAGAIN;
+	}
 	
 	//We'll duplicate the calling process and thread.
 	//Lock them both.
@@ -669,6 +798,7 @@ pid_t k_px_fork(uintptr_t child_entry_pc)
 		err_ret = -ENOMEM;
 		goto failure;
 	}
+	vdata_setpid(new_pptr->mem, new_pptr->id);
 	
 	//Allocate array for file descriptors
 	KASSERT(new_pptr->fd_array == NULL);
@@ -689,8 +819,9 @@ pid_t k_px_fork(uintptr_t child_entry_pc)
 		goto failure;
 	}
 	
-	newthread->process = new_pptr;
-	new_pptr->nthreads = 1;
+	process_addthread(new_pptr, newthread);
+	newthread->fpu_buf = fpu_buf;
+	process_addchild(old_pptr, new_pptr);
 	
 	//Copy over file descriptor numbers.
 	//There should be no failure here - file descriptors shouldn't disappear while we lock a process that still refers to them.
@@ -723,6 +854,9 @@ pid_t k_px_fork(uintptr_t child_entry_pc)
 	process_unlock(old_pptr);
 	thread_unlock(old_tptr);
 	
+	//Make the new process findable by its group, now that we don't hold any process locks
+	process_pgrp_join(retval);
+	
 	//Return ID of process created
 	return retval;
 	
@@ -751,19 +885,33 @@ failure:
 		new_pptr->fd_count = 0;
 	}
 	
-	new_pptr->state = PROCESS_STATE_NONE;
-	process_unlock(new_pptr);
+	process_free(new_pptr);
 	process_unlock(old_pptr);
 	thread_unlock(old_tptr);
 	
+	thread_fpu_free(fpu_buf);
+	
 	KASSERT(err_ret < 0);
 	return err_ret;
 }
 
 int k_px_nanosleep(int64_t ns)
 {
-	(void)ns;
-	return -EINTR;
+	if(ns < 0)
+		return -EINVAL;
+	
+	//Wait for a notify that will never come, except for a timeout or a signal.
+	//Notifies left over from anything else we were waiting on just wake us up early - keep waiting.
+	uint64_t deadline = timer_now() + ns;
+	while(1)
+	{
+		int wait_err = notify_timedwait(deadline);
+		if(wait_err == -ETIMEDOUT)
+			return 0;
+		
+		if(wait_err < 0)
+			return wait_err;
+	}
 }
 
 ssize_t k_px_wait(idtype_t id_type, int64_t id, int options, px_wait_t *ptr, size_t len)
@@ -778,39 +926,122 @@ ssize_t k_px_wait(idtype_t id_type, int64_t id, int options, px_wait_t *ptr, siz
 	if(len > sizeof(buf))
 		len = sizeof(buf);
 	
-	memcpy(ptr, &buf, len);
+	int copy_err = copyout(ptr, &buf, len);
+	if(copy_err < 0)
+		return copy_err;
+	
 	return len;
 }
 
+int k_px_thread_create(uintptr_t entry_pc, uintptr_t stack_ptr, uintptr_t tls_ptr, uintptr_t arg)
+{
+	return process_thread_new(entry_pc, stack_ptr, tls_ptr, arg);
+}
+
+void k_px_thread_exit(void)
+{
+	//Pull this thread out of the process. If it's the last one, the process is dead.
+	process_leave();
+	
+	//Terminate the calling thread now that it's out of the process.
+	thread_die();
+	KASSERT(0);
+}
+
+int k_px_thread_join(int tid)
+{
+	return process_thread_join(tid);
+}
+
+int k_px_futex_wait(volatile uint64_t *word, uint64_t expected, int64_t timeout)
+{
+	return futex_wait((uintptr_t)word, expected, timeout);
+}
+
+int k_px_futex_wake(volatile uint64_t *word, int count)
+{
+	return futex_wake((uintptr_t)word, count);
+}
+
+//Resolves the ID -1, meaning "this", for calls that act on threads by thread/process/pgrp ID.
+static id_t k_px_selfid(idtype_t id_type, int64_t id)
+{
+	if(id != -1)
+		return id;
+	
+	if(id_type == P_TID)
+	{
+		thread_t *tptr = thread_lockcur();
+		id = tptr->id;
+		thread_unlock(tptr);
+	}
+	else if(id_type == P_PID || id_type == P_PGID)
+	{
+		process_t *pptr = process_lockcur();
+		id = (id_type == P_PID) ? pptr->id : pptr->pgid;
+		process_unlock(pptr);
+	}
+	
+	return id;
+}
+
 int k_px_priority(idtype_t id_type, int64_t id, int prval)
 {
-	(void)id_type;
-	(void)id;
-	(void)prval;
-	return -ENOSYS;
+	return thread_priority(id_type, k_px_selfid(id_type, id), prval);
+}
+
+int k_px_affinity(idtype_t id_type, int64_t id, const px_cpuset_t *set_ptr, px_cpuset_t *old_ptr)
+{
+	//Copy the new set before looking at any threads
+	px_cpuset_t set;
+	if(set_ptr != NULL)
+	{
+		int copy_err = copyin(&set, set_ptr, sizeof(set));
+		if(copy_err < 0)
+			return copy_err;
+	}
+	
+	px_cpuset_t old;
+	int retval = thread_affinity(id_type, k_px_selfid(id_type, id), (set_ptr != NULL) ? &set : NULL, &old);
+	if(retval < 0)
+		return retval;
+	
+	if(old_ptr != NULL)
+		return copyout(old_ptr, &old, sizeof(old));
+	
+	return 0;
+}
+
+ssize_t k_px_sched_stat(px_sched_stat_t *out_ptr, size_t out_len)
+{
+	if(out_len > sizeof(px_sched_stat_t))
+		out_len = sizeof(px_sched_stat_t);
+	
+	px_sched_stat_t st = {0};
+	thread_getstat(&st);
+	int copy_err = copyout(out_ptr, &st, out_len);
+	if(copy_err < 0)
+		return copy_err;
+	
+	return out_len;
 }
 
 int64_t k_px_timer_set(timer_t id, int flags, int64_t value_ns, int64_t interval_ns)
 {
-	(void)id;
-	(void)flags;
-	(void)value_ns;
-	(void)interval_ns;
-	return -ENOSYS;
+	if(flags != 0)
+		return -EINVAL;
+	
+	return process_timer_set(id, value_ns, interval_ns);
 }
 
 int64_t k_px_timer_get(timer_t id)
 {
-	(void)id;
-	return -ENOSYS;
+	return process_timer_get(id);
 }
 
 intptr_t k_px_mem_avail(uintptr_t around, size_t size)
 {
-	process_t *pptr = process_lockcur();
-	intptr_t retval = mem_space_avail(pptr->mem, around, size);
-	process_unlock(pptr);
-	return retval;
+	return mem_space_avail(process_curmem(), around, size);
 }
 
 int k_px_mem_anon(uintptr_t start, size_t size, int prot)
@@ -819,15 +1050,46 @@ int k_px_mem_anon(uintptr_t start, size_t size, int prot)
 	if(prot & PX_MEM_X)
 		return -EPERM;
 	
-	if(prot & ~(PX_MEM_R | PX_MEM_W | PX_MEM_X))
+	if(prot & ~(PX_MEM_R | PX_MEM_W | PX_MEM_X | PX_MEM_HUGE))
 		return -EINVAL;
 	
-	process_t *pptr = process_lockcur();
-	int retval = mem_space_add(pptr->mem, start, size, prot);
-	process_unlock(pptr);
+	int flags = 0;
+	if(prot & PX_MEM_HUGE)
+		flags |= MEM_ADD_HUGE;
+	
+	prot &= ~PX_MEM_HUGE;
+	
+	//Release anything replaced by huge pages, in case other threads' CPUs cached it
+	mem_space_t *mptr = process_curmem();
+	int retval = mem_space_add(mptr, start, size, prot, flags);
+	mem_space_sync(mptr);
 	return retval;
 }
 
+ssize_t k_px_mem_stat(px_mem_stat_t *out_ptr, size_t out_len)
+{
+	if(out_len > sizeof(px_mem_stat_t))
+		out_len = sizeof(px_mem_stat_t);
+	
+	px_mem_stat_t st = {0};
+	mem_getstat(&st);
+	int copy_err = copyout(out_ptr, &st, out_len);
+	if(copy_err < 0)
+		return copy_err;
+	
+	return out_len;
+}
+
+int k_px_ring_enter(px_ring_t *ring)
+{
+	return ring_enter(ring);
+}
+
+int k_px_ring_poll(px_ring_t *ring, int64_t idle)
+{
+	return ring_poll(ring, idle);
+}
+
 uint64_t syscalls_switch(uint64_t call, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, uint64_t p5)
 {
 	//Use macro-trick to call the appropriate function based on system-call number.
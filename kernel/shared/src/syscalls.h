@@ -5,8 +5,23 @@
 #define SYSCALLS_H
 
 #include <stdint.h>
+#include <sys/types.h>
+
+#include "px.h"
 
 //Acts on a system-call action with the given parameters.
 uint64_t syscalls_switch(uint64_t call, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, uint64_t p5);
 
+//File operations, also performed on behalf of userspace when submitted through a ring.
+//Pointers passed must be in the calling process's userspace, as with the system calls.
+int k_px_fd_find(int at, const char *name);
+ssize_t k_px_fd_read(int fd, void *buf, size_t len);
+ssize_t k_px_fd_write(int fd, const void *buf, size_t len);
+off_t k_px_fd_seek(int fd, off_t off, int whence);
+int k_px_fd_create(int at, const char *name, mode_t mode, uint64_t spec);
+ssize_t k_px_fd_stat(int fd, px_fd_stat_t *buf, size_t len);
+int k_px_fd_trunc(int fd, off_t size);
+int k_px_fd_unlink(int at, const char *name, int onlyfd, int rmdir);
+int k_px_fd_close(int fd);
+
 #endif //SYSCALLS_H
@@ -4,6 +4,8 @@
 
 #include "systar.h"
 #include "kassert.h"
+#include "fd.h"
+#include "process.h"
 #include "kspace.h"
 #include "libcstubs.h"
 #include "hal_bootfile.h"
@@ -116,9 +118,9 @@ void systar_unpack_file(int fnum)
 		}
 		
 		//Parse each non-final pathname component. Make sure the directories exist. Change into them, starting from root.
-		extern int k_px_fd_find();
-		int dir_fd = k_px_fd_find(-1, "/");
-		KASSERT(dir_fd >= 0);
+		//Work on file descriptors directly - the names and contents are in kernel memory, which the syscalls won't take.
+		id_t dir_fd = fd_find(process_getfdpwd(), "/");
+		KASSERT(dir_fd > 0);
 		while(1)
 		{
 			const char *slash = strchr(path_remain, '/');
@@ -139,20 +141,18 @@ void systar_unpack_file(int fnum)
 			}
 			
 			//Try to look up that directory
-			int next_dir_fd = k_px_fd_find(dir_fd, dirname);
+			id_t next_dir_fd = fd_find(dir_fd, dirname);
 			
 			//Make it, if it doesn't exist
 			if(next_dir_fd < 0)
 			{
-				extern int k_px_fd_create();
-				next_dir_fd = k_px_fd_create(dir_fd, dirname, S_IFDIR | 0755, 0);
+				next_dir_fd = fd_create(dir_fd, dirname, S_IFDIR | 0755, 0);
 			}
 			
-			KASSERT(next_dir_fd >= 0);
+			KASSERT(next_dir_fd > 0);
 			
 			//Close the previous one and advance
-			extern int k_px_fd_close();
-			k_px_fd_close(dir_fd);
+			fd_decr(dir_fd);
 			dir_fd = next_dir_fd;
 			
 			path_remain = slash + 1;
@@ -164,26 +164,22 @@ void systar_unpack_file(int fnum)
 		//Directories in TAR files can end with a "/", in which case, we're already done.
 		if(strlen(path_remain) > 0)
 		{
-			extern int k_px_fd_create();
-			int file_fd = k_px_fd_create(dir_fd, path_remain, mode, spec);
-			KASSERT(file_fd >= 0);
+			id_t file_fd = fd_create(dir_fd, path_remain, mode, spec);
+			KASSERT(file_fd > 0);
 			
 			//Write the contents into the file
 			if(S_ISREG(mode))
 			{
-				extern int k_px_fd_write();
-				ssize_t written = k_px_fd_write(file_fd, block_bytes, file_size);
+				ssize_t written = fd_write(file_fd, block_bytes, file_size);
 				KASSERT(written == file_size);
 			}
 			
 			//Close the file
-			extern int k_px_fd_close();
-			k_px_fd_close(file_fd);
+			fd_decr(file_fd);
 		}
 		
 		//Close the directory where we made the file
-		extern int k_px_fd_close();
-		k_px_fd_close(dir_fd);
+		fd_decr(dir_fd);
 		
 		//Advance past the file contents in the TAR
 		size_t file_blocks = (file_size + 511) / 512;
@@ -0,0 +1,191 @@
+//teardown.c
+//Deferred teardown of large objects
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "teardown.h"
+#include "kassert.h"
+#include "libcstubs.h"
+#include "notify.h"
+#include "thread.h"
+
+#include "hal_cpu.h"
+#include "hal_frame.h"
+#include "hal_spl.h"
+
+#include <stdbool.h>
+
+//Queue of jobs for the worker on each CPU
+typedef struct teardown_cpu_s
+{
+	//Spinlock protecting the queue
+	hal_spl_t spl;
+	
+	//Jobs waiting, oldest first
+	teardown_job_t *head;
+	teardown_job_t *tail;
+	
+	//Whether the worker has been started
+	bool started;
+	
+	//Notification for waking the worker
+	notify_src_t notify;
+	notify_dst_t dst;
+	
+} teardown_cpu_t;
+static teardown_cpu_t teardown_cpu_array[HAL_CPU_MAX];
+
+//Pages waiting to be freed by queued jobs, and statistics, and spinlock protecting them.
+//Taken after any queue lock.
+static hal_spl_t teardown_stat_spl;
+static uint64_t teardown_pending;
+static uint64_t teardown_stat_deferred;
+static uint64_t teardown_stat_inline;
+
+//Takes the oldest job off of the given CPU's queue, or returns NULL if there's none.
+static teardown_job_t *teardown_pop(teardown_cpu_t *cptr)
+{
+	hal_spl_lock(&(cptr->spl));
+	teardown_job_t *job = cptr->head;
+	if(job != NULL)
+	{
+		cptr->head = job->next;
+		if(cptr->head == NULL)
+			cptr->tail = NULL;
+		
+		job->next = NULL;
+	}
+	hal_spl_unlock(&(cptr->spl));
+	return job;
+}
+
+//Finishes a job taken off of a queue.
+//Returns the estimated number of pages freed.
+static size_t teardown_run(teardown_job_t *job)
+{
+	//The job is part of the object it tears down, so it's gone afterwards
+	size_t pages = job->pages;
+	job->func(job);
+	
+	hal_spl_lock(&teardown_stat_spl);
+	KASSERT(teardown_pending >= pages);
+	teardown_pending -= pages;
+	hal_spl_unlock(&teardown_stat_spl);
+	
+	return pages;
+}
+
+//Entry point of the worker on each CPU
+static void teardown_main(void *data)
+{
+	teardown_cpu_t *cptr = (teardown_cpu_t*)data;
+	hal_spl_lock(&(cptr->spl));
+	notify_add(&(cptr->notify), &(cptr->dst));
+	hal_spl_unlock(&(cptr->spl));
+	
+	while(1)
+	{
+		teardown_job_t *job = teardown_pop(cptr);
+		if(job == NULL)
+		{
+			notify_wait();
+			continue;
+		}
+		
+		teardown_run(job);
+	}
+}
+
+void teardown_initcpu(void)
+{
+	int cpu = hal_cpu_num();
+	teardown_cpu_t *cptr = &(teardown_cpu_array[cpu]);
+	
+	thread_t *tptr = thread_new(&teardown_main, cptr);
+	if(tptr == NULL)
+	{
+		//No worker - jobs on this CPU just get done right away
+		return;
+	}
+	
+	//Keep the worker with the CPU that queues its jobs, where the objects are still warm in cache
+	memset(&(tptr->affinity), 0, sizeof(tptr->affinity));
+	tptr->affinity.bits[cpu / 64] |= 1ull << (cpu % 64);
+	thread_unlock(tptr);
+	
+	hal_spl_lock(&(cptr->spl));
+	cptr->started = true;
+	hal_spl_unlock(&(cptr->spl));
+}
+
+void teardown_defer(teardown_job_t *job, void (*func)(teardown_job_t *job), size_t pages)
+{
+	job->func = func;
+	job->pages = pages;
+	job->next = NULL;
+	
+	//Only queue the job if the memory it frees won't be missed in the meantime
+	bool low = hal_frame_count() < TEARDOWN_LOW_FRAMES;
+	
+	teardown_cpu_t *cptr = &(teardown_cpu_array[hal_cpu_num()]);
+	hal_spl_lock(&(cptr->spl));
+	
+	bool queue = false;
+	if(cptr->started)
+	{
+		hal_spl_lock(&teardown_stat_spl);
+		queue = !low && (teardown_pending + pages <= TEARDOWN_PENDING_MAX);
+		if(queue)
+		{
+			teardown_pending += pages;
+			teardown_stat_deferred++;
+		}
+		hal_spl_unlock(&teardown_stat_spl);
+	}
+	
+	if(queue)
+	{
+		if(cptr->tail != NULL)
+			cptr->tail->next = job;
+		else
+			cptr->head = job;
+		
+		cptr->tail = job;
+		notify_send(&(cptr->notify));
+	}
+	
+	hal_spl_unlock(&(cptr->spl));
+	
+	//If we couldn't queue it, pay for it now
+	if(!queue)
+	{
+		hal_spl_lock(&teardown_stat_spl);
+		teardown_stat_inline++;
+		hal_spl_unlock(&teardown_stat_spl);
+		
+		func(job);
+	}
+}
+
+size_t teardown_help(void)
+{
+	size_t freed = 0;
+	int ncpu = hal_cpu_count();
+	for(int cc = 0; cc < ncpu; cc++)
+	{
+		teardown_job_t *job = NULL;
+		while((job = teardown_pop(&(teardown_cpu_array[cc]))) != NULL)
+		{
+			freed += teardown_run(job);
+		}
+	}
+	return freed;
+}
+
+void teardown_getstat(px_mem_stat_t *out)
+{
+	hal_spl_lock(&teardown_stat_spl);
+	out->teardown_pending = teardown_pending;
+	out->teardown_deferred = teardown_stat_deferred;
+	out->teardown_inline = teardown_stat_inline;
+	hal_spl_unlock(&teardown_stat_spl);
+}
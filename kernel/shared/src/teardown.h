@@ -0,0 +1,53 @@
+//teardown.h
+//Deferred teardown of large objects
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef TEARDOWN_H
+#define TEARDOWN_H
+
+#include "px.h"
+#include <stddef.h>
+
+//Freeing the memory of an exiting process, or the pages of a deleted file, can take a long time.
+//Rather than making exit and unlink wait on it, the object is queued for a worker thread on the same CPU to finish.
+//Pages waiting to be freed are counted, and callers do the work themselves once too many are waiting or memory is low.
+
+//Number of pages waiting to be freed, beyond which teardown is done immediately rather than queued
+#ifndef TEARDOWN_PENDING_MAX
+	#define TEARDOWN_PENDING_MAX 65536
+#endif
+
+//Number of free frames below which teardown is done immediately rather than queued
+#ifndef TEARDOWN_LOW_FRAMES
+	#define TEARDOWN_LOW_FRAMES 4096
+#endif
+
+//Object queued for teardown. Embedded in the object being torn down.
+typedef struct teardown_job_s
+{
+	//Function that finishes tearing down the object
+	void (*func)(struct teardown_job_s *job);
+	
+	//Estimate of how many pages finishing the job will free
+	size_t pages;
+	
+	//Link in queue
+	struct teardown_job_s *next;
+	
+} teardown_job_t;
+
+//Starts the teardown worker for the calling CPU.
+void teardown_initcpu(void);
+
+//Arranges for the given function to be called on the given job, to finish tearing down the object containing it.
+//The caller must have made the object unreachable already; nothing else may touch it until the function runs.
+//Calls the function immediately, if there's no worker to take it or too much memory is waiting to be freed.
+void teardown_defer(teardown_job_t *job, void (*func)(teardown_job_t *job), size_t pages);
+
+//Finishes queued teardown jobs from any CPU in the caller, as when memory is needed right away.
+//Returns the estimated number of pages freed.
+size_t teardown_help(void);
+
+//Fills in statistics about deferred teardown.
+void teardown_getstat(px_mem_stat_t *out);
+
+#endif //TEARDOWN_H
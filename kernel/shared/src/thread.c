@@ -6,14 +6,104 @@
 #include "kspace.h"
 #include "process.h"
 #include "kassert.h"
+#include "idtab.h"
 #include "libcstubs.h"
 #include "hal_intr.h"
 #include "hal_ktls.h"
 #include "hal_frame.h"
+#include "hal_cpu.h"
+#include "hal_clock.h"
+#include "hal_atomic.h"
+#include "hal_fpu.h"
+#include "timer.h"
+#include <errno.h>
 
 //Thread table
-static thread_t *thread_array;
-static int thread_count;
+static idtab_t thread_tab;
+
+//Scheduling classes.
+//Normal threads share the CPU round-robin, with longer time-slices for better priorities.
+//Batch threads only run when no normal threads are waiting for the CPU.
+#define THREAD_CLASS_NORMAL 0
+#define THREAD_CLASS_BATCH 1
+#define THREAD_CLASS_MAX 2
+
+//List of threads of one class, in the order they became ready
+typedef struct thread_runq_list_s
+{
+	thread_t *head;
+	thread_t *tail;
+	int count;
+	
+} thread_runq_list_t;
+
+//Queue of threads ready to run on a CPU
+typedef struct thread_runq_s
+{
+	//Spinlock protecting the queue. Taken after any thread lock.
+	hal_spl_t spl;
+	
+	//Threads in the queue, by class, and total count
+	thread_runq_list_t list[THREAD_CLASS_MAX];
+	int count;
+	
+	//Whether the CPU is looking for a thread to run or halted, rather than running one.
+	//Set and cleared under the queue's lock, so anyone queueing work afterwards sees it.
+	//Others may peek at it without the lock, but only to skip CPUs that look busy.
+	bool idle;
+	
+	//Timer marking the end of the running thread's time-slice, and whether it's gone off
+	timer_event_t slice;
+	bool expired;
+	
+	//Context of the CPU's scheduling loop, which threads switch back to when there's nothing else to run
+	hal_ctx_t *sched_ctx;
+	
+	//Thread that the CPU just switched away from, still locked, for whatever it switched to to finish off
+	thread_t *prev;
+	
+	//Thread the CPU is running, or NULL in the scheduling loop. Changed only by the CPU itself, under the queue's lock.
+	thread_t *running;
+	
+	//Thread woken by the running thread to take over from it, ready but not queued anywhere, if any.
+	//Runs next when the running thread yields. Only the CPU itself uses this.
+	thread_t *handoff;
+	
+	//Thread whose FPU state was last loaded on the CPU, and whether it's using it now (i.e. the FPU doesn't trap).
+	//Only the CPU itself uses these.
+	thread_t *fpu_owner;
+	bool fpu_live;
+	
+} thread_runq_t;
+
+//Run queue for each CPU
+static thread_runq_t thread_runq_array[HAL_CPU_MAX];
+
+static void thread_switch_finish(void);
+static void thread_fpu_out(thread_runq_t *rptr);
+static void thread_fpu_in(thread_runq_t *rptr, thread_t *cur);
+
+//Word that an idle CPU watches for new work.
+//Each gets a cache line to itself, so only wakeups disturb the watching CPU.
+typedef struct thread_idle_s
+{
+	//Changed to wake the CPU
+	hal_atomic_t seq;
+	
+	//Time when the CPU was first asked to wake up, in nanoseconds, or 0 if it hasn't been since it last did
+	uint64_t kicked;
+	
+	uint8_t pad[48];
+	
+} thread_idle_t;
+static thread_idle_t thread_idle_array[HAL_CPU_MAX] __attribute__((aligned(64)));
+
+//Statistics about waking idle CPUs, and spinlock protecting them
+static hal_spl_t thread_stat_spl;
+static uint64_t thread_stat_wakes;
+static uint64_t thread_stat_wake_ns;
+static uint64_t thread_stat_wake_ipis;
+static uint64_t thread_stat_handoffs;
 
 //First code executed when switching to new threads, before their entry function.
 void thread_preentry(void)
@@ -23,6 +113,9 @@ void thread_preentry(void)
 	void (*entry_func)(void *data) = tptr->entry_func;
 	void *entry_data = tptr->entry_data;
 	
+	//Deal with whatever ran on the CPU before us
+	thread_switch_finish();
+	
 	//Release thread control block (locked when context-switching in) and execute thread at entry point
 	thread_unlock(tptr);
 	(*entry_func)(entry_data);
@@ -31,43 +124,423 @@ void thread_preentry(void)
 	KASSERT(0);
 }
 
-void thread_init(void)
+//Called by a CPU's timer when the thread it's running has used up its time-slice.
+static void thread_slice_expired(void *arg)
 {
-	int threads = 256; //Todo - allow adjusting with a command line or something
-	thread_array = kspace_alloc(sizeof(thread_t) * threads, alignof(thread_t));
-	KASSERT(thread_array != NULL);
-	thread_count = threads;
+	thread_runq_t *rptr = (thread_runq_t*)arg;
+	rptr->expired = true;
+	
+	//Have the running thread notice when it next heads back to user code.
+	//Only this CPU changes what it's running, so no need to lock the queue to look.
+	if(rptr->running != NULL)
+		thread_work(rptr->running, THREAD_WORK_PREEMPT);
 }
 
-static thread_t *thread_locknew(void)
+//Returns the scheduling class for a thread at the given priority.
+static int thread_class(int priority)
+{
+	return (priority >= PX_PRIO_BATCH) ? THREAD_CLASS_BATCH : THREAD_CLASS_NORMAL;
+}
+
+//Returns the length of time-slice given to a thread at the given priority, in nanoseconds.
+//Normal threads get the default slice at the default priority, twice that at priority 0, scaling down to 1/20 at the worst.
+//Batch threads get the default slice, but give way to normal threads as soon as they notice any.
+static uint64_t thread_slice_ns(int priority)
 {
-	for(int tt = 0; tt < thread_count; tt++)
+	uint64_t slice = THREAD_SLICE_US * 1000ull;
+	if(thread_class(priority) != THREAD_CLASS_NORMAL)
+		return slice;
+	
+	return slice * (PX_PRIO_BATCH - priority) / (PX_PRIO_BATCH - PX_PRIO_DEFAULT);
+}
+
+//Returns whether the given thread may run on the given CPU.
+static bool thread_cpu_ok(const thread_t *tptr, int cpu)
+{
+	return (tptr->affinity.bits[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+//Returns a CPU for the given thread to run on - the preferred one if allowed, or the first allowed otherwise.
+static int thread_cpu_pick(const thread_t *tptr, int pref)
+{
+	if(thread_cpu_ok(tptr, pref))
+		return pref;
+	
+	int ncpu = hal_cpu_count();
+	for(int cc = 0; cc < ncpu; cc++)
 	{
-		//Try to lock this array entry, but give up if contested
-		if(hal_spl_try(&(thread_array[tt].spl)))
-		{
-			if(thread_array[tt].state == THREAD_STATE_NONE)
-			{
-				//Found a free spot.
-				//Give the thread an ID that maps to its spot in the table.
-				if( (thread_array[tt].id % thread_count) != tt )
-					thread_array[tt].id = tt;
-				
-				//Advance ID every time we use a table entry
-				thread_array[tt].id += thread_count;
-				
-				return &(thread_array[tt]);
-			}
-			
-			//Not free, keep looking
-			hal_spl_unlock(&(thread_array[tt].spl));
-		}
+		if(thread_cpu_ok(tptr, cc))
+			return cc;
+	}
+	
+	//Affinity doesn't include any CPU that exists - shouldn't be allowed to happen, but run it somewhere.
+	return pref;
+}
+
+//Starts a new time-slice for the thread running on the calling CPU.
+static void thread_slice_start(thread_runq_t *rptr, int priority)
+{
+	rptr->expired = false;
+	rptr->slice.func = &thread_slice_expired;
+	rptr->slice.arg = rptr;
+	timer_arm(&(rptr->slice), timer_now() + thread_slice_ns(priority));
+}
+
+//Adds a ready thread to the end of the given CPU's run queue, in the class for its priority.
+//Returns whether the CPU was idle at the time.
+static bool thread_runq_push(thread_t *tptr, int cpu)
+{
+	KASSERT(tptr->state == THREAD_STATE_READY);
+	KASSERT(tptr->runq_next == NULL);
+	KASSERT(cpu >= 0 && cpu < HAL_CPU_MAX);
+	
+	thread_runq_t *rptr = &(thread_runq_array[cpu]);
+	thread_runq_list_t *lptr = &(rptr->list[thread_class(tptr->priority)]);
+	hal_spl_lock(&(rptr->spl));
+	if(lptr->tail == NULL)
+		lptr->head = tptr;
+	else
+		lptr->tail->runq_next = tptr;
+	
+	lptr->tail = tptr;
+	lptr->count++;
+	rptr->count++;
+	bool idle = rptr->idle;
+	
+	//A batch thread running there gives way to normal threads as soon as it notices any - make sure it looks.
+	//Its priority might change under us, but changing priority flags it anyway.
+	thread_t *running = rptr->running;
+	if(running != NULL && thread_class(tptr->priority) == THREAD_CLASS_NORMAL && thread_class(running->priority) == THREAD_CLASS_BATCH)
+		thread_work(running, THREAD_WORK_PREEMPT);
+	
+	hal_spl_unlock(&(rptr->spl));
+	return idle;
+}
+
+//Wakes an idle CPU, so it looks for threads to run.
+static void thread_idle_wake(int cpu)
+{
+	thread_idle_t *iptr = &(thread_idle_array[cpu]);
+	if(iptr->kicked == 0)
+		iptr->kicked = hal_clock_ns();
+	
+	if(THREAD_IDLE_WATCH && hal_intr_canwatch())
+	{
+		//The CPU is watching its word, so a store is enough. No interrupt needed.
+		hal_atomic_inc(&(iptr->seq));
+		return;
+	}
+	
+	hal_intr_wake(cpu);
+	
+	hal_spl_lock(&thread_stat_spl);
+	thread_stat_wake_ipis++;
+	hal_spl_unlock(&thread_stat_spl);
+}
+
+//Notes that an idle CPU picked up a thread, and how long it took since it was asked to.
+static void thread_idle_woke(int cpu)
+{
+	thread_idle_t *iptr = &(thread_idle_array[cpu]);
+	if(iptr->kicked == 0)
+		return;
+	
+	uint64_t now = hal_clock_ns();
+	uint64_t elapsed = (now > iptr->kicked) ? (now - iptr->kicked) : 0;
+	iptr->kicked = 0;
+	
+	hal_spl_lock(&thread_stat_spl);
+	thread_stat_wakes++;
+	thread_stat_wake_ns += elapsed;
+	hal_spl_unlock(&thread_stat_spl);
+}
+
+//Makes sure some CPU gets around to running a thread just queued on the given CPU.
+//Wakes at most one CPU, and none if the queueing CPU will get to it on its own.
+static void thread_runq_kick(const thread_t *tptr, int cpu, bool idle)
+{
+	int self = hal_cpu_num();
+	if(idle)
+	{
+		//The CPU is idle, so it'll run the thread as soon as it notices - wake it, unless that's us.
+		if(cpu != self)
+			thread_idle_wake(cpu);
+		
+		return;
+	}
+	
+	//The CPU is busy with another thread. Get an idle CPU to steal the work, if there is one.
+	//If we're idle ourselves (i.e. a timer went off while halted), we'll steal it on our own.
+	if(thread_runq_array[self].idle && thread_cpu_ok(tptr, self))
+		return;
+	
+	int ncpu = hal_cpu_count();
+	for(int cc = 1; cc < ncpu; cc++)
+	{
+		int other = (cpu + cc) % ncpu;
+		thread_runq_t *optr = &(thread_runq_array[other]);
+		if(other == self || !optr->idle || !thread_cpu_ok(tptr, other))
+			continue;
+		
+		//Mark it busy, so other wakeups before it gets going pick on someone else.
+		//Someone else might have got there first, though.
+		hal_spl_lock(&(optr->spl));
+		bool claimed = optr->idle;
+		optr->idle = false;
+		hal_spl_unlock(&(optr->spl));
+		if(!claimed)
+			continue;
+		
+		thread_idle_wake(other);
+		return;
+	}
+	
+	//Everyone's busy. The thread will run when its CPU's current thread blocks or is preempted.
+}
+
+//Removes the first thread of the given class that may run on the given CPU, from a run queue that should already be locked.
+//Returns NULL if there's no such thread.
+static thread_t *thread_runq_pop(thread_runq_t *rptr, int cls, int cpu)
+{
+	thread_runq_list_t *lptr = &(rptr->list[cls]);
+	thread_t *prev = NULL;
+	thread_t *tptr = lptr->head;
+	while(tptr != NULL && !thread_cpu_ok(tptr, cpu))
+	{
+		prev = tptr;
+		tptr = tptr->runq_next;
+	}
+	
+	if(tptr == NULL)
+		return NULL;
+	
+	if(prev == NULL)
+		lptr->head = tptr->runq_next;
+	else
+		prev->runq_next = tptr->runq_next;
+	
+	if(lptr->tail == tptr)
+		lptr->tail = prev;
+	
+	lptr->count--;
+	rptr->count--;
+	tptr->runq_next = NULL;
+	return tptr;
+}
+
+//Steals a thread of the given class to run on the given CPU, from other CPUs that have more than they're getting to.
+//Returns the thread, not yet locked, or NULL if there's nothing to steal.
+static thread_t *thread_runq_steal(int cls, int cpu)
+{
+	//Look at other CPUs, starting after us so we don't all pick on the same one.
+	//An idle CPU will take its own work, so only steal from busy CPUs, or ones with a backlog.
+	int ncpu = hal_cpu_count();
+	for(int cc = 1; cc < ncpu; cc++)
+	{
+		thread_runq_t *victim = &(thread_runq_array[(cpu + cc) % ncpu]);
+		if(victim->list[cls].count == 0)
+			continue;
+		
+		if(victim->idle && victim->count < 2)
+			continue;
+		
+		if(!hal_spl_try(&(victim->spl)))
+			continue;
+		
+		thread_t *tptr = thread_runq_pop(victim, cls, cpu);
+		hal_spl_unlock(&(victim->spl));
+		if(tptr != NULL)
+			return tptr;
+	}
+	
+	return NULL;
+}
+
+//Takes a thread to run on the given CPU.
+//Normal threads go before batch threads, even ones we have to steal.
+//Within each class, prefers threads queued on that CPU, before stealing from others.
+//Returns the thread, not yet locked, or NULL if there's nothing to run.
+static thread_t *thread_runq_take(int cpu)
+{
+	thread_runq_t *rptr = &(thread_runq_array[cpu]);
+	for(int cls = 0; cls < THREAD_CLASS_MAX; cls++)
+	{
+		hal_spl_lock(&(rptr->spl));
+		thread_t *tptr = thread_runq_pop(rptr, cls, cpu);
+		hal_spl_unlock(&(rptr->spl));
+		if(tptr != NULL)
+			return tptr;
+		
+		tptr = thread_runq_steal(cls, cpu);
+		if(tptr != NULL)
+			return tptr;
 	}
 	
-	//No room in thread table
 	return NULL;
 }
 
+//Picks the next thread to run on the given CPU, and locks it. Returns NULL if there's nothing to run.
+static thread_t *thread_runq_next(int cpu)
+{
+	while(1)
+	{
+		thread_t *tptr = thread_runq_take(cpu);
+		if(tptr == NULL)
+			return NULL;
+		
+		//Threads stay ready while they're queued, so it's still ready once we lock it.
+		hal_spl_lock(&(tptr->spl));
+		KASSERT(tptr->state == THREAD_STATE_READY);
+		if(thread_cpu_ok(tptr, cpu))
+			return tptr;
+		
+		//Its affinity changed while it was queued here. Move it somewhere it's allowed.
+		int dest = thread_cpu_pick(tptr, cpu);
+		thread_runq_kick(tptr, dest, thread_runq_push(tptr, dest));
+		hal_spl_unlock(&(tptr->spl));
+	}
+}
+
+//Finishes off the thread that the calling CPU just switched away from, now that we're off its stack.
+//Called by whatever the CPU switched to - the next thread, or the scheduling loop.
+static void thread_switch_finish(void)
+{
+	int cpu = hal_cpu_num();
+	thread_runq_t *rptr = &(thread_runq_array[cpu]);
+	
+	//Start charging time to whatever thread we're now running, and give it back the FPU if it's still holding its state
+	thread_t *cur = hal_ktls_get();
+	if(cur != NULL)
+	{
+		cur->usage_stamp = hal_clock_cycles();
+		thread_fpu_in(rptr, cur);
+	}
+	
+	//Note what we're running, for anyone queueing threads here or ending its slice.
+	//If it already has reason to give way - work queued while we weren't looking, or the slice is already up - flag that now.
+	hal_spl_lock(&(rptr->spl));
+	rptr->running = cur;
+	if(cur != NULL && (rptr->expired || (thread_class(cur->priority) == THREAD_CLASS_BATCH && rptr->list[THREAD_CLASS_NORMAL].count > 0)))
+		thread_work(cur, THREAD_WORK_PREEMPT);
+	
+	hal_spl_unlock(&(rptr->spl));
+	
+	thread_t *tptr = rptr->prev;
+	rptr->prev = NULL;
+	if(tptr == NULL)
+		return;
+	
+	KASSERT(tptr->state != THREAD_STATE_RUN);
+	KASSERT(tptr->spl > 0);
+	
+	if(tptr->state == THREAD_STATE_DONE)
+	{
+		//Thread finished; clean it up.
+		
+		//It should have removed itself from its process before dieing.
+		KASSERT(tptr->process == NULL);
+		
+		kspace_free(tptr->stack_bottom, tptr->stack_size);
+		tptr->stack_bottom = NULL;
+		tptr->stack_top = NULL;
+		tptr->stack_size = 0;
+		
+		tptr->entry_func = NULL;
+		tptr->entry_data = NULL;
+		
+		tptr->ctx = (hal_ctx_t){0};
+		
+		tptr->sigmask_cur = 0;
+		tptr->sigmask_ret = 0;
+		tptr->sigpend = 0;
+		
+		tptr->notify_count = 0;
+		tptr->notify_last = 0;
+		
+		tptr->killed = false;
+		tptr->work = 0;
+		
+		memset(&(tptr->usage), 0, sizeof(tptr->usage));
+		tptr->usage_stamp = 0;
+		
+		//Its FPU state was saved when we switched away, if it was using it
+		KASSERT(!rptr->fpu_live);
+		if(rptr->fpu_owner == tptr)
+			rptr->fpu_owner = NULL;
+		
+		thread_fpu_free(tptr->fpu_buf);
+		tptr->fpu_buf = NULL;
+		tptr->fpu_cpu = -1;
+		tptr->fpu_sigsaved = false;
+		
+		tptr->runq_cpu = -1;
+		
+		memset(&(tptr->siginfo), 0, sizeof(tptr->siginfo));
+		memset(&(tptr->sigexit), 0, sizeof(tptr->sigexit));
+		
+		tptr->state = THREAD_STATE_NONE;
+		idtab_free(&thread_tab, tptr->id);
+	}
+	else if(tptr->state == THREAD_STATE_READY)
+	{
+		//Thread gave up the CPU but can keep running. Queue it again.
+		//If it can't stay on this CPU anymore, move it, and make sure someone picks it up.
+		int dest = thread_cpu_pick(tptr, cpu);
+		bool idle = thread_runq_push(tptr, dest);
+		if(dest != cpu)
+			thread_runq_kick(tptr, dest, idle);
+	}
+	
+	hal_spl_unlock(&(tptr->spl));
+}
+
+//Switches the calling CPU into a thread that's been picked to run on it and locked.
+//Saves the current context in the given buffer - either the previous thread's, or the scheduling loop's.
+//The previous thread, if any, should already be locked and have its new state set. Whatever runs next finishes it off.
+//Starts a new time-slice for the thread, unless it's taking over the rest of the previous thread's.
+//Returns when something switches back to the saved context, having finished off whatever it switched away from.
+static void thread_switch(thread_runq_t *rptr, thread_t *prev, hal_ctx_t *save, thread_t *next, bool slice)
+{
+	KASSERT(next->state == THREAD_STATE_READY);
+	next->state = THREAD_STATE_RUN;
+	next->runq_cpu = rptr - thread_runq_array;
+	
+	//Start its time-slice. The thread is preempted when the slice runs out, the next time it's in user code.
+	if(slice)
+		thread_slice_start(rptr, next->priority);
+	
+	KASSERT(rptr->prev == NULL);
+	rptr->prev = prev;
+	thread_usage_exit();
+	thread_fpu_out(rptr);
+	hal_ctx_switch(save, &(next->ctx));
+	
+	//Something switched back to us - maybe on a different CPU than we left.
+	thread_switch_finish();
+}
+
+void thread_init(void)
+{
+	KASSERT(HAL_CPU_MAX <= PX_CPU_MAX);
+	
+	idtab_init(&thread_tab, sizeof(thread_t), THREAD_MAX);
+}
+
+static thread_t *thread_locknew(void)
+{
+	//Take a free spot in the thread table
+	id_t id = 0;
+	thread_t *tptr = idtab_alloc(&thread_tab, &id);
+	if(tptr == NULL)
+		return NULL;
+	
+	//Whatever freed it might not have unlocked it yet
+	hal_spl_lock(&(tptr->spl));
+	KASSERT(tptr->state == THREAD_STATE_NONE);
+	tptr->id = id;
+	return tptr;
+}
+
 thread_t *thread_new(void (*entry_func)(void *data), void *entry_data)
 {
 	//Find a spot in the thread table
@@ -84,6 +557,7 @@ thread_t *thread_new(void (*entry_func)(void *data), void *entry_data)
 	if(tptr->stack_bottom == NULL)
 	{
 		//No room for stack
+		idtab_free(&thread_tab, tptr->id);
 		hal_spl_unlock(&(tptr->spl));
 		return NULL;
 	}
@@ -97,9 +571,30 @@ thread_t *thread_new(void (*entry_func)(void *data), void *entry_data)
 	tptr->entry_func = entry_func;
 	tptr->entry_data = entry_data;
 	
-	//Make the thread runnable by default
+	//Thread gets FPU state when it first uses the FPU
+	tptr->fpu_buf = NULL;
+	tptr->fpu_cpu = -1;
+	tptr->fpu_sigsaved = false;
+	
+	//Inherit priority and affinity from the thread making this one, if any
+	thread_t *parent = hal_ktls_get();
+	if(parent != NULL)
+	{
+		tptr->priority = parent->priority;
+		tptr->affinity = parent->affinity;
+	}
+	else
+	{
+		tptr->priority = PX_PRIO_DEFAULT;
+		memset(&(tptr->affinity), 0xFF, sizeof(tptr->affinity));
+	}
+	
+	//Make the thread runnable by default, starting on the CPU that made it
 	tptr->state = THREAD_STATE_READY;
-
+	tptr->runq_cpu = -1;
+	int cpu = thread_cpu_pick(tptr, hal_cpu_num());
+	thread_runq_kick(tptr, cpu, thread_runq_push(tptr, cpu));
+	
 	//Return it, still locked
 	return tptr;
 }
@@ -119,8 +614,11 @@ thread_t *thread_getlocked(id_t tid)
 	if(tid < 0)
 		return NULL;
 	
-	//Thread ID should correspond with position in the array.
-	thread_t *tptr = &(thread_array[tid % thread_count]);
+	//Thread ID should correspond with position in the table.
+	thread_t *tptr = idtab_get(&thread_tab, tid);
+	if(tptr == NULL)
+		return NULL;
+	
 	hal_spl_lock(&(tptr->spl));
 	if(tptr->id != tid || tptr->state == THREAD_STATE_NONE)
 	{
@@ -138,23 +636,189 @@ void thread_unlock(thread_t *tptr)
 	hal_spl_unlock(&(tptr->spl));
 }
 
+//Takes the thread woken to take over from the one running on the given CPU, if any, and locks it.
+//Returns NULL if there isn't one, or it's no longer allowed to run here.
+static thread_t *thread_handoff_take(thread_runq_t *rptr, int cpu)
+{
+	thread_t *tptr = rptr->handoff;
+	if(tptr == NULL)
+		return NULL;
+	
+	rptr->handoff = NULL;
+	hal_spl_lock(&(tptr->spl));
+	KASSERT(tptr->state == THREAD_STATE_READY);
+	if(!thread_cpu_ok(tptr, cpu))
+	{
+		//Its affinity changed since it was woken. Queue it somewhere it's allowed instead.
+		int dest = thread_cpu_pick(tptr, cpu);
+		thread_runq_kick(tptr, dest, thread_runq_push(tptr, dest));
+		hal_spl_unlock(&(tptr->spl));
+		return NULL;
+	}
+	
+	hal_spl_lock(&thread_stat_spl);
+	thread_stat_handoffs++;
+	hal_spl_unlock(&thread_stat_spl);
+	
+	return tptr;
+}
+
+void thread_ready(thread_t *tptr)
+{
+	KASSERT(tptr->spl > 0);
+	KASSERT(tptr->state != THREAD_STATE_READY && tptr->state != THREAD_STATE_RUN);
+	
+	tptr->state = THREAD_STATE_READY;
+	int cpu = thread_cpu_pick(tptr, (tptr->runq_cpu >= 0) ? tptr->runq_cpu : hal_cpu_num());
+	thread_runq_kick(tptr, cpu, thread_runq_push(tptr, cpu));
+}
+
+void thread_ready_handoff(thread_t *tptr)
+{
+	KASSERT(tptr->spl > 0);
+	KASSERT(tptr->state != THREAD_STATE_READY && tptr->state != THREAD_STATE_RUN);
+	
+	//Only take over from a user thread, on a CPU it's allowed on, and only if it wouldn't be waiting behind us anyway.
+	//Give up if we've already picked a thread to take over.
+	thread_t *cur = hal_ktls_get();
+	int cpu = hal_cpu_num();
+	thread_runq_t *rptr = &(thread_runq_array[cpu]);
+	bool ok = (cur != NULL) && (cur->process != NULL) && (cur != tptr) && (rptr->handoff == NULL);
+	ok = ok && thread_cpu_ok(tptr, cpu);
+	ok = ok && (thread_class(tptr->priority) <= thread_class(cur->priority));
+	if(!ok)
+	{
+		thread_ready(tptr);
+		return;
+	}
+	
+	//Leave it off the run queues - it runs next here, as soon as we yield.
+	tptr->state = THREAD_STATE_READY;
+	rptr->handoff = tptr;
+}
+
+void thread_handoff(void)
+{
+	thread_runq_t *rptr = &(thread_runq_array[hal_cpu_num()]);
+	if(rptr->handoff == NULL)
+		return;
+	
+	//Whatever we woke runs next, and we go back on the run queue
+	thread_t *tptr = thread_lockcur();
+	tptr->state = THREAD_STATE_READY;
+	thread_yield(tptr);
+	thread_unlock(tptr);
+}
+
 void thread_yield(thread_t *tptr)
 {
 	//The thread control block should already be locked by us.
 	KASSERT(tptr == hal_ktls_get());
 	KASSERT(tptr->spl > 0);
 	
-	//Switch back to the scheduling context.
-	//The scheduling context will unlock our thread control block after the switch.
-	KASSERT(tptr->sched_ctx != NULL);
-	hal_ctx_switch(&(tptr->ctx), tptr->sched_ctx);
+	KASSERT(tptr->state != THREAD_STATE_RUN);
+	
+	int cpu = hal_cpu_num();
+	thread_runq_t *rptr = &(thread_runq_array[cpu]);
+	KASSERT(tptr->runq_cpu == cpu);
+	
+	//Count the switch, if we end up switching - it's involuntary if we could have kept running.
+	bool preempted = (tptr->state == THREAD_STATE_READY);
+	
+	//A thread we woke to take over from us goes first, with the rest of our time-slice.
+	//Nobody else can run it, as it's not queued, so it's safe to lock while we hold our own lock.
+	thread_t *next = thread_handoff_take(rptr, cpu);
+	if(next != NULL)
+	{
+		tptr->usage.nvcsw++;
+		thread_switch(rptr, tptr, &(tptr->ctx), next, false);
+		return;
+	}
+	
+	//Otherwise switch directly to the next thread that's ready to run here, if any.
+	//Whatever we switch to will unlock our thread control block, and queue us again if we're still ready.
+	next = thread_runq_next(cpu);
+	if(next != NULL)
+	{
+		if(preempted)
+			tptr->usage.nivcsw++;
+		else
+			tptr->usage.nvcsw++;
+		
+		thread_switch(rptr, tptr, &(tptr->ctx), next, true);
+	}
+	else if(tptr->state == THREAD_STATE_READY && thread_cpu_ok(tptr, cpu))
+	{
+		//Nothing else wants this CPU, and we can keep going - just start another slice.
+		tptr->state = THREAD_STATE_RUN;
+		thread_slice_start(rptr, tptr->priority);
+	}
+	else
+	{
+		//Nothing else to run here. Go back to the scheduling loop, which finishes us off and waits for work.
+		//No need to interrupt it when the slice runs out.
+		timer_disarm(&(rptr->slice));
+		if(preempted)
+			tptr->usage.nivcsw++;
+		else
+			tptr->usage.nvcsw++;
+		
+		KASSERT(rptr->prev == NULL);
+		rptr->prev = tptr;
+		thread_usage_exit();
+		thread_fpu_out(rptr);
+		hal_ctx_switch(&(tptr->ctx), rptr->sched_ctx);
+		thread_switch_finish();
+	}
 	
 	//When we're eventually rescheduled, we'll arrive back here.
-	//The scheduling context will have locked our thread control block.
+	//Whatever switched to us will have locked our thread control block.
 	//Leave it locked - as it was when we initially entered.
 	//Our caller will unlock it.
 }
 
+void thread_preempt(void)
+{
+	thread_t *tptr = thread_lockcur();
+	int cpu = tptr->runq_cpu;
+	thread_runq_t *rptr = &(thread_runq_array[cpu]);
+	
+	bool yield = false;
+	int cls = thread_class(tptr->priority);
+	if(!thread_cpu_ok(tptr, cpu))
+	{
+		//Our affinity changed to exclude this CPU - move off of it right away
+		yield = true;
+	}
+	else if(cls == THREAD_CLASS_BATCH && rptr->list[THREAD_CLASS_NORMAL].count > 0)
+	{
+		//Batch threads give way to normal threads as soon as they notice any
+		yield = true;
+	}
+	else if(rptr->expired)
+	{
+		//If nothing else is waiting for this CPU, there's no reason to switch away - just start another slice.
+		//Threads queued elsewhere are either about to run there, or will be stolen by an idle CPU.
+		//Batch threads don't count as waiting, if we're a normal thread - they'd just wait for us anyway.
+		int waiting = rptr->list[THREAD_CLASS_NORMAL].count;
+		if(cls == THREAD_CLASS_BATCH)
+			waiting += rptr->list[THREAD_CLASS_BATCH].count;
+		
+		if(waiting > 0)
+			yield = true;
+		else
+			thread_slice_start(rptr, tptr->priority);
+	}
+	
+	if(yield)
+	{
+		//Whatever runs next will queue us again, once it's off our stack
+		tptr->state = THREAD_STATE_READY;
+		thread_yield(tptr);
+	}
+	thread_unlock(tptr);
+}
+
 void thread_die(void)
 {
 	//The calling thread should already have been removed from its process, if any
@@ -162,78 +826,102 @@ void thread_die(void)
 	KASSERT(tptr->process == NULL);
 	
 	//Set our state to dead and switch away.
-	//The scheduling context will clean us up.
+	//Whatever runs next will clean us up.
 	tptr->state = THREAD_STATE_DONE;
 	thread_yield(tptr);
 	
-	//The scheduling context should never switch back to us.
+	//Nothing should ever switch back to us.
 	KASSERT(0);
 }
 
-void thread_sendsig(idtype_t idtype, pid_t id, int signum)
+//Raises a signal on the given thread, which should be locked, and wakes it if it's waiting.
+static void thread_raise(thread_t *tptr, int signum)
 {
-	//If we've got an ID other than a thread ID, try to resolve it into a thread ID
-	if(idtype == P_PID)
+	//Signal 0 only checks that the target exists
+	if(signum == 0)
+		return;
+	
+	tptr->sigpend |= (1l << signum);
+	thread_work(tptr, THREAD_WORK_SIGNAL);
+	if(tptr->state == THREAD_STATE_NOTIFY)
+		thread_ready(tptr);
+}
+
+//Raises a signal on one thread of the given process, which should be locked.
+//Picks the first thread that isn't blocking the signal, or the first thread if all are.
+static void thread_sendsig_process(process_t *pptr, void *arg)
+{
+	int signum = *(int*)arg;
+	thread_t *target = pptr->threads;
+	for(thread_t *tptr = pptr->threads; tptr != NULL; tptr = tptr->process_next)
 	{
-		//Find any thread belonging to this process	
-		id_t found_tid = -1;
-		for(int tt = 0; tt < thread_count; tt++)
-		{
-			hal_spl_lock(&(thread_array[tt].spl));
-			
-			if(thread_array[tt].state > THREAD_STATE_NONE && thread_array[tt].state < THREAD_STATE_DONE)
-			{
-				if(thread_array[tt].process != NULL)
-				{
-					process_t *pptr = thread_array[tt].process;
-					hal_spl_lock(&(pptr->spl));
-					
-					if(pptr->id == id)
-					{
-						//Thread belongs to a process with an ID matching the one we're signalling
-						found_tid = thread_array[tt].id;
-					}
-					
-					hal_spl_unlock(&(pptr->spl));
-				}
-			}
-			
-			hal_spl_unlock(&(thread_array[tt].spl));
-			
-			//Stop at the first thread we find in the process
-			if(found_tid >= 0)
-				break;
-		}
+		hal_spl_lock(&(tptr->spl));
+		bool blocked = (tptr->sigmask_cur >> signum) & 1;
+		hal_spl_unlock(&(tptr->spl));
 		
-		if(found_tid >= 0)
+		if(!blocked)
 		{
-			idtype = P_TID;
-			id = found_tid;
+			target = tptr;
+			break;
 		}
 	}
 	
-	if(idtype != P_TID)
-	{
-		//Trying to signal an ID other than a thread-ID, but we couldn't resolve it to a thread.
+	if(target == NULL)
+		return; //Process has no threads left
+	
+	hal_spl_lock(&(target->spl));
+	thread_raise(target, signum);
+	hal_spl_unlock(&(target->spl));
+}
+
+//Raises a signal on one thread of the given process, which should be locked, unless it's init.
+//Init only gets signals sent to it by its ID.
+static void thread_sendsig_all(process_t *pptr, void *arg)
+{
+	if(pptr->id == 1)
 		return;
-	}
 	
-	//Look up the given thread
-	thread_t *tptr = thread_getlocked(id);
-	if(tptr == NULL)
+	thread_sendsig_process(pptr, arg);
+}
+
+int thread_sendsig(idtype_t idtype, id_t id, int signum)
+{
+	if(signum < 0 || signum >= 64)
+		return -EINVAL;
+	
+	if(idtype == P_TID)
 	{
-		//Couldn't find the thread
-		return;
+		//Look up the given thread
+		thread_t *tptr = thread_getlocked(id);
+		if(tptr == NULL)
+			return -ESRCH;
+		
+		thread_raise(tptr, signum);
+		thread_unlock(tptr);
+		return 0;
 	}
 	
-	//Raise signal and wake thread if sleeping
-	tptr->sigpend |= (1<<signum);
-	if(tptr->state == THREAD_STATE_NOTIFY)
-		tptr->state = THREAD_STATE_READY;
+	if(idtype == P_PID || idtype == P_PGID)
+	{
+		//Signal one thread in each matching process, found through the process and its group
+		int found = process_foreach(idtype, id, &thread_sendsig_process, &signum);
+		if(found == 0)
+			return -ESRCH;
+		
+		return 0;
+	}
 	
-	hal_intr_wake();
+	if(idtype == P_ALL)
+	{
+		//Signal one thread in every process besides init
+		int found = process_foreach(P_ALL, 0, &thread_sendsig_all, &signum);
+		if(found == 0)
+			return -ESRCH;
+		
+		return 0;
+	}
 	
-	thread_unlock(tptr);
+	return -EINVAL;
 }
 
 void thread_sched(void)
@@ -242,93 +930,430 @@ void thread_sched(void)
 	hal_ctx_t sched_ctx = {0};
 	KASSERT(hal_ctx_size() <= sizeof(sched_ctx)); //Should really define this properly
 	
+	int cpu = hal_cpu_num();
+	KASSERT(cpu >= 0 && cpu < HAL_CPU_MAX);
+	thread_runq_t *rptr = &(thread_runq_array[cpu]);
+	thread_idle_t *iptr = &(thread_idle_array[cpu]);
+	
+	//Threads switch back here when they stop running and there's nothing else for this CPU to do.
+	KASSERT(rptr->sched_ctx == NULL);
+	rptr->sched_ctx = &sched_ctx;
+	
 	//Look for threads to schedule
 	while(1)
 	{
 		//Disable interrupts while scheduling - so we're not stuck holding the run-queue spinlock while an ISR runs.
 		hal_intr_ei(false);
 		
-		//Something tells me I should have a run-queue or something.
-		//But... my CPU is real fast so I don't give a shit.
-		thread_t *tptr = NULL;
-		for(int tt = 0; tt < thread_count; tt++)
-		{
-			hal_spl_lock(&(thread_array[tt].spl));
-			if(thread_array[tt].state == THREAD_STATE_READY)
-			{
-				tptr = &(thread_array[tt]);
-				break;
-			}
-			
-			hal_spl_unlock(&(thread_array[tt].spl));
-		}
+		//Note that we're idle before looking for work.
+		//Anyone who queues a thread after we look will see this, and wake us (or someone else idle).
+		hal_spl_lock(&(rptr->spl));
+		rptr->idle = true;
+		hal_spl_unlock(&(rptr->spl));
+		
+		//Note our wakeup word before looking, too. A wakeup after we look will have changed it.
+		hal_atomic_t seen = *(volatile hal_atomic_t*)&(iptr->seq);
 		
+		thread_t *tptr = thread_runq_next(cpu);
 		if(tptr == NULL)
 		{
 			//No threads ready to run. Sleep, and then try again.
-			//Anyone who made a thread runnable while we were looking, would have fired a wakeup IPI.
-			//We'll catch that immediately on halting with interrupts enabled, if so.
-			hal_intr_halt();
+			//If we were woken while we were looking, we'll return immediately - either the word changed, or an IPI is pending.
+			if(THREAD_IDLE_WATCH)
+				hal_intr_watch(&(iptr->seq), seen);
+			else
+				hal_intr_halt();
+			
 			continue;
 		}
 		
-		//Okay, we have a thread to run, and we've already locked it.
-		//Switch into that thread to run it, noting where to switch back.
-		//The thread will unlock its thread control block after the switch.
-		KASSERT(tptr->sched_ctx == NULL);
-		tptr->sched_ctx = &sched_ctx;
-		
-		KASSERT(tptr->state == THREAD_STATE_READY);
-		tptr->state = THREAD_STATE_RUN;
-		
-		hal_ctx_switch(&sched_ctx, &(tptr->ctx));
+		hal_spl_lock(&(rptr->spl));
+		rptr->idle = false;
+		hal_spl_unlock(&(rptr->spl));
 		
-		//Eventually the thread will want to be descheduled.
-		//It will lock its thread control block, change its state, and return here with another hal_ctx_switch.
-		KASSERT(tptr->sched_ctx == &sched_ctx);
-		tptr->sched_ctx = NULL;
+		thread_idle_woke(cpu);
 		
-		KASSERT(tptr->state != THREAD_STATE_RUN);
-		KASSERT(tptr->spl > 0);
+		//Switch into that thread to run it.
+		//Threads switch directly between each other from then on, and only come back here when the CPU runs out of work.
+		thread_switch(rptr, NULL, &sched_ctx, tptr, true);
+	}
+	
+	KASSERT(0);
+}
+
+//Function and argument passed through process_foreach to each thread of the processes it finds
+typedef struct thread_foreach_s
+{
+	void (*func)(thread_t *tptr, void *arg);
+	void *arg;
+	int count;
+} thread_foreach_t;
+
+//Calls a function on each thread of the given process, which should be locked.
+static void thread_foreach_process(process_t *pptr, void *arg)
+{
+	thread_foreach_t *fe = (thread_foreach_t*)arg;
+	for(thread_t *tptr = pptr->threads; tptr != NULL; tptr = tptr->process_next)
+	{
+		hal_spl_lock(&(tptr->spl));
+		fe->func(tptr, fe->arg);
+		fe->count++;
+		hal_spl_unlock(&(tptr->spl));
+	}
+}
+
+//Calls the given function on each thread identified by the given ID, with the thread locked.
+//Only user threads are identified by anything other than thread ID.
+//Returns the number of threads found.
+static int thread_foreach(idtype_t idtype, id_t id, void (*func)(thread_t *tptr, void *arg), void *arg)
+{
+	if(idtype == P_TID)
+	{
+		thread_t *tptr = thread_getlocked(id);
+		if(tptr == NULL)
+			return 0;
 		
-		if(tptr->state == THREAD_STATE_DONE)
+		func(tptr, arg);
+		thread_unlock(tptr);
+		return 1;
+	}
+	
+	if(idtype == P_ALL)
+	{
+		int count = 0;
+		int slots = idtab_count(&thread_tab);
+		for(int tt = 0; tt < slots; tt++)
 		{
-			//Thread finished; clean it up.
-			
-			//It should have removed itself from its process before dieing.
-			KASSERT(tptr->process == NULL);
-			
-			kspace_free(tptr->stack_bottom, tptr->stack_size);
-			tptr->stack_bottom = NULL;
-			tptr->stack_top = NULL;
-			tptr->stack_size = 0;
-			
-			tptr->entry_func = NULL;
-			tptr->entry_data = NULL;
-			
-			tptr->ctx = (hal_ctx_t){0};
-			
-			tptr->sigmask_cur = 0;
-			tptr->sigmask_ret = 0;
-			tptr->sigpend = 0;
-			
-			tptr->notify_count = 0;
-			tptr->notify_last = 0;
+			thread_t *tptr = idtab_slot(&thread_tab, tt);
+			if(tptr == NULL)
+				continue;
 			
-			memset(&(tptr->siginfo), 0, sizeof(tptr->siginfo));
-			memset(&(tptr->sigexit), 0, sizeof(tptr->sigexit));
-			
-			tptr->state = THREAD_STATE_NONE;
-			
-			hal_spl_unlock(&(tptr->spl));			
+			hal_spl_lock(&(tptr->spl));
+			if(tptr->process != NULL && tptr->state != THREAD_STATE_NONE && tptr->state != THREAD_STATE_DONE)
+			{
+				func(tptr, arg);
+				count++;
+			}
+			hal_spl_unlock(&(tptr->spl));
 		}
-		else
+		return count;
+	}
+	
+	//Process and group IDs are found through the process, which keeps a list of its threads
+	thread_foreach_t fe = { .func = func, .arg = arg, .count = 0 };
+	process_foreach(idtype, id, &thread_foreach_process, &fe);
+	return fe.count;
+}
+
+//Priority to set on threads, and the old priority of the first one found
+typedef struct thread_priority_s
+{
+	int priority;
+	int old;
+} thread_priority_t;
+
+static void thread_priority_one(thread_t *tptr, void *arg)
+{
+	thread_priority_t *tp = (thread_priority_t*)arg;
+	if(tp->old < 0)
+		tp->old = tptr->priority;
+	
+	if(tp->priority >= 0)
+	{
+		tptr->priority = tp->priority;
+		thread_work(tptr, THREAD_WORK_PREEMPT);
+	}
+}
+
+int thread_priority(idtype_t idtype, id_t id, int priority)
+{
+	if(priority < -1 || priority > PX_PRIO_MAX)
+		return -EINVAL;
+	
+	thread_priority_t tp = { .priority = priority, .old = -1 };
+	if(thread_foreach(idtype, id, &thread_priority_one, &tp) == 0)
+		return -ESRCH;
+	
+	return tp.old;
+}
+
+//CPU set to apply to threads, and where to store the old set of the first one found
+typedef struct thread_affinity_s
+{
+	const px_cpuset_t *set;
+	px_cpuset_t *old;
+} thread_affinity_t;
+
+static void thread_affinity_one(thread_t *tptr, void *arg)
+{
+	thread_affinity_t *ta = (thread_affinity_t*)arg;
+	if(ta->old != NULL)
+	{
+		*(ta->old) = tptr->affinity;
+		ta->old = NULL;
+	}
+	
+	//Running threads notice the change when they next return to user code, and queued threads when they're next picked.
+	if(ta->set != NULL)
+	{
+		tptr->affinity = *(ta->set);
+		thread_work(tptr, THREAD_WORK_PREEMPT);
+	}
+}
+
+int thread_affinity(idtype_t idtype, id_t id, const px_cpuset_t *set, px_cpuset_t *old)
+{
+	if(set != NULL)
+	{
+		//Make sure there's somewhere to run
+		bool any = false;
+		int ncpu = hal_cpu_count();
+		for(int cc = 0; cc < ncpu; cc++)
 		{
-			//Thread still exists.
-			hal_spl_unlock(&(tptr->spl));
+			if((set->bits[cc / 64] >> (cc % 64)) & 1)
+				any = true;
 		}
+		
+		if(!any)
+			return -EINVAL;
 	}
 	
-	KASSERT(0);
+	thread_affinity_t ta = { .set = set, .old = old };
+	if(thread_foreach(idtype, id, &thread_affinity_one, &ta) == 0)
+		return -ESRCH;
+	
+	return 0;
+}
+
+static void thread_kill_one(thread_t *tptr, void *arg)
+{
+	id_t except = *(id_t*)arg;
+	if(tptr->id == except)
+		return;
+	
+	tptr->killed = true;
+	thread_work(tptr, THREAD_WORK_KILL);
+	if(tptr->state == THREAD_STATE_NOTIFY)
+		thread_ready(tptr);
+}
+
+void thread_kill(pid_t pid, id_t except)
+{
+	thread_foreach(P_PID, pid, &thread_kill_one, &except);
+}
+
+void thread_work(thread_t *tptr, uint32_t bits)
+{
+	hal_atomic_or(&(tptr->work), bits);
+}
+
+void thread_getstat(px_sched_stat_t *out)
+{
+	out->cpus = hal_cpu_count();
+	out->idle_watch = THREAD_IDLE_WATCH && hal_intr_canwatch();
+	
+	hal_spl_lock(&thread_stat_spl);
+	out->wakes = thread_stat_wakes;
+	out->wake_ns = thread_stat_wake_ns;
+	out->wake_ipis = thread_stat_wake_ipis;
+	out->handoffs = thread_stat_handoffs;
+	hal_spl_unlock(&thread_stat_spl);
+}
+
+//Charges the cycles since the calling thread's last stamp, as user or kernel time, and restamps it.
+static void thread_usage_charge(bool user)
+{
+	thread_t *tptr = hal_ktls_get();
+	if(tptr == NULL)
+		return; //Scheduling loop
+	
+	uint64_t now = hal_clock_cycles();
+	uint64_t elapsed = now - tptr->usage_stamp;
+	if(user)
+		tptr->usage.ucycles += elapsed;
+	else
+		tptr->usage.scycles += elapsed;
+	
+	tptr->usage_stamp = now;
+}
+
+void thread_usage_enter(void)
+{
+	thread_usage_charge(true);
+}
+
+void thread_usage_exit(void)
+{
+	thread_usage_charge(false);
+}
+
+void thread_usage_add(thread_usage_t *sum, const thread_usage_t *add)
+{
+	sum->ucycles += add->ucycles;
+	sum->scycles += add->scycles;
+	sum->nvcsw += add->nvcsw;
+	sum->nivcsw += add->nivcsw;
+}
+
+//Returns the size of one copy of FPU state in a thread's buffer, keeping both copies aligned.
+static size_t thread_fpu_stride(void)
+{
+	return (hal_fpu_size() + HAL_FPU_ALIGN - 1) & ~(size_t)(HAL_FPU_ALIGN - 1);
+}
+
+//Allocates a buffer for a thread's FPU state.
+static void *thread_fpu_alloc(void)
+{
+	return kspace_alloc(2 * thread_fpu_stride(), HAL_FPU_ALIGN);
+}
+
+void thread_fpu_free(void *buf)
+{
+	if(buf != NULL)
+		kspace_free(buf, 2 * thread_fpu_stride());
+}
+
+//Called before switching away from whatever the CPU is running.
+//Saves the FPU state of the thread using it, if any, and makes the FPU trap for whatever runs next.
+static void thread_fpu_out(thread_runq_t *rptr)
+{
+	if(!rptr->fpu_live)
+		return;
+	
+	KASSERT(rptr->fpu_owner != NULL && rptr->fpu_owner == hal_ktls_get());
+	hal_fpu_save(rptr->fpu_owner->fpu_buf);
+	hal_fpu_trap(true);
+	rptr->fpu_live = false;
+}
+
+//Called after switching to a thread.
+//If nothing else has loaded FPU state on this CPU since the thread's was saved, its state is still in the registers.
+//In that case it can go ahead and use them without trapping.
+static void thread_fpu_in(thread_runq_t *rptr, thread_t *cur)
+{
+	KASSERT(!rptr->fpu_live);
+	if(rptr->fpu_owner == cur && cur->fpu_cpu == rptr - thread_runq_array)
+	{
+		hal_fpu_trap(false);
+		rptr->fpu_live = true;
+	}
+}
+
+//Makes sure the calling thread's buffer has its current FPU state, if it's using the FPU now.
+static void thread_fpu_sync(thread_t *cur)
+{
+	thread_runq_t *rptr = &(thread_runq_array[hal_cpu_num()]);
+	if(rptr->fpu_live)
+	{
+		KASSERT(rptr->fpu_owner == cur);
+		hal_fpu_save(cur->fpu_buf);
+	}
 }
 
+int thread_fpu_claim(void)
+{
+	thread_t *cur = hal_ktls_get();
+	int cpu = hal_cpu_num();
+	thread_runq_t *rptr = &(thread_runq_array[cpu]);
+	KASSERT(!rptr->fpu_live);
+	
+	//First use of the FPU - make room for the thread's state, starting from the initial state
+	if(cur->fpu_buf == NULL)
+	{
+		cur->fpu_buf = thread_fpu_alloc();
+		if(cur->fpu_buf == NULL)
+			return -ENOMEM;
+		
+		hal_fpu_reset(cur->fpu_buf);
+		cur->fpu_cpu = -1;
+	}
+	
+	//Whoever used the FPU here before saved their state when they switched away.
+	//Load ours, unless it's still in the registers.
+	hal_fpu_trap(false);
+	if(rptr->fpu_owner != cur || cur->fpu_cpu != cpu)
+	{
+		hal_fpu_load(cur->fpu_buf);
+		rptr->fpu_owner = cur;
+		cur->fpu_cpu = cpu;
+	}
+	
+	rptr->fpu_live = true;
+	return 0;
+}
+
+void thread_fpu_reset(void)
+{
+	thread_t *cur = hal_ktls_get();
+	if(cur->fpu_buf == NULL)
+		return;
+	
+	//Just forget the old state. If the thread uses the FPU again, it starts over from the initial state.
+	thread_runq_t *rptr = &(thread_runq_array[hal_cpu_num()]);
+	if(rptr->fpu_owner == cur)
+	{
+		if(rptr->fpu_live)
+			hal_fpu_trap(true);
+		
+		rptr->fpu_live = false;
+		rptr->fpu_owner = NULL;
+	}
+	
+	thread_fpu_free(cur->fpu_buf);
+	cur->fpu_buf = NULL;
+	cur->fpu_cpu = -1;
+	cur->fpu_sigsaved = false;
+}
+
+int thread_fpu_dup(void **buf_out)
+{
+	*buf_out = NULL;
+	
+	thread_t *cur = hal_ktls_get();
+	if(cur->fpu_buf == NULL)
+		return 0;
+	
+	void *copy = thread_fpu_alloc();
+	if(copy == NULL)
+		return -ENOMEM;
+	
+	thread_fpu_sync(cur);
+	memcpy(copy, cur->fpu_buf, thread_fpu_stride());
+	*buf_out = copy;
+	return 0;
+}
+
+void thread_fpu_sigsave(void)
+{
+	//Threads that haven't used the FPU have nothing to save
+	thread_t *cur = hal_ktls_get();
+	cur->fpu_sigsaved = (cur->fpu_buf != NULL);
+	if(!cur->fpu_sigsaved)
+		return;
+	
+	thread_fpu_sync(cur);
+	memcpy((uint8_t*)(cur->fpu_buf) + thread_fpu_stride(), cur->fpu_buf, thread_fpu_stride());
+}
+
+void thread_fpu_sigrestore(void)
+{
+	thread_t *cur = hal_ktls_get();
+	if(cur->fpu_buf == NULL)
+		return;
+	
+	//Put back the state from before the signal.
+	//If the handler was the first to use the FPU, go back to the initial state instead.
+	if(cur->fpu_sigsaved)
+		memcpy(cur->fpu_buf, (uint8_t*)(cur->fpu_buf) + thread_fpu_stride(), thread_fpu_stride());
+	else
+		hal_fpu_reset(cur->fpu_buf);
+	
+	cur->fpu_sigsaved = false;
+	
+	//Load it now if we're using the FPU; otherwise make sure it's loaded when we next do.
+	thread_runq_t *rptr = &(thread_runq_array[hal_cpu_num()]);
+	if(rptr->fpu_live)
+		hal_fpu_load(cur->fpu_buf);
+	else
+		cur->fpu_cpu = -1;
+}
@@ -7,11 +7,37 @@
 #include "hal_spl.h"
 #include "hal_ctx.h"
 #include "hal_exit.h"
+#include "hal_atomic.h"
 
 #include <sys/wait.h>
 
 #include "px.h"
 
+//Length of time a user thread can run before being preempted, in microseconds
+#ifndef THREAD_SLICE_US
+#define THREAD_SLICE_US 10000
+#endif
+
+//Most threads that can exist at once
+#ifndef THREAD_MAX
+#define THREAD_MAX 65536
+#endif
+
+//Whether idle CPUs wait on memory for new work, where the CPU supports it, rather than halting until an interrupt.
+#ifndef THREAD_IDLE_WATCH
+#define THREAD_IDLE_WATCH 1
+#endif
+
+//CPU time and context switches used by a thread, or summed up over threads
+typedef struct thread_usage_s
+{
+	uint64_t ucycles; //Cycles spent running user code
+	uint64_t scycles; //Cycles spent in the kernel on behalf of the thread
+	int64_t nvcsw; //Times the thread gave up the CPU to wait for something
+	int64_t nivcsw; //Times the thread was preempted
+	
+} thread_usage_t;
+
 //States a thread can be in
 typedef enum thread_state_e
 {
@@ -24,6 +50,12 @@ typedef enum thread_state_e
 	
 } thread_state_t;
 
+//Work a thread has to do before returning to user code, flagged in its work word.
+#define THREAD_WORK_PREEMPT 1 //Might have to give up the CPU - time-slice ran out, or priority, affinity, or competition changed
+#define THREAD_WORK_SIGNAL 2 //Might have a signal to take, or a temporary signal mask to restore
+#define THREAD_WORK_KILL 4 //Might have to leave its process
+#define THREAD_WORK_MEM 8 //Might have unmapped memory that other CPUs have to flush before it's released (see mem_space_sync)
+
 //Thread control block
 typedef struct thread_s
 {
@@ -48,11 +80,21 @@ typedef struct thread_s
 	void (*entry_func)(void *data);
 	void *entry_data;
 	
-	//Context to return to on deschedule, if running
-	hal_ctx_t *sched_ctx;
+	//CPU whose run queue the thread goes on when ready - the last one it ran on, or -1 if it hasn't run yet
+	int runq_cpu;
+	
+	//Next thread in the same run queue, while ready
+	struct thread_s *runq_next;
 	
-	//Process that owns this thread
+	//Scheduling priority, from 0 (best) to PX_PRIO_MAX. Takes effect the next time the thread is queued to run.
+	int priority;
+	
+	//CPUs that the thread may run on
+	px_cpuset_t affinity;
+	
+	//Process that owns this thread, and next thread in the same process (protected by the process lock)
 	struct process_s *process;
+	struct thread_s *process_next;
 	
 	//Signals currently blocked (bitmask, 1 = blocked)
 	int64_t sigmask_cur;
@@ -76,6 +118,32 @@ typedef struct thread_s
 	//Notifies already consumed - notify_count at the last time a wait-for-notify returned.
 	int64_t notify_last;
 	
+	//Set when the thread should leave its process instead of returning to user code (i.e. another thread is execing).
+	bool killed;
+	
+	//Work to check for before returning to user code - THREAD_WORK_* bits.
+	//Set atomically, without the lock, by whatever makes the work. Cleared only by the thread itself.
+	//Returning to user code while it's 0 takes no locks at all.
+	hal_atomic_t work;
+	
+	//Resources used so far, and cycle count when time was last charged to the thread.
+	//Only changed by the thread itself, or by whatever switches away from it.
+	thread_usage_t usage;
+	uint64_t usage_stamp;
+	
+	//Buffer for FPU state, allocated when the thread first uses the FPU, and CPU whose registers it was last loaded into.
+	//Holds two copies - the current state, and the state to restore when leaving a signal handler, if one was saved.
+	//Only changed by the thread itself, or by whatever switches away from it.
+	void *fpu_buf;
+	int fpu_cpu;
+	bool fpu_sigsaved;
+	
+	//Where a new user thread starts - entry point, stack, thread pointer, and argument - until it does.
+	uintptr_t ustart_pc;
+	uintptr_t ustart_sp;
+	uintptr_t ustart_tls;
+	uintptr_t ustart_arg;
+	
 } thread_t;
 
 //Initializes thread table
@@ -94,21 +162,92 @@ thread_t *thread_getlocked(id_t tid);
 //Unlocks the given thread control block.
 void thread_unlock(thread_t *tptr);
 
+//Makes a blocked thread ready to run, queueing it on the CPU it last ran on and waking that CPU if needed.
+//The thread control block should be locked by the caller.
+void thread_ready(thread_t *tptr);
+
+//Makes a blocked thread ready to run like thread_ready, but has it take over the calling CPU when the calling thread yields.
+//It gets the rest of the calling thread's time-slice. Falls back to thread_ready if it can't run here.
+//The thread control block should be locked by the caller.
+void thread_ready_handoff(thread_t *tptr);
+
+//Yields the calling thread's CPU to a thread readied with thread_ready_handoff, if there is one.
+//The calling thread stays ready to run, and goes back on the run queue.
+//Should be called without holding any locks.
+void thread_handoff(void);
+
 //Deschedules the calling thread.
 //The calling thread should already hold the lock on its thread control block.
 //The thread will be descheduled and then unlocked. 
 //When the thread is scheduled again, this will return with the thread control block locked once again.
 void thread_yield(thread_t *tptr);
 
+//Gives up the CPU if the calling thread's time-slice has run out, and any other threads are waiting to run on it.
+//The calling thread stays ready to run, and goes back on the run queue.
+void thread_preempt(void);
+
 //Ends the execution of the calling thread.
 //The thread must have already been removed from its process.
 void thread_die(void);
 
-//Sends a signal to a thread, by process-ID, thread-ID, etc
-void thread_sendsig(idtype_t idtype, pid_t pid, int signum);
+//Sends a signal to a thread, by thread-ID, or to one thread in each process matching a process-ID or process group ID.
+//Should be called without any process locked.
+//Returns 0 on success or a negative error number.
+int thread_sendsig(idtype_t idtype, id_t id, int signum);
+
+//Makes all threads of the given process, except the given thread, leave the process when they next return to user code.
+//Interrupts any waits they're in.
+void thread_kill(pid_t pid, id_t except);
 
+//Flags work for a thread to check for before it next returns to user code.
+//Should be called after making the change that needs checking. The thread needn't be locked.
+void thread_work(thread_t *tptr, uint32_t bits);
 
 //Schedules threads forever. Does not return.
 void thread_sched(void);
 
+//Sets the priority of threads matching the given ID, or just gets it, if priority is -1.
+//Returns the old priority of the first matching thread, or a negative error number.
+int thread_priority(idtype_t idtype, id_t id, int priority);
+
+//Sets the CPUs that threads matching the given ID may run on, if set is not NULL.
+//Stores the old set of the first matching thread in old, if not NULL.
+//Returns 0 on success or a negative error number.
+int thread_affinity(idtype_t idtype, id_t id, const px_cpuset_t *set, px_cpuset_t *old);
+
+//Fills in statistics about scheduling.
+void thread_getstat(px_sched_stat_t *out);
+
+//Charges time since the last kernel entry or exit to the calling thread, as user time.
+//Called when entering the kernel from user code.
+void thread_usage_enter(void);
+
+//Charges time since the last kernel entry or exit to the calling thread, as kernel time.
+//Called before returning to user code, and when the thread's usage is read.
+void thread_usage_exit(void);
+
+//Adds one set of usage counts to another.
+void thread_usage_add(thread_usage_t *sum, const thread_usage_t *add);
+
+//Lets the calling thread use the FPU, loading its state if it isn't already in the registers.
+//Called when user code traps on its first use of the FPU since switching to the thread.
+//Returns 0 on success or a negative error number.
+int thread_fpu_claim(void);
+
+//Gives the calling thread the initial FPU state, as when starting a new program.
+void thread_fpu_reset(void);
+
+//Makes a copy of the calling thread's FPU state, for a new thread to start with.
+//Stores NULL if the thread hasn't used the FPU. Returns 0 on success or a negative error number.
+int thread_fpu_dup(void **buf_out);
+
+//Frees a buffer of FPU state made by thread_fpu_dup.
+void thread_fpu_free(void *buf);
+
+//Sets aside the calling thread's FPU state when entering a signal handler.
+void thread_fpu_sigsave(void);
+
+//Puts back the FPU state set aside when entering a signal handler.
+void thread_fpu_sigrestore(void);
+
 #endif //THREAD_H
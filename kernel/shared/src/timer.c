@@ -0,0 +1,186 @@
+//timer.c
+//Kernel timers
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "timer.h"
+#include "kassert.h"
+#include "kspace.h"
+
+#include "hal_spl.h"
+#include "hal_cpu.h"
+#include "hal_clock.h"
+
+#include <errno.h>
+
+//Maximum number of events armed on each CPU
+#define TIMER_HEAP_MAX 1024
+
+//Binary heap of events armed on a CPU, soonest first
+typedef struct timer_heap_s
+{
+	//Spinlock protecting the heap
+	hal_spl_t spl;
+	
+	//Events in the heap, allocated the first time the CPU arms one
+	timer_event_t **array;
+	int count;
+	
+} timer_heap_t;
+
+//Heap for each CPU
+static timer_heap_t timer_heap_array[HAL_CPU_MAX];
+
+//Puts an event at the given position in a heap, keeping its back-reference up to date.
+static void timer_heap_put(timer_heap_t *hptr, int pos, timer_event_t *ev)
+{
+	hptr->array[pos] = ev;
+	ev->pos = pos + 1;
+}
+
+//Restores heap order around the given position, after its event was changed.
+static void timer_heap_fix(timer_heap_t *hptr, int pos)
+{
+	timer_event_t *ev = hptr->array[pos];
+	
+	//Move towards the root while sooner than the parent
+	while(pos > 0)
+	{
+		int parent = (pos - 1) / 2;
+		if(hptr->array[parent]->deadline <= ev->deadline)
+			break;
+		
+		timer_heap_put(hptr, pos, hptr->array[parent]);
+		pos = parent;
+	}
+	
+	//Move towards the leaves while later than either child
+	while(1)
+	{
+		int child = (pos * 2) + 1;
+		if(child >= hptr->count)
+			break;
+		
+		if(child + 1 < hptr->count && hptr->array[child + 1]->deadline < hptr->array[child]->deadline)
+			child++;
+		
+		if(hptr->array[child]->deadline >= ev->deadline)
+			break;
+		
+		timer_heap_put(hptr, pos, hptr->array[child]);
+		pos = child;
+	}
+	
+	timer_heap_put(hptr, pos, ev);
+}
+
+//Removes the event at the given position in a heap.
+static void timer_heap_remove(timer_heap_t *hptr, int pos)
+{
+	timer_event_t *ev = hptr->array[pos];
+	ev->cpu = 0;
+	ev->pos = 0;
+	
+	hptr->count--;
+	if(pos < hptr->count)
+	{
+		timer_heap_put(hptr, pos, hptr->array[hptr->count]);
+		timer_heap_fix(hptr, pos);
+	}
+	hptr->array[hptr->count] = NULL;
+}
+
+//Sets the calling CPU's timer for the soonest event in its heap, which should be locked.
+static void timer_heap_alarm(timer_heap_t *hptr)
+{
+	hal_clock_alarm((hptr->count > 0) ? hptr->array[0]->deadline : 0);
+}
+
+uint64_t timer_now(void)
+{
+	return hal_clock_ns();
+}
+
+int timer_arm(timer_event_t *ev, uint64_t deadline)
+{
+	timer_disarm(ev);
+	KASSERT(ev->func != NULL);
+	
+	int cpu = hal_cpu_num();
+	timer_heap_t *hptr = &(timer_heap_array[cpu]);
+	hal_spl_lock(&(hptr->spl));
+	
+	if(hptr->array == NULL)
+	{
+		hptr->array = kspace_alloc(sizeof(hptr->array[0]) * TIMER_HEAP_MAX, alignof(timer_event_t*));
+		if(hptr->array == NULL)
+		{
+			hal_spl_unlock(&(hptr->spl));
+			return -ENOMEM;
+		}
+	}
+	
+	if(hptr->count >= TIMER_HEAP_MAX)
+	{
+		hal_spl_unlock(&(hptr->spl));
+		return -EAGAIN;
+	}
+	
+	ev->deadline = deadline;
+	ev->cpu = cpu + 1;
+	timer_heap_put(hptr, hptr->count, ev);
+	hptr->count++;
+	timer_heap_fix(hptr, hptr->count - 1);
+	
+	//Reprogram our timer if this is the new soonest event
+	if(hptr->array[0] == ev)
+		timer_heap_alarm(hptr);
+	
+	hal_spl_unlock(&(hptr->spl));
+	return 0;
+}
+
+bool timer_disarm(timer_event_t *ev)
+{
+	//If the event is on another CPU, it may fire while we lock that CPU's heap - so check again after locking.
+	//Leave that CPU's timer alone. If it goes off early, it'll find nothing to do and re-arm itself.
+	int cpu = ev->cpu;
+	if(cpu == 0)
+		return false;
+	
+	timer_heap_t *hptr = &(timer_heap_array[cpu - 1]);
+	hal_spl_lock(&(hptr->spl));
+	bool armed = (ev->cpu == cpu);
+	if(armed)
+	{
+		KASSERT(hptr->array[ev->pos - 1] == ev);
+		timer_heap_remove(hptr, ev->pos - 1);
+	}
+	hal_spl_unlock(&(hptr->spl));
+	return armed;
+}
+
+void timer_fire(void)
+{
+	timer_heap_t *hptr = &(timer_heap_array[hal_cpu_num()]);
+	while(1)
+	{
+		hal_spl_lock(&(hptr->spl));
+		if(hptr->count == 0 || hptr->array[0]->deadline > hal_clock_ns())
+		{
+			//Nothing else due yet
+			timer_heap_alarm(hptr);
+			hal_spl_unlock(&(hptr->spl));
+			return;
+		}
+		
+		//Take the event out of the heap and call it without the lock held.
+		//Once it's out of the heap, its owner can reuse it, so only keep what the call needs.
+		timer_event_t *ev = hptr->array[0];
+		void (*func)(void *arg) = ev->func;
+		void *arg = ev->arg;
+		timer_heap_remove(hptr, 0);
+		hal_spl_unlock(&(hptr->spl));
+		
+		(*func)(arg);
+	}
+}
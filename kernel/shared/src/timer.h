@@ -0,0 +1,43 @@
+//timer.h
+//Kernel timers
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//Event that runs a function at a certain time.
+//Each CPU keeps a heap of events that were armed on it, and fires them from its timer interrupt.
+//Does not provide locking of its own. Callers should serialize arming/disarming any given event.
+typedef struct timer_event_s
+{
+	//Monotonic time when the event fires, in nanoseconds
+	uint64_t deadline;
+	
+	//Function to call when the event fires, in interrupt context with no locks held.
+	//The event may be reused or freed by the time the function is called, so it only gets the argument.
+	void (*func)(void *arg);
+	void *arg;
+	
+	//CPU whose heap holds the event and position in that heap, plus one, or 0 if not armed
+	int cpu;
+	int pos;
+	
+} timer_event_t;
+
+//Returns the current monotonic time in nanoseconds.
+uint64_t timer_now(void);
+
+//Arms an event to fire at the given time, on the calling CPU. Disarms it first if it was already armed.
+//Returns 0 on success or a negative error number.
+int timer_arm(timer_event_t *ev, uint64_t deadline);
+
+//Disarms an event. Returns true if it was still armed, or false if it already fired or was never armed.
+bool timer_disarm(timer_event_t *ev);
+
+//Fires all events due on the calling CPU and sets the timer for the next one.
+//Called on timer interrupts.
+void timer_fire(void);
+
+#endif //TIMER_H
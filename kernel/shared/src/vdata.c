@@ -0,0 +1,146 @@
+//vdata.c
+//Kernel data mapped read-only in userspace
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "vdata.h"
+#include "kassert.h"
+#include "kspace.h"
+
+#include "hal_clock.h"
+#include "hal_kspc.h"
+#include "hal_spl.h"
+#include "hal_uspc.h"
+
+#include <errno.h>
+
+//Shared timekeeping page, as the kernel sees it, and the frame that backs it
+static px_vclock_t *vdata_clock;
+static hal_frame_id_t vdata_clock_frame;
+
+//Spinlock serializing changes to the timekeeping page
+static hal_spl_t vdata_clock_spl;
+
+//Whether the timekeeping page has been filled in
+static bool vdata_clock_ready;
+
+void vdata_init(void)
+{
+	size_t pagesize = hal_frame_size();
+	vdata_clock = kspace_alloc(pagesize, pagesize);
+	KASSERT(vdata_clock != NULL);
+	vdata_clock_frame = hal_kspc_get((uintptr_t)vdata_clock);
+	KASSERT(vdata_clock_frame != HAL_FRAME_ID_INVALID);
+	
+	//Nothing's known until the clocks are calibrated
+	vdata_clock->rtc_base = -1;
+}
+
+void vdata_initcpu(void)
+{
+	hal_spl_lock(&vdata_clock_spl);
+	if(vdata_clock_ready)
+	{
+		hal_spl_unlock(&vdata_clock_spl);
+		return;
+	}
+	
+	vdata_clock->seq++;
+	__sync_synchronize();
+	
+	hal_clock_user_t cu = {0};
+	if(hal_clock_user(&cu))
+	{
+		vdata_clock->flags |= PX_VCLOCK_F_CYCLES;
+		if(cu.cpunum)
+			vdata_clock->flags |= PX_VCLOCK_F_CPUNUM;
+		
+		vdata_clock->cycle_base = cu.base;
+		vdata_clock->cycle_mul = cu.mul;
+		vdata_clock->cycle_div = cu.div;
+	}
+	
+	//Real time is kept as an offset from monotonic time, so it's only read once
+	int64_t rtc = hal_clock_rtc();
+	if(rtc >= 0)
+		vdata_clock->rtc_base = rtc - (int64_t)(hal_clock_ns() / 1000);
+	
+	__sync_synchronize();
+	vdata_clock->seq++;
+	vdata_clock_ready = true;
+	hal_spl_unlock(&vdata_clock_spl);
+}
+
+int vdata_map(mem_space_t *mptr)
+{
+	size_t pagesize = hal_frame_size();
+	KASSERT(mptr->vproc == NULL);
+	mptr->vproc = kspace_alloc(pagesize, pagesize);
+	if(mptr->vproc == NULL)
+		return -ENOMEM;
+	
+	uintptr_t addr = hal_uspc_vdata();
+	hal_frame_id_t proc_frame = hal_kspc_get((uintptr_t)(mptr->vproc));
+	if(hal_uspc_set(mptr->uspc, addr, vdata_clock_frame, false) < 0 ||
+		hal_uspc_set(mptr->uspc, addr + pagesize, proc_frame, false) < 0)
+	{
+		vdata_unmap(mptr);
+		return -ENOMEM;
+	}
+	
+	return 0;
+}
+
+void vdata_unmap(mem_space_t *mptr)
+{
+	if(mptr->vproc == NULL)
+		return;
+	
+	//Neither frame belongs to the space, so take them out before anything frees what's mapped there
+	size_t pagesize = hal_frame_size();
+	uintptr_t addr = hal_uspc_vdata();
+	if(hal_uspc_get(mptr->uspc, addr) != HAL_FRAME_ID_INVALID)
+		hal_uspc_set(mptr->uspc, addr, HAL_FRAME_ID_INVALID, false);
+	if(hal_uspc_get(mptr->uspc, addr + pagesize) != HAL_FRAME_ID_INVALID)
+		hal_uspc_set(mptr->uspc, addr + pagesize, HAL_FRAME_ID_INVALID, false);
+	
+	kspace_free(mptr->vproc, pagesize);
+	mptr->vproc = NULL;
+}
+
+void vdata_setpid(mem_space_t *mptr, pid_t pid)
+{
+	KASSERT(mptr->vproc != NULL);
+	mptr->vproc->pid = pid;
+}
+
+intptr_t vdata_addr(int page)
+{
+	if(page < 0 || page >= HAL_USPC_VDATA_PAGES)
+		return -EINVAL;
+	
+	return hal_uspc_vdata() + (page * hal_frame_size());
+}
+
+int64_t vdata_getrtc(void)
+{
+	hal_spl_lock(&vdata_clock_spl);
+	int64_t base = vdata_clock->rtc_base;
+	hal_spl_unlock(&vdata_clock_spl);
+	
+	if(base < 0)
+		return -ENOSYS;
+	
+	return base + (int64_t)(hal_clock_ns() / 1000);
+}
+
+void vdata_setrtc(int64_t usec)
+{
+	//Readers in userspace don't take the lock - they check that seq is even and unchanged around their read
+	hal_spl_lock(&vdata_clock_spl);
+	vdata_clock->seq++;
+	__sync_synchronize();
+	vdata_clock->rtc_base = usec - (int64_t)(hal_clock_ns() / 1000);
+	__sync_synchronize();
+	vdata_clock->seq++;
+	hal_spl_unlock(&vdata_clock_spl);
+}
@@ -0,0 +1,41 @@
+//vdata.h
+//Kernel data mapped read-only in userspace
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef VDATA_H
+#define VDATA_H
+
+#include "mem.h"
+#include "px.h"
+
+//Every memory space has two pages mapped read-only past the end of its usable addresses.
+//The first holds timekeeping parameters, and is one frame shared by every space.
+//The second holds information about the process, and belongs to the space.
+//User code reads them to answer getpid, clock_gettime, and the like without system calls.
+
+//Sets up the shared timekeeping page. Called before any memory spaces are made.
+void vdata_init(void);
+
+//Fills in the timekeeping page, once clocks are running, reading the real-time clock if there is one.
+//Called on each CPU as it starts scheduling. Only the first does anything.
+void vdata_initcpu(void);
+
+//Maps the pages into a new memory space.
+//Returns 0 on success or a negative error number.
+int vdata_map(mem_space_t *mptr);
+
+//Unmaps the pages from a memory space being deleted, and frees its own.
+void vdata_unmap(mem_space_t *mptr);
+
+//Sets the process ID seen by user code in the given memory space.
+void vdata_setpid(mem_space_t *mptr, pid_t pid);
+
+//Returns the address where the given page is mapped, or a negative error number.
+intptr_t vdata_addr(int page);
+
+//Returns the real time in microseconds since the GPS epoch, or a negative error number if it isn't known.
+int64_t vdata_getrtc(void);
+
+//Sets the real time, in microseconds since the GPS epoch.
+void vdata_setrtc(int64_t usec);
+
+#endif //VDATA_H
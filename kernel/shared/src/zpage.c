@@ -0,0 +1,408 @@
+//zpage.c
+//Compressed in-memory page store
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "zpage.h"
+#include "kassert.h"
+#include "kspace.h"
+#include "libcstubs.h"
+#include "hal_spl.h"
+#include "hal_clock.h"
+
+//Compressed pages are stored in pool pages, carved up into fixed-size chunks.
+//Each pool page tracks which of its chunks are used in a 64-bit mask.
+#define ZPAGE_CHUNK 64
+#define ZPAGE_CHUNKS 64
+
+//Maximum number of pool pages the store can use
+#define ZPAGE_POOL_MAX 4096
+
+//Pages that take more chunks than this to store aren't worth compressing
+#define ZPAGE_CHUNKS_MAX 48
+
+//Each compressed page is stored with a 2-byte length header
+#define ZPAGE_HDR 2
+
+//Size of the hash table used to find matches when compressing
+#define ZPAGE_HASH_BITS 10
+
+//Minimum length of a match, when compressing
+#define ZPAGE_MATCH_MIN 4
+
+//Pool page for storing compressed data
+typedef struct zpage_pool_s
+{
+	uint8_t *page; //Storage, or NULL if not allocated
+	uint64_t used; //Mask of chunks in use
+} zpage_pool_t;
+
+//Spinlock protecting the store and the buffers used for compression
+static hal_spl_t zpage_spl;
+
+//Pool pages for storage
+static zpage_pool_t *zpage_pool_array;
+
+//Pool page to try first when storing
+static size_t zpage_pool_hint;
+
+//Hash table of recent positions in the page being compressed
+static uint16_t zpage_hash[1 << ZPAGE_HASH_BITS];
+
+//Buffers for page contents and their compressed version
+static uint8_t zpage_buf[4096];
+static uint8_t zpage_cbuf[4096];
+
+//Statistics
+static uint64_t zpage_stat_stored;
+static uint64_t zpage_stat_bytes;
+static uint64_t zpage_stat_frames;
+static uint64_t zpage_stat_evicted;
+static uint64_t zpage_stat_rejected;
+static uint64_t zpage_stat_faults;
+static uint64_t zpage_stat_fault_cycles;
+static uint64_t zpage_stat_copied;
+
+//Reads 4 bytes from a possibly-unaligned position
+static uint32_t zpage_read32(const uint8_t *ptr)
+{
+	return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+}
+
+//Returns the hash table index for the given 4 bytes
+static size_t zpage_hashof(uint32_t val)
+{
+	return (val * 2654435761u) >> (32 - ZPAGE_HASH_BITS);
+}
+
+//Writes a sequence to the compressed output - literals, and then a match unless mlen is 0.
+//Returns the new output position, or 0 if there wasn't enough room.
+static size_t zpage_emit(uint8_t *out, size_t op, size_t out_max, const uint8_t *lit, size_t llen, size_t off, size_t mlen)
+{
+	//Worst case - token, literal length, literals, offset, match length
+	if(op + 1 + (llen / 255) + 1 + llen + 2 + (mlen / 255) + 1 > out_max)
+		return 0;
+
+	//Token has 4 bits each for literal length and match length, with longer lengths continued in following bytes
+	size_t mcode = (mlen > 0) ? (mlen - ZPAGE_MATCH_MIN) : 0;
+	out[op++] = ((llen < 15 ? llen : 15) << 4) | (mcode < 15 ? mcode : 15);
+
+	if(llen >= 15)
+	{
+		size_t rem = llen - 15;
+		while(rem >= 255)
+		{
+			out[op++] = 255;
+			rem -= 255;
+		}
+		out[op++] = rem;
+	}
+
+	memcpy(out + op, lit, llen);
+	op += llen;
+
+	if(mlen == 0)
+		return op; //Last sequence has no match
+
+	out[op++] = off & 0xFF;
+	out[op++] = off >> 8;
+
+	if(mcode >= 15)
+	{
+		size_t rem = mcode - 15;
+		while(rem >= 255)
+		{
+			out[op++] = 255;
+			rem -= 255;
+		}
+		out[op++] = rem;
+	}
+
+	return op;
+}
+
+//Compresses data with a simple LZ77 scheme, like LZ4.
+//Returns the compressed length, or 0 if it didn't fit in the output.
+static size_t zpage_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_max)
+{
+	memset(zpage_hash, 0, sizeof(zpage_hash));
+
+	size_t ip = 0;
+	size_t op = 0;
+	size_t anchor = 0;
+	while(ip + ZPAGE_MATCH_MIN <= in_len)
+	{
+		//See if we've seen these bytes recently
+		uint32_t seq = zpage_read32(in + ip);
+		size_t hh = zpage_hashof(seq);
+		size_t cand = zpage_hash[hh];
+		zpage_hash[hh] = ip;
+		if(cand >= ip || zpage_read32(in + cand) != seq)
+		{
+			ip++;
+			continue;
+		}
+
+		//Found a match - see how far it goes
+		size_t mlen = ZPAGE_MATCH_MIN;
+		while(ip + mlen < in_len && in[cand + mlen] == in[ip + mlen])
+		{
+			mlen++;
+		}
+
+		op = zpage_emit(out, op, out_max, in + anchor, ip - anchor, ip - cand, mlen);
+		if(op == 0)
+			return 0;
+
+		ip += mlen;
+		anchor = ip;
+	}
+
+	//Finish with whatever literals are left
+	op = zpage_emit(out, op, out_max, in + anchor, in_len - anchor, 0, 0);
+	return op;
+}
+
+//Decompresses data made by zpage_compress.
+static void zpage_decompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len)
+{
+	size_t ip = 0;
+	size_t op = 0;
+	while(ip < in_len)
+	{
+		uint8_t token = in[ip++];
+
+		size_t llen = token >> 4;
+		if(llen == 15)
+		{
+			uint8_t more;
+			do
+			{
+				more = in[ip++];
+				llen += more;
+			} while(more == 255);
+		}
+
+		KASSERT(ip + llen <= in_len && op + llen <= out_len);
+		memcpy(out + op, in + ip, llen);
+		ip += llen;
+		op += llen;
+
+		if(ip >= in_len)
+			break; //Last sequence has no match
+
+		size_t off = in[ip] | (in[ip + 1] << 8);
+		ip += 2;
+
+		size_t mlen = (token & 0xF) + ZPAGE_MATCH_MIN;
+		if((token & 0xF) == 15)
+		{
+			uint8_t more;
+			do
+			{
+				more = in[ip++];
+				mlen += more;
+			} while(more == 255);
+		}
+
+		//Matches may overlap what they produce, so copy a byte at a time
+		KASSERT(off > 0 && off <= op && op + mlen <= out_len);
+		for(size_t bb = 0; bb < mlen; bb++)
+		{
+			out[op] = out[op - off];
+			op++;
+		}
+	}
+
+	KASSERT(op == out_len);
+}
+
+//Finds space for the given number of chunks, allocating a new pool page if needed.
+//Returns the handle for the space, or 0 if there's no room.
+static uint64_t zpage_chunks_alloc(size_t nchunks)
+{
+	KASSERT(nchunks > 0 && nchunks < ZPAGE_CHUNKS);
+	uint64_t mask = (1ull << nchunks) - 1;
+
+	if(zpage_pool_array == NULL)
+	{
+		zpage_pool_array = kspace_alloc(sizeof(zpage_pool_t) * ZPAGE_POOL_MAX, alignof(zpage_pool_t));
+		if(zpage_pool_array == NULL)
+			return 0;
+	}
+
+	//Look for room in the existing pool pages, remembering the first empty spot in case we need a new one
+	size_t unused = ZPAGE_POOL_MAX;
+	for(size_t searched = 0; searched < ZPAGE_POOL_MAX; searched++)
+	{
+		size_t pp = (zpage_pool_hint + searched) % ZPAGE_POOL_MAX;
+		zpage_pool_t *pool = &(zpage_pool_array[pp]);
+		if(pool->page == NULL)
+		{
+			if(unused == ZPAGE_POOL_MAX)
+				unused = pp;
+
+			continue;
+		}
+
+		if(pool->used == ~0ull)
+			continue;
+
+		for(size_t cc = 0; cc + nchunks <= ZPAGE_CHUNKS; cc++)
+		{
+			if(pool->used & (mask << cc))
+				continue;
+
+			pool->used |= mask << cc;
+			zpage_pool_hint = pp;
+			return (pp * ZPAGE_CHUNKS) + cc + 1;
+		}
+	}
+
+	if(unused == ZPAGE_POOL_MAX)
+		return 0; //Store is full
+
+	zpage_pool_t *pool = &(zpage_pool_array[unused]);
+	pool->page = kspace_alloc(ZPAGE_CHUNK * ZPAGE_CHUNKS, ZPAGE_CHUNK * ZPAGE_CHUNKS);
+	if(pool->page == NULL)
+		return 0;
+
+	zpage_stat_frames++;
+	pool->used = mask;
+	zpage_pool_hint = unused;
+	return (unused * ZPAGE_CHUNKS) + 1;
+}
+
+//Returns where the data for a handle is stored.
+static uint8_t *zpage_chunks_ptr(uint64_t handle)
+{
+	KASSERT(handle > 0 && handle <= ZPAGE_POOL_MAX * ZPAGE_CHUNKS);
+	zpage_pool_t *pool = &(zpage_pool_array[(handle - 1) / ZPAGE_CHUNKS]);
+	KASSERT(pool->page != NULL);
+	return pool->page + (ZPAGE_CHUNK * ((handle - 1) % ZPAGE_CHUNKS));
+}
+
+//Releases the chunks used for the given handle, freeing the pool page when it's empty.
+static void zpage_chunks_free(uint64_t handle)
+{
+	uint8_t *data = zpage_chunks_ptr(handle);
+	size_t clen = data[0] | (data[1] << 8);
+	size_t nchunks = (clen + ZPAGE_HDR + ZPAGE_CHUNK - 1) / ZPAGE_CHUNK;
+	uint64_t mask = ((1ull << nchunks) - 1) << ((handle - 1) % ZPAGE_CHUNKS);
+
+	zpage_pool_t *pool = &(zpage_pool_array[(handle - 1) / ZPAGE_CHUNKS]);
+	KASSERT((pool->used & mask) == mask);
+	pool->used &= ~mask;
+
+	zpage_stat_stored--;
+	zpage_stat_bytes -= clen;
+
+	if(pool->used == 0)
+	{
+		kspace_free(pool->page, ZPAGE_CHUNK * ZPAGE_CHUNKS);
+		pool->page = NULL;
+		zpage_stat_frames--;
+	}
+}
+
+//Compresses the page in zpage_buf into the store. Call with the store locked.
+static uint64_t zpage_put_locked(void)
+{
+	KASSERT(sizeof(zpage_buf) == hal_frame_size());
+
+	size_t clen = zpage_compress(zpage_buf, sizeof(zpage_buf), zpage_cbuf, (ZPAGE_CHUNKS_MAX * ZPAGE_CHUNK) - ZPAGE_HDR);
+	if(clen == 0)
+	{
+		zpage_stat_rejected++;
+		return 0;
+	}
+
+	uint64_t handle = zpage_chunks_alloc((clen + ZPAGE_HDR + ZPAGE_CHUNK - 1) / ZPAGE_CHUNK);
+	if(handle == 0)
+		return 0;
+
+	uint8_t *data = zpage_chunks_ptr(handle);
+	data[0] = clen & 0xFF;
+	data[1] = clen >> 8;
+	memcpy(data + ZPAGE_HDR, zpage_cbuf, clen);
+
+	zpage_stat_stored++;
+	zpage_stat_bytes += clen;
+	zpage_stat_evicted++;
+	return handle;
+}
+
+//Decompresses the page with the given handle into zpage_buf. Call with the store locked.
+static void zpage_get_locked(uint64_t handle, bool keep)
+{
+	const uint8_t *data = zpage_chunks_ptr(handle);
+	size_t clen = data[0] | (data[1] << 8);
+	zpage_decompress(data + ZPAGE_HDR, clen, zpage_buf, sizeof(zpage_buf));
+
+	if(keep)
+		zpage_stat_copied++;
+	else
+		zpage_chunks_free(handle);
+}
+
+uint64_t zpage_put(const void *page)
+{
+	hal_spl_lock(&zpage_spl);
+	memcpy(zpage_buf, page, sizeof(zpage_buf));
+	uint64_t handle = zpage_put_locked();
+	hal_spl_unlock(&zpage_spl);
+	return handle;
+}
+
+uint64_t zpage_put_frame(hal_frame_id_t frame)
+{
+	hal_spl_lock(&zpage_spl);
+	hal_frame_read(frame, zpage_buf);
+	uint64_t handle = zpage_put_locked();
+	hal_spl_unlock(&zpage_spl);
+	return handle;
+}
+
+void zpage_get(uint64_t handle, void *page, bool keep)
+{
+	hal_spl_lock(&zpage_spl);
+	zpage_get_locked(handle, keep);
+	memcpy(page, zpage_buf, sizeof(zpage_buf));
+	hal_spl_unlock(&zpage_spl);
+}
+
+void zpage_get_frame(uint64_t handle, hal_frame_id_t frame, bool keep)
+{
+	hal_spl_lock(&zpage_spl);
+	zpage_get_locked(handle, keep);
+	hal_frame_write(frame, zpage_buf);
+	hal_spl_unlock(&zpage_spl);
+}
+
+void zpage_free(uint64_t handle)
+{
+	hal_spl_lock(&zpage_spl);
+	zpage_chunks_free(handle);
+	hal_spl_unlock(&zpage_spl);
+}
+
+void zpage_fault_count(uint64_t cycles)
+{
+	hal_spl_lock(&zpage_spl);
+	zpage_stat_faults++;
+	zpage_stat_fault_cycles += cycles;
+	hal_spl_unlock(&zpage_spl);
+}
+
+void zpage_getstat(px_mem_stat_t *out)
+{
+	hal_spl_lock(&zpage_spl);
+	out->zpage_stored = zpage_stat_stored;
+	out->zpage_bytes = zpage_stat_bytes;
+	out->zpage_frames = zpage_stat_frames;
+	out->zpage_evicted = zpage_stat_evicted;
+	out->zpage_rejected = zpage_stat_rejected;
+	out->zpage_faults = zpage_stat_faults;
+	out->zpage_fault_cycles = zpage_stat_fault_cycles;
+	out->zpage_copied = zpage_stat_copied;
+	hal_spl_unlock(&zpage_spl);
+}
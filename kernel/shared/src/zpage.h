@@ -0,0 +1,41 @@
+//zpage.h
+//Compressed in-memory page store
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef ZPAGE_H
+#define ZPAGE_H
+
+#include "hal_frame.h"
+#include "px.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+//Pages evicted from memory are compressed and kept in a store, until they're needed again.
+//Each stored page is identified by a nonzero handle.
+//Handles fit in 48 bits, so users can tag them alongside pointers and frame addresses.
+
+//Compresses a page of kernel memory into the store.
+//Returns a nonzero handle, or 0 if the page didn't compress well enough to be worth storing.
+uint64_t zpage_put(const void *page);
+
+//Compresses a physical frame into the store.
+//Returns a nonzero handle, or 0 if the page didn't compress well enough to be worth storing.
+uint64_t zpage_put_frame(hal_frame_id_t frame);
+
+//Decompresses a page from the store into a page of kernel memory.
+//Unless keep is set, the page is removed from the store and its handle becomes invalid.
+void zpage_get(uint64_t handle, void *page, bool keep);
+
+//Decompresses a page from the store into a physical frame.
+//Unless keep is set, the page is removed from the store and its handle becomes invalid.
+void zpage_get_frame(uint64_t handle, hal_frame_id_t frame, bool keep);
+
+//Removes a page from the store without decompressing it.
+void zpage_free(uint64_t handle);
+
+//Counts a fault that brought a page back from the store, and the CPU cycles spent handling it.
+void zpage_fault_count(uint64_t cycles);
+
+//Fills in statistics about the compressed store.
+void zpage_getstat(px_mem_stat_t *out);
+
+#endif //ZPAGE_H
@@ -0,0 +1,229 @@
+//zygote.c
+//Templates of loaded programs, for starting them again quickly
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "zygote.h"
+#include "elf64.h"
+#include "fd.h"
+#include "kassert.h"
+#include "kspace.h"
+
+#include "hal_spl.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+//Template of a loaded program
+typedef struct zygote_s
+{
+	//File the program was loaded from
+	ino_t ino;
+	
+	//Memory space with the program loaded, and where it starts
+	mem_space_t *mem;
+	uintptr_t entry;
+	
+	//Number of memory spaces being copied from the template right now
+	int busy;
+	
+	//Whether the template was taken out of the table, and should be deleted once it's not busy
+	bool stale;
+	
+} zygote_t;
+
+//Table of templates, and spinlock protecting them and their statistics
+static hal_spl_t zygote_spl;
+static zygote_t *zygote_array[ZYGOTE_MAX];
+
+//Number of templates in the table, checked without locking to skip the work when there's none
+static volatile int zygote_count;
+
+//Statistics
+static uint64_t zygote_stat_spawned;
+
+//Looks up the RAMfs file open as the given file descriptor, outputting its inode.
+//Returns 0 on success or a negative error number.
+static int zygote_ino(id_t fdid, ino_t *ino_out)
+{
+	fd_t *fptr = fd_getlocked(fdid);
+	if(fptr == NULL)
+		return -EBADF;
+	
+	bool regular = S_ISREG(fptr->mode);
+	*ino_out = fptr->ino;
+	fd_unlock(fptr);
+	
+	if(!regular)
+		return -EACCES;
+	
+	return 0;
+}
+
+//Takes the template for the given file out of the table, if any.
+//Returns it, if it should be deleted by the caller after unlocking.
+static zygote_t *zygote_remove(ino_t ino)
+{
+	for(int zz = 0; zz < ZYGOTE_MAX; zz++)
+	{
+		zygote_t *zptr = zygote_array[zz];
+		if(zptr == NULL || zptr->ino != ino)
+			continue;
+		
+		zygote_array[zz] = NULL;
+		zygote_count--;
+		
+		//Whoever is copying it deletes it when they're done
+		zptr->stale = true;
+		return (zptr->busy > 0) ? NULL : zptr;
+	}
+	
+	return NULL;
+}
+
+//Deletes a template that's out of the table and no longer busy.
+static void zygote_delete(zygote_t *zptr)
+{
+	if(zptr == NULL)
+		return;
+	
+	KASSERT(zptr->stale && zptr->busy == 0);
+	mem_space_retire(zptr->mem);
+	kspace_free(zptr, sizeof(*zptr));
+}
+
+int zygote_make(id_t fdid)
+{
+	ino_t ino = 0;
+	int ino_err = zygote_ino(fdid, &ino);
+	if(ino_err < 0)
+		return ino_err;
+	
+	zygote_t *zptr = kspace_alloc(sizeof(zygote_t), alignof(zygote_t));
+	if(zptr == NULL)
+		return -ENOMEM;
+	
+	zptr->ino = ino;
+	zptr->mem = mem_space_new();
+	if(zptr->mem == NULL)
+	{
+		kspace_free(zptr, sizeof(*zptr));
+		return -ENOMEM;
+	}
+	
+	int elf_err = elf64_load(fdid, zptr->mem, &(zptr->entry));
+	if(elf_err < 0)
+	{
+		mem_space_delete(zptr->mem);
+		kspace_free(zptr, sizeof(*zptr));
+		return elf_err;
+	}
+	
+	//Share all the pages, so copies only need their own pagetables until they write
+	mem_space_share(zptr->mem);
+	
+	//Put the template in place of any older one for the same file
+	hal_spl_lock(&zygote_spl);
+	zygote_t *old = zygote_remove(ino);
+	int slot = -1;
+	for(int zz = 0; zz < ZYGOTE_MAX; zz++)
+	{
+		if(zygote_array[zz] == NULL)
+		{
+			slot = zz;
+			break;
+		}
+	}
+	
+	if(slot >= 0)
+	{
+		zygote_array[slot] = zptr;
+		zygote_count++;
+	}
+	hal_spl_unlock(&zygote_spl);
+	
+	zygote_delete(old);
+	if(slot < 0)
+	{
+		//No room in the table
+		zptr->stale = true;
+		zygote_delete(zptr);
+		return -ENOSPC;
+	}
+	
+	return 0;
+}
+
+int zygote_drop(id_t fdid)
+{
+	ino_t ino = 0;
+	int ino_err = zygote_ino(fdid, &ino);
+	if(ino_err < 0)
+		return ino_err;
+	
+	zygote_forget(ino);
+	return 0;
+}
+
+mem_space_t *zygote_spawn(id_t fdid, uintptr_t *entry_out)
+{
+	if(zygote_count <= 0)
+		return NULL;
+	
+	ino_t ino = 0;
+	if(zygote_ino(fdid, &ino) < 0)
+		return NULL;
+	
+	//Find the template and keep it around while we copy it
+	zygote_t *zptr = NULL;
+	hal_spl_lock(&zygote_spl);
+	for(int zz = 0; zz < ZYGOTE_MAX; zz++)
+	{
+		if(zygote_array[zz] != NULL && zygote_array[zz]->ino == ino)
+		{
+			zptr = zygote_array[zz];
+			zptr->busy++;
+			break;
+		}
+	}
+	hal_spl_unlock(&zygote_spl);
+	
+	if(zptr == NULL)
+		return NULL;
+	
+	//Nothing changes the template's pages once it's made, so it can be copied by several at once
+	mem_space_t *mem = mem_space_fork(zptr->mem);
+	*entry_out = zptr->entry;
+	
+	hal_spl_lock(&zygote_spl);
+	zptr->busy--;
+	bool done = zptr->stale && zptr->busy == 0;
+	if(mem != NULL)
+		zygote_stat_spawned++;
+	hal_spl_unlock(&zygote_spl);
+	
+	if(done)
+		zygote_delete(zptr);
+	
+	return mem;
+}
+
+void zygote_forget(ino_t ino)
+{
+	if(zygote_count <= 0)
+		return;
+	
+	hal_spl_lock(&zygote_spl);
+	zygote_t *old = zygote_remove(ino);
+	hal_spl_unlock(&zygote_spl);
+	
+	zygote_delete(old);
+}
+
+void zygote_getstat(px_mem_stat_t *out)
+{
+	hal_spl_lock(&zygote_spl);
+	out->zygote_count = zygote_count;
+	out->zygote_spawned = zygote_stat_spawned;
+	hal_spl_unlock(&zygote_spl);
+}
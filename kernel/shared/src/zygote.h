@@ -0,0 +1,41 @@
+//zygote.h
+//Templates of loaded programs, for starting them again quickly
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include "mem.h"
+#include "px.h"
+#include <sys/types.h>
+
+//Programs run over and over, like the shell and common utilities, can be kept loaded as templates.
+//A template is a memory space with the program loaded, whose pages are all shared as merged frames.
+//Executing the same file again copies the template, sharing its pages until they're written, rather than loading the file.
+//Templates are found by the file they were loaded from, and dropped if the file changes.
+//They hold only what's loaded from the file, not any state from running the program.
+//Their memory isn't charged to any process, so only init may make them.
+
+//Most templates kept at once
+#ifndef ZYGOTE_MAX
+	#define ZYGOTE_MAX 16
+#endif
+
+//Loads the executable open as the given file descriptor into a new template, replacing any for the same file.
+//Returns 0 on success or a negative error number.
+int zygote_make(id_t fdid);
+
+//Drops the template made from the file open as the given file descriptor.
+//Returns 0 on success or a negative error number.
+int zygote_drop(id_t fdid);
+
+//Makes a new memory space from the template for the file open as the given file descriptor, outputting its entry point.
+//Returns NULL if there's no template, or no memory to copy it.
+mem_space_t *zygote_spawn(id_t fdid, uintptr_t *entry_out);
+
+//Drops any template made from the given RAMfs file, as when the file is changed or deleted.
+void zygote_forget(ino_t ino);
+
+//Fills in statistics about templates.
+void zygote_getstat(px_mem_stat_t *out);
+
+#endif //ZYGOTE_H
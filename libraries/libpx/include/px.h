@@ -105,6 +105,14 @@ int px_fd_close(int fd);
 //Returns a negative error number, or doesn't return on success.
 int px_fd_exec(int fd, char * const * argv, char * const * envp);
 
+//Keeps the program represented by the given file descriptor loaded as a template, if keep is nonzero, or drops it.
+//Later executions of the same file copy the template, sharing its pages until written, rather than loading the file again.
+//The template is dropped automatically if the file is written, truncated, or deleted.
+//It holds the program as loaded from the file, before it's run - not the state of an initialized process.
+//Only init may keep or drop templates.
+//Returns 0 on success or a negative error number.
+int px_fd_zygote(int fd, int keep);
+
 //Makes another reference to an existing file descriptor.
 //newmin specifies the minimum file descriptor number to use for the new reference.
 //overwrite specifies whether to search for a free number starting at newmin, or just overwrite the one at newmin.
@@ -122,6 +130,7 @@ int px_fd_dup(int oldfd, int newmin, bool overwrite);
 #define PX_FD_IOCTL_SETPGRP 6
 #define PX_FD_IOCTL_GETGFXM 7 //Get graphics mode
 #define PX_FD_IOCTL_SETGFXM 8 //Set graphics mode
+#define PX_FD_IOCTL_RDTIMEO 9 //Set read timeout - int64_t nanoseconds, 0 to wait forever. Reads time out with -EAGAIN.
 int px_fd_ioctl(int fd, uint64_t request, void *ptr, size_t len);
 
 //Sets the working directory of the calling process to that described by the given file descriptor.
@@ -139,6 +148,33 @@ pid_t px_getpid(void);
 //Returns the process ID of the parent of the calling process.
 pid_t px_getppid(void);
 
+//Returns the thread ID of the calling thread.
+int px_gettid(void);
+
+//Starts a new thread in the calling process.
+//The thread begins executing at entry_pc, with the given stack pointer and thread pointer, and arg as its first parameter.
+//It starts with the signal mask of the calling thread.
+//Returns the ID of the new thread or a negative error number.
+int px_thread_create(uintptr_t entry_pc, uintptr_t stack_ptr, uintptr_t tls_ptr, uintptr_t arg);
+
+//Terminates the calling thread. If it was the last thread in the process, the process exits with status 0.
+void px_thread_exit(void);
+
+//Waits for the given thread in the calling process to terminate.
+//Once this returns, the thread no longer uses its stack or thread-local storage.
+//Returns 0 on success or a negative error number.
+int px_thread_join(int tid);
+
+//Waits until woken on the given 8-byte-aligned word, if it still holds the expected value.
+//Gives up after the given number of nanoseconds, unless timeout is negative.
+//Returns 0 when woken (or possibly spuriously), or a negative error number.
+//Returns -EAGAIN if the word held something else, -ETIMEDOUT if the time passed, or -EINTR on a signal.
+int px_futex_wait(volatile uint64_t *word, uint64_t expected, int64_t timeout);
+
+//Wakes up to count threads waiting on the given word in the calling process, oldest first.
+//Returns the number of threads woken or a negative error number.
+int px_futex_wake(volatile uint64_t *word, int count);
+
 //Returns the process group ID of the given process, or the calling process if pid==0.
 pid_t px_getpgid(pid_t pid);
 
@@ -167,9 +203,11 @@ typedef struct px_rusage_s
 	int64_t utime_usec;
 	int64_t stime_sec;
 	int64_t stime_usec;
+	int64_t nvcsw; //Context switches from waiting for something
+	int64_t nivcsw; //Context switches from being preempted
 } px_rusage_t;
 
-//Returns resource usage for the current thread, current process, or process and all children.
+//Returns resource usage for the current thread, current process, or its children that have been waited on.
 #define PX_RUSAGE_THREAD 1
 #define PX_RUSAGE_PROCESS 0
 #define PX_RUSAGE_CHILDREN -1
@@ -218,6 +256,36 @@ int64_t px_getrtc(void);
 //Returns 0 on success or a negative error number.
 int px_setrtc(int64_t val);
 
+//Timekeeping data that the kernel maps read-only in every process, so time can be read without system calls.
+//seq is odd while the kernel is changing the data. Readers retry until they see the same even value before and after.
+typedef struct px_vclock_s
+{
+	uint64_t seq; //Changes whenever the rest does
+	uint64_t flags; //PX_VCLOCK_F_* flags
+	uint64_t cycle_base; //Cycle count at monotonic time zero
+	uint64_t cycle_mul; //Monotonic time in nanoseconds is (cycles - cycle_base) * cycle_mul / cycle_div
+	uint64_t cycle_div;
+	int64_t rtc_base; //Real time at monotonic time zero, in microseconds since the GPS epoch, or negative if unknown
+} px_vclock_t;
+
+#define PX_VCLOCK_F_CYCLES 1 //User code can read the cycle counter and compute the time itself
+#define PX_VCLOCK_F_CPUNUM 2 //Reading the cycle counter with the CPU ID also gives the index of the CPU
+
+//Data about the calling process that the kernel maps read-only in it
+typedef struct px_vproc_s
+{
+	pid_t pid; //Process ID
+} px_vproc_t;
+
+//Pages of kernel-maintained data that can be located with px_vdata
+#define PX_VDATA_CLOCK 0 //px_vclock_t, shared by all processes
+#define PX_VDATA_PROC 1 //px_vproc_t, about the calling process
+
+//Returns the address where the given page of kernel-maintained data is mapped in the calling process.
+//The addresses are the same in every process and never change.
+//Returns a negative error number on failure.
+intptr_t px_vdata(int page);
+
 //Creates a copy of the calling process.
 //The new process retains references to all file descriptors at their same numbers.
 //The new process starts with a copy of all memory from the calling process.
@@ -244,13 +312,58 @@ typedef struct px_wait_s
 //Returns the size of structure filled or a negative error number.
 ssize_t px_wait(idtype_t id_type, int64_t id, int options, px_wait_t *ptr, size_t len);
 
-//Sets or gets priority for the given user/process/pgrp.
+//Priorities used by the kernel. Lower numbers get more of the CPU.
+//Threads with priority below PX_PRIO_BATCH share the CPU, with longer time-slices for lower numbers.
+//Threads with priority PX_PRIO_BATCH or more only run when no others are waiting.
+#define PX_PRIO_MAX 99
+#define PX_PRIO_DEFAULT 20
+#define PX_PRIO_BATCH 40
+
+//Sets or gets priority for the given thread/process/pgrp, or all threads (P_ALL).
 //Returns the old priority or a negative error number.
 //Pass -1 as ID to mean "this".
 //The kernel uses priority 0-99. Pass -1 to prval to query without changing.
+//New threads and processes inherit the priority of the thread that made them.
 int px_priority(idtype_t id_type, int64_t id, int prval);
 
-//Sets a timer. The timer starts counting down from the given value.
+//Maximum number of CPUs supported
+#define PX_CPU_MAX 256
+
+//Set of CPUs, one bit for each by index
+typedef struct px_cpuset_s
+{
+	uint64_t bits[PX_CPU_MAX / 64];
+} px_cpuset_t;
+
+//Sets or gets the CPUs that the given thread/process/pgrp, or all threads (P_ALL), may run on.
+//Pass -1 as ID to mean "this".
+//If set_ptr is not NULL, changes the set. Sets that contain no CPUs that exist are rejected.
+//If old_ptr is not NULL, stores the previous set there.
+//New threads and processes inherit the set of the thread that made them.
+//Returns 0 on success or a negative error number.
+int px_affinity(idtype_t id_type, int64_t id, const px_cpuset_t *set_ptr, px_cpuset_t *old_ptr);
+
+//Statistics about scheduling, system-wide
+typedef struct px_sched_stat_s
+{
+	uint64_t cpus; //Number of CPUs running threads
+	uint64_t idle_watch; //Nonzero if idle CPUs wait on memory for new work, rather than halting until an interrupt
+	uint64_t wakes; //Number of times an idle CPU was woken to run a thread
+	uint64_t wake_ns; //Total nanoseconds between asking idle CPUs to wake and them picking up a thread
+	uint64_t wake_ipis; //Number of interprocessor interrupts sent to wake idle CPUs
+	uint64_t handoffs; //Number of times a thread gave the rest of its time-slice to a thread it woke (i.e. pipe writer to reader)
+} px_sched_stat_t;
+
+//Returns statistics about scheduling.
+//Returns the number of bytes written or a negative error number.
+ssize_t px_sched_stat(px_sched_stat_t *out_ptr, size_t out_len);
+
+//Number of timers available to each process. Each raises SIGALRM in the process when it expires.
+//Timers aren't inherited on fork.
+#define PX_TIMER_MAX 4
+
+//Sets a timer. The timer starts counting down from the given value. A value of 0 stops the timer.
+//No flags are defined yet - pass 0.
 //If interval is nonzero, the timer will be reloaded automatically with interval on expiration.
 //Returns the previous value of the timer on success or a negative error number.
 int64_t px_timer_set(timer_t id, int flags, int64_t value_ns, int64_t interval_ns);
@@ -263,6 +376,9 @@ int64_t px_timer_get(timer_t id);
 #define PX_MEM_W 2
 #define PX_MEM_X 1
 
+//Flag for px_mem_anon to back memory with huge pages, where aligned huge pages fit in the region
+#define PX_MEM_HUGE 0x100
+
 //Finds a free region of at least the given size, near the given address, in the calling process's memory map.
 //Returns the address of the region or a negative error number.
 intptr_t px_mem_avail(uintptr_t around, size_t size);
@@ -272,5 +388,103 @@ intptr_t px_mem_avail(uintptr_t around, size_t size);
 //Returns 0 on success or a negative error number.
 int px_mem_anon(uintptr_t start, size_t size, int prot);
 
+//Statistics about physical memory usage, system-wide
+typedef struct px_mem_stat_s
+{
+	uint64_t frame_size; //Size of a page, in bytes
+	uint64_t frames_free; //Number of pages of memory free
+	uint64_t huge_size; //Size of a huge page, in bytes
+	uint64_t huge_free; //Number of huge pages of memory free and contiguous, not counting broken-up ones until they are reassembled
+	uint64_t huge_mapped; //Number of huge pages mapped in userspace
+	uint64_t huge_fallback; //Number of times huge pages were wanted, but small pages were used instead
+	uint64_t zpage_stored; //Number of pages currently evicted into the compressed store
+	uint64_t zpage_bytes; //Number of bytes those pages occupy after compression
+	uint64_t zpage_frames; //Number of pages of memory used by the compressed store
+	uint64_t zpage_evicted; //Number of times pages were evicted into the compressed store
+	uint64_t zpage_rejected; //Number of times pages were left in memory because they didn't compress well
+	uint64_t zpage_faults; //Number of times pages were brought back from the compressed store, by faults or file access
+	uint64_t zpage_fault_cycles; //Total CPU cycles spent handling those, from allocating memory for the page to mapping it
+	uint64_t merge_frames; //Number of frames shared by merging identical pages
+	uint64_t merge_saved; //Number of pages of memory saved by merging identical pages
+	uint64_t teardown_pending; //Number of pages waiting to be freed by background teardown of exited processes and deleted files
+	uint64_t teardown_deferred; //Number of times teardown was left to the background
+	uint64_t teardown_inline; //Number of times teardown was done immediately, because of a backlog or low memory
+	uint64_t zygote_count; //Number of programs kept loaded as templates
+	uint64_t zygote_spawned; //Number of times a program was started by copying a template rather than loading it
+	uint64_t zpage_copied; //Number of times compressed pages were copied for a fork, leaving them in the store
+} px_mem_stat_t;
+
+//Returns statistics about physical memory usage.
+//Returns the number of bytes written or a negative error number.
+ssize_t px_mem_stat(px_mem_stat_t *out_ptr, size_t out_len);
+
+//Operations that can be submitted through a ring, each acting like the system call of the same name.
+#define PX_RING_OP_NOP       0 //Does nothing; completes with 0
+#define PX_RING_OP_FD_FIND   1 //fd = directory searched, ptr = name
+#define PX_RING_OP_FD_READ   2 //fd, ptr = buffer, len = length
+#define PX_RING_OP_FD_WRITE  3 //fd, ptr = buffer, len = length
+#define PX_RING_OP_FD_SEEK   4 //fd, arg = offset, len = whence
+#define PX_RING_OP_FD_STAT   5 //fd, ptr = px_fd_stat_t buffer, len = length
+#define PX_RING_OP_FD_CLOSE  6 //fd
+#define PX_RING_OP_FD_CREATE 7 //fd = directory, ptr = name, len = mode, arg = spec
+#define PX_RING_OP_FD_TRUNC  8 //fd, arg = size
+#define PX_RING_OP_FD_UNLINK 9 //fd = directory, ptr = name, arg = onlyfd, len = rmdir
+
+//Flags on a submission
+#define PX_RING_SQE_LINK   1 //Next submission is only performed if this one succeeds - otherwise it completes with -ECANCELED.
+#define PX_RING_SQE_FDPREV 2 //Use the result of the previous submission, which must link to this one, as the file descriptor.
+
+//Submission - one operation to perform
+typedef struct px_ring_sqe_s
+{
+	uint16_t op; //Operation to perform, PX_RING_OP_*
+	uint16_t flags; //PX_RING_SQE_* flags
+	int32_t fd; //File descriptor acted on, or directory searched
+	uint64_t ptr; //Name or buffer in the calling process
+	uint64_t len; //Length of buffer, or other parameter as above
+	int64_t arg; //Other parameter as above
+	uint64_t user; //Returned unchanged in the completion
+} px_ring_sqe_t;
+
+//Completion - result of one operation performed
+typedef struct px_ring_cqe_s
+{
+	uint64_t user; //As passed in the submission
+	int64_t result; //Value the corresponding system call would have returned
+} px_ring_cqe_t;
+
+//Ring of submissions and completions, in memory shared between userspace and the kernel.
+//Each queue has the given number of entries, a power of two. Counters run freely and are taken modulo the size.
+//Userspace fills submissions, then advances sq_tail. The kernel performs them in order, posting completions at cq_tail.
+//The kernel stops when the completion queue is full - userspace advances cq_head as it consumes completions.
+//The counters are shared, so userspace should access them atomically, with a full barrier between posting and checking flags.
+typedef struct px_ring_s
+{
+	uint64_t sq_head; //Submissions taken - advanced by the kernel
+	uint64_t sq_tail; //Submissions posted - advanced by userspace
+	uint64_t cq_head; //Completions consumed - advanced by userspace
+	uint64_t cq_tail; //Completions posted - advanced by the kernel, and woken as a futex when polled
+	uint64_t flags; //PX_RING_F_* flags, set by the kernel
+	uint64_t size; //Number of entries in each queue
+	px_ring_sqe_t *sq; //Array of submissions
+	px_ring_cqe_t *cq; //Array of completions
+} px_ring_t;
+
+//Flags set by the kernel on a ring
+#define PX_RING_F_SLEEP 1 //Polling thread is asleep - call px_ring_enter after posting submissions
+
+//Performs submissions posted to the given ring, until there are none left or the completion queue is full.
+//Operations run in order. A chain of linked operations ends early at the last one posted.
+//If the ring is being polled, just wakes the polling thread instead.
+//Returns the number of submissions performed or a negative error number.
+int px_ring_enter(px_ring_t *ring);
+
+//Starts a thread in the kernel which performs submissions to the given ring as they're posted, without system calls.
+//It runs at batch priority, so it only takes CPU time that nothing else wants.
+//After idle nanoseconds with nothing posted, it sets PX_RING_F_SLEEP and waits for px_ring_enter to wake it.
+//Only one ring in each process can be polled. Passing NULL stops polling.
+//Returns 0 on success or a negative error number.
+int px_ring_poll(px_ring_t *ring, int64_t idle);
+
 
 #endif //PX_H
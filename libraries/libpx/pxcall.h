@@ -11,6 +11,7 @@ PXCALL2V(0x01, void,     px_exit,       int, int)
 
 PXCALL0R(0x02, pid_t,    px_getpid)
 PXCALL0R(0x03, pid_t,    px_getppid)
+PXCALL0R(0x06, int,      px_gettid)
 PXCALL1R(0x04, pid_t,    px_getpgid,    pid_t)
 PXCALL2R(0x05, int,      px_setpgid,    pid_t, pid_t)
 
@@ -22,6 +23,7 @@ PXCALL4R(0x16, int,      px_fd_create,  int, const char *, mode_t, uint64_t)
 PXCALL3R(0x17, ssize_t,  px_fd_stat,    int, px_fd_stat_t *, size_t)
 PXCALL1R(0x18, int,      px_fd_close,   int)
 PXCALL3R(0x19, int,      px_fd_exec,    int, char * const *, char * const *)
+PXCALL2R(0x12, int,      px_fd_zygote,  int, int)
 PXCALL3R(0x1A, int,      px_fd_dup,     int, int, bool)
 PXCALL4R(0x1B, int,      px_fd_ioctl,   int, uint64_t, void *, size_t)
 PXCALL3R(0x1C, int,      px_fd_access,  int, int, int)
@@ -46,10 +48,22 @@ PXCALL1R(0x51, int,      px_setrtc,     int64_t)
 PXCALL1R(0x52, int,      px_nanosleep,  int64_t)
 PXCALL4R(0x53, int64_t,  px_timer_set,  timer_t, int, int64_t, int64_t)
 PXCALL1R(0x54, int64_t,  px_timer_get,  timer_t)
+PXCALL1R(0x55, intptr_t, px_vdata,      int)
 
 PXCALL1R(0x60, pid_t,    px_fork,       uintptr_t)
 PXCALL5R(0x61, ssize_t,  px_wait,       idtype_t, int64_t, int, px_wait_t *, size_t)
 PXCALL3R(0x62, int,      px_priority,   idtype_t, int64_t, int)
+PXCALL2R(0x63, ssize_t,  px_sched_stat, px_sched_stat_t *, size_t)
+PXCALL4R(0x64, int,      px_affinity,   idtype_t, int64_t, const px_cpuset_t *, px_cpuset_t *)
+PXCALL4R(0x65, int,      px_thread_create, uintptr_t, uintptr_t, uintptr_t, uintptr_t)
+PXCALL0V(0x66, void,     px_thread_exit)
+PXCALL1R(0x67, int,      px_thread_join, int)
+PXCALL3R(0x68, int,      px_futex_wait, volatile uint64_t *, uint64_t, int64_t)
+PXCALL2R(0x69, int,      px_futex_wake, volatile uint64_t *, int)
 
 PXCALL2R(0x70, intptr_t, px_mem_avail,  uintptr_t, size_t)
 PXCALL3R(0x71, int,      px_mem_anon,   uintptr_t, size_t, int)
+PXCALL2R(0x72, ssize_t,  px_mem_stat,   px_mem_stat_t *, size_t)
+
+PXCALL1R(0x80, int,      px_ring_enter, px_ring_t *)
+PXCALL2R(0x81, int,      px_ring_poll,  px_ring_t *, int64_t)
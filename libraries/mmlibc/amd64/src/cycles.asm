@@ -0,0 +1,14 @@
+;cycles.asm
+;Cycle counter for MuKe's libc on AMD64
+;Bryan E. Topp <betopp@betopp.com> 2021
+
+section .text
+bits 64
+
+align 16
+global _vdata_cycles ;uint64_t _vdata_cycles(void)
+_vdata_cycles:
+	rdtsc
+	shl RDX, 32
+	or RAX, RDX
+	ret
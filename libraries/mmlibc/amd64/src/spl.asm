@@ -2,6 +2,15 @@
 ;Spinlocks for MuKe's libc on AMD64
 ;Bryan E. Topp <betopp@betopp.com> 2021
 
+;Lock values are 0 when free, 1 when held, and 2 when held with someone possibly sleeping on it.
+;We spin for a while, then sleep in the kernel on the lock word (see spl.c).
+
+;Number of times to check the lock before sleeping
+%define SPL_SPINS 256
+
+extern _spl_sleep
+extern _spl_wake
+
 section .text
 bits 64
 
@@ -12,7 +21,7 @@ _spl_lock:
 	mov AX, 0x0100         ;AH = 1, AL = 0
 	lock cmpxchg [RDI], AH ;Compare lock value with 0, and if it was, overwrite with 1. Otherwise, 
 	cmp AL, 0              ;If lock value wasn't 0, AL is overwritten with lock value
-	jne .waitzero          ;If we failed to get the lock, stop with the locked atomics for a moment
+	jne .contended         ;If we failed to get the lock, stop with the locked atomics for a moment
 	
 	;Got the lock
 	mfence                 ;Make sure no subsequent memory operations can happen until we hold the lock
@@ -20,15 +29,21 @@ _spl_lock:
 	
 	;If we failed to get the lock, wait until the memory shows 0, using non-locked accesses.
 	;Vahalia claims that this improves performance when a lock is contested.
+	.contended:
+	mov ECX, SPL_SPINS
 	.waitzero:
 	pause ;Architectural hint - tell the CPU we're in a busy loop
 	cmp [RDI], byte 0 ;Do a normal read to see if the spinlock has been released
-	jne .waitzero ;Repeat until we see it at least momentarily zeroed
-	jmp _spl_lock ;Try again for real
+	je _spl_lock ;Try again for real once we see it at least momentarily zeroed
+	dec ECX
+	jnz .waitzero ;Keep spinning for a while
+	jmp _spl_sleep ;Spun too long - the holder probably isn't running. Sleep until it's released.
 
 align 16
 global _spl_unlock ;void _spl_unlock(_spl_t *spl)
 _spl_unlock:
-	mfence                ;Make sure all memory operations are completed before releasing the lock
-	mov byte [RDI], 0     ;Zero the lock value
+	xor EAX, EAX
+	xchg [RDI], AL        ;Zero the lock value - implicitly locked, so all memory operations complete first
+	cmp AL, 2             ;See if anyone might be sleeping on it
+	je _spl_wake          ;If so, wake one of them
 	ret
@@ -89,7 +89,7 @@
 #define PAGE_SIZE                     PAGESIZE
 #define PTHREAD_DESTRUCTOR_ITERATIONS _POSIX_THREAD_DESTRUCTOR_ITERATIONS
 #define PTHREAD_KEYS_MAX              _POSIX_THREAD_KEYS_MAX
-#define PTHREAD_STACK_MIN             0
+#define PTHREAD_STACK_MIN             16384
 #define PTHREAD_THREADS_MAX           _POSIX_THREAD_THREADS_MAX
 #define RTSIG_MAX                     _POSIX_RTSIG_MAX
 #define SEM_NSEMS_MAX                 _POSIX_SEM_NSEMS_MAX
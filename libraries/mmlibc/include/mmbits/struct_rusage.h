@@ -10,6 +10,8 @@ struct rusage
 {
 	struct timeval ru_utime;
 	struct timeval ru_stime;
+	long ru_nvcsw;
+	long ru_nivcsw;
 };
 
 #endif //_STRUCT_RUSAGE_H
@@ -11,6 +11,7 @@ typedef struct
 {
 	int detachstate;
 	size_t guardsize;
+	size_t stacksize;
 	struct sched_param schedparam;	
 } pthread_attr_t;
 
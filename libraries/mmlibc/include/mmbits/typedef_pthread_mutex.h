@@ -4,6 +4,12 @@
 #ifndef _TYPEDEF_PTHREAD_MUTEX_H
 #define _TYPEDEF_PTHREAD_MUTEX_H
 
-typedef unsigned long pthread_mutex_t;
+typedef struct
+{
+	volatile unsigned long lock; //Nonzero while held
+	int type; //Type from mutex attributes
+	int owner; //Thread ID of holder
+	unsigned long count; //Number of times locked by the holder, for recursive mutexes
+} pthread_mutex_t;
 
 #endif //_TYPEDEF_PTHREAD_MUTEX_H
@@ -20,6 +20,23 @@ typedef struct _tls_s
 	//Current signal actions for this thread
 	struct sigaction sigactions[64];
 	
+	//Kernel thread ID
+	int tid;
+	
+	//Function run by the thread, its argument, and what it returned
+	void *(*start)(void *arg);
+	void *arg;
+	void *retval;
+	
+	//Memory holding the thread's TLS and stack, or NULL for the initial thread
+	void *mem;
+	
+	//Whether the thread is joinable, detached, or finished (see pthread.c)
+	int pstate;
+	
+	//Next in the list of finished detached threads, waiting to be cleaned up
+	struct _tls_s *reap_next;
+	
 } _tls_t;
 
 //Returns pointer to thread-local storage.
@@ -4,16 +4,82 @@
 
 #include <time.h>
 #include <errno.h>
+#include <sys/time.h>
 #include <px.h>
+#include "vdata.h"
 
+//GPS epoch (1980-01-06) in seconds since the Unix epoch
+#define GPS_UNIX_SEC 315964800l
+
+clock_t clock(void)
+{
+	//Processor time used by the process, user and system both
+	px_rusage_t r = {0};
+	if(px_rusage(PX_RUSAGE_PROCESS, &r, sizeof(r)) < 0)
+		return (clock_t)(-1);
+	
+	int64_t usec = ((r.utime_sec + r.stime_sec) * 1000000l) + r.utime_usec + r.stime_usec;
+	return usec / (1000000l / CLOCKS_PER_SEC);
+}
 
 int clock_gettime(clockid_t clock_id, struct timespec *tp)
 {
-	(void)clock_id;
-	(void)tp;
+	if(clock_id != CLOCK_MONOTONIC && clock_id != CLOCK_REALTIME)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	
+	//Keep time from the kernel's shared page if we can, without a system call
+	uint64_t mono_ns = 0;
+	int64_t rtc_base = 0;
+	int err = _vdata_time(&mono_ns, &rtc_base);
+	if(err < 0)
+	{
+		//Can't read the clock ourselves - real time is still available from the kernel
+		int64_t gps_usec = (clock_id == CLOCK_REALTIME) ? px_getrtc() : err;
+		if(gps_usec < 0)
+		{
+			errno = -gps_usec;
+			return -1;
+		}
+		
+		tp->tv_sec = (gps_usec / 1000000l) + GPS_UNIX_SEC;
+		tp->tv_nsec = (gps_usec % 1000000l) * 1000l;
+		return 0;
+	}
+	
+	if(clock_id == CLOCK_MONOTONIC)
+	{
+		tp->tv_sec = mono_ns / 1000000000ul;
+		tp->tv_nsec = mono_ns % 1000000000ul;
+		return 0;
+	}
+	
+	if(rtc_base < 0)
+	{
+		//Nobody's told the kernel what time it is
+		errno = ENOSYS;
+		return -1;
+	}
+	
+	int64_t gps_nsec = (rtc_base * 1000l) + (int64_t)mono_ns;
+	tp->tv_sec = (gps_nsec / 1000000000l) + GPS_UNIX_SEC;
+	tp->tv_nsec = gps_nsec % 1000000000l;
+	return 0;
+}
+
+int gettimeofday(struct timeval *tp, void *tzp)
+{
+	(void)tzp;
 	
-	errno = ENOSYS;
-	return -1;
+	struct timespec ts = {0};
+	if(clock_gettime(CLOCK_REALTIME, &ts) < 0)
+		return -1;
+	
+	tp->tv_sec = ts.tv_sec;
+	tp->tv_usec = ts.tv_nsec / 1000;
+	return 0;
 }
 
 unsigned int sleep(unsigned int seconds)
@@ -27,6 +93,10 @@ unsigned int sleep(unsigned int seconds)
 
 unsigned int alarm(unsigned int seconds)
 {
-	(void)seconds;
-	return 0;
+	//Timer 0 is reserved for alarm(). Round up any time left, so a pending alarm never reads as none.
+	int64_t left = px_timer_set(0, 0, seconds * 1000000000l, 0);
+	if(left <= 0)
+		return 0;
+	
+	return (left + 999999999l) / 1000000000l;
 }
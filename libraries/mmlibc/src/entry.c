@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <tls.h>
+#include <px.h>
 
 void _libc_entry(void)
 {
@@ -21,6 +23,9 @@ void _libc_entry(void)
 	while(argv[argc] != NULL)
 		argc++;
 	
+	//Note our thread ID, for pthreads
+	_tls()->tid = px_gettid();
+	
 	//Set signal actions to default
 	for(int ss = 0; ss < 64; ss++)
 	{
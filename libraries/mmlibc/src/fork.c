@@ -4,6 +4,7 @@
 
 #include <unistd.h>
 #include <errno.h>
+#include <tls.h>
 #include <px.h>
 
 pid_t fork(void)
@@ -35,6 +36,8 @@ pid_t fork(void)
 	else
 	{
 		// _forkctx_save returned again after _forkctx_load loaded the context. we're on the child.
+		// Only this thread came along, under a new thread ID.
+		_tls()->tid = px_gettid();
 		return 0;
 	}
 }
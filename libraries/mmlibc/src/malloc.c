@@ -43,6 +43,9 @@ typedef struct _malloc_used_item_s
 	
 } _malloc_used_item_t;
 
+//Size of huge pages. Regions at least this big are aligned so the kernel can back them with huge pages.
+#define MALLOC_HUGE_SIZE (2048ul * 1024ul)
+
 //Magic number stored in used-item bookkeeping.
 #define MALLOC_USED_MAGIC 0x737564656d5f6d65 //used_mem
 
@@ -146,8 +149,16 @@ void *malloc(size_t size)
 		if(size_needed > req)
 			req = size_needed;
 		
+		//Big regions get rounded and aligned to huge pages.
+		size_t align = 0;
+		if(req >= MALLOC_HUGE_SIZE)
+		{
+			req = (req + MALLOC_HUGE_SIZE - 1) & ~(MALLOC_HUGE_SIZE - 1);
+			align = MALLOC_HUGE_SIZE;
+		}
+		
 		//Find room in our memory space for new pages
-		intptr_t avail = px_mem_avail(0, req);
+		intptr_t avail = px_mem_avail(0, req + align);
 		if(avail < 0)
 		{
 			//No room in memory map for a new allocation...?
@@ -155,6 +166,9 @@ void *malloc(size_t size)
 			return NULL;
 		}
 		
+		if(align != 0)
+			avail = (avail + align - 1) & ~(align - 1);
+		
 		//Try to map new pages there
 		int mapped = px_mem_anon(avail, req, PX_MEM_R | PX_MEM_W);
 		if(mapped < 0)
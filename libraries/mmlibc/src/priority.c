@@ -0,0 +1,99 @@
+//priority.c
+//Scheduling priority functions in libc
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include <sys/resource.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <px.h>
+
+//Nice values run from -NZERO to NZERO-1, and map onto the kernel's normal priorities.
+//The kernel's default priority is where the nice value is 0.
+
+//Converts arguments for getpriority/setpriority into arguments for px_priority.
+static int priority_idtype(int which, id_t who, idtype_t *idtype_out, int64_t *id_out)
+{
+	//An ID of 0 means the calling process, group, or user. The kernel takes -1 to mean the same.
+	*id_out = (who == 0) ? -1 : (int64_t)who;
+	switch(which)
+	{
+		case PRIO_PROCESS:
+			*idtype_out = P_PID;
+			return 0;
+		case PRIO_PGRP:
+			*idtype_out = P_PGID;
+			return 0;
+		case PRIO_USER:
+			//There's only one user.
+			*idtype_out = P_ALL;
+			return 0;
+		default:
+			return -EINVAL;
+	}
+}
+
+int getpriority(int which, id_t who)
+{
+	idtype_t idtype;
+	int64_t id;
+	int result = priority_idtype(which, who, &idtype, &id);
+	if(result >= 0)
+		result = px_priority(idtype, id, -1);
+	
+	if(result < 0)
+	{
+		errno = -result;
+		return -1;
+	}
+	
+	//Batch priorities are worse than any nice value - report them as the worst
+	int value = result - PX_PRIO_DEFAULT;
+	if(value > NZERO - 1)
+		value = NZERO - 1;
+	
+	return value;
+}
+
+int setpriority(int which, id_t who, int value)
+{
+	if(value < -NZERO)
+		value = -NZERO;
+	if(value > NZERO - 1)
+		value = NZERO - 1;
+	if(value + PX_PRIO_DEFAULT < 0)
+		value = -PX_PRIO_DEFAULT;
+	
+	idtype_t idtype;
+	int64_t id;
+	int result = priority_idtype(which, who, &idtype, &id);
+	if(result >= 0)
+		result = px_priority(idtype, id, value + PX_PRIO_DEFAULT);
+	
+	if(result < 0)
+	{
+		errno = -result;
+		return -1;
+	}
+	
+	return 0;
+}
+
+int nice(int incr)
+{
+	errno = 0;
+	int old = getpriority(PRIO_PROCESS, 0);
+	if(old == -1 && errno != 0)
+		return -1;
+	
+	int newval = old + incr;
+	if(newval < -NZERO)
+		newval = -NZERO;
+	if(newval > NZERO - 1)
+		newval = NZERO - 1;
+	
+	if(setpriority(PRIO_PROCESS, 0, newval) < 0)
+		return -1;
+	
+	return newval;
+}
@@ -0,0 +1,495 @@
+//pthread.c
+//POSIX threads in libc
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <tls.h>
+#include <px.h>
+#include "spl.h"
+
+//States of a thread, kept in its TLS
+#define PSTATE_JOINABLE 0 //Running, someone will join it
+#define PSTATE_DETACHED 1 //Running, nobody will join it
+#define PSTATE_EXITED 2 //Finished, waiting to be joined
+
+//Stack size used when not given in the attributes
+#define PTHREAD_STACK_DEFAULT 65536
+
+//Lock protecting thread states and the list of threads to clean up
+static _spl_t _pthread_spl;
+
+//Detached threads that have finished, but whose memory hasn't been freed yet
+static _tls_t *_pthread_reap_list;
+
+//Number of times to check a contended mutex before sleeping on it
+#define PTHREAD_SPINS 256
+
+//Returns the nanoseconds left until the given absolute time (in CLOCK_REALTIME), or -1 to wait forever.
+static int64_t _pthread_timeout(const struct timespec *abstime)
+{
+	if(abstime == NULL)
+		return -1;
+	
+	int64_t gps_usec = px_getrtc();
+	if(gps_usec < 0)
+		return -1; //No clock to time out with
+	
+	int64_t unix_nsec = (gps_usec + (315964800l * 1000000l)) * 1000l;
+	int64_t dead_nsec = (abstime->tv_sec * 1000000000l) + abstime->tv_nsec;
+	if(dead_nsec <= unix_nsec)
+		return 0;
+	
+	return dead_nsec - unix_nsec;
+}
+
+//Frees the memory of detached threads that have finished.
+static void _pthread_reap(void)
+{
+	_spl_lock(&_pthread_spl);
+	_tls_t *list = _pthread_reap_list;
+	_pthread_reap_list = NULL;
+	_spl_unlock(&_pthread_spl);
+	
+	while(list != NULL)
+	{
+		_tls_t *next = list->reap_next;
+		
+		//The thread may not have made it all the way out of the kernel yet - it's still on its stack until then.
+		while(px_thread_join(list->tid) == -EINTR) { }
+		
+		free(list->mem);
+		list = next;
+	}
+}
+
+//Entry point of new threads, passed our TLS by the kernel.
+static void _pthread_entry(_tls_t *tls)
+{
+	//Wait for our creator to finish filling in our TLS
+	_spl_lock(&_pthread_spl);
+	_spl_unlock(&_pthread_spl);
+	
+	pthread_exit(tls->start(tls->arg));
+}
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start_routine)(void*), void *arg)
+{
+	_pthread_reap();
+	
+	size_t stacksize = PTHREAD_STACK_DEFAULT;
+	int detachstate = PTHREAD_CREATE_JOINABLE;
+	if(attr != NULL)
+	{
+		if(attr->stacksize != 0)
+			stacksize = attr->stacksize;
+		
+		detachstate = attr->detachstate;
+	}
+	
+	//Allocate the TLS and the stack together
+	size_t tlssize = (sizeof(_tls_t) + 15) & ~15ul;
+	void *mem = malloc(tlssize + stacksize);
+	if(mem == NULL)
+		return EAGAIN;
+	
+	_tls_t *tls = (_tls_t*)mem;
+	memset(tls, 0, sizeof(*tls));
+	tls->self = tls;
+	tls->start = start_routine;
+	tls->arg = arg;
+	tls->mem = mem;
+	tls->pstate = (detachstate == PTHREAD_CREATE_DETACHED) ? PSTATE_DETACHED : PSTATE_JOINABLE;
+	
+	//New threads start with the same signal actions as their creator
+	memcpy(tls->sigactions, _tls()->sigactions, sizeof(tls->sigactions));
+	
+	//Stack starts as if the entry point had been called - with a return address pushed, off 16-byte alignment.
+	uintptr_t sp = ((uintptr_t)mem + tlssize + stacksize) & ~15ul;
+	sp -= sizeof(uintptr_t);
+	*(uintptr_t*)sp = 0;
+	
+	//Hold the lock while creating so the thread can't run before its ID is filled in
+	_spl_lock(&_pthread_spl);
+	int tid = px_thread_create((uintptr_t)&_pthread_entry, sp, (uintptr_t)tls, (uintptr_t)tls);
+	if(tid >= 0)
+		tls->tid = tid;
+	
+	_spl_unlock(&_pthread_spl);
+	
+	if(tid < 0)
+	{
+		free(mem);
+		return (tid == -ENOMEM) ? EAGAIN : -tid;
+	}
+	
+	*thread = tls;
+	return 0;
+}
+
+void pthread_exit(void *value_ptr)
+{
+	_tls_t *tls = _tls();
+	
+	_spl_lock(&_pthread_spl);
+	tls->retval = value_ptr;
+	if(tls->pstate == PSTATE_DETACHED && tls->mem != NULL)
+	{
+		//Nobody will join us - leave our memory for someone else to clean up
+		tls->reap_next = _pthread_reap_list;
+		_pthread_reap_list = tls;
+	}
+	else
+	{
+		tls->pstate = PSTATE_EXITED;
+	}
+	_spl_unlock(&_pthread_spl);
+	
+	//The process ends when its last thread leaves, even if that isn't the initial thread
+	px_thread_exit();
+	while(1) { }
+}
+
+int pthread_join(pthread_t thread, void **value_ptr)
+{
+	if(thread == _tls())
+		return EDEADLK;
+	
+	_spl_lock(&_pthread_spl);
+	int pstate = thread->pstate;
+	_spl_unlock(&_pthread_spl);
+	if(pstate == PSTATE_DETACHED)
+		return EINVAL;
+	
+	//Wait for the kernel to tell us the thread is gone
+	int result = px_thread_join(thread->tid);
+	while(result == -EINTR)
+	{
+		result = px_thread_join(thread->tid);
+	}
+	
+	if(result < 0 && result != -ESRCH)
+		return -result;
+	
+	if(value_ptr != NULL)
+		*value_ptr = thread->retval;
+	
+	if(thread->mem != NULL)
+		free(thread->mem);
+	
+	return 0;
+}
+
+int pthread_detach(pthread_t thread)
+{
+	_spl_lock(&_pthread_spl);
+	int pstate = thread->pstate;
+	if(pstate == PSTATE_JOINABLE)
+	{
+		//Still running - it'll put itself on the reap list when done
+		thread->pstate = PSTATE_DETACHED;
+	}
+	else if(pstate == PSTATE_EXITED && thread->mem != NULL)
+	{
+		//Already done - clean it up ourselves
+		thread->pstate = PSTATE_DETACHED;
+		thread->reap_next = _pthread_reap_list;
+		_pthread_reap_list = thread;
+	}
+	_spl_unlock(&_pthread_spl);
+	
+	if(pstate == PSTATE_DETACHED)
+		return EINVAL;
+	
+	_pthread_reap();
+	return 0;
+}
+
+pthread_t pthread_self(void)
+{
+	return _tls();
+}
+
+int pthread_equal(pthread_t t1, pthread_t t2)
+{
+	return t1 == t2;
+}
+
+int pthread_kill(pthread_t thread, int sig)
+{
+	int result = px_sigsend(P_TID, thread->tid, sig);
+	if(result < 0)
+		return -result;
+	
+	return 0;
+}
+
+int pthread_sigmask(int how, const sigset_t *set, sigset_t *oldset)
+{
+	//Our signal masks are already per-thread
+	if(sigprocmask(how, set, oldset) < 0)
+		return errno;
+	
+	return 0;
+}
+
+int pthread_once(pthread_once_t *once_control, void (*init_routine)(void))
+{
+	//0 = not started, 1 = running, 2 = done
+	volatile pthread_once_t *once = once_control;
+	if(*once == 2)
+		return 0;
+	
+	if(__sync_bool_compare_and_swap(once, 0, 1))
+	{
+		init_routine();
+		__sync_synchronize();
+		*once = 2;
+		px_futex_wake(once, INT_MAX);
+		return 0;
+	}
+	
+	while(*once != 2)
+	{
+		px_futex_wait(once, 1, -1);
+	}
+	
+	return 0;
+}
+
+int pthread_attr_init(pthread_attr_t *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+	attr->detachstate = PTHREAD_CREATE_JOINABLE;
+	attr->stacksize = PTHREAD_STACK_DEFAULT;
+	return 0;
+}
+
+int pthread_attr_destroy(pthread_attr_t *attr)
+{
+	(void)attr;
+	return 0;
+}
+
+int pthread_attr_getdetachstate(const pthread_attr_t *attr, int *detachstate)
+{
+	*detachstate = attr->detachstate;
+	return 0;
+}
+
+int pthread_attr_setdetachstate(pthread_attr_t *attr, int detachstate)
+{
+	if(detachstate != PTHREAD_CREATE_JOINABLE && detachstate != PTHREAD_CREATE_DETACHED)
+		return EINVAL;
+	
+	attr->detachstate = detachstate;
+	return 0;
+}
+
+int pthread_attr_getstacksize(const pthread_attr_t *attr, size_t *stacksize)
+{
+	*stacksize = attr->stacksize;
+	return 0;
+}
+
+int pthread_attr_setstacksize(pthread_attr_t *attr, size_t stacksize)
+{
+	if(stacksize < PTHREAD_STACK_MIN)
+		return EINVAL;
+	
+	attr->stacksize = stacksize;
+	return 0;
+}
+
+int pthread_mutexattr_init(pthread_mutexattr_t *attr)
+{
+	attr->robustness = PTHREAD_MUTEX_STALLED;
+	attr->type = PTHREAD_MUTEX_DEFAULT;
+	return 0;
+}
+
+int pthread_mutexattr_destroy(pthread_mutexattr_t *attr)
+{
+	(void)attr;
+	return 0;
+}
+
+int pthread_mutexattr_gettype(const pthread_mutexattr_t *attr, int *type)
+{
+	*type = attr->type;
+	return 0;
+}
+
+int pthread_mutexattr_settype(pthread_mutexattr_t *attr, int type)
+{
+	if(type != PTHREAD_MUTEX_NORMAL && type != PTHREAD_MUTEX_ERRORCHECK && type != PTHREAD_MUTEX_RECURSIVE)
+		return EINVAL;
+	
+	attr->type = type;
+	return 0;
+}
+
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr)
+{
+	memset(mutex, 0, sizeof(*mutex));
+	mutex->type = (attr != NULL) ? attr->type : PTHREAD_MUTEX_DEFAULT;
+	return 0;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t *mutex)
+{
+	if(mutex->lock)
+		return EBUSY;
+	
+	return 0;
+}
+
+//Mutex lock values are the same as for libc's spinlocks (see spl.asm) - 0 free, 1 held, 2 held with sleepers.
+
+//Tries to take the given mutex, waiting until the given time if it's contended.
+//Returns 0 on success or an error number.
+static int _pthread_mutex_take(pthread_mutex_t *mutex, int wait, const struct timespec *abstime)
+{
+	int tid = _tls()->tid;
+	if(mutex->lock && mutex->owner == tid)
+	{
+		//We hold it already
+		if(mutex->type == PTHREAD_MUTEX_RECURSIVE)
+		{
+			mutex->count++;
+			return 0;
+		}
+		
+		if(mutex->type == PTHREAD_MUTEX_ERRORCHECK)
+			return EDEADLK;
+	}
+	
+	if(!__sync_bool_compare_and_swap(&(mutex->lock), 0, 1))
+	{
+		if(!wait)
+			return EBUSY;
+		
+		//Spin for a bit, in case the holder is running and about to let go
+		for(int ss = 0; ss < PTHREAD_SPINS && mutex->lock != 0; ss++)
+		{
+			__asm__ volatile ("pause");
+		}
+		
+		//Mark the mutex as having sleepers and sleep until we see it free
+		while(__sync_lock_test_and_set(&(mutex->lock), 2) != 0)
+		{
+			int64_t timeout = _pthread_timeout(abstime);
+			if(timeout == 0)
+				return ETIMEDOUT;
+			
+			px_futex_wait(&(mutex->lock), 2, timeout);
+		}
+	}
+	
+	mutex->owner = tid;
+	mutex->count = 1;
+	return 0;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+	return _pthread_mutex_take(mutex, 0, NULL);
+}
+
+int pthread_mutex_timedlock(pthread_mutex_t *mutex, const struct timespec *abstime)
+{
+	return _pthread_mutex_take(mutex, 1, abstime);
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+	return _pthread_mutex_take(mutex, 1, NULL);
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *mutex)
+{
+	if(mutex->type != PTHREAD_MUTEX_NORMAL)
+	{
+		if(!mutex->lock || mutex->owner != _tls()->tid)
+			return EPERM;
+		
+		mutex->count--;
+		if(mutex->count > 0)
+			return 0;
+	}
+	
+	mutex->owner = 0;
+	if(__sync_lock_test_and_set(&(mutex->lock), 0) == 2)
+		px_futex_wake(&(mutex->lock), 1);
+	
+	return 0;
+}
+
+//Condition variables are a sequence number, bumped on each signal, and waited on with the kernel.
+//Waiters wait for it to change from what it was when they unlocked the mutex.
+//This can wake more waiters than necessary on signal, which POSIX allows.
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr)
+{
+	(void)attr;
+	*cond = 0;
+	return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t *cond)
+{
+	(void)cond;
+	return 0;
+}
+
+int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime)
+{
+	volatile pthread_cond_t *seqptr = cond;
+	pthread_cond_t seq = *seqptr;
+	
+	//Recursive mutexes are released all the way while waiting
+	unsigned long count = mutex->count;
+	mutex->count = 1;
+	int result = pthread_mutex_unlock(mutex);
+	if(result != 0)
+	{
+		mutex->count = count;
+		return result;
+	}
+	
+	//Sleep until the sequence number changes. Wakes without a change are just spurious wakeups.
+	result = 0;
+	if(*seqptr == seq)
+	{
+		int64_t timeout = _pthread_timeout(abstime);
+		if(timeout == 0 || px_futex_wait(seqptr, seq, timeout) == -ETIMEDOUT)
+			result = ETIMEDOUT;
+	}
+	
+	pthread_mutex_lock(mutex);
+	mutex->count = count;
+	return result;
+}
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+	return pthread_cond_timedwait(cond, mutex, NULL);
+}
+
+int pthread_cond_signal(pthread_cond_t *cond)
+{
+	__sync_fetch_and_add(cond, 1);
+	px_futex_wake(cond, 1);
+	return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond)
+{
+	__sync_fetch_and_add(cond, 1);
+	px_futex_wake(cond, INT_MAX);
+	return 0;
+}
@@ -11,16 +11,12 @@ char *tzname[2] = { "UTC", "UTC" };
 
 time_t time(time_t *tloc)
 {
-	int64_t gps_usec = px_getrtc();
-	if(gps_usec < 0)
-	{
-		//Todo - Janeway will need this to support negative time values.
-		errno = -gps_usec;
+	//Todo - Janeway will need this to support negative time values.
+	struct timespec ts = {0};
+	if(clock_gettime(CLOCK_REALTIME, &ts) < 0)
 		return (time_t)(-1);
-	}
 	
-	int64_t gps_sec = gps_usec / 1000000l;
-	int64_t unix_sec = gps_sec + 315964800l;
+	int64_t unix_sec = ts.tv_sec;
 	if(tloc != NULL)
 		*tloc = unix_sec;
 	
@@ -20,5 +20,7 @@ int getrusage(int who, struct rusage *rusage)
 	rusage->ru_utime.tv_usec = r.utime_usec;
 	rusage->ru_stime.tv_sec = r.stime_sec;
 	rusage->ru_stime.tv_usec = r.stime_usec;
+	rusage->ru_nvcsw = r.nvcsw;
+	rusage->ru_nivcsw = r.nivcsw;
 	return 0;
 }
@@ -0,0 +1,22 @@
+//spl.c
+//Sleeping on contended spinlocks in libc
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include <stdint.h>
+#include <px.h>
+#include "spl.h"
+
+void _spl_sleep(_spl_t *spl)
+{
+	//Mark the lock as having sleepers, and sleep until it's released.
+	//If it was free when we marked it, we got it - but still marked, so we'll wake someone needlessly on unlock.
+	while(__sync_lock_test_and_set(spl, 2) != 0)
+	{
+		px_futex_wait(spl, 2, -1);
+	}
+}
+
+void _spl_wake(_spl_t *spl)
+{
+	px_futex_wake(spl, 1);
+}
@@ -4,7 +4,7 @@
 #ifndef _SPL_H
 #define _SPL_H
 
-//Data for spinlock
+//Data for spinlock. Spins for a while when contended, then sleeps in the kernel.
 typedef volatile uint64_t _spl_t;
 
 //Locks the given spinlock.
@@ -13,4 +13,8 @@ void _spl_lock(_spl_t *spl);
 //Unlocks the given spinlock.
 void _spl_unlock(_spl_t *spl);
 
+//Slow paths of the above, for when the lock is contended.
+void _spl_sleep(_spl_t *spl);
+void _spl_wake(_spl_t *spl);
+
 #endif //_SPL_H
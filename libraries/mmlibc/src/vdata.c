@@ -0,0 +1,63 @@
+//vdata.c
+//Kernel data mapped read-only in the process, for MuKe's libc
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "vdata.h"
+#include <stddef.h>
+#include <errno.h>
+
+//Where the pages were found. They're at the same place in every process, so this survives fork and exec.
+static const volatile px_vclock_t *_vdata_clock_ptr;
+static const volatile px_vproc_t *_vdata_proc_ptr;
+
+const volatile px_vclock_t *_vdata_clock(void)
+{
+	if(_vdata_clock_ptr == NULL)
+	{
+		intptr_t addr = px_vdata(PX_VDATA_CLOCK);
+		if(addr < 0)
+			return NULL;
+		
+		_vdata_clock_ptr = (const volatile px_vclock_t*)addr;
+	}
+	return _vdata_clock_ptr;
+}
+
+const volatile px_vproc_t *_vdata_proc(void)
+{
+	if(_vdata_proc_ptr == NULL)
+	{
+		intptr_t addr = px_vdata(PX_VDATA_PROC);
+		if(addr < 0)
+			return NULL;
+		
+		_vdata_proc_ptr = (const volatile px_vproc_t*)addr;
+	}
+	return _vdata_proc_ptr;
+}
+
+int _vdata_time(uint64_t *ns_out, int64_t *rtc_base_out)
+{
+	const volatile px_vclock_t *vc = _vdata_clock();
+	if(vc == NULL || !(vc->flags & PX_VCLOCK_F_CYCLES))
+		return -ENOSYS;
+	
+	//Take a consistent snapshot - retry if the kernel changed it while we were looking
+	uint64_t seq, base, mul, div;
+	int64_t rtc_base;
+	do
+	{
+		seq = vc->seq;
+		base = vc->cycle_base;
+		mul = vc->cycle_mul;
+		div = vc->cycle_div;
+		rtc_base = vc->rtc_base;
+	}
+	while((seq & 1) || (seq != vc->seq));
+	
+	//Scale without overflowing
+	uint64_t cycles = _vdata_cycles() - base;
+	*ns_out = ((cycles / div) * mul) + (((cycles % div) * mul) / div);
+	*rtc_base_out = rtc_base;
+	return 0;
+}
@@ -0,0 +1,24 @@
+//vdata.h
+//Kernel data mapped read-only in the process, for MuKe's libc
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef _VDATA_H
+#define _VDATA_H
+
+#include <stdint.h>
+#include <px.h>
+
+//Returns the kernel's timekeeping page, or NULL if it can't be found.
+const volatile px_vclock_t *_vdata_clock(void);
+
+//Returns the kernel's page about this process, or NULL if it can't be found.
+const volatile px_vproc_t *_vdata_proc(void);
+
+//Reads the monotonic time in nanoseconds, and the real time at monotonic time zero in microseconds since the GPS epoch.
+//The real time is negative if it isn't known.
+//Returns 0 on success or a negative error number if time can't be kept without the kernel.
+int _vdata_time(uint64_t *ns_out, int64_t *rtc_base_out);
+
+//Reads the cycle counter (architecture-specific).
+uint64_t _vdata_cycles(void);
+
+#endif //_VDATA_H
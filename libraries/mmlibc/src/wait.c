@@ -58,28 +58,3 @@ pid_t waitpid(pid_t wpid, int *status, int options)
 	*status = status_ret;
 	return w.pid;
 }
-
-int nice(int incr)
-{	
-	int old = px_priority(P_PID, -1, -1);
-	if(old < 0)
-	{
-		errno = -old;
-		return -1;
-	}
-	
-	int newval = old + incr;
-	if(newval < 0)
-		newval = 0;
-	if(newval > 99)
-		newval = 99;
-	
-	int result = px_priority(P_PID, -1, newval);
-	if(result < 0)
-	{
-		errno = -result;
-		return -1;
-	}
-	
-	return 0;
-}
@@ -0,0 +1,148 @@
+//copybench.c
+//Measures how fast data moves between user buffers and the kernel
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+//Reads and writes go back and forth over a RAMfs file this big, so only the copies are measured after the first pass
+#define FILE_SIZE (1024 * 1024)
+
+//Roughly how much data to move for each size, and the most calls to make for it
+#define TOTAL_BYTES (64 * 1024 * 1024)
+#define MAX_CALLS 200000
+
+//Buffers for the user side of the copies, and for comparing with a copy that stays in userspace
+static uint8_t buf[FILE_SIZE];
+static uint8_t buf2[FILE_SIZE];
+
+//Returns the monotonic time in nanoseconds
+static uint64_t now_ns(void)
+{
+	struct timespec ts = {0};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec;
+}
+
+//Returns how many calls to make for the given size
+static size_t calls_for(size_t size)
+{
+	size_t calls = TOTAL_BYTES / size;
+	if(calls > MAX_CALLS)
+		calls = MAX_CALLS;
+	
+	return calls;
+}
+
+//Moves the given number of bytes at a time between buf and the file, with read or write.
+//Returns the nanoseconds taken.
+static uint64_t run_file(int fd, size_t size, size_t calls, int writing)
+{
+	if(lseek(fd, 0, SEEK_SET) != 0)
+	{
+		perror("lseek");
+		exit(-1);
+	}
+	
+	off_t off = 0;
+	uint64_t start = now_ns();
+	for(size_t cc = 0; cc < calls; cc++)
+	{
+		if(off + size > FILE_SIZE)
+		{
+			lseek(fd, 0, SEEK_SET);
+			off = 0;
+		}
+		
+		ssize_t done = writing ? write(fd, buf, size) : read(fd, buf, size);
+		if(done != (ssize_t)size)
+		{
+			perror(writing ? "write" : "read");
+			exit(-1);
+		}
+		
+		off += size;
+	}
+	
+	return now_ns() - start;
+}
+
+//Copies the given number of bytes at a time within userspace, for comparison.
+//Returns the nanoseconds taken.
+static uint64_t run_memcpy(size_t size, size_t calls)
+{
+	size_t off = 0;
+	uint64_t start = now_ns();
+	for(size_t cc = 0; cc < calls; cc++)
+	{
+		if(off + size > FILE_SIZE)
+			off = 0;
+		
+		memcpy(buf2 + off, buf + off, size);
+		off += size;
+		
+		//Keep the compiler from deciding the copies don't matter
+		__asm__ volatile ("" : : "r"(buf2) : "memory");
+	}
+	
+	return now_ns() - start;
+}
+
+//Returns throughput in megabytes per second
+static unsigned long mbps(size_t size, size_t calls, uint64_t ns)
+{
+	if(ns == 0)
+		ns = 1;
+	
+	return (unsigned long)(((uint64_t)size * calls * 1000) / ns);
+}
+
+int main(int argc, const char **argv)
+{
+	//Scratch file defaults to the root of the RAMfs
+	const char *path = (argc > 1) ? argv[1] : "/copybench.tmp";
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if(fd < 0)
+	{
+		perror("open");
+		return -1;
+	}
+	
+	//Fill the file once, so later passes don't measure allocating its pages
+	memset(buf, 0x5A, sizeof(buf));
+	if(write(fd, buf, FILE_SIZE) != FILE_SIZE)
+	{
+		perror("write");
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	
+	printf("%8s %10s %10s %10s %10s %10s\n", "bytes", "write ns", "write MB/s", "read ns", "read MB/s", "user MB/s");
+	
+	static const size_t sizes[] = { 16, 64, 256, 1024, 4096, 16384, 65536, 262144, FILE_SIZE, 0 };
+	for(int ss = 0; sizes[ss] != 0; ss++)
+	{
+		size_t size = sizes[ss];
+		size_t calls = calls_for(size);
+		
+		uint64_t write_ns = run_file(fd, size, calls, 1);
+		uint64_t read_ns = run_file(fd, size, calls, 0);
+		uint64_t user_ns = run_memcpy(size, calls);
+		
+		printf("%8lu %10lu %10lu %10lu %10lu %10lu\n",
+			(unsigned long)size,
+			(unsigned long)(write_ns / calls), mbps(size, calls, write_ns),
+			(unsigned long)(read_ns / calls), mbps(size, calls, read_ns),
+			mbps(size, calls, user_ns));
+	}
+	
+	close(fd);
+	unlink(path);
+	return 0;
+}
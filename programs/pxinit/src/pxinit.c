@@ -8,6 +8,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <sys/wait.h>
+#include <px.h>
 
 int main(int argc, const char **argv)
 {
@@ -20,6 +21,18 @@ int main(int argc, const char **argv)
 	const char *initstr = "pxinit " BUILDVERSION " built " BUILDDATE " by " BUILDUSER "\n";
 	write(con, initstr, strlen(initstr));
 	
+	//Keep the programs that get run over and over loaded, so they start quickly
+	const char *zygotes[] = { "/bin/oksh", "/bin/ls", "/bin/cat", NULL };
+	for(int zz = 0; zygotes[zz] != NULL; zz++)
+	{
+		int fd = open(zygotes[zz], O_EXEC | O_CLOEXEC);
+		if(fd < 0)
+			continue;
+		
+		px_fd_zygote(fd, 1);
+		close(fd);
+	}
+	
 	//Spawn shells forever
 	while(1)
 	{